@@ -0,0 +1,131 @@
+#!/bin/sh
+# Filename: bench.sh
+# Purpose:  run two capsulators back to back in network namespaces and
+#           measure them with capbench over a sweep of frame sizes and
+#           border port counts
+#
+# Topology (all links are veth pairs except the tap devices):
+#
+#   [capbench tx] gaN --- baN [capsulator A] tunA ==== tunB [capsulator B] tapN [capbench rx]
+#        ns capbA                 ns capbA          ns capbB                      ns capbB
+#
+# Every line of output is one JSON object (see capbench.c).  Tunables:
+#   SIZES     frame sizes in bytes        (default: 60 128 256 512 1024 1514 9014)
+#   PORTS     border port counts          (default: 1 2 4)
+#   DURATION  seconds per run             (default: 5)
+#   RATE      offered frames/s, 0 = max   (default: 0)
+#   CAPS_ARGS extra arguments for both capsulators
+#   BENCH_OUT file the JSON lines are appended to as well
+#
+# Frames which come back with a length other than the size sent (9014-byte
+# frames through a capsulator whose buffers are too small for them, say) are
+# reported as "mismatched" and count as lost.
+
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+CAPSULATOR=${CAPSULATOR:-$DIR/../capsulator}
+CAPBENCH=${CAPBENCH:-$DIR/capbench}
+SIZES=${SIZES:-"60 128 256 512 1024 1514 9014"}
+PORTS=${PORTS:-"1 2 4"}
+DURATION=${DURATION:-5}
+RATE=${RATE:-0}
+NSA=capbA
+NSB=capbB
+IPA=10.250.0.1
+IPB=10.250.0.2
+JUMBO_MTU=9200
+
+if [ "$(id -u)" != 0 ]; then
+    echo "bench.sh: must be run as root (it creates network namespaces)" >&2
+    exit 1
+fi
+
+cleanup() {
+    [ -n "$PIDA" ] && kill $PIDA 2>/dev/null || true
+    [ -n "$PIDB" ] && kill $PIDB 2>/dev/null || true
+    ip netns del $NSA 2>/dev/null || true
+    ip netns del $NSB 2>/dev/null || true
+}
+trap cleanup EXIT INT TERM
+
+# sets up the namespaces and the tunnel link between them
+setup() {
+    cleanup
+    ip netns add $NSA
+    ip netns add $NSB
+    ip link add tunA netns $NSA mtu $JUMBO_MTU type veth peer name tunB netns $NSB mtu $JUMBO_MTU
+    ip -n $NSA addr add $IPA/24 dev tunA
+    ip -n $NSB addr add $IPB/24 dev tunB
+    for ns in $NSA $NSB; do
+        ip -n $ns link set lo up
+        ip netns exec $ns sysctl -qw net.ipv6.conf.all.disable_ipv6=1
+    done
+    ip -n $NSA link set tunA up
+    ip -n $NSB link set tunB up
+
+    # static neighbours so no frame waits for ARP
+    ip -n $NSA neigh replace $IPB lladdr "$(ip -n $NSB -br link show tunB | awk '{print $3}')" dev tunA
+    ip -n $NSB neigh replace $IPA lladdr "$(ip -n $NSA -br link show tunA | awk '{print $3}')" dev tunB
+}
+
+# starts both capsulators with $1 border ports
+start() {
+    FA=""; FB=""; BA=""; BB=""
+    i=0
+    while [ $i -lt "$1" ]; do
+        ip link add ba$i netns $NSA mtu $JUMBO_MTU type veth peer name ga$i netns $NSA mtu $JUMBO_MTU
+        ip -n $NSA link set ba$i up
+        ip -n $NSA link set ga$i up
+        FA="$FA${FA:+,}$IPB"
+        FB="$FB${FB:+,}$IPA"
+        BA="$BA -b ba$i#$((100 + i))"
+        BB="$BB -vb tap$i#$((100 + i))"
+        i=$((i + 1))
+    done
+
+    ip netns exec $NSA "$CAPSULATOR" -t tunA -f $FA $BA $CAPS_ARGS >/dev/null 2>&1 &
+    PIDA=$!
+    ip netns exec $NSB "$CAPSULATOR" -t tunB -f $FB $BB $CAPS_ARGS >/dev/null 2>&1 &
+    PIDB=$!
+    sleep 1
+
+    i=0
+    while [ $i -lt "$1" ]; do
+        ip -n $NSB link set tap$i mtu $JUMBO_MTU up
+        i=$((i + 1))
+    done
+}
+
+# stops both capsulators and removes the border ports
+stop() {
+    kill $PIDA $PIDB 2>/dev/null || true
+    wait $PIDA $PIDB 2>/dev/null || true
+    PIDA=""; PIDB=""
+    i=0
+    while [ $i -lt "$1" ]; do
+        ip -n $NSA link del ba$i 2>/dev/null || true
+        ip -n $NSB link del tap$i 2>/dev/null || true
+        i=$((i + 1))
+    done
+}
+
+setup
+for ports in $PORTS; do
+    start $ports
+    TX=""; RX=""
+    i=0
+    while [ $i -lt $ports ]; do
+        TX="$TX${TX:+,}ga$i"
+        RX="$RX${RX:+,}tap$i"
+        i=$((i + 1))
+    done
+
+    for size in $SIZES; do
+        line=$("$CAPBENCH" -t $NSA:$TX -r $NSB:$RX -e $NSA:tunA \
+                   -s $size -d $DURATION -p $RATE -l "ports=$ports size=$size${CAPS_ARGS:+ $CAPS_ARGS}")
+        echo "$line"
+        [ -n "$BENCH_OUT" ] && echo "$line" >> "$BENCH_OUT"
+    done
+    stop $ports
+done
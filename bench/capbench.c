@@ -0,0 +1,409 @@
+/**
+ * Filename: capbench.c
+ * Purpose:  traffic generator and sink for benchmarking two back to back
+ *           capsulators; reports rates and latency percentiles as JSON
+ */
+
+#define _GNU_SOURCE /* setns, sendmmsg, recvmmsg */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common.h"
+
+#define STR_USAGE "\
+%s: -t NS:INTF[,INTF...] -r NS:INTF[,INTF...] [options]\n\
+  -t:  namespace and interfaces frames are generated on (round-robin)\n\
+  -r:  namespace and interfaces frames are expected back on (same order)\n\
+  -e:  NS:INTF of the sending capsulator's tunnel interface; its tx packet\n\
+       count gives the encapsulation rate\n\
+  -s:  Ethernet frame size in bytes without FCS (default: 60)\n\
+  -d:  seconds to generate traffic for (default: 5)\n\
+  -p:  frames per second to offer, 0 for as fast as possible (default: 0)\n\
+  -l:  label copied into the report\n"
+
+/** EtherType of benchmark frames (IEEE local experimental) */
+#define BENCH_ETHERTYPE 0x88B5
+
+/** marks a benchmark frame */
+#define BENCH_MAGIC 0xCA95B37Cu
+
+/** frames handed to the kernel per sendmmsg()/recvmmsg() */
+#define BENCH_BATCH 64
+
+/** largest frame the benchmark generates */
+#define BENCH_MAX_FRAME (16 * 1024)
+
+/** maximum number of latency samples kept */
+#define BENCH_MAX_SAMPLES (4 * 1024 * 1024)
+
+/** maximum number of generator/sink interfaces */
+#define BENCH_MAX_PORTS 64
+
+/** payload of every benchmark frame, right after the Ethernet header */
+typedef struct bench_payload {
+    uint32_t magic;
+    uint32_t port;
+    uint64_t seq;
+    uint64_t sent_ns;
+} __attribute__((packed)) bench_payload;
+
+/** a namespace and the interfaces used in it */
+typedef struct bench_side {
+    char ns[64];
+    char intf[BENCH_MAX_PORTS][IF_NAMESIZE];
+    int fd[BENCH_MAX_PORTS];
+    unsigned len;
+} bench_side;
+
+/** state shared by the generator and the sink */
+typedef struct bench {
+    bench_side tx, rx;
+    char tun_ns[64];
+    char tun_intf[IF_NAMESIZE];
+    unsigned frame_size;
+    double duration;
+    double rate;
+    const char* label;
+
+    /** set by the generator once it is done */
+    volatile int tx_done;
+    uint64_t sent;
+
+    uint64_t received;
+    uint64_t received_bytes;
+
+    /** frames which came back with the magic but not frame_size bytes long
+        (cut short on the way, say), counted apart from received */
+    uint64_t mismatched;
+    uint64_t* samples;
+    uint64_t samples_len;
+    uint64_t first_rx_ns, last_rx_ns;
+} bench;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** moves the calling thread into the network namespace called ns */
+static void enter_ns(const char* ns) {
+    char path[128];
+    int fd;
+
+    snprintf(path, sizeof(path), "/var/run/netns/%s", ns);
+    if((fd = open(path, O_RDONLY)) < 0)
+        pdie(path);
+    if(setns(fd, CLONE_NEWNET) < 0)
+        pdie("setns");
+    close(fd);
+}
+
+/** parses NS:INTF[,INTF...] into side */
+static void parse_side(bench_side* side, char* arg) {
+    char *intf, *save;
+
+    if(!(intf = strchr(arg, ':')))
+        die("%s is not of the form NS:INTF[,INTF...]", arg);
+    *intf++ = '\0';
+    strncpy(side->ns, arg, sizeof(side->ns) - 1);
+
+    for(intf = strtok_r(intf, ",", &save); intf; intf = strtok_r(NULL, ",", &save)) {
+        if(side->len == BENCH_MAX_PORTS)
+            die("at most %d interfaces are supported", BENCH_MAX_PORTS);
+        strncpy(side->intf[side->len++], intf, IF_NAMESIZE - 1);
+    }
+}
+
+/** opens a packet socket for proto bound to intf (in the current namespace) */
+static int open_packet_socket(const char* intf, uint16_t proto) {
+    struct sockaddr_ll addr;
+    int fd, val;
+
+    if((fd = socket(PF_PACKET, SOCK_RAW, htons(proto))) < 0)
+        pdie("socket (PF_PACKET)");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = PF_PACKET;
+    addr.sll_protocol = htons(proto);
+    if(!(addr.sll_ifindex = if_nametoindex(intf)))
+        die("no interface named %s", intf);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        pdie("bind (PF_PACKET)");
+
+    val = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &val, sizeof(val));
+    val = 1;
+    setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &val, sizeof(val));
+    return fd;
+}
+
+/** returns the tx packet counter of intf in the current namespace */
+static uint64_t read_tx_packets(const char* intf) {
+    unsigned long long v[16];
+    char line[512], name[64];
+    uint64_t ret;
+    FILE* fp;
+
+    ret = 0;
+    if(!(fp = fopen("/proc/net/dev", "r")))
+        return 0;
+    while(fgets(line, sizeof(line), fp)) {
+        /* name: rx bytes packets errs drop fifo frame compressed multicast
+                 tx bytes packets ... */
+        if(sscanf(line, " %63[^:]: %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+                  name, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7],
+                  &v[8], &v[9]) == 11 && strcmp(name, intf) == 0)
+            ret = v[9];
+    }
+    fclose(fp);
+    return ret;
+}
+
+/** generates frames round-robin over the tx interfaces */
+static void* generator_main(void* vb) {
+    bench* b;
+    static char frames[BENCH_BATCH][BENCH_MAX_FRAME];
+    struct mmsghdr msgs[BENCH_BATCH];
+    struct iovec iovs[BENCH_BATCH];
+    struct ether_header* eh;
+    bench_payload* pl;
+    uint64_t start, end, due, seq;
+    unsigned i, port;
+    int n;
+
+    b = (bench*)vb;
+    memset(msgs, 0, sizeof(msgs));
+    for(i=0; i<BENCH_BATCH; i++) {
+        memset(frames[i], 0, b->frame_size);
+        eh = (struct ether_header*)frames[i];
+        memcpy(eh->ether_dhost, "\x02\x00\x00\x00\x00\x01", ETH_ALEN);
+        memcpy(eh->ether_shost, "\x02\x00\x00\x00\x00\x02", ETH_ALEN);
+        eh->ether_type = htons(BENCH_ETHERTYPE);
+        iovs[i].iov_base = frames[i];
+        iovs[i].iov_len = b->frame_size;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    seq = 0;
+    port = 0;
+    start = now_ns();
+    end = start + (uint64_t)(b->duration * 1e9);
+    while(now_ns() < end) {
+        for(i=0; i<BENCH_BATCH; i++) {
+            eh = (struct ether_header*)frames[i];
+            pl = (bench_payload*)(frames[i] + sizeof(*eh));
+
+            /* vary the source MAC so the frames form many inner flows */
+            eh->ether_shost[4] = seq >> 8;
+            eh->ether_shost[5] = seq;
+            pl->magic = htonl(BENCH_MAGIC);
+            pl->port = port;
+            pl->seq = seq++;
+            pl->sent_ns = now_ns();
+        }
+
+        /* send the batch; a full socket buffer just drops the rest */
+        n = sendmmsg(b->tx.fd[port], msgs, BENCH_BATCH, 0);
+        b->sent += (n > 0) ? n : 0;
+        port = (port + 1) % b->tx.len;
+
+        if(b->rate > 0) {
+            due = start + (uint64_t)(b->sent / b->rate * 1e9);
+            while(now_ns() < due);
+        }
+    }
+
+    b->duration = (now_ns() - start) / 1e9;
+    b->tx_done = 1;
+    return NULL;
+}
+
+/** receives frames from all the rx interfaces and records their latency */
+static void sink_main(bench* b) {
+    static char bufs[BENCH_BATCH][BENCH_MAX_FRAME];
+    struct mmsghdr msgs[BENCH_BATCH];
+    struct iovec iovs[BENCH_BATCH];
+    struct pollfd pfds[BENCH_MAX_PORTS];
+    bench_payload* pl;
+    uint64_t now, idle_since;
+    unsigned i;
+    int k, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for(i=0; i<BENCH_BATCH; i++) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = BENCH_MAX_FRAME;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    for(i=0; i<b->rx.len; i++) {
+        pfds[i].fd = b->rx.fd[i];
+        pfds[i].events = POLLIN;
+    }
+
+    idle_since = 0;
+    while(1) {
+        /* stop once the generator is done and nothing arrived for a while */
+        if(poll(pfds, b->rx.len, 100) == 0) {
+            now = now_ns();
+            if(!b->tx_done)
+                continue;
+            if(!idle_since)
+                idle_since = now;
+            else if(now - idle_since > 500000000ULL)
+                break;
+            continue;
+        }
+        idle_since = 0;
+
+        for(i=0; i<b->rx.len; i++) {
+            if(!(pfds[i].revents & POLLIN))
+                continue;
+
+            n = recvmmsg(b->rx.fd[i], msgs, BENCH_BATCH, MSG_DONTWAIT, NULL);
+            now = now_ns();
+            for(k=0; k<n; k++) {
+                pl = (bench_payload*)(bufs[k] + sizeof(struct ether_header));
+                if(msgs[k].msg_len < sizeof(struct ether_header) + sizeof(*pl)
+                   || pl->magic != htonl(BENCH_MAGIC))
+                    continue;
+                if(msgs[k].msg_len != b->frame_size) {
+                    b->mismatched += 1;
+                    continue;
+                }
+
+                if(!b->received)
+                    b->first_rx_ns = now;
+                b->last_rx_ns = now;
+                b->received += 1;
+                b->received_bytes += msgs[k].msg_len;
+                if(b->samples_len < BENCH_MAX_SAMPLES)
+                    b->samples[b->samples_len++] = now - pl->sent_ns;
+            }
+        }
+    }
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/** returns percentile p (0..1) of the sorted latency samples in us */
+static double percentile_us(bench* b, double p) {
+    if(!b->samples_len)
+        return 0;
+    return b->samples[(uint64_t)(p * (b->samples_len - 1))] / 1000.0;
+}
+
+int main(int argc, char** argv) {
+    bench b;
+    pthread_t tid;
+    uint64_t tun_before = 0, tun_after;
+    double rx_secs;
+    int i;
+    unsigned k;
+
+    memset(&b, 0, sizeof(b));
+    b.frame_size = 60;
+    b.duration = 5;
+    b.label = "";
+
+    for(i=1; i<argc; i++) {
+        if(str_matches(argv[i], 3, "-?", "-help", "--help")) {
+            printf(STR_USAGE, argv[0]);
+            return 0;
+        }
+        if(i + 1 == argc)
+            die("%s requires an argument", argv[i]);
+
+        if(!strcmp(argv[i], "-t"))
+            parse_side(&b.tx, argv[++i]);
+        else if(!strcmp(argv[i], "-r"))
+            parse_side(&b.rx, argv[++i]);
+        else if(!strcmp(argv[i], "-e")) {
+            bench_side tun;
+            memset(&tun, 0, sizeof(tun));
+            parse_side(&tun, argv[++i]);
+            strcpy(b.tun_ns, tun.ns);
+            strcpy(b.tun_intf, tun.intf[0]);
+        }
+        else if(!strcmp(argv[i], "-s"))
+            b.frame_size = strtoul(argv[++i], NULL, 10);
+        else if(!strcmp(argv[i], "-d"))
+            b.duration = strtod(argv[++i], NULL);
+        else if(!strcmp(argv[i], "-p"))
+            b.rate = strtod(argv[++i], NULL);
+        else if(!strcmp(argv[i], "-l"))
+            b.label = argv[++i];
+        else
+            die("unknown option %s", argv[i]);
+    }
+
+    if(!b.tx.len || !b.rx.len)
+        die("-t and -r are required (see -help)");
+    if(b.frame_size < sizeof(struct ether_header) + sizeof(bench_payload)
+       || b.frame_size > BENCH_MAX_FRAME)
+        die("frame size must be between %u and %u bytes",
+            (unsigned)(sizeof(struct ether_header) + sizeof(bench_payload)),
+            BENCH_MAX_FRAME);
+    if(!(b.samples = malloc(BENCH_MAX_SAMPLES * sizeof(uint64_t))))
+        pdie("malloc (samples)");
+
+    /* sockets keep the namespace they were created in */
+    enter_ns(b.rx.ns);
+    for(k=0; k<b.rx.len; k++)
+        b.rx.fd[k] = open_packet_socket(b.rx.intf[k], BENCH_ETHERTYPE);
+    enter_ns(b.tx.ns);
+    for(k=0; k<b.tx.len; k++)
+        b.tx.fd[k] = open_packet_socket(b.tx.intf[k], 0);
+
+    if(b.tun_intf[0]) {
+        enter_ns(b.tun_ns);
+        tun_before = read_tx_packets(b.tun_intf);
+    }
+
+    if(pthread_create(&tid, NULL, generator_main, &b) != 0)
+        pdie("pthread_create");
+    sink_main(&b);
+    pthread_join(tid, NULL);
+
+    tun_after = b.tun_intf[0] ? read_tx_packets(b.tun_intf) : 0;
+
+    qsort(b.samples, b.samples_len, sizeof(uint64_t), cmp_u64);
+    rx_secs = (b.last_rx_ns > b.first_rx_ns) ? (b.last_rx_ns - b.first_rx_ns) / 1e9 : b.duration;
+
+    printf("{\"label\":\"%s\",\"frame_size\":%u,\"ports\":%u,\"duration_s\":%.3f,"
+           "\"sent\":%llu,\"received\":%llu,\"mismatched\":%llu,\"loss_pct\":%.3f,"
+           "\"tx_pps\":%.0f,\"encap_pps\":%.0f,\"decap_pps\":%.0f,\"decap_gbps\":%.4f,"
+           "\"lat_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+           b.label, b.frame_size, b.tx.len, b.duration,
+           (unsigned long long)b.sent, (unsigned long long)b.received,
+           (unsigned long long)b.mismatched,
+           b.sent ? 100.0 * (b.sent - (b.received < b.sent ? b.received : b.sent)) / b.sent : 0,
+           b.sent / b.duration,
+           b.tun_intf[0] ? (tun_after - tun_before) / b.duration : 0,
+           b.received / rx_secs,
+           b.received_bytes * 8 / rx_secs / 1e9,
+           percentile_us(&b, 0.50), percentile_us(&b, 0.90), percentile_us(&b, 0.99),
+           percentile_us(&b, 0.999), percentile_us(&b, 1.0));
+    return 0;
+}
@@ -0,0 +1,142 @@
+/**
+ * Filename: capcheck.c
+ * Purpose:  standalone checks of code the capsulator trusts with what the
+ *           network sends it: the reassembly of its fragments
+ */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common.h"
+#include "../frag.h"
+#include "../stats.h"
+
+/** size of the reassembly buffers */
+#define CHECK_BUF_SIZE 9216
+
+/** number of checks which failed */
+static unsigned check_failures = 0;
+
+/** reports whether the check named what held */
+static void check(int ok, const char* what) {
+    printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+    if(!ok)
+        check_failures += 1;
+}
+
+/** fills the len bytes at buf with a pattern of frame id */
+static void check_fill(char* buf, unsigned len, uint32_t id) {
+    unsigned i;
+
+    for(i=0; i<len; i++)
+        buf[i] = (char)(i * 7 + id);
+}
+
+/**
+ * Adds fragment index (of count) of frame id to t, claiming to hold the n bytes
+ * at offset off of frame.
+ *
+ * @return what frag_add() returns
+ */
+static char* check_add(frag_table* t, const char* frame, uint32_t id, unsigned count,
+                       unsigned index, unsigned off, unsigned n, unsigned* frame_len) {
+    frag_info fi;
+
+    fi.id = htonl(id);
+    fi.offset = htons(off);
+    fi.index = index;
+    fi.count = count;
+    return frag_add(t, htonl(0x0A000001), htonl(20), &fi, frame + off, n, frame_len);
+}
+
+/** returns the offset and length of fragment index of a frame of len bytes
+    split into count by egress */
+static unsigned check_split(unsigned len, unsigned count, unsigned index, unsigned* n) {
+    unsigned seg;
+
+    seg = (len + count - 1) / count;
+    *n = (index == count - 1) ? len - index * seg : seg;
+    return index * seg;
+}
+
+int main(void) {
+    static char frame[CHECK_BUF_SIZE], other[CHECK_BUF_SIZE];
+    static const unsigned order[4] = { 2, 0, 3, 1 };
+    frag_table* t;
+    port_stats* stats;
+    char* out;
+    unsigned i, off, n, len;
+
+    stats = stats_alloc(1);
+    t = frag_table_create(4, CHECK_BUF_SIZE, stats);
+    check_fill(frame, sizeof(frame), 1);
+    check_fill(other, sizeof(other), 2);
+
+    /* out of order, with a duplicate of an earlier fragment */
+    out = NULL;
+    for(i=0; i<4; i++) {
+        off = check_split(5000, 4, order[i], &n);
+        out = check_add(t, frame, 1, 4, order[i], off, n, &len);
+        if(i == 1)
+            check(!check_add(t, frame, 1, 4, order[0], check_split(5000, 4, order[0], &n), n, &len),
+                  "a duplicate fragment completes nothing");
+    }
+    check(out && len == 5000 && memcmp(out, frame, len) == 0,
+          "fragments out of order reassemble the frame");
+    frag_release(t);
+
+    /* a frame of one fragment */
+    out = check_add(t, frame, 2, 1, 0, 0, 800, &len);
+    check(out && len == 800 && memcmp(out, frame, len) == 0, "a single fragment is a frame");
+    frag_release(t);
+
+    /* fragments which disagree on the number of fragments */
+    off = check_split(3000, 3, 0, &n);
+    check_add(t, frame, 3, 3, 0, off, n, &len);
+    off = check_split(3000, 2, 1, &n);
+    check(!check_add(t, frame, 3, 2, 1, off, n, &len), "a mismatched count completes nothing");
+    off = check_split(3000, 3, 1, &n);
+    check_add(t, frame, 3, 3, 1, off, n, &len);
+    off = check_split(3000, 3, 2, &n);
+    check(!check_add(t, frame, 3, 3, 2, off, n, &len), "a mismatched count drops the frame");
+
+    /* a previous frame leaves its bytes in the buffers, which gapped
+       fragments must not pass on */
+    for(i=0; i<2; i++) {
+        check_add(t, other, 10 + i, 2, 0, 0, 3000, &len);
+        check_add(t, other, 10 + i, 2, 1, 3000, 3000, &len);
+    }
+    frag_release(t);
+    check(!check_add(t, frame, 4, 2, 0, 0, 100, &len) &&
+          !check_add(t, frame, 4, 2, 1, 5000, 100, &len),
+          "a gap between fragments completes nothing");
+    check(!check_add(t, frame, 5, 2, 1, 5000, 100, &len) &&
+          !check_add(t, frame, 5, 2, 0, 0, 100, &len),
+          "a gap before the last fragment completes nothing");
+    check(!check_add(t, frame, 6, 3, 0, 0, 1000, &len) &&
+          !check_add(t, frame, 6, 3, 1, 1000, 500, &len) &&
+          !check_add(t, frame, 6, 3, 2, 2000, 100, &len),
+          "fragments of unequal length complete nothing");
+    check(!check_add(t, frame, 7, 2, 0, 0, 1000, &len) &&
+          !check_add(t, frame, 7, 2, 1, 1000, 1500, &len),
+          "a last fragment longer than the others completes nothing");
+    check(!check_add(t, frame, 8, 2, 1, 1000, 500, &len) &&
+          !check_add(t, frame, 8, 2, 0, 100, 1000, &len),
+          "a first fragment at an offset completes nothing");
+
+    /* after all that, a good frame still goes through */
+    out = NULL;
+    for(i=0; i<3; i++) {
+        off = check_split(4001, 3, i, &n);
+        out = check_add(t, frame, 9, 3, i, off, n, &len);
+    }
+    check(out && len == 4001 && memcmp(out, frame, len) == 0, "a good frame follows bad ones");
+    frag_release(t);
+
+    frag_table_destroy(t);
+    printf("%u checks failed\n", check_failures);
+    return check_failures ? 1 : 0;
+}
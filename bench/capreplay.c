@@ -0,0 +1,468 @@
+/**
+ * Filename: capreplay.c
+ * Purpose:  offline benchmark of the capsulator's encapsulation and
+ *           decapsulation paths: replays the Ethernet frames of a pcap file
+ *           through them without sockets and reports each stage's cost as JSON
+ */
+
+#define _GNU_SOURCE /* struct mmsghdr */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../capsulator.h"
+#include "../common.h"
+#include "../csum.h"
+#include "../egress.h"
+
+/* UDP GSO option newer than some C libraries' <netinet/udp.h> */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#define STR_USAGE "\
+%s: -r FILE [options]\n\
+  -r:      pcap file of the Ethernet frames the border ports receive\n\
+  -p:      border ports (tags 1..N) the frames are dealt out to in turn\n\
+           (default: 1)\n\
+  -d:      tunnel endpoints every frame is sent to (default: 1)\n\
+  -n:      timed passes over the frames per stage (default: 10)\n\
+  -u:      encapsulate in UDP rather than raw IP\n\
+  -gso:    with -u, hand trains of frames over as UDP GSO messages\n\
+  -learn:  bridge the tags (MAC learning)\n\
+  -frag:   split frames longer than the MTU into capsulator fragments\n\
+  -hdrincl: without -u, write the outer IP headers rather than the kernel\n\
+  -batch:  frames per batch (default: %u)\n\
+  -mtu:    MTU of the tunnel port, which bounds GSO trains (default: 1500)\n\
+  -w:      pcap file the decapsulated frames of one pass are written to\n\
+  -l:      label copied into the report\n\
+\n\
+A first, untimed pass of each stage captures its output: the tunnel packets\n\
+the decapsulation stage replays, and the frames -w writes.  The timed\n\
+passes hand their output to a sink which only counts it.\n"
+
+/** pcap file magic numbers (microsecond and nanosecond timestamps) */
+#define PCAP_MAGIC    0xA1B2C3D4u
+#define PCAP_MAGIC_NS 0xA1B23C4Du
+
+/** link type of Ethernet frames */
+#define PCAP_LINKTYPE_ETHERNET 1
+
+/** UDP port tunnel packets are sent to with -u */
+#define REPLAY_UDP_PORT 4789
+
+/** size of the IP header put in front of captured raw IP tunnel packets */
+#define REPLAY_IP_HDR_LEN 20
+
+/** NBO IPv4 address decapsulated tunnel packets come from (192.0.2.1) */
+#define REPLAY_SRC_IP htonl(0xC0000201u)
+
+/** pcap file header */
+typedef struct pcap_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcap_hdr;
+
+/** pcap record header */
+typedef struct pcap_rec {
+    uint32_t ts_sec;
+    uint32_t ts_frac;
+    uint32_t caplen;
+    uint32_t len;
+} pcap_rec;
+
+/** packets laid out one after the other in a growing buffer */
+typedef struct replay_packets {
+    char** data;
+    unsigned* len;
+    unsigned count;
+    unsigned cap;
+} replay_packets;
+
+/** what the sinks do with the packets they are handed */
+typedef struct replay_sinks {
+    /** if non-zero, tunnel packets are captured into tunnel and frames
+        written to out (if not NULL) */
+    int capture;
+    replay_packets tunnel;
+    FILE* out;
+
+    /** if non-zero, tunnel packets come with their IP header (-hdrincl) */
+    int hdrincl;
+
+    /** packets each sink was handed */
+    uint64_t tunnel_packets;
+    uint64_t border_packets;
+} replay_sinks;
+
+/** one stage's timing */
+typedef struct replay_result {
+    uint64_t in;
+    uint64_t out;
+    double ns;
+} replay_result;
+
+/** returns a monotonic timestamp in ns */
+static double replay_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** appends a copy of the len bytes at data to p, behind headroom bytes */
+static char* replay_append(replay_packets* p, unsigned headroom, const char* data, unsigned len) {
+    char* copy;
+
+    if(p->count == p->cap) {
+        p->cap = p->cap ? 2 * p->cap : 1024;
+        p->data = realloc(p->data, p->cap * sizeof(*p->data));
+        p->len = realloc(p->len, p->cap * sizeof(*p->len));
+        if(!p->data || !p->len)
+            pdie("realloc (replay packets)");
+    }
+    if(!(copy = malloc(headroom + len)))
+        pdie("malloc (replay packet)");
+    memcpy(copy + headroom, data, len);
+    p->data[p->count] = copy;
+    p->len[p->count++] = headroom + len;
+    return copy;
+}
+
+/** copies the iovecs of m into buf (of at least 64KB) and returns their length */
+static unsigned replay_gather(struct msghdr* m, char* buf) {
+    unsigned i, len;
+
+    len = 0;
+    for(i=0; i<m->msg_iovlen; i++) {
+        memcpy(buf + len, m->msg_iov[i].iov_base, m->msg_iov[i].iov_len);
+        len += m->msg_iov[i].iov_len;
+    }
+    return len;
+}
+
+/** returns the UDP GSO segment size of m, or 0 if it carries one packet */
+static unsigned replay_gso_size(struct msghdr* m) {
+    struct cmsghdr* cm;
+    uint16_t size;
+
+    for(cm = CMSG_FIRSTHDR(m); cm; cm = CMSG_NXTHDR(m, cm))
+        if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_SEGMENT) {
+            memcpy(&size, CMSG_DATA(cm), sizeof(size));
+            return size;
+        }
+    return 0;
+}
+
+/**
+ * Takes what would be sent to the tunnel endpoints: counts the packets and,
+ * when capturing, keeps them as the tunnel port would receive them.
+ */
+static int replay_tunnel_sink(void* arg, int fd, struct mmsghdr* msgs, unsigned len) {
+    static char buf[0x10000];
+    replay_sinks* s;
+    struct iphdr* ip;
+    struct msghdr* m;
+    unsigned i, j, n, seg, off;
+
+    s = arg;
+    for(i=0; i<len; i++) {
+        m = &msgs[i].msg_hdr;
+        n = 0;
+        for(j=0; j<m->msg_iovlen; j++)
+            n += m->msg_iov[j].iov_len;
+        msgs[i].msg_len = n;
+
+        seg = m->msg_controllen ? replay_gso_size(m) : 0;
+        s->tunnel_packets += seg ? (n + seg - 1) / seg : 1;
+        if(!s->capture)
+            continue;
+
+        /* a raw IP socket would receive the packet with its IP header,
+           which it may have been sent with (checksummed, for the receiver
+           would drop it otherwise) */
+        n = replay_gather(m, buf);
+        if(s->hdrincl) {
+            if(csum(buf, REPLAY_IP_HDR_LEN) != 0)
+                die("tunnel packet %u has a bad IP header checksum", s->tunnel.count);
+            replay_append(&s->tunnel, 0, buf, n);
+            continue;
+        }
+        if(!seg)
+            seg = n;
+        for(off=0; off<n; off+=seg) {
+            ip = (struct iphdr*)replay_append(&s->tunnel, REPLAY_IP_HDR_LEN, buf + off,
+                                              (n - off < seg) ? n - off : seg);
+            memset(ip, 0, REPLAY_IP_HDR_LEN);
+            ip->version = 4;
+            ip->ihl = REPLAY_IP_HDR_LEN / 4;
+            ip->protocol = IPPROTO_CAPSULATOR;
+            ip->saddr = REPLAY_SRC_IP;
+        }
+    }
+    return len;
+}
+
+/**
+ * Takes what would be written to the border ports: counts the frames and,
+ * when capturing, writes them to the output file.
+ */
+static int replay_border_sink(void* arg, int fd, struct mmsghdr* msgs, unsigned len) {
+    replay_sinks* s;
+    pcap_rec rec;
+    unsigned i;
+
+    s = arg;
+    for(i=0; i<len; i++) {
+        msgs[i].msg_len = msgs[i].msg_hdr.msg_iov[0].iov_len;
+        if(s->capture && s->out) {
+            memset(&rec, 0, sizeof(rec));
+            rec.caplen = rec.len = msgs[i].msg_len;
+            fwrite(&rec, sizeof(rec), 1, s->out);
+            fwrite(msgs[i].msg_hdr.msg_iov[0].iov_base, msgs[i].msg_len, 1, s->out);
+        }
+    }
+    s->border_packets += len;
+    return len;
+}
+
+/**
+ * Maps the pcap file path (privately, so frames may be padded in place) and
+ * stores its frames in frames.  Dies on failure.
+ */
+static void replay_read_pcap(const char* path, replay_packets* frames) {
+    struct stat st;
+    pcap_hdr* hdr;
+    pcap_rec* rec;
+    char* map;
+    size_t off;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+        pdie("pcap file");
+    if((size_t)st.st_size < sizeof(*hdr))
+        die("%s is not a pcap file", path);
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+        pdie("mmap (pcap file)");
+    close(fd);
+
+    hdr = (pcap_hdr*)map;
+    if(hdr->magic != PCAP_MAGIC && hdr->magic != PCAP_MAGIC_NS)
+        die("%s is not a pcap file in host byte order", path);
+    if(hdr->linktype != PCAP_LINKTYPE_ETHERNET)
+        die("%s does not hold Ethernet frames (link type %u)", path, hdr->linktype);
+
+    /* the frames are used where they are mapped */
+    memset(frames, 0, sizeof(*frames));
+    for(off = sizeof(*hdr); off + sizeof(*rec) <= (size_t)st.st_size; ) {
+        rec = (pcap_rec*)(map + off);
+        off += sizeof(*rec);
+        if(off + rec->caplen > (size_t)st.st_size)
+            break;
+        if(frames->count == frames->cap) {
+            frames->cap = frames->cap ? 2 * frames->cap : 1024;
+            frames->data = realloc(frames->data, frames->cap * sizeof(*frames->data));
+            frames->len = realloc(frames->len, frames->cap * sizeof(*frames->len));
+            if(!frames->data || !frames->len)
+                pdie("realloc (pcap frames)");
+        }
+        frames->data[frames->count] = map + off;
+        frames->len[frames->count++] = rec->caplen;
+        off += rec->caplen;
+    }
+    if(!frames->count)
+        die("%s holds no frames", path);
+}
+
+/** opens the pcap file path for writing Ethernet frames */
+static FILE* replay_open_pcap(const char* path) {
+    pcap_hdr hdr;
+    FILE* fp;
+
+    if(!(fp = fopen(path, "w")))
+        pdie("pcap file");
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PCAP_MAGIC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.snaplen = 0xFFFF;
+    hdr.linktype = PCAP_LINKTYPE_ETHERNET;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    return fp;
+}
+
+/** runs passes of the encapsulation stage over frames */
+static void replay_encap(capsulator_replay* r, replay_packets* frames,
+                         unsigned ports, unsigned passes, replay_result* res) {
+    unsigned i, p;
+    double start;
+
+    start = replay_now();
+    for(p=0; p<passes; p++)
+        for(i=0; i<frames->count; i++)
+            capsulator_replay_encap(r, i % ports, frames->data[i], frames->len[i]);
+    capsulator_replay_flush(r);
+    res->ns = replay_now() - start;
+    res->in = (uint64_t)passes * frames->count;
+}
+
+/** runs passes of the decapsulation stage over the captured tunnel packets */
+static void replay_decap(capsulator_replay* r, replay_sinks* s, unsigned udp,
+                         unsigned passes, replay_result* res) {
+    unsigned i, p, off;
+    double start;
+
+    /* UDP sockets receive the packets without their IP header */
+    off = udp ? REPLAY_IP_HDR_LEN : 0;
+    start = replay_now();
+    for(p=0; p<passes; p++)
+        for(i=0; i<s->tunnel.count; i++)
+            capsulator_replay_decap(r, s->tunnel.data[i] + off, s->tunnel.len[i] - off,
+                                    REPLAY_SRC_IP);
+    capsulator_replay_flush(r);
+    res->ns = replay_now() - start;
+    res->in = (uint64_t)passes * s->tunnel.count;
+}
+
+/** prints one stage of the report */
+static void replay_print_stage(const char* name, const replay_result* res, int last) {
+    printf("\"%s\":{\"packets_in\":%llu,\"packets_out\":%llu,\"ns_per_packet\":%.1f,\"packets_per_s\":%.0f}%s",
+           name, (unsigned long long)res->in, (unsigned long long)res->out,
+           res->in ? res->ns / res->in : 0.0,
+           res->ns > 0 ? res->in * 1e9 / res->ns : 0.0, last ? "" : ",");
+}
+
+int main(int argc, char** argv) {
+    replay_packets frames;
+    replay_result enc, dec;
+    replay_sinks sinks;
+    capsulator_replay* r;
+    capsulator c;
+    const char *in_path, *out_path, *label;
+    unsigned i, ports, dests, passes, max_len;
+
+    in_path = out_path = NULL;
+    label = "";
+    ports = dests = 1;
+    passes = 10;
+    memset(&c, 0, sizeof(c));
+    c.batch = EGRESS_DEFAULT_BATCH;
+    c.flush_us = EGRESS_DEFAULT_FLUSH_US;
+    c.udp_sources = EGRESS_DEFAULT_UDP_SOURCES;
+    c.learn_age = MAC_TABLE_DEFAULT_AGE;
+    c.tunnel_workers = 1;
+    c.tp.mtu = 1500;
+    strncpy(c.tp.intf, "replay", IF_NAMESIZE - 1);
+
+    for(i=1; i<(unsigned)argc; i++) {
+        if(str_matches(argv[i], 3, "-h", "-?", "--help")) {
+            printf(STR_USAGE, argv[0], EGRESS_DEFAULT_BATCH);
+            return 0;
+        }
+        else if(str_matches(argv[i], 1, "-u"))
+            c.udp_port = htons(REPLAY_UDP_PORT);
+        else if(str_matches(argv[i], 1, "-gso"))
+            c.udp_offload = 1;
+        else if(str_matches(argv[i], 1, "-learn"))
+            c.learn = 1;
+        else if(str_matches(argv[i], 1, "-frag"))
+            c.frag = 1;
+        else if(str_matches(argv[i], 1, "-hdrincl"))
+            c.hdrincl = 1;
+        else if(i + 1 == (unsigned)argc)
+            die("%s requires a value (see -h)", argv[i]);
+        else if(str_matches(argv[i], 1, "-r"))
+            in_path = argv[++i];
+        else if(str_matches(argv[i], 1, "-w"))
+            out_path = argv[++i];
+        else if(str_matches(argv[i], 1, "-l"))
+            label = argv[++i];
+        else if(str_matches(argv[i], 1, "-p"))
+            ports = strtoul(argv[++i], NULL, 10);
+        else if(str_matches(argv[i], 1, "-d"))
+            dests = strtoul(argv[++i], NULL, 10);
+        else if(str_matches(argv[i], 1, "-n"))
+            passes = strtoul(argv[++i], NULL, 10);
+        else if(str_matches(argv[i], 1, "-batch"))
+            c.batch = strtoul(argv[++i], NULL, 10);
+        else if(str_matches(argv[i], 1, "-mtu"))
+            c.tp.mtu = strtoul(argv[++i], NULL, 10);
+        else
+            die("unknown option %s (see -h)", argv[i]);
+    }
+    if(!in_path)
+        die("a pcap file to replay is required (-r)");
+    if(!ports || !dests || !passes || !c.batch)
+        die("-p, -d, -n and -batch must be at least 1");
+    if(c.hdrincl && c.udp_port)
+        die("-hdrincl cannot be used with -u");
+
+    replay_read_pcap(in_path, &frames);
+    max_len = 0;
+    for(i=0; i<frames.count; i++)
+        if(frames.len[i] > max_len)
+            max_len = frames.len[i];
+
+    /* every port's frames go to all the endpoints */
+    broadcast = 1;
+    if(!(c.tp.tunnel_dest_ips = calloc(dests, sizeof(uint32_t))) ||
+       !(c.bp = calloc(ports, sizeof(*c.bp))))
+        pdie("malloc (replay ports)");
+    for(i=0; i<dests; i++)
+        c.tp.tunnel_dest_ips[i] = htonl(0xC6120001u + i); /* 198.18.0.1 on */
+    c.tp.tunnel_dest_ips_len = dests;
+    for(i=0; i<ports; i++) {
+        snprintf(c.bp[i].intf, IF_NAMESIZE, "bp%u", i);
+        c.bp[i].tag = i + 1;
+    }
+    c.bp_len = ports;
+    c.buf_size = (max_len > c.tp.mtu ? max_len : c.tp.mtu) + REPLAY_IP_HDR_LEN + 64;
+
+    memset(&sinks, 0, sizeof(sinks));
+    sinks.hdrincl = c.hdrincl;
+    r = capsulator_replay_create(&c, replay_tunnel_sink, replay_border_sink, &sinks);
+
+    /* one pass each to capture what the next stage (and -w) takes, then
+       the timed ones */
+    sinks.capture = 1;
+    sinks.out = out_path ? replay_open_pcap(out_path) : NULL;
+    replay_encap(r, &frames, ports, 1, &enc);
+    replay_decap(r, &sinks, c.udp_port != 0, 1, &dec);
+    if(sinks.out)
+        fclose(sinks.out);
+    sinks.capture = 0;
+
+    sinks.tunnel_packets = sinks.border_packets = 0;
+    replay_encap(r, &frames, ports, passes, &enc);
+    enc.out = sinks.tunnel_packets;
+    replay_decap(r, &sinks, c.udp_port != 0, passes, &dec);
+    dec.out = sinks.border_packets;
+
+    printf("{\"label\":\"%s\",\"frames\":%u,\"ports\":%u,\"dests\":%u,\"passes\":%u,\"udp\":%d,\"gso\":%d,\"learn\":%d,\"frag\":%d,\"hdrincl\":%d,",
+           label, frames.count, ports, dests, passes, c.udp_port != 0,
+           c.udp_port && c.udp_offload, c.learn, c.frag, c.hdrincl);
+    replay_print_stage("encap", &enc, 0);
+    replay_print_stage("decap", &dec, 1);
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,106 @@
+/* Filename: bpf.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bpf.h"
+#include "common.h"
+
+int bpf_prog_load(unsigned type, unsigned attach_type,
+                  const struct bpf_insn* insns, unsigned len) {
+    static char log[8192];
+    union bpf_attr a;
+    int fd;
+
+    memset(&a, 0, sizeof(a));
+    a.prog_type = type;
+    a.expected_attach_type = attach_type;
+    a.insns = (uintptr_t)insns;
+    a.insn_cnt = len;
+    a.license = (uintptr_t)"GPL";
+    a.log_buf = (uintptr_t)log;
+    a.log_size = sizeof(log);
+    a.log_level = 1;
+    log[0] = '\0';
+    if((fd = syscall(__NR_bpf, BPF_PROG_LOAD, &a, sizeof(a))) < 0 && log[0])
+        verbose_println("%s", log);
+    return fd;
+}
+
+int bpf_map_create(unsigned type, unsigned key_size, unsigned value_size,
+                   unsigned entries) {
+    union bpf_attr a;
+
+    memset(&a, 0, sizeof(a));
+    a.map_type = type;
+    a.key_size = key_size;
+    a.value_size = value_size;
+    a.max_entries = entries;
+    return syscall(__NR_bpf, BPF_MAP_CREATE, &a, sizeof(a));
+}
+
+/** issues the map element command cmd */
+static int bpf_map_elem(int cmd, int map, const void* key, void* value) {
+    union bpf_attr a;
+
+    memset(&a, 0, sizeof(a));
+    a.map_fd = map;
+    a.key = (uintptr_t)key;
+    a.value = (uintptr_t)value;
+    return syscall(__NR_bpf, cmd, &a, sizeof(a));
+}
+
+int bpf_map_update(int map, const void* key, const void* value) {
+    return bpf_map_elem(BPF_MAP_UPDATE_ELEM, map, key, (void*)value);
+}
+
+int bpf_map_lookup(int map, const void* key, void* value) {
+    return bpf_map_elem(BPF_MAP_LOOKUP_ELEM, map, key, value);
+}
+
+int bpf_map_delete(int map, const void* key) {
+    return bpf_map_elem(BPF_MAP_DELETE_ELEM, map, key, NULL);
+}
+
+int bpf_map_next_key(int map, const void* key, void* next) {
+    union bpf_attr a;
+
+    memset(&a, 0, sizeof(a));
+    a.map_fd = map;
+    a.key = (uintptr_t)key;
+    a.next_key = (uintptr_t)next;
+    return syscall(__NR_bpf, BPF_MAP_GET_NEXT_KEY, &a, sizeof(a));
+}
+
+unsigned bpf_possible_cpus(void) {
+    static unsigned n = 0;
+    unsigned lo, hi;
+    FILE* fp;
+    int c;
+
+    if(n)
+        return n;
+
+    /* a list of ranges like "0-3,8-11" */
+    if((fp = fopen("/sys/devices/system/cpu/possible", "r"))) {
+        while(fscanf(fp, "%u", &lo) == 1) {
+            hi = lo;
+            if((c = fgetc(fp)) == '-') {
+                if(fscanf(fp, "%u", &hi) != 1)
+                    break;
+                c = fgetc(fp);
+            }
+            if(hi + 1 > n)
+                n = hi + 1;
+            if(c != ',')
+                break;
+        }
+        fclose(fp);
+    }
+    if(!n)
+        n = sysconf(_SC_NPROCESSORS_CONF);
+    return n;
+}
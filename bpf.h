@@ -0,0 +1,71 @@
+/**
+ * Filename: bpf.h
+ * Purpose:  assemble eBPF instructions and issue the bpf() system calls the
+ *           XDP programs and socket filters need, without libbpf
+ */
+
+#ifndef _BPF_H_
+#define _BPF_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <linux/bpf.h>
+
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_IMM(d, i)     INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define MOV64_REG(d, s)     INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define ADD64_IMM(d, i)     INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define AND64_IMM(d, i)     INSN(BPF_ALU64 | BPF_AND | BPF_K, d, 0, 0, i)
+#define LDX(size, d, s, o)  INSN(BPF_LDX | BPF_MEM | (size), d, s, o, 0)
+#define STX(size, d, s, o)  INSN(BPF_STX | BPF_MEM | (size), d, s, o, 0)
+#define LD_ABS(size, o)     INSN(BPF_LD | BPF_ABS | (size), 0, 0, 0, o)
+#define CALL(f)             INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()              INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/** the two instructions loading the address of map (an fd) into d */
+#define LD_MAP_FD(d, map) \
+    INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, map), \
+    INSN(0, 0, 0, 0, 0)
+
+/* conditional jumps compare the low 32 bits so immediates are not
+   sign-extended (but a pointer is checked against NULL with JEQ_IMM); their
+   offset is patched once the target is known */
+#define JEQ_IMM(d, i)       INSN(BPF_JMP | BPF_JEQ | BPF_K, d, 0, 0, i)
+#define JEQ32_IMM(d, i)     INSN(BPF_JMP32 | BPF_JEQ | BPF_K, d, 0, 0, i)
+#define JNE32_IMM(d, i)     INSN(BPF_JMP32 | BPF_JNE | BPF_K, d, 0, 0, i)
+#define JLT32_IMM(d, i)     INSN(BPF_JMP32 | BPF_JLT | BPF_K, d, 0, 0, i)
+#define JSET32_IMM(d, i)    INSN(BPF_JMP32 | BPF_JSET | BPF_K, d, 0, 0, i)
+#define JGT_REG(d, s)       INSN(BPF_JMP | BPF_JGT | BPF_X, d, s, 0, 0)
+#define JA()                INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0)
+
+/**
+ * Loads the program insns (of len instructions) of type type.  If the kernel
+ * refuses, its verifier log is printed in verbose mode.
+ *
+ * @return the program's fd, or -1 (errno is set)
+ */
+int bpf_prog_load(unsigned type, unsigned attach_type,
+                  const struct bpf_insn* insns, unsigned len);
+
+/** @return a new map's fd, or -1 (errno is set) */
+int bpf_map_create(unsigned type, unsigned key_size, unsigned value_size,
+                   unsigned entries);
+
+/** Wrappers of the map element commands: return 0, or -1 (errno is set). */
+int bpf_map_update(int map, const void* key, const void* value);
+int bpf_map_lookup(int map, const void* key, void* value);
+int bpf_map_delete(int map, const void* key);
+
+/** Stores the key after key (the first one if key is NULL) in next. */
+int bpf_map_next_key(int map, const void* key, void* next);
+
+/**
+ * Returns the number of CPUs the kernel may ever bring up: a lookup in a
+ * per-CPU map returns one value for each.
+ */
+unsigned bpf_possible_cpus(void);
+
+#endif /* _BPF_H_ */
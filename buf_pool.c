@@ -0,0 +1,64 @@
+/* Filename: buf_pool.c */
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "buf_pool.h"
+#include "common.h"
+
+/** size of a huge page; smaller pools use normal pages */
+#define BUF_POOL_HUGE_PAGE (2 * 1024 * 1024)
+
+/** buffers start on their own cache line */
+#define BUF_POOL_ALIGN 64
+
+/** maps len bytes, from reserved huge pages if there are any */
+static void* buf_pool_map(size_t* len) {
+    size_t huge_len;
+    void* area;
+
+    if(*len >= BUF_POOL_HUGE_PAGE) {
+        huge_len = (*len + BUF_POOL_HUGE_PAGE - 1) & ~(size_t)(BUF_POOL_HUGE_PAGE - 1);
+        area = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(area != MAP_FAILED) {
+            *len = huge_len;
+            return area;
+        }
+    }
+
+    area = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(area == MAP_FAILED)
+        pdie("mmap (buffer pool)");
+
+    /* without reserved huge pages, transparent ones will do */
+    madvise(area, *len, MADV_HUGEPAGE);
+    return area;
+}
+
+buf_pool* buf_pool_create(unsigned count, unsigned size) {
+    buf_pool* p;
+
+    if(!(p = calloc(1, sizeof(*p))))
+        pdie("malloc (buffer pool)");
+    p->size = size;
+    p->stride = (BUF_POOL_HEADROOM + size + BUF_POOL_ALIGN - 1) & ~(BUF_POOL_ALIGN - 1);
+    p->count = count ? count : 1;
+    p->area_len = (size_t)p->count * p->stride;
+    p->area = buf_pool_map(&p->area_len);
+    p->used = 0;
+
+    return p;
+}
+
+uint8_t* buf_pool_get(buf_pool* p) {
+    if(p->used == p->count)
+        return NULL;
+    return p->area + (size_t)p->used++ * p->stride + BUF_POOL_HEADROOM;
+}
+
+void buf_pool_destroy(buf_pool* p) {
+    munmap(p->area, p->area_len);
+    free(p);
+}
@@ -0,0 +1,64 @@
+/**
+ * Filename: buf_pool.h
+ * Purpose:  preallocated packet buffers with headroom: the egress slots, the
+ *           ingress buffers, the shaper rings and the io_uring provided
+ *           buffers all come from pools
+ */
+
+#ifndef _BUF_POOL_H_
+#define _BUF_POOL_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <stddef.h> /* size_t */
+
+/** headroom in front of every buffer, for headers prepended in place */
+#define BUF_POOL_HEADROOM 64
+
+/**
+ * A fixed number of equally sized buffers carved out of one mapping.  The
+ * mapping uses huge pages when it is large enough and the system has them.  Its
+ * pages are not touched until a buffer is first used, so they are placed on the
+ * NUMA node of the thread using them.
+ *
+ * Buffers are taken once, when what uses them (a batch, a shaper ring or a
+ * provided buffer ring, each with a pool of its own) is set up, and are kept
+ * until the pool is destroyed: they are not given back one by one.  Whatever
+ * passes them between threads (a shaper ring) or to the kernel (a provided
+ * buffer ring) does its own accounting of which are in use.
+ */
+typedef struct buf_pool {
+    uint8_t* area;
+    size_t area_len;
+
+    /** bytes a buffer holds after its headroom, and the distance between
+        buffers */
+    unsigned size;
+    unsigned stride;
+    unsigned count;
+
+    /** buffers handed out so far (taken in order, without touching the
+        others' pages) */
+    unsigned used;
+} buf_pool;
+
+/**
+ * Creates a pool of count buffers of size bytes, each behind
+ * BUF_POOL_HEADROOM bytes of headroom.  Dies on failure.
+ */
+buf_pool* buf_pool_create(unsigned count, unsigned size);
+
+/**
+ * Takes a buffer.  Only the thread owning p may call this.
+ *
+ * @return the start of the buffer (after its headroom), or NULL if all are
+ *         taken
+ */
+uint8_t* buf_pool_get(buf_pool* p);
+
+/** Unmaps the pool and with it all its buffers. */
+void buf_pool_destroy(buf_pool* p);
+
+#endif /* _BUF_POOL_H_ */
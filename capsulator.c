@@ -1,30 +1,116 @@
 /* Filename: capsulator.c */
 
+#define _GNU_SOURCE /* ppoll */
+
 #include <errno.h>
 #include <net/ethernet.h>
 #include <netinet/ip.h>
+#include <netinet/udp.h>
 #include <netpacket/packet.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "buf_pool.h"
 #include "capsulator.h"
 #include "common.h"
+#include "config.h"
+#include "egress.h"
+#include "filter.h"
+#include "flow.h"
+#include "frag.h"
 #include "get_ip_for_interface.h"
+#include "ingress.h"
+#include "keepalive.h"
+#include "log.h"
+#include "stats.h"
+#include "tag_table.h"
+#include "uring.h"
+#include "xdp_engine.h"
 
 #include "linux/if_tun.h"
 
+/* fanout modes newer than some C libraries' <netpacket/packet.h> */
+#ifndef PACKET_FANOUT_CBPF
+#define PACKET_FANOUT_CBPF 6
+#endif
+#ifndef PACKET_FANOUT_FLAG_DEFRAG
+#define PACKET_FANOUT_FLAG_DEFRAG 0x8000
+#endif
+
+/* UDP GRO option newer than some C libraries' <netinet/udp.h> */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
 /**
  * Specifies which border port a thread should control.
  */
 typedef struct border_port_control_info {
     tunnel_port* tp;
     border_port* bp;
+
+    /** the queue of bp this thread reads, its file descriptor and counters */
+    unsigned queue;
+    int fd;
+    port_stats* stats;
+
+    /** how much the thread serving the queue logs about it */
+    log_limit log;
+
+    /** size of the virtio-net header in front of each frame, or 0 */
+    unsigned vnet_hdr_len;
+
+    /** batches frames from this border port to its tunnel endpoints (or,
+        if shaping, hands them to the shaper through ring) */
+    egress* eg;
+    shaper_ring* ring;
+
+    /** MAC addresses learned behind the tunnel endpoints, or NULL */
+    mac_table* macs;
+
+    /** with the epoll and io_uring engines: non-zero while eg holds frames
+        waiting for their batch to fill */
+    int dirty;
+
+    /** with the io_uring engine: what is posted for the queue (a
+        URING_POSTED_*), and non-zero once the loop has cancelled it to let
+        go of the queue */
+    int posted;
+    int cancelled;
+
+    /** with the io_uring engine: the provided buffers whose frames eg has
+        queued, put back once it has sent them */
+    unsigned* held;
+    unsigned held_len;
+
+    /** the thread serving this queue: its own with the threads engine (on
+        CPU cpu, or wherever the scheduler puts it if that is negative), or
+        with the epoll and io_uring engines the tunnel port thread which owns
+        it (set once it serves the queue) */
+    pthread_t tid;
+    int cpu;
+    struct tunnel_worker_info* owner;
+    int serving;
+
+    /** set by the control thread to have the queue's batch flushed and the
+        queue let go of, which its thread reports by setting stopped */
+    int stop;
+    int stopped;
 } border_port_control_info;
 
 /** Tunnel packet format */
@@ -32,11 +118,84 @@ typedef struct tunnet_packet_hdr {
     uint32_t tag;
 } tunnel_packet_hdr;
 
+/**
+ * Specifies which tunnel socket a tunnel port thread should receive from.
+ */
+typedef struct tunnel_worker_info {
+    capsulator* c;
+
+    /** socket this worker receives tunnel packets from */
+    int fd;
+
+    /** index of this worker among the tunnel port threads */
+    unsigned id;
+
+    /** CPU this worker is pinned to, or -1 to let the scheduler decide */
+    int cpu;
+
+    /** non-zero if the thread polls without sleeping; with the epoll and
+        io_uring engines it also does while it serves any of spinners border
+        port queues which should */
+    int spin;
+    unsigned spinners;
+
+    /** offline while the thread blocks, so the control thread knows when
+        it holds no references to c->tags, c->macs or a border port */
+    rcu_reader rcu;
+
+    /** name used in log messages, receive state (set once the thread has
+        created it) and counters of the thread */
+    char name[IF_NAMESIZE + 16];
+    ingress* in;
+    port_stats* stats;
+    log_limit log;
+
+    /** with -frag: the frames being reassembled from fragments, else NULL */
+    frag_table* frags;
+
+    /** with the epoll and io_uring engines: the border port queues this
+        thread serves and those whose egress holds frames waiting for their
+        batch to fill */
+    border_port_control_info** bpcis;
+    unsigned bpcis_len;
+    border_port_control_info** dirty;
+    unsigned dirty_len;
+
+    /** with the epoll and io_uring engines: border port queues handed to the
+        thread, to serve or (with stop set) to let go of, announced through
+        event_fd */
+    int event_fd;
+    pthread_mutex_t lock;
+    border_port_control_info** mail;
+    unsigned mail_len;
+
+    /** with the io_uring engine: the ring receives are posted to and the
+        ring batches are sent through; the buffers tunnel packets and border
+        frames are received into (NULL if the kernel cannot provide them);
+        the header UDP packets are received with; whether receives (and
+        reads from tap devices) are multishot, else the thread polls and
+        reads as the epoll loop does; what is posted for the tunnel port;
+        and whether some receive needs posting again */
+    uring rx;
+    uring tx;
+    uring_bufs* tunnel_bufs;
+    uring_bufs* border_bufs;
+    struct msghdr rx_msg;
+    int multishot;
+    int read_multishot;
+    int posted;
+    int unposted;
+
+    /** number of border port queues handed to the thread (only the control
+        thread uses it) */
+    unsigned load;
+} tunnel_worker_info;
+
 /**
  * Entry point for a thread responsible for listening to the tunnel port and
  * forwarding all received traffic out the appropriate border port.
  */
-void* capsulator_thread_main_for_tunnel_port(void* vcapsulator);
+void* capsulator_thread_main_for_tunnel_port(void* vtwi);
 
 /**
  * Entry point for a thread responsible for listening to a border port and
@@ -44,8 +203,130 @@ void* capsulator_thread_main_for_tunnel_port(void* vcapsulator);
  */
 void* capsulator_thread_main_for_border_port(void* vbpci);
 
-/** binds a raw packets file descriptor fd to the interface specified by name */
-void bindll(int fd, char* name) {
+static void capsulator_handle_sigusr1(int sig) {
+    stats_request_dump();
+}
+
+/** SIGUSR2 only interrupts the wait of a border port thread told to stop */
+static void capsulator_handle_sigusr2(int sig) {
+}
+
+/** how long (us) the control thread sleeps between looks at a thread it
+    waits for */
+#define CONTROL_POLL_US 1000
+
+static void capsulator_control_sleep(void) {
+    struct timespec ts;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = CONTROL_POLL_US * 1000L;
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Starts a thread running start(arg), pinned from its first instruction to
+ * cpu unless that is negative, so its stack and the buffers it touches first
+ * are allocated on the NUMA node of that CPU.
+ */
+static void capsulator_start_thread(pthread_t* tid, int cpu,
+                                    void* (*start)(void*), void* arg) {
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+
+    pthread_attr_init(&attr);
+    if(cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    if(pthread_create(tid, &attr, start, arg) != 0) {
+        /* an offline CPU, say: better unpinned than not at all */
+        if(cpu < 0 || pthread_create(tid, NULL, start, arg) != 0)
+            pdie("pthread_create");
+        verbose_println("Warning: unable to pin a thread to CPU %d", cpu);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/** returns non-zero if the tunnel port threads of c serve the border port
+    queues too, from an epoll or io_uring loop */
+static int capsulator_shared_loops(capsulator* c) {
+    return c->engine == CAPSULATOR_ENGINE_EPOLL || c->engine == CAPSULATOR_ENGINE_URING;
+}
+
+/** describes where the calling thread runs, for the startup log */
+static void capsulator_placement(char* buf, size_t len) {
+    cpu_set_t cpus;
+    unsigned cpu, node;
+
+    if(pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0 &&
+       CPU_COUNT(&cpus) == 1 && syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+        snprintf(buf, len, "CPU %u, NUMA node %u", cpu, node);
+    else
+        snprintf(buf, len, "unpinned");
+}
+
+/** returns whether the threads serving port intf should poll without sleeping */
+static int capsulator_spins(capsulator* c, const char* intf) {
+    const char *p, *end;
+    size_t n;
+
+    if(!c->spin)
+        return 0;
+    n = strlen(intf);
+    for(p = c->spin; ; p = end + 1) {
+        if(!(end = strchr(p, ',')))
+            end = p + strlen(p);
+        if((end - p == 3 && strncmp(p, "all", 3) == 0) ||
+           ((size_t)(end - p) == n && strncmp(p, intf, n) == 0))
+            return 1;
+        if(*end == '\0')
+            return 0;
+    }
+}
+
+/** sets SO_BUSY_POLL on the socket fd of port intf, if asked to */
+static void capsulator_busy_poll(capsulator* c, int fd, const char* intf) {
+    int us;
+
+    us = c->busy_poll_us;
+    if(us && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0)
+        verbose_println("%s: Warning: unable to set SO_BUSY_POLL (%s)", intf, strerror(errno));
+}
+
+/** returns the CPU of the thread serving queue q of border port i, or -1 */
+static int capsulator_border_cpu(capsulator* c, unsigned i, unsigned q) {
+    if(!c->border_cpus_len)
+        return -1;
+    return c->border_cpus[(i * c->tap_queues + q) % c->border_cpus_len];
+}
+
+/**
+ * Maps a receive ring onto fd while running on cpu (unless it is negative), so
+ * the kernel allocates the ring on the NUMA node of the thread walking it.
+ */
+static rx_ring* capsulator_ring_on_cpu(int fd, int cpu) {
+    cpu_set_t old, cpus;
+    rx_ring* r;
+    int moved;
+
+    moved = 0;
+    if(cpu >= 0 && pthread_getaffinity_np(pthread_self(), sizeof(old), &old) == 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        moved = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+    }
+    r = rx_ring_create(fd);
+    if(moved)
+        pthread_setaffinity_np(pthread_self(), sizeof(old), &old);
+    return r;
+}
+
+/**
+ * binds a raw packets file descriptor fd to the interface specified by name
+ * and (if non-zero) the NBO protocol proto
+ */
+void bindll(int fd, char* name, uint16_t proto) {
     struct ifreq ifr;
     struct sockaddr_ll addr;
 
@@ -54,306 +335,2187 @@ void bindll(int fd, char* name) {
 
     memset(&addr, 0, sizeof(addr));
     addr.sll_family = PF_PACKET;
-    addr.sll_protocol = 0;
+    addr.sll_protocol = proto;
     addr.sll_ifindex = ifr.ifr_ifindex;
     if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
         pdie("bind (border port interface)");
 }
 
-void create_new_tunnel_fd(struct tunnel_port* new_tp) {
-    int val;
-    struct sockaddr_in addr;
-    new_tp->fd = socket(AF_INET, SOCK_RAW, IPPROTO_CAPSULATOR);
-    if(new_tp->fd < 0)
-        pdie("tunnel port socket");
-    val = 0;
-    if(setsockopt(new_tp->fd, IPPROTO_IP, IP_HDRINCL, &val, sizeof(val)) < 0)
-            pdie("ioctl (IP_HDRINCL)");
-
-    /* bind to the tunnel port's interface */
-    addr.sin_family = AF_INET;
-    addr.sin_port = 0;
-    addr.sin_addr.s_addr = new_tp->ip;
-    
-    if(bind(new_tp->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
-        pdie("bind (tunnel port interface)");
-}
+#define MIN_ETH_LEN 60
+#define MIN_IP_HEADER_LEN 20
 
-void capsulator_run(capsulator* c) {
+/** buffer size when frames may be GSO superframes (the largest IP packet) */
+#define VNET_BUFSZ (64 * 1024)
+
+/** receive buffer of the tunnel port's sockets with the AF_XDP engine: the
+    fragments its XDP program passes to the kernel arrive in page-sized
+    buffers, which fill the default quickly */
+#define XDP_TUNNEL_RCVBUF (1024 * 1024)
+
+/** room in a buffer beyond the largest MTU: the Ethernet header, a VLAN tag
+    and the outer IP header and tag of a tunnel packet, rounded up */
+#define MTU_SLACK 64
+
+/** returns the MTU of intf, or the Ethernet default if it does not exist
+    (yet, as a tap about to be created) */
+static unsigned capsulator_mtu(int fd, const char* intf) {
     struct ifreq ifr;
-    int fd, val;
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", intf);
+    if(ioctl(fd, SIOCGIFMTU, &ifr) < 0)
+        return ETH_DATA_LEN;
+    return ifr.ifr_mtu;
+}
+
+/**
+ * Returns the size of the buffers frames and tunnel packets are read into:
+ * enough for the largest MTU among the ports at startup.  Records the tunnel
+ * port's MTU on the way.
+ */
+static unsigned capsulator_buf_size(capsulator* c) {
+    unsigned i, mtu, m;
+    int fd;
+
+    if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        pdie("socket (MTU lookup)");
+    mtu = c->tp.mtu = capsulator_mtu(fd, c->tp.intf);
+    if(c->vnet_hdr_len) {
+        close(fd);
+        return VNET_BUFSZ;
+    }
+
+    for(i=0; i<c->bp_len; i++)
+        if((m = capsulator_mtu(fd, c->bp[i].intf)) > mtu)
+            mtu = m;
+    close(fd);
+
+    return mtu + MTU_SLACK;
+}
+
+/**
+ * Has e, which sends to the dest_ips_len endpoints dest_ips, send the frames to
+ * each wherever the keepalive thread fails it over to.
+ */
+static void capsulator_follow(capsulator* c, egress* e, const uint32_t* dest_ips,
+                              unsigned dest_ips_len) {
+    uint32_t** follows;
     unsigned i;
-    pthread_t tid;
+
+    if(!(follows = malloc(dest_ips_len * sizeof(*follows))))
+        pdie("malloc (keepalive follows)");
+    for(i=0; i<dest_ips_len; i++)
+        follows[i] = keepalive_active(c->keepalive, dest_ips[i]);
+    egress_follow(e, follows);
+    free(follows);
+}
+
+/**
+ * Sets up the egress state for queue q of border port i, which hands its
+ * batches to sink (with arg) rather than sockets unless that is NULL.
+ *
+ * @return the description of the queue for the thread which will serve it
+ */
+static border_port_control_info* capsulator_border_port_info(capsulator* c,
+                                                             unsigned i, unsigned q,
+                                                             egress_sink sink, void* arg) {
     border_port_control_info* bpci;
+    tunnel_packet_hdr hdr;
+    uint32_t* dest_ips;
+    unsigned dest_ips_len, gso_max;
+
+    if(!(bpci = calloc(1, sizeof(*bpci))))
+        pdie("malloc");
+    bpci->tp = &c->tp;
+    bpci->bp = &c->bp[i];
+    bpci->queue = q;
+    bpci->fd = c->bp[i].queue_fds[q];
+    bpci->stats = &c->bp[i].stats[q];
+    bpci->vnet_hdr_len = c->vnet_hdr_len;
+    bpci->macs = c->macs;
+
+    if(broadcast) {
+        dest_ips = c->tp.tunnel_dest_ips;
+        dest_ips_len = c->tp.tunnel_dest_ips_len;
+    }
+    else {
+        /* if not broadcast, just send packets to this interface's
+           corresponding IP address */
+        dest_ips = &c->bp[i].dest_ip;
+        dest_ips_len = 1;
+    }
+
+    /* populate the static tunneling header */
+    hdr.tag = htonl(c->bp[i].tag);
+    gso_max = c->udp_offload ? c->tp.mtu - sizeof(struct iphdr) - sizeof(struct udphdr) : 0;
+    if(sink)
+        bpci->eg = egress_create_sink(dest_ips, dest_ips_len,
+                                      &hdr, sizeof(hdr), c->udp_port, c->udp_sources,
+                                      gso_max, c->batch, c->flush_us,
+                                      buf_pool_create(c->batch, c->buf_size),
+                                      bpci->stats, sink, arg);
+    else
+        bpci->eg = egress_create(c->tp.ip, dest_ips, dest_ips_len,
+                                 &hdr, sizeof(hdr), c->udp_port, c->udp_sources,
+                                 gso_max, c->batch, c->flush_us,
+                                 buf_pool_create(c->batch, c->buf_size),
+                                 bpci->stats);
+
+    /* frames go to the backup an endpoint failed over to */
+    if(c->keepalive && !sink)
+        capsulator_follow(c, bpci->eg, dest_ips, dest_ips_len);
+
+    /* the outer IP headers come from templates of the endpoints */
+    if(c->hdrincl)
+        egress_raw_headers(bpci->eg, c->tp.ip);
+
+    /* frames too big for the path MTU go out in fragments of our own */
+    if(c->frag) {
+        hdr.tag = htonl(c->bp[i].tag | CAPSULATOR_TAG_FRAG);
+        egress_fragment(bpci->eg, &hdr, c->tp.mtu);
+    }
+
+    /* the shaper thread sends through that egress, counting in the second
+       half of the port's counters; the queue's thread gets a shaped one */
+    if(c->shaper) {
+        bpci->eg->stats = &c->bp[i].stats[c->bp[i].queues + q];
+        bpci->ring = shaper_ring_create(c->shape_queue, c->buf_size, c->bp[i].tag, bpci->eg);
+        bpci->eg = egress_create_shaped(bpci->ring, bpci->eg->sources, c->batch,
+                                        buf_pool_create(c->batch, c->buf_size),
+                                        bpci->stats);
+        shaper_attach(c->shaper, bpci->ring);
+    }
+    return bpci;
+}
+
+/**
+ * Opens queue q of virtual border port bp, creating the tap device along with
+ * queue 0.
+ *
+ * @return the queue's non-blocking file descriptor
+ */
+static int capsulator_open_tap_queue(capsulator* c, border_port* bp, unsigned q) {
+    struct ifreq ifr;
+    unsigned offload;
+    int fd, hdr_len;
+
+    if ((fd = open("/dev/net/tun",O_RDWR)) < 0)
+        pdie("Virtual border port problem");
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if(c->tap_queues > 1)
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    if(c->vnet_hdr_len)
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    strncpy(ifr.ifr_name, bp->intf, sizeof(ifr.ifr_name) - 1);
+
+    if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0)
+        pdie("IOCTL on TAP device filed");
+
+    if(q == 0 && ioctl(fd, TUNSETPERSIST, 1) < 0)
+        pdie("TAP device not persistent\n");
+
+    if(c->vnet_hdr_len) {
+        hdr_len = c->vnet_hdr_len;
+        if(ioctl(fd, TUNSETVNETHDRSZ, &hdr_len) < 0)
+            pdie("ioctl (TUNSETVNETHDRSZ on TAP device)");
+
+        /* accept checksum-offloaded and TSO superframes from the host; they
+           cross the tunnel whole and are finished by the device which
+           finally sends them */
+        offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+        if(ioctl(fd, TUNSETOFFLOAD, offload) < 0)
+            verbose_println("%s: Warning: unable to enable offloads on TAP device",
+                            bp->intf);
+    }
+
+    /* reads must not block so a partial batch can be flushed on time */
+    if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+        pdie("fcntl (O_NONBLOCK on TAP device)");
+
+    return fd;
+}
+
+/**
+ * Makes the tunnel port filter let exactly the tags of the active border ports
+ * through.
+ */
+static void capsulator_filter_tags(capsulator* c) {
+    uint32_t* tags;
+    unsigned i, n;
+
+    if(c->tp.filter < 0)
+        return;
+    if(!(tags = malloc((2 * c->bp_len + 1) * sizeof(*tags))))
+        pdie("malloc (tunnel port filter tags)");
+    for(i=n=0; i<c->bp_len; i++)
+        if(c->bp[i].active) {
+            tags[n++] = c->bp[i].tag;
+            if(c->frag)
+                tags[n++] = c->bp[i].tag | CAPSULATOR_TAG_FRAG;
+        }
+    if(c->keepalive)
+        tags[n++] = CAPSULATOR_TAG_PROBE;
+    filter_tags_set(c->tp.filter_tags, tags, n);
+    free(tags);
+}
+
+/**
+ * Loads the filter of the tunnel port's sockets, unless the kernel refuses (the
+ * tunnel port threads check every packet anyway).
+ */
+static void capsulator_load_tunnel_filter(capsulator* c) {
+    unsigned min_len;
+
+    c->tp.filter = c->tp.filter_counters = c->tp.filter_tags = -1;
+    if(!c->socket_filters)
+        return;
+
+    min_len = (c->udp_port ? 8 : MIN_IP_HEADER_LEN) + sizeof(tunnel_packet_hdr)
+            + c->vnet_hdr_len + MIN_ETH_LEN;
+    if((c->tp.filter_counters = filter_counters_create()) < 0 ||
+       (c->tp.filter_tags = filter_tags_create((c->frag ? 2 * c->bp_cap : c->bp_cap) + 1)) < 0 ||
+       (c->tp.filter = filter_tunnel_prog(c->tp.filter_counters, c->tp.filter_tags,
+                                          c->tp.ip, c->udp_port != 0, min_len)) < 0) {
+        verbose_println("%s: Warning: no socket filter (%s), tunnel packets are checked in user space only",
+                        c->tp.intf, strerror(errno));
+        if(c->tp.filter_counters >= 0)
+            close(c->tp.filter_counters);
+        if(c->tp.filter_tags >= 0)
+            close(c->tp.filter_tags);
+        c->tp.filter_counters = c->tp.filter_tags = -1;
+        return;
+    }
+    capsulator_filter_tags(c);
+}
+
+/** attaches the tunnel port filter to fd; returns 0 on success */
+static int capsulator_filter_tunnel_socket(capsulator* c, int fd) {
+    if(c->tp.filter < 0)
+        return -1;
+    if(filter_attach_prog(fd, c->tp.filter) < 0) {
+        verbose_println("%s: Warning: unable to attach the socket filter (%s)",
+                        c->tp.intf, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns a UDP socket bound to the tunnel port's IP and UDP port.  Each tunnel
+ * port thread has one; the kernel spreads the packets over them by the hash of
+ * their addresses and ports (SO_REUSEPORT), and the senders vary the source
+ * port by inner flow.
+ */
+static int capsulator_open_tunnel_udp_socket(capsulator* c) {
     struct sockaddr_in addr;
+    int fd, one, rcvbuf;
 
-    /* create a raw IP socket to handle the tunneling I/O */
-    c->tp.fd = socket(AF_INET, SOCK_RAW, IPPROTO_CAPSULATOR);
-    if(c->tp.fd < 0)
-        pdie("tunnel port socket");
+    if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        pdie("tunnel port UDP socket");
+    capsulator_filter_tunnel_socket(c, fd);
 
-    /* tell the socket to provide the IP header for us (so it handles fragmentation!) */
-    val = 0;
-    if(setsockopt(c->tp.fd, IPPROTO_IP, IP_HDRINCL, &val, sizeof(val)) < 0)
-            pdie("ioctl (IP_HDRINCL)");
+    one = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        pdie("setsockopt (SO_REUSEPORT on tunnel port)");
 
-    /* get the IP address of the tunneling port's interface */
-    c->tp.ip = get_ip_for_interface(c->tp.intf);
-    verbose_println("c->tp.ip = %d\n",c->tp.ip);
-    verbose_println("c->c->tp.tunnel_dest_ips_len = %d\n",c->tp.tunnel_dest_ips_len);
-    int r;
-    for (r=0; r<c->tp.tunnel_dest_ips_len; r++)
-        verbose_println("c->tp.tunnel_dest_ips = %d\n",c->tp.tunnel_dest_ips[r]);
+    rcvbuf = XDP_TUNNEL_RCVBUF;
+    if(c->engine == CAPSULATOR_ENGINE_XDP)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 
-    if(!c->tp.ip)
-        die("tunneling interface IP could not found (interface down?)");
+    /* have packets from the same sender coalesced, to be split again by the
+       tunnel port thread */
+    if(c->udp_offload && setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0)
+        verbose_println("Warning: the kernel does not support UDP GRO (%s)", strerror(errno));
 
-    /* bind to the tunnel port's interface */
+    memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = 0;
+    addr.sin_port = c->udp_port;
     addr.sin_addr.s_addr = c->tp.ip;
-    if(bind(c->tp.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
-        pdie("bind (tunnel port interface)");
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        pdie("bind (tunnel port UDP port)");
 
-    /* increase the buffer size to reduce the chance of a dropped packet (ok if
-       this fails */
-    val = 64 * 1024;
-    setsockopt(c->tp.fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+    return fd;
+}
 
-    /* create a raw packet socket to get all the incoming Ethernet frames */
-    for(i=0; i<c->bp_len; i++) {
-      if (c->bp[i].vbp == 0){
-        fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
-        if(fd < 0)
-            pdie("border port socket");
+/**
+ * Opens the sockets of the tunnel port threads.  A single thread reads the raw
+ * IP socket c->tp.fd.  Several threads each get a packet socket in a fanout
+ * group which spreads tunnel packets over them by the hash of their inner flow.
+ * In UDP mode every thread gets a UDP socket instead.
+ *
+ * @return an array of c->tunnel_workers worker descriptions
+ */
+static tunnel_worker_info* capsulator_open_tunnel_workers(capsulator* c) {
+    tunnel_worker_info* twi = NULL;
+    unsigned i, n;
+    int fanout;
+
+    n = c->tunnel_workers;
+    capsulator_load_tunnel_filter(c);
+    if(posix_memalign((void**)&twi, sizeof(rcu_reader), n * sizeof(*twi)) != 0)
+        pdie("posix_memalign (tunnel workers)");
+    memset(twi, 0, n * sizeof(*twi));
+    if(!(c->tp.worker_fds = calloc(n, sizeof(int))))
+        pdie("malloc (tunnel workers)");
+
+    for(i=0; i<n; i++) {
+        twi[i].c = c;
+        twi[i].id = i;
+        twi[i].fd = c->tp.worker_fds[i] = c->tp.fd;
+        twi[i].spin = capsulator_spins(c, c->tp.intf);
+        rcu_register(&c->rcu, &twi[i].rcu);
+        if(n > 1)
+            snprintf(twi[i].name, sizeof(twi[i].name), "%s[%u]", c->tp.intf, i);
         else
-            c->bp[i].fd = fd;
-
-        /* bind the border port to its interface */
-        bindll(fd, c->bp[i].intf);
-
-        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
-
-        /* put the interface into promiscuous mode so we get packets destined for
-           devices on the other side of the tunnel too */
-        strncpy(ifr.ifr_name, c->bp[i].intf, IFNAMSIZ);
-        ioctl(fd, SIOCGIFFLAGS, &ifr);
-        ifr.ifr_flags |= IFF_PROMISC;
-        ioctl(fd, SIOCSIFFLAGS, &ifr);
-
-        /* start the border port controller thread */
-        if( (bpci=malloc(sizeof(*bpci))) ) {
-            bpci->tp = malloc(sizeof(struct tunnel_port));
-            memcpy(bpci->tp, &c->tp, sizeof(struct tunnel_port));
-            create_new_tunnel_fd(bpci->tp);
-	    if (broadcast == 0) {
-		/* if not broadcast, just send packets to this interface's corresponding
-			IP address */
-		bpci->tp->tunnel_dest_ips_len = 1;
-		bpci->tp->tunnel_dest_ips = malloc(sizeof(uint32_t));
-		*(bpci->tp->tunnel_dest_ips) = c->tp.tunnel_dest_ips[i];
-	    }
-            bpci->bp = &c->bp[i];
-
-            if( pthread_create(&tid, NULL, capsulator_thread_main_for_border_port, bpci) != 0 )
-                pdie("pthread_create");
-        }
+            snprintf(twi[i].name, sizeof(twi[i].name), "%s", c->tp.intf);
+        if(c->tunnel_cpus_len)
+            twi[i].cpu = c->tunnel_cpus[i % c->tunnel_cpus_len];
+        else if(n > 1)
+            twi[i].cpu = i % sysconf(_SC_NPROCESSORS_ONLN);
         else
-            pdie("malloc");
-      } else {
-  	/* Virtual Border Ports */
-	memset(&ifr, 0, sizeof(ifr));
-	if ((fd = open("/dev/net/tun",O_RDWR)) < 0)
-		pdie("Virtual border port problem");
-	else
-		c->bp[i].fd = fd;
-
-   	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
- 	strncpy(ifr.ifr_name, c->bp[i].intf, sizeof(ifr.ifr_name) - 1);
-
-	if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0)
-	   pdie("IOCTL on TAP device filed");
-
-   	if(ioctl(fd, TUNSETPERSIST, 1) < 0){
-      	   pdie("TAP device not persistent\n");
-    	}
-
-        /* start the border port controller thread */
-        if( (bpci=malloc(sizeof(*bpci))) ) {
-            bpci->tp = malloc(sizeof(struct tunnel_port));
-            memcpy(bpci->tp, &c->tp, sizeof(struct tunnel_port));
-            create_new_tunnel_fd(bpci->tp);
-            bpci->bp = &c->bp[i];
-
-        if( pthread_create(&tid, NULL, capsulator_thread_main_for_border_port, bpci) != 0 )
-                pdie("pthread_create");
+            twi[i].cpu = -1;
+
+        if(capsulator_shared_loops(c)) {
+            if((twi[i].event_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+                pdie("eventfd (border port queue mail)");
+            pthread_mutex_init(&twi[i].lock, NULL);
         }
-        else
-            pdie("malloc");
-     }
-   }
+    }
+
+    if(c->udp_port) {
+        for(i=0; i<n; i++) {
+            twi[i].fd = c->tp.worker_fds[i] = capsulator_open_tunnel_udp_socket(c);
+            capsulator_busy_poll(c, twi[i].fd, c->tp.intf);
+        }
+        c->tp.fd = twi[0].fd;
+        return twi;
+    }
+    if(n == 1) {
+        capsulator_filter_tunnel_socket(c, c->tp.fd);
+        capsulator_busy_poll(c, c->tp.fd, c->tp.intf);
+        return twi;
+    }
+
+    /* the raw socket stays open (without it the kernel would answer every
+       tunnel packet with an ICMP protocol unreachable) but reads nothing */
+    filter_drop_all(c->tp.fd);
+
+    fanout = (getpid() & 0xFFFF)
+           | ((PACKET_FANOUT_CBPF | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+    for(i=0; i<n; i++) {
+        /* the socket receives nothing until it is bound, so the filter is in
+           place before the first packet arrives */
+        if((twi[i].fd = c->tp.worker_fds[i] = socket(PF_PACKET, SOCK_DGRAM, 0)) < 0)
+            pdie("tunnel port worker socket");
+        if(capsulator_filter_tunnel_socket(c, twi[i].fd) < 0)
+            filter_tunnel_input(twi[i].fd, c->tp.ip);
+        bindll(twi[i].fd, c->tp.intf, htons(ETH_P_IP));
+
+        if(setsockopt(twi[i].fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0)
+            pdie("setsockopt (PACKET_FANOUT on tunnel port)");
+        capsulator_busy_poll(c, twi[i].fd, c->tp.intf);
+    }
+    filter_fanout_flow_hash(twi[0].fd, n);
 
-    /* use the main thread to run the tunnel controller */
-    capsulator_thread_main_for_tunnel_port(c);
+    return twi;
 }
 
-#define BUFSZ (8 * 1024)
-#define MIN_ETH_LEN 60
-#define MIN_IP_HEADER_LEN 20
+/**
+ * Attaches the border port filter to bp's packet socket.  Without one the
+ * thread still checks every frame, but nothing enforces the allow-lists.
+ */
+static void capsulator_filter_border_port(capsulator* c, border_port* bp) {
+    if(!c->socket_filters)
+        return;
 
-void* capsulator_thread_main_for_tunnel_port(void* vcapsulator) {
-    capsulator* c;
-    struct iphdr* iphdr;
-    tunnel_packet_hdr* hdr;
-    char buf[BUFSZ];
-    char* data;
-    int actual, i, n, data_len;
+    if((bp->filter_counters = filter_counters_create()) < 0 ||
+       (bp->filter = filter_border_prog(bp->filter_counters, &c->allow, MIN_ETH_LEN)) < 0 ||
+       filter_attach_prog(bp->fd, bp->filter) < 0) {
+        if(c->allow.ethertypes_len || c->allow.vlans_len)
+            pdie("socket filter (border port allow-lists)");
+        verbose_println("%s: Warning: no socket filter (%s), frames are checked in user space only",
+                        bp->intf, strerror(errno));
+        if(bp->filter >= 0)
+            close(bp->filter);
+        if(bp->filter_counters >= 0)
+            close(bp->filter_counters);
+        bp->filter = bp->filter_counters = -1;
+    }
+}
 
-    pthread_detach(pthread_self());
-    c = (capsulator*)vcapsulator;
-    iphdr = (struct iphdr*)buf;
-    hdr = (tunnel_packet_hdr*)(buf + MIN_IP_HEADER_LEN);
-    data = ((char*)hdr) + sizeof(tunnel_packet_hdr);
+/**
+ * Opens the sockets (or tap queues), receive ring and counters of the border
+ * port in slot i.
+ */
+static void capsulator_open_border_port(capsulator* c, unsigned i) {
+    border_port* bp;
+    struct ifreq ifr;
+    int fd, one, rcvbuf;
+    unsigned q;
 
-    verbose_println("%s TPH: thread for handling incoming tunnel port traffic is now running", c->tp.intf);
+    bp = &c->bp[i];
+    bp->queues = bp->vbp ? c->tap_queues : 1;
+    if(!(bp->queue_fds = calloc(bp->queues, sizeof(int))))
+        pdie("malloc (border port queues)");
+    bp->stats = stats_alloc(bp->queues * (c->shaper ? 2 : 1));
+    bp->ring = NULL;
+    bp->spin = capsulator_spins(c, bp->intf);
+    bp->filter = bp->filter_counters = -1;
 
-    /* continuously decapsulate and forward tunneled packets from the tunnel to the border */
-    while(1) {
+    if(bp->vbp) {
+        /* Virtual Border Ports: one fd per queue */
+        for(q=0; q<bp->queues; q++)
+            bp->queue_fds[q] = capsulator_open_tap_queue(c, bp, q);
+        bp->fd = bp->queue_fds[0];
+        return;
+    }
 
-        /* wait for a tunneled packet to arrive */
-        verbose_println("%s TPH: waiting for tunnel port traffic", c->tp.intf);
-        n = read(c->tp.fd, buf, BUFSZ);
+    /* create a raw packet socket to get all the incoming Ethernet frames */
+    fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if(fd < 0)
+        pdie("border port socket");
+    bp->fd = bp->queue_fds[0] = fd;
 
-        data_len = n - MIN_IP_HEADER_LEN - sizeof(tunnel_packet_hdr);
+    /* the filter is in place before the socket is bound (until then it sees
+       the frames of every interface) */
+    if(c->engine != CAPSULATOR_ENGINE_XDP)
+        capsulator_filter_border_port(c, bp);
 
-        if(n < 0) {
-            if(errno != EINTR)
-                verbose_println("tunnel read error");
-            else
-                continue;
-        }
-        else if(n == 0) {
-            verbose_println("%s TPH: read did not read any bytes (n==0)",
-                            c->tp.intf);
-            continue;
-        }
-        else if(iphdr->ihl != MIN_IP_HEADER_LEN / 4) {
-            verbose_println("%s TPH: Warning: ignoring tunnel packet with IP header including options (IP header length %uB)",
-                            c->tp.intf, iphdr->ihl * 4);
-            continue;
-        }
-        else if(data_len < MIN_ETH_LEN) {
-            verbose_println("%s TPH: Warning: ignoring tunnel packet of %u data bytes %s",
-                            "(too small to include a tunneled packet containing a IP header + tunneling header + Ethernet frame)",
-                            c->tp.intf,
-                            data_len);
-            continue;
-        }
-        else
-            verbose_println("%s TPH: Tunnel received %d data bytes destined for Tag=%u",
-                            c->tp.intf,
-                            data_len,
-                            ntohl(hdr->tag));
-
-        /* forward to any border port which should receive this packet's data */
-          for(i=0; i<c->bp_len; i++) {
-            if(ntohl(hdr->tag) == c->bp[i].tag) {
-                if((actual=write(c->bp[i].fd, data, data_len)) != data_len) {
-                    verbose_println(
-                            "Error: %s %s failed (sent %dB, had %dB to send)\n",
-                            "forwarding data to border port",
-                            c->bp[i].intf, actual, data_len);
-                }
-                else
-                    verbose_println("%s TPH: Tunnel forwarded %dB destined for Tag=%u to %s",
-                                    c->tp.intf,
-                                    data_len, ntohl(hdr->tag), c->bp[i].intf);
-            }
-        }
+    /* frames are received and sent with their virtio-net header (this must
+       precede the ring, which reserves room for it) */
+    one = 1;
+    if(c->vnet_hdr_len &&
+       setsockopt(fd, SOL_PACKET, PACKET_VNET_HDR, &one, sizeof(one)) < 0)
+        pdie("setsockopt (PACKET_VNET_HDR on border port)");
 
-    } 
+    /* bind the border port to its interface */
+    bindll(fd, bp->intf, 0);
 
-    return NULL;
+    /* increase the buffer size to reduce the chance of a dropped packet (ok
+       if this fails) */
+    rcvbuf = 64 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    capsulator_busy_poll(c, fd, bp->intf);
+
+    /* with the AF_XDP engine the socket only sends (frames the tunnel port
+       threads decapsulate from fragments) */
+    if(c->engine == CAPSULATOR_ENGINE_XDP)
+        filter_drop_all(fd);
+
+    /* walk frames in place in a mapped ring unless told to read() them; a
+       spinning port reads too, since the kernel hands over a ring block only
+       once it is full or its timeout expires, and the io_uring engine has
+       the kernel receive into buffers of its own */
+    else if(c->rx_ring && !bp->spin && c->engine != CAPSULATOR_ENGINE_URING) {
+        bp->ring = capsulator_ring_on_cpu(fd, capsulator_border_cpu(c, i, 0));
+        if(!bp->ring)
+            verbose_println("%s: TPACKET_V3 receive ring unavailable, falling back to read()",
+                            bp->intf);
+    }
+
+    /* put the interface into promiscuous mode so we get packets destined for
+       devices on the other side of the tunnel too */
+    strncpy(ifr.ifr_name, bp->intf, IFNAMSIZ);
+    ioctl(fd, SIOCGIFFLAGS, &ifr);
+    ifr.ifr_flags |= IFF_PROMISC;
+    ioctl(fd, SIOCSIFFLAGS, &ifr);
 }
 
-void* capsulator_thread_main_for_border_port(void* vbpci) {
-    struct sockaddr_in addr;
+/**
+ * Closes what capsulator_open_border_port() opened for slot i, once no thread
+ * serves or writes to the port any more.  A tap device stays (it is
+ * persistent).
+ */
+static void capsulator_close_border_port(capsulator* c, unsigned i) {
+    border_port* bp;
+    unsigned q;
+
+    bp = &c->bp[i];
+    if(bp->ring)
+        rx_ring_destroy(bp->ring);
+    for(q=0; q<bp->queues; q++)
+        close(bp->queue_fds[q]);
+    if(bp->filter >= 0) {
+        close(bp->filter);
+        close(bp->filter_counters);
+    }
+    free(bp->queue_fds);
+    free(bp->stats);
+}
+
+/** Hands bpci to the epoll or io_uring loop of the tunnel port thread w. */
+static void capsulator_post(tunnel_worker_info* w, border_port_control_info* bpci) {
+    uint64_t one;
+
+    pthread_mutex_lock(&w->lock);
+    if(!(w->mail = realloc(w->mail, (w->mail_len + 1) * sizeof(*w->mail))))
+        pdie("realloc (border port queue mail)");
+    w->mail[w->mail_len++] = bpci;
+    pthread_mutex_unlock(&w->lock);
+
+    one = 1;
+    if(write(w->event_fd, &one, sizeof(one)) < 0)
+        verbose_println("%s: unable to wake up the loop (%s)", w->name, strerror(errno));
+}
+
+/**
+ * Starts serving every queue of the border port in slot i: a thread per queue,
+ * or with the epoll and io_uring engines an entry in the loop of the least
+ * loaded tunnel
+ * port thread.  The AF_XDP engine only takes the egress of queue 0.
+ */
+static void capsulator_start_border_port(capsulator* c, unsigned i) {
+    border_port* bp;
     border_port_control_info* bpci;
-    tunnel_packet_hdr* hdr;
-    char buf[BUFSZ];
-    char* data;
-    int actual, i, n;
+    tunnel_worker_info* w;
+    unsigned q, k;
 
-    pthread_detach(pthread_self());
-    bpci = (border_port_control_info*)vbpci;
-    hdr = (tunnel_packet_hdr*)buf;
-    data = buf + sizeof(tunnel_packet_hdr);
+    bp = &c->bp[i];
+    if(!(bp->controls = calloc(bp->queues, sizeof(*bp->controls))))
+        pdie("malloc (border port controls)");
 
-    verbose_println("%s BPH: (tag=%u) thread for handling incoming border port traffic is now running",
-                    bpci->bp->intf, bpci->bp->tag);
+    for(q=0; q<bp->queues; q++) {
+        bpci = bp->controls[q] = capsulator_border_port_info(c, i, q, NULL, NULL);
+        bpci->cpu = capsulator_border_cpu(c, i, q);
+        if(capsulator_shared_loops(c)) {
+            w = &c->workers[0];
+            for(k=1; k<c->tunnel_workers; k++)
+                if(c->workers[k].load < w->load)
+                    w = &c->workers[k];
+            w->load += 1;
+            bpci->owner = w;
+            capsulator_post(w, bpci);
+        }
+        else if(c->engine == CAPSULATOR_ENGINE_THREADS)
+            capsulator_start_thread(&bpci->tid, bpci->cpu,
+                                    capsulator_thread_main_for_border_port, bpci);
+    }
+}
 
-    /* populate the static tunneling header */
-    hdr->tag = htonl(bpci->bp->tag);
+/**
+ * Stops serving every queue of the border port in slot i: each is flushed and
+ * let go of by its thread, then its egress freed.
+ */
+static void capsulator_stop_border_port(capsulator* c, unsigned i) {
+    border_port* bp;
+    border_port_control_info* bpci;
+    buf_pool* pool;
+    unsigned q;
 
-    /* prepare the address for connection later */
-    addr.sin_family = AF_INET;
-    addr.sin_port = 0;
+    bp = &c->bp[i];
+    for(q=0; q<bp->queues; q++) {
+        bpci = bp->controls[q];
 
-    /* continuously encapsulate and forward Ethernet frames from the border through the tunnel */
-    while(1) {
-        /* wait for an Ethernet frame to arrive */
-        verbose_println("%s BPH: (tag=%u) waiting for border port traffic",
-                        bpci->bp->intf, bpci->bp->tag);
-        n = read(bpci->bp->fd, data, BUFSZ - sizeof(*hdr));
-        if(n < 0) {
-            if(errno != EINTR) {
-                verbose_println(
-                        "Error: read from border port %s failed\n",
-                        bpci->bp->intf);
-            }
-            else
-                continue;
+        /* a loop is told once it serves the queue; a border port thread is
+           interrupted until it notices (it may have been about to block when
+           the first signal arrived) */
+        if(capsulator_shared_loops(c))
+            while(!__atomic_load_n(&bpci->serving, __ATOMIC_ACQUIRE))
+                capsulator_control_sleep();
+        __atomic_store_n(&bpci->stop, 1, __ATOMIC_RELEASE);
+        if(capsulator_shared_loops(c)) {
+            bpci->owner->load -= 1;
+            capsulator_post(bpci->owner, bpci);
         }
-        else if(n < MIN_ETH_LEN) {
-	  if (bpci->bp->vbp == 0){
-            verbose_println(
-                    "%s BPH: (tag=%u) Warning: ignoring border Ethernet frame of length %uB (too small)\n",
-                    bpci->bp->intf, bpci->bp->tag, n);
-            continue;
-	  } else {
-		memset(data+n,0,MIN_ETH_LEN-n);
-		n = MIN_ETH_LEN;
-	  }
+        while(!__atomic_load_n(&bpci->stopped, __ATOMIC_ACQUIRE)) {
+            if(c->engine == CAPSULATOR_ENGINE_THREADS)
+                pthread_kill(bpci->tid, SIGUSR2);
+            capsulator_control_sleep();
         }
-        else
-            verbose_println("%s BPH: (tag=%u) received %d data bytes to tunnel",
-                            bpci->bp->intf, bpci->bp->tag, n);
-
-        /* set the total length of the IP packet */
-        n += sizeof(*hdr);
-
-        /* send the MAC-in-IP packet to all the tunneling endpoints */
-        for(i=0; i<bpci->tp->tunnel_dest_ips_len; i++) {
-            /* set the foreign address */
-            addr.sin_addr.s_addr = bpci->tp->tunnel_dest_ips[i];
-            if(connect(bpci->tp->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
-                pdie("connect (forwarding data to tunnel port)");
-
-            
-            if((actual=write(bpci->tp->fd, buf, n)) != n) {
-                verbose_println(
-                        "Error: %s %s failed (sent %dB, had %dB to send)\n",
-                        "forwarding data to tunnel port from border port",
-                        bpci->bp->intf, actual, n);
-                
-            }
-            else
-                verbose_println("%s BPH: (tag=%u) tunneled %d data bytes",
-                                bpci->bp->intf, bpci->bp->tag, n - sizeof(*hdr)); 
-            
-        } 
-    }
+        if(c->engine == CAPSULATOR_ENGINE_THREADS)
+            pthread_join(bpci->tid, NULL);
 
-    free(bpci);
-    return NULL;
+        pool = bpci->eg->pool;
+        egress_destroy(bpci->eg);
+        buf_pool_destroy(pool);
+        if(bpci->ring) {
+            shaper_detach(c->shaper, bpci->ring);
+            pool = bpci->ring->out->pool;
+            egress_destroy(bpci->ring->out);
+            buf_pool_destroy(pool);
+            shaper_ring_destroy(bpci->ring);
+        }
+        free(bpci->held);
+        free(bpci);
+    }
+    free(bp->controls);
+    bp->controls = NULL;
+}
+
+/**
+ * Replaces the tag dispatch index (and the tunnel port filter's tag set) with
+ * one built from the active border ports and frees the old one once no tunnel
+ * port thread reads it.
+ */
+static void capsulator_publish_tags(capsulator* c) {
+    tag_table* old;
+
+    capsulator_filter_tags(c);
+    old = __atomic_exchange_n(&c->tags, tag_table_create(c->bp, c->bp_len), __ATOMIC_ACQ_REL);
+    rcu_synchronize(&c->rcu);
+    tag_table_destroy(old);
+}
+
+/**
+ * Returns the MAC table domain of the port in slot i: that of another active
+ * port with its tag, or else one no active port uses.  New domains are taken
+ * round-robin from beyond the slot indices used at startup, so the addresses
+ * learned for a removed port's tag age out before its domain is reused.
+ */
+static unsigned capsulator_domain(capsulator* c, unsigned i) {
+    static unsigned next = CAPSULATOR_MAX_BORDER_PORTS;
+    unsigned j, d;
+
+    for(j=0; j<c->bp_len; j++)
+        if(j != i && c->bp[j].active && c->bp[j].tag == c->bp[i].tag)
+            return c->bp[j].domain;
+
+    while(1) {
+        d = next;
+        next = (next + 1) % MAC_TABLE_MAX_DOMAINS;
+        for(j=0; j<c->bp_len && !(j != i && c->bp[j].active && c->bp[j].domain == d); j++);
+        if(j == c->bp_len)
+            return d;
+    }
+}
+
+/** Returns a border port slot which holds no port (there must be one). */
+static unsigned capsulator_free_slot(capsulator* c) {
+    unsigned i;
+
+    for(i=0; i<c->bp_len && c->bp[i].active; i++);
+    return i;
+}
+
+/**
+ * Checks the border ports want and the numbers of tunnel endpoints dests_len
+ * and backups backups_len a reload asks for.
+ *
+ * @return 0 if they can be applied, or -1 with the reason in err
+ */
+static int capsulator_reload_check(capsulator* c, config_port* want, unsigned want_len,
+                                   unsigned dests_len, unsigned backups_len,
+                                   char* err, size_t err_len) {
+    unsigned i, j;
+
+    if(dests_len == 0)
+        snprintf(err, err_len, "no IP to forward tunneled packets to");
+    else if(backups_len && !c->keepalive)
+        snprintf(err, err_len, "backups need -keepalive (or backups on the command line)");
+    else if(!broadcast && want_len != dests_len)
+        snprintf(err, err_len, "%u border ports but %u IPs (in non-broadcast mode they must match)",
+                 want_len, dests_len);
+    else if(want_len > c->bp_cap)
+        snprintf(err, err_len, "more than %u border ports", c->bp_cap);
+    else if(c->learn && dests_len > MAC_TABLE_MAX_ENDPOINTS)
+        snprintf(err, err_len, "MAC learning supports at most %u IPs", MAC_TABLE_MAX_ENDPOINTS);
+    else {
+        for(i=0; i<want_len; i++) {
+            for(j=0; j<i; j++)
+                if(strcmp(want[i].intf, want[j].intf) == 0) {
+                    snprintf(err, err_len, "border port %s is listed twice", want[i].intf);
+                    return -1;
+                }
+            if(!want[i].vbp && if_nametoindex(want[i].intf) == 0) {
+                snprintf(err, err_len, "border port %s does not exist", want[i].intf);
+                return -1;
+            }
+            if(c->frag && (want[i].tag & CAPSULATOR_TAG_FRAG)) {
+                snprintf(err, err_len, "tag %lu of %s is too large for -frag (at most %lu)",
+                         (unsigned long)want[i].tag, want[i].intf,
+                         (unsigned long)CAPSULATOR_TAG_FRAG - 1);
+                return -1;
+            }
+            if(c->keepalive &&
+               (c->frag ? want[i].tag | CAPSULATOR_TAG_FRAG : want[i].tag) == CAPSULATOR_TAG_PROBE) {
+                snprintf(err, err_len, "tag %lu of %s is reserved for -keepalive probes",
+                         (unsigned long)want[i].tag, want[i].intf);
+                return -1;
+            }
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Rereads c->config_path and brings the border ports, tunnel endpoints and their
+ * backups in line with it and the command line.  Ports no longer listed, or listed with
+ * another tag or kind, are removed and new ones added; the queues of ports
+ * whose endpoints changed (all of them when broadcasting or learning) are
+ * restarted.  A file with errors changes nothing.
+ */
+static void capsulator_reload(capsulator* c) {
+    config cf;
+    config_port* want;
+    uint32_t *dests, *backup_of, *backup_ips;
+    int *slot_of, *restart;
+    unsigned want_len, dests_len, backups_len, i, j, k, removed, added;
+    int dests_changed;
+    mac_table* old_macs;
+    char err[256];
+
+    if(config_read(&cf, c->config_path, err, sizeof(err)) != 0) {
+        verbose_println("Warning: not reloading: %s", err);
+        return;
+    }
+
+    /* the ports and endpoints of the command line come first */
+    want_len = c->static_bp_len + cf.ports_len;
+    dests_len = c->static_dests_len + cf.dest_ips_len;
+    backups_len = c->static_backups_len + cf.backups_len;
+    want = calloc(want_len + 1, sizeof(*want));
+    dests = calloc(dests_len + 1, sizeof(*dests));
+    backup_of = calloc(backups_len + 1, sizeof(*backup_of));
+    backup_ips = calloc(backups_len + 1, sizeof(*backup_ips));
+    slot_of = calloc(want_len + 1, sizeof(*slot_of));
+    restart = calloc(c->bp_cap, sizeof(*restart));
+    if(!want || !dests || !backup_of || !backup_ips || !slot_of || !restart)
+        pdie("malloc (reload)");
+    for(i=0; i<c->static_bp_len; i++) {
+        memcpy(want[i].intf, c->bp[i].intf, IF_NAMESIZE);
+        want[i].tag = c->bp[i].tag;
+        want[i].vbp = c->bp[i].vbp;
+    }
+    memcpy(&want[c->static_bp_len], cf.ports, cf.ports_len * sizeof(*want));
+    memcpy(dests, c->tp.tunnel_dest_ips, c->static_dests_len * sizeof(*dests));
+    memcpy(&dests[c->static_dests_len], cf.dest_ips, cf.dest_ips_len * sizeof(*dests));
+    memcpy(backup_of, c->tp.backup_of, c->static_backups_len * sizeof(*backup_of));
+    memcpy(&backup_of[c->static_backups_len], cf.backup_of, cf.backups_len * sizeof(*backup_of));
+    memcpy(backup_ips, c->tp.backup_ips, c->static_backups_len * sizeof(*backup_ips));
+    memcpy(&backup_ips[c->static_backups_len], cf.backup_ips, cf.backups_len * sizeof(*backup_ips));
+    config_free(&cf);
+
+    if(capsulator_reload_check(c, want, want_len, dests_len, backups_len, err, sizeof(err)) != 0) {
+        verbose_println("Warning: not reloading %s: %s", c->config_path, err);
+        goto out;
+    }
+
+    /* new endpoints are probed, and have somewhere to fail over to, before
+       any queue sends to them */
+    if(c->keepalive &&
+       keepalive_set_paths(c->keepalive, dests, dests_len, backup_of, backup_ips, backups_len,
+                           err, sizeof(err)) != 0) {
+        verbose_println("Warning: not reloading %s: %s", c->config_path, err);
+        goto out;
+    }
+    free(c->tp.backup_of);
+    free(c->tp.backup_ips);
+    c->tp.backup_of = backup_of;
+    c->tp.backup_ips = backup_ips;
+    c->tp.backups_len = backups_len;
+    backup_of = backup_ips = NULL;
+
+    /* the tunnel port threads must have set up their ingress, which has to
+       learn about added ports */
+    for(i=0; i<c->tunnel_workers; i++)
+        while(!__atomic_load_n(&c->workers[i].in, __ATOMIC_ACQUIRE))
+            capsulator_control_sleep();
+
+    /* a port is known by its interface name */
+    dests_changed = dests_len != c->tp.tunnel_dest_ips_len ||
+                    memcmp(dests, c->tp.tunnel_dest_ips, dests_len * sizeof(*dests)) != 0;
+    removed = 0;
+    for(j=0; j<want_len; j++)
+        slot_of[j] = -1;
+    for(i=0; i<c->bp_len; i++) {
+        if(!c->bp[i].active)
+            continue;
+        for(j=0; j<want_len; j++)
+            if(strcmp(want[j].intf, c->bp[i].intf) == 0)
+                break;
+        if(j == want_len || want[j].tag != c->bp[i].tag || want[j].vbp != c->bp[i].vbp) {
+            __atomic_store_n(&c->bp[i].active, 0, __ATOMIC_RELEASE);
+            restart[i] = -1;
+            removed += 1;
+            continue;
+        }
+        slot_of[j] = i;
+        restart[i] = (dests_changed && (broadcast || c->learn)) ||
+                     (!broadcast && c->bp[i].dest_ip != dests[j]);
+    }
+
+    /* once no thread looks them up any more, stop and close the removed
+       ports and stop the queues which will send elsewhere */
+    if(removed)
+        capsulator_publish_tags(c);
+    for(i=0; i<c->bp_len; i++) {
+        if(restart[i] == 0)
+            continue;
+        if(c->bp[i].controls)
+            capsulator_stop_border_port(c, i);
+        if(restart[i] < 0) {
+            capsulator_close_border_port(c, i);
+            verbose_println("removed border port %s (tag=%u)", c->bp[i].intf, c->bp[i].tag);
+        }
+    }
+
+    /* learned locations are endpoint indices, so they go with the endpoints;
+       every queue which looked them up has been stopped */
+    if(dests_changed) {
+        free(c->tp.tunnel_dest_ips);
+        c->tp.tunnel_dest_ips = dests;
+        c->tp.tunnel_dest_ips_len = dests_len;
+        dests = NULL;
+        if(c->learn) {
+            old_macs = __atomic_exchange_n(&c->macs,
+                                           mac_table_create(c->tp.tunnel_dest_ips,
+                                                            c->tp.tunnel_dest_ips_len,
+                                                            c->learn_age),
+                                           __ATOMIC_ACQ_REL);
+            rcu_synchronize(&c->rcu);
+            mac_table_destroy(old_macs);
+        }
+    }
+    for(j=0; j<want_len; j++)
+        if(slot_of[j] >= 0 && !broadcast)
+            c->bp[slot_of[j]].dest_ip = c->tp.tunnel_dest_ips[j];
+
+    /* open the new ports before the tunnel port threads look them up */
+    added = 0;
+    for(j=0; j<want_len; j++) {
+        if(slot_of[j] >= 0)
+            continue;
+        i = capsulator_free_slot(c);
+        memset(&c->bp[i], 0, sizeof(c->bp[i]));
+        memcpy(c->bp[i].intf, want[j].intf, IF_NAMESIZE);
+        c->bp[i].tag = want[j].tag;
+        c->bp[i].vbp = want[j].vbp;
+        c->bp[i].dest_ip = broadcast ? 0 : c->tp.tunnel_dest_ips[j];
+        capsulator_open_border_port(c, i);
+        for(k=0; k<c->tunnel_workers; k++)
+            ingress_open_port(c->workers[k].in, i);
+        if(c->learn)
+            c->bp[i].domain = capsulator_domain(c, i);
+        if(i == c->bp_len)
+            __atomic_store_n(&c->bp_len, i + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&c->bp[i].active, 1, __ATOMIC_RELEASE);
+        restart[i] = 1;
+        added = 1;
+        verbose_println("added border port %s (tag=%u)", c->bp[i].intf, c->bp[i].tag);
+    }
+    if(added)
+        capsulator_publish_tags(c);
+
+    for(i=0; i<c->bp_len; i++)
+        if(restart[i] > 0)
+            capsulator_start_border_port(c, i);
+    verbose_println("reloaded %s: %u border ports, %u tunnel endpoints",
+                    c->config_path, want_len, c->tp.tunnel_dest_ips_len);
+
+out:
+    free(want);
+    free(dests);
+    free(backup_of);
+    free(backup_ips);
+    free(slot_of);
+    free(restart);
+}
+
+/** Entry point of the thread which reloads the configuration file on SIGHUP. */
+static void* capsulator_control_main(void* vc) {
+    capsulator* c;
+    sigset_t hup;
+    int sig;
+
+    pthread_detach(pthread_self());
+    c = (capsulator*)vc;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+
+    while(1)
+        if(sigwait(&hup, &sig) == 0)
+            capsulator_reload(c);
+
+    return NULL;
+}
+
+/** Creates the MAC table and the ports' domains, if learning. */
+static void capsulator_learn_setup(capsulator* c) {
+    unsigned i;
+
+    if(!c->learn)
+        return;
+    if(c->bp_len > MAC_TABLE_MAX_DOMAINS)
+        die("MAC learning supports at most %u border ports", MAC_TABLE_MAX_DOMAINS);
+    c->macs = mac_table_create(c->tp.tunnel_dest_ips, c->tp.tunnel_dest_ips_len,
+                               c->learn_age);
+
+    /* ports sharing a tag share its addresses */
+    for(i=0; i<c->bp_len; i++)
+        for(c->bp[i].domain=0; c->bp[c->bp[i].domain].tag != c->bp[i].tag; c->bp[i].domain++);
+}
+
+void capsulator_run(capsulator* c) {
+    int val, rcvbuf;
+    unsigned i;
+    struct sockaddr_in addr;
+    struct sigaction sa;
+    sigset_t usr1, hup;
+    tunnel_worker_info* twi;
+    egress** egs;
+    xdp_engine* xe;
+    pthread_t tid;
+    char err[256];
+
+    /* get the IP address of the tunneling port's interface */
+    c->tp.ip = get_ip_for_interface(c->tp.intf);
+    verbose_println("c->tp.ip = %d\n",c->tp.ip);
+    verbose_println("c->c->tp.tunnel_dest_ips_len = %d\n",c->tp.tunnel_dest_ips_len);
+    int r;
+    for (r=0; r<c->tp.tunnel_dest_ips_len; r++)
+        verbose_println("c->tp.tunnel_dest_ips = %d\n",c->tp.tunnel_dest_ips[r]);
+
+    if(!c->tp.ip)
+        die("tunneling interface IP could not found (interface down?)");
+
+    /* probes are as long as the shortest frame, so the filters let them in */
+    if(c->keepalive_ms) {
+        c->keepalive = keepalive_create(c->tp.ip, c->udp_port, c->vnet_hdr_len + MIN_ETH_LEN,
+                                        c->keepalive_ms);
+        if(keepalive_set_paths(c->keepalive, c->tp.tunnel_dest_ips, c->tp.tunnel_dest_ips_len,
+                               c->tp.backup_of, c->tp.backup_ips, c->tp.backups_len,
+                               err, sizeof(err)) != 0)
+            die("%s", err);
+    }
+
+    /* with a configuration file, leave room for the ports it may add (the
+       slots never move, so threads may keep pointers to them) */
+    c->bp_cap = c->config_path ? CAPSULATOR_MAX_BORDER_PORTS : c->bp_len;
+    if(c->bp_len > c->bp_cap)
+        die("at most %u border ports are supported", c->bp_cap);
+    if(!(c->bp = realloc(c->bp, c->bp_cap * sizeof(*c->bp))))
+        pdie("realloc (border port slots)");
+    memset(&c->bp[c->bp_len], 0, (c->bp_cap - c->bp_len) * sizeof(*c->bp));
+    for(i=0; i<c->bp_len; i++) {
+        c->bp[i].dest_ip = broadcast ? 0 : c->tp.tunnel_dest_ips[i];
+        c->bp[i].controls = NULL;
+        c->bp[i].kernel_drops = 0;
+    }
+    rcu_init(&c->rcu);
+
+    c->buf_size = capsulator_buf_size(c);
+    verbose_println("packet buffers hold %u bytes", c->buf_size);
+
+    capsulator_learn_setup(c);
+
+    /* create a raw IP socket to handle the tunneling I/O (the UDP sockets
+       are opened with the tunnel port threads) */
+    if(!c->udp_port) {
+        c->tp.fd = socket(AF_INET, SOCK_RAW, IPPROTO_CAPSULATOR);
+        if(c->tp.fd < 0)
+            pdie("tunnel port socket");
+
+        /* tell the socket to provide the IP header for us (so it handles fragmentation!) */
+        val = 0;
+        if(setsockopt(c->tp.fd, IPPROTO_IP, IP_HDRINCL, &val, sizeof(val)) < 0)
+                pdie("ioctl (IP_HDRINCL)");
+
+        /* bind to the tunnel port's interface */
+        addr.sin_family = AF_INET;
+        addr.sin_port = 0;
+        addr.sin_addr.s_addr = c->tp.ip;
+        if(bind(c->tp.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+            pdie("bind (tunnel port interface)");
+    }
+
+    /* increase the buffer size to reduce the chance of a dropped packet (ok if
+       this fails */
+    val = 64 * 1024;
+    rcvbuf = (c->engine == CAPSULATOR_ENGINE_XDP) ? XDP_TUNNEL_RCVBUF : val;
+    if(!c->udp_port)
+        setsockopt(c->tp.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    /* SIGUSR1 asks for the counters; keep it away from the border port
+       threads, whose waits it would only interrupt */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = capsulator_handle_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+    /* SIGUSR2 interrupts border port threads told to stop (and must not
+       restart their waits); SIGHUP is left to the control thread */
+    sa.sa_handler = capsulator_handle_sigusr2;
+    sigaction(SIGUSR2, &sa, NULL);
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    if(c->config_path)
+        pthread_sigmask(SIG_BLOCK, &hup, NULL);
+
+    /* the forwarding threads log through per-thread rings this drains (a
+       thread started earlier would take the signals blocked above) */
+    if(verbose)
+        log_start();
+
+    if(c->shape)
+        c->shaper = shaper_create(c->shape_rates, c->shape_rates_len,
+                                  c->shape_quantum, c->buf_size);
+
+    for(i=0; i<c->bp_len; i++) {
+        capsulator_open_border_port(c, i);
+        c->bp[i].active = 1;
+    }
+    c->tags = tag_table_create(c->bp, c->bp_len);
+
+    /* start a border port controller thread per queue, or leave the queues
+       to the epoll or io_uring loops or the AF_XDP engine (which uses the egress for the
+       frames it cannot send itself) */
+    c->tp.worker_stats = stats_alloc(c->tunnel_workers);
+    twi = c->workers = capsulator_open_tunnel_workers(c);
+    for(i=0; i<c->bp_len; i++)
+        capsulator_start_border_port(c, i);
+
+    /* start the extra tunnel port threads, if any, and the stats thread */
+    xe = NULL;
+    if(c->engine == CAPSULATOR_ENGINE_XDP) {
+        if(!(egs = calloc(c->bp_len, sizeof(*egs))))
+            pdie("malloc (border port egress)");
+        for(i=0; i<c->bp_len; i++)
+            egs[i] = c->bp[i].controls[0]->eg;
+        xe = xdp_engine_create(c, c->tags, egs);
+        free(egs);
+    }
+    stats_start(c, c->stats_path, c->stats_interval_ms);
+    if(c->keepalive)
+        keepalive_start(c->keepalive);
+
+    for(i=1; i<c->tunnel_workers; i++)
+        capsulator_start_thread(&tid, twi[i].cpu, capsulator_thread_main_for_tunnel_port, &twi[i]);
+    if(xe && pthread_create(&tid, NULL, xdp_engine_main, xe) != 0)
+        pdie("pthread_create");
+    if(c->config_path && pthread_create(&tid, NULL, capsulator_control_main, c) != 0)
+        pdie("pthread_create");
+
+    pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+
+    /* use the main thread to run the first tunnel controller */
+    capsulator_thread_main_for_tunnel_port(&twi[0]);
+}
+
+/** Writes the frames twi decapsulated out, then frees the reassembled ones. */
+static void capsulator_tunnel_flush(tunnel_worker_info* twi) {
+    ingress_flush(twi->in);
+    if(twi->frags)
+        frag_release(twi->frags);
+}
+
+/**
+ * Decapsulates the tunnel packet of len bytes at pkt (received as, or as part
+ * of, packet k of twi) and queues its frame for every border port which
+ * terminates its tag.
+ */
+static void capsulator_decap_packet(tunnel_worker_info* twi, unsigned k,
+                                    char* pkt, unsigned len) {
+    capsulator* c;
+    struct iphdr* iphdr;
+    tunnel_packet_hdr* hdr;
+    tag_table* tags;
+    mac_table* macs;
+    const unsigned* ports;
+    char* data;
+    unsigned i, nports, off, frame_len;
+    int data_len;
+    uint32_t src_ip, tag;
+
+    c = twi->c;
+
+    /* UDP sockets receive the packets without their IP header */
+    off = c->udp_port ? 0 : MIN_IP_HEADER_LEN;
+    iphdr = (struct iphdr*)pkt;
+    hdr = (tunnel_packet_hdr*)((char*)iphdr + off);
+    data = ((char*)hdr) + sizeof(tunnel_packet_hdr);
+    data_len = (int)len - (int)off - (int)sizeof(tunnel_packet_hdr);
+    src_ip = off ? iphdr->saddr : ingress_source(twi->in, k);
+    STAT_ADD(twi->stats, rx_packets, 1);
+    STAT_ADD(twi->stats, rx_bytes, len);
+
+    if(len == 0) {
+        log_dp(LOG_WARN, &twi->log, twi->name, 0,
+               "TPH: read did not read any bytes (n==0)");
+        STAT_ADD(twi->stats, drop_short, 1);
+        return;
+    }
+    else if(off && iphdr->ihl != MIN_IP_HEADER_LEN / 4) {
+        log_dp(LOG_WARN, &twi->log, twi->name, 0,
+               "TPH: Warning: ignoring tunnel packet with IP header including options (IP header length %luB)",
+               (long)iphdr->ihl * 4);
+        STAT_ADD(twi->stats, drop_ip_options, 1);
+        return;
+    }
+
+    /* probes carry no frame (their tag has the fragment bit set too) */
+    tag = hdr->tag;
+    if(c->keepalive && tag == htonl(CAPSULATOR_TAG_PROBE) && data_len > 0) {
+        keepalive_input(c->keepalive, src_ip, data, data_len);
+        return;
+    }
+
+    /* a fragment waits for the rest of its frame, which then goes on as if
+       it had arrived whole */
+    if(twi->frags && (tag & htonl(CAPSULATOR_TAG_FRAG)) && data_len > (int)sizeof(frag_info)) {
+        tag &= ~htonl(CAPSULATOR_TAG_FRAG);
+        if(frag_full(twi->frags))
+            capsulator_tunnel_flush(twi);
+        if(!(data = frag_add(twi->frags, src_ip, tag, (frag_info*)data,
+                             data + sizeof(frag_info), data_len - sizeof(frag_info),
+                             &frame_len)))
+            return;
+        data_len = frame_len;
+    }
+
+    if(data_len < (int)c->vnet_hdr_len + MIN_ETH_LEN) {
+        STAT_ADD(twi->stats, drop_short, 1);
+        log_dp(LOG_WARN, &twi->log, twi->name, 0,
+               "TPH: Warning: ignoring tunnel packet of %ld data bytes (too small to include a tunneled packet containing a IP header + tunneling header + Ethernet frame)",
+               (long)data_len);
+        return;
+    }
+
+    log_dp(LOG_PACKET, &twi->log, twi->name, 0,
+           "TPH: Tunnel received %ld data bytes destined for Tag=%lu",
+           (long)data_len, (long)ntohl(tag));
+
+    /* queue for any border port which should receive this packet's data */
+    tags = __atomic_load_n(&c->tags, __ATOMIC_ACQUIRE);
+    if(!(nports = tag_table_lookup(tags, tag, &ports)))
+        STAT_ADD(twi->stats, drop_unknown_tag, 1);
+    else {
+        STAT_ADD(twi->stats, tag_hits, 1);
+
+        /* the frame's sender is behind the endpoint it came from */
+        if((macs = __atomic_load_n(&c->macs, __ATOMIC_ACQUIRE)))
+            mac_table_learn(macs, c->bp[ports[0]].domain,
+                            (uint8_t*)data + c->vnet_hdr_len + ETH_ALEN,
+                            mac_table_endpoint(macs, src_ip));
+    }
+    for(i=0; i<nports; i++) {
+        ingress_queue(twi->in, ports[i], data, data_len);
+        log_dp(LOG_PACKET, &twi->log, c->bp[ports[i]].intf, 0,
+               "TPH: Tunnel forwarded %ldB destined for Tag=%lu",
+               (long)data_len, (long)ntohl(tag));
+    }
+}
+
+/**
+ * Decapsulates the len bytes at pkt received as packet k of twi, which a UDP
+ * socket coalesced from packets of seg bytes (the last may be shorter) unless
+ * seg is 0.
+ */
+static void capsulator_decap_segments(tunnel_worker_info* twi, unsigned k,
+                                      char* pkt, unsigned len, unsigned seg) {
+    unsigned off;
+
+    if(!seg)
+        seg = len;
+    else
+        STAT_ADD(twi->stats, rx_coalesced, 1);
+
+    off = 0;
+    do {
+        capsulator_decap_packet(twi, k, pkt + off, (len - off < seg) ? len - off : seg);
+        off += seg;
+    } while(off < len);
+}
+
+/**
+ * Decapsulates received tunnel packet k of twi, which a UDP socket may have
+ * coalesced from several.
+ */
+static void capsulator_decap(tunnel_worker_info* twi, unsigned k) {
+    char* pkt;
+    unsigned len;
+
+    pkt = ingress_packet(twi->in, k, &len);
+    capsulator_decap_segments(twi, k, pkt, len, ingress_segment_size(twi->in, k));
+}
+
+/**
+ * Tunnel port loop of the thread-per-port engine: blocks for each batch of
+ * tunnel packets, or polls for them without sleeping if the thread spins.
+ */
+static void capsulator_tunnel_port_loop(tunnel_worker_info* twi) {
+    int k, n;
+
+    /* continuously decapsulate and forward tunneled packets from the tunnel to the border */
+    while(1) {
+        /* wait for a batch of tunneled packets to arrive (holding no
+           references to tables the control thread may replace meanwhile) */
+        if(!twi->spin)
+            log_dp(LOG_PACKET, &twi->log, twi->name, 0, "TPH: waiting for tunnel port traffic");
+        rcu_offline(&twi->rcu);
+        n = ingress_recv(twi->in, twi->fd, !twi->spin);
+        rcu_online(&twi->rcu);
+        if(n < 0) {
+            if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+                log_dp(LOG_ERROR, &twi->log, twi->name, errno, "TPH: Error: tunnel read failed");
+            continue;
+        }
+
+        for(k=0; k<n; k++)
+            capsulator_decap(twi, k);
+
+        /* write the decapsulated batch out, grouped by border port */
+        capsulator_tunnel_flush(twi);
+    }
+}
+
+static void capsulator_epoll_loop(tunnel_worker_info* twi);
+static void capsulator_uring_loop(tunnel_worker_info* twi);
+
+void* capsulator_thread_main_for_tunnel_port(void* vtwi) {
+    tunnel_worker_info* twi;
+    capsulator* c;
+    cpu_set_t cpus;
+    char where[64];
+
+    pthread_detach(pthread_self());
+    twi = (tunnel_worker_info*)vtwi;
+    c = twi->c;
+
+    /* the other threads were started on their CPU; the main thread moves
+       before it allocates anything of its own */
+    if(twi->id == 0 && twi->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(twi->cpu, &cpus);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            verbose_println("%s TPH: Warning: unable to pin thread to CPU %d", twi->name, twi->cpu);
+    }
+
+    /* each thread has its own buffer pool and counters so they never share
+       a cache line or a lock */
+    twi->stats = &c->tp.worker_stats[twi->id];
+    __atomic_store_n(&twi->in,
+                     ingress_create(c->bp, c->bp_cap, c->batch,
+                                    buf_pool_create(c->batch, (c->udp_port && c->udp_offload)
+                                                              ? INGRESS_GRO_BUF_SIZE : c->buf_size),
+                                    twi->id, twi->stats),
+                     __ATOMIC_RELEASE);
+    if(c->frag)
+        twi->frags = frag_table_create(FRAG_DEFAULT_ENTRIES, c->buf_size, twi->stats);
+
+    capsulator_placement(where, sizeof(where));
+    verbose_println("%s TPH: thread for handling incoming tunnel port traffic is now running (%s, %u border port queues%s)",
+                    twi->name, where, twi->load, twi->spin ? ", spinning" : "");
+
+    /* the loops only go offline while they block */
+    rcu_online(&twi->rcu);
+
+    if(c->engine == CAPSULATOR_ENGINE_EPOLL)
+        capsulator_epoll_loop(twi);
+    else if(c->engine == CAPSULATOR_ENGINE_URING)
+        capsulator_uring_loop(twi);
+    else
+        capsulator_tunnel_port_loop(twi);
+
+    return NULL;
+}
+
+/**
+ * Returns the flow hash of the frame (behind its virtio-net header, if any) in
+ * the n bytes at data, or 0 if the egress has no use for it.
+ */
+static uint32_t capsulator_flow_hash(border_port_control_info* bpci,
+                                     char* data, unsigned n) {
+    if(bpci->eg->sources == 1)
+        return 0;
+    return flow_hash((uint8_t*)data + bpci->vnet_hdr_len, n - bpci->vnet_hdr_len);
+}
+
+/**
+ * Tunnels the n bytes (virtio-net header, if any, and frame) at data received
+ * from bpci's border port.  Short frames from a tap are padded (data must have
+ * room for it), others are dropped.
+ */
+static void capsulator_encap(border_port_control_info* bpci, char* data, int n) {
+    int min_len, dest, where;
+    uint8_t* frame;
+
+    STAT_ADD(bpci->stats, rx_packets, 1);
+    STAT_ADD(bpci->stats, rx_bytes, n);
+
+    min_len = bpci->vnet_hdr_len + MIN_ETH_LEN;
+    if(n < min_len) {
+	  if (bpci->bp->vbp == 0 || n < (int)bpci->vnet_hdr_len){
+            STAT_ADD(bpci->stats, drop_short, 1);
+            log_dp(LOG_WARN, &bpci->log, bpci->bp->intf, 0,
+                   "BPH: (tag=%lu) Warning: ignoring border Ethernet frame of length %ldB (too small)",
+                   (long)bpci->bp->tag, (long)n);
+            return;
+	  } else {
+		memset(data+n,0,min_len-n);
+		n = min_len;
+	  }
+    }
+    else
+        log_dp(LOG_PACKET, &bpci->log, bpci->bp->intf, 0,
+               "BPH: (tag=%lu) received %ld data bytes to tunnel",
+               (long)bpci->bp->tag, (long)n);
+
+    /* bridge the tag: the sender lives on this side, and a unicast frame to
+       a learned MAC address goes only where that address lives */
+    dest = EGRESS_ALL_DESTS;
+    if(bpci->macs) {
+        frame = (uint8_t*)data + bpci->vnet_hdr_len;
+        mac_table_learn(bpci->macs, bpci->bp->domain, frame + ETH_ALEN, MAC_TABLE_LOCAL);
+        where = mac_table_lookup(bpci->macs, bpci->bp->domain, frame);
+        if(where == MAC_TABLE_LOCAL) {
+            STAT_ADD(bpci->stats, drop_local, 1);
+            return;
+        }
+        if(where != MAC_TABLE_UNKNOWN && broadcast) {
+            STAT_ADD(bpci->stats, learned_frames, 1);
+            dest = where;
+        }
+    }
+
+    egress_queue_dest(bpci->eg, dest, data, n, capsulator_flow_hash(bpci, data, n));
+}
+
+/**
+ * Tunnels every frame of the ring block which is ready, then hands the block
+ * back to the kernel.
+ */
+static void capsulator_border_port_ring_block(border_port_control_info* bpci) {
+    unsigned n;
+    char* data;
+
+    while((data = (char*)rx_ring_next_frame(bpci->bp->ring, &n))) {
+        /* the kernel puts the virtio-net header right before the frame */
+        capsulator_encap(bpci, data - bpci->vnet_hdr_len, n + bpci->vnet_hdr_len);
+    }
+
+    /* the frames live in the ring, so they must be sent before the block
+       is handed back to the kernel */
+    egress_flush(bpci->eg);
+    rx_ring_release(bpci->bp->ring);
+}
+
+/**
+ * Reads one frame from bpci's border port into the next egress slot and
+ * tunnels it.
+ *
+ * @return the result of the read (-1 with errno set if there was nothing)
+ */
+static int capsulator_border_port_read(border_port_control_info* bpci) {
+    char* buf;
+    int n;
+
+    buf = egress_slot(bpci->eg);
+    if(bpci->bp->vbp)
+        n = read(bpci->fd, buf, bpci->eg->slot_size);
+    else
+        n = recv(bpci->fd, buf, bpci->eg->slot_size, MSG_DONTWAIT);
+    STAT_ADD(bpci->stats, syscalls, 1);
+
+    if(n >= 0)
+        capsulator_encap(bpci, buf, n);
+    return n;
+}
+
+/**
+ * Waits for the border port to become readable, flushing the pending batch if
+ * its deadline passes first.
+ */
+static void capsulator_border_port_wait(border_port_control_info* bpci) {
+    struct pollfd pfd;
+    struct timespec ts;
+    long ns;
+
+    log_dp(LOG_PACKET, &bpci->log, bpci->bp->intf, 0,
+           "BPH: (tag=%lu) waiting for border port traffic", (long)bpci->bp->tag);
+
+    if((ns = egress_wait_ns(bpci->eg)) == 0) {
+        egress_flush(bpci->eg);
+        ns = -1;
+    }
+    ts.tv_sec = ns / 1000000000L;
+    ts.tv_nsec = ns % 1000000000L;
+
+    pfd.fd = bpci->fd;
+    pfd.events = POLLIN;
+    STAT_ADD(bpci->stats, syscalls, 1);
+    if(ppoll(&pfd, 1, (ns < 0) ? NULL : &ts, NULL) == 0)
+        egress_flush(bpci->eg);
+}
+
+/**
+ * Border port loop for ports with a receive ring: waits for a block of frames
+ * and tunnels each of them straight out of the ring.
+ */
+static void capsulator_border_port_ring_loop(border_port_control_info* bpci) {
+    uint64_t polls;
+    int ret;
+
+    while(!__atomic_load_n(&bpci->stop, __ATOMIC_ACQUIRE)) {
+        log_dp(LOG_PACKET, &bpci->log, bpci->bp->intf, 0,
+               "BPH: (tag=%lu) waiting for border port traffic", (long)bpci->bp->tag);
+        polls = bpci->bp->ring->polls;
+        ret = rx_ring_wait(bpci->bp->ring, -1);
+        STAT_ADD(bpci->stats, syscalls, bpci->bp->ring->polls - polls);
+        if(ret < 0) {
+            if(errno != EINTR)
+                log_dp(LOG_ERROR, &bpci->log, bpci->bp->intf, errno,
+                       "BPH: Error: poll on border port ring failed");
+            continue;
+        }
+
+        capsulator_border_port_ring_block(bpci);
+    }
+}
+
+/**
+ * Border port loop for ports without a receive ring: reads frames one at a
+ * time into the egress batch slots.  A spinning port never sleeps while it
+ * has nothing to read; it only flushes the batch when it is due.
+ */
+static void capsulator_border_port_read_loop(border_port_control_info* bpci) {
+    while(!__atomic_load_n(&bpci->stop, __ATOMIC_ACQUIRE)) {
+        if(capsulator_border_port_read(bpci) >= 0)
+            continue;
+
+        if((errno == EAGAIN || errno == EWOULDBLOCK) && bpci->bp->spin) {
+            if(egress_wait_ns(bpci->eg) == 0)
+                egress_flush(bpci->eg);
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK)
+            capsulator_border_port_wait(bpci);
+        else if(errno != EINTR)
+            log_dp(LOG_ERROR, &bpci->log, bpci->bp->intf, errno,
+                   "BPH: Error: read from border port failed");
+    }
+}
+
+void* capsulator_thread_main_for_border_port(void* vbpci) {
+    border_port_control_info* bpci;
+    char where[64];
+
+    /* the control thread joins the thread once it has stopped it */
+    bpci = (border_port_control_info*)vbpci;
+
+    capsulator_placement(where, sizeof(where));
+    verbose_println("%s BPH: (tag=%u) thread for handling incoming border port traffic (queue %u) is now running (%s%s)",
+                    bpci->bp->intf, bpci->bp->tag, bpci->queue, where,
+                    bpci->bp->spin ? ", spinning" : "");
+
+    /* continuously encapsulate and forward Ethernet frames from the border through the tunnel */
+    if(bpci->bp->ring)
+        capsulator_border_port_ring_loop(bpci);
+    else
+        capsulator_border_port_read_loop(bpci);
+
+    /* told to stop: send what is queued and leave the rest to the control
+       thread */
+    egress_flush(bpci->eg);
+    verbose_println("%s BPH: (tag=%u) thread for queue %u stopped",
+                    bpci->bp->intf, bpci->bp->tag, bpci->queue);
+    __atomic_store_n(&bpci->stopped, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/** maximum number of events taken from the kernel per epoll wait */
+#define EPOLL_MAX_EVENTS 64
+
+/** maximum number of batches (or ring blocks) taken from a ready fd before
+    the other ready fds get their turn */
+#define EPOLL_BURST 4
+
+/** Receives and decapsulates up to EPOLL_BURST batches of tunnel packets. */
+static void capsulator_epoll_tunnel_port(tunnel_worker_info* twi) {
+    unsigned i;
+    int k, n;
+
+    for(i=0; i<EPOLL_BURST; i++) {
+        n = ingress_recv(twi->in, twi->fd, 0);
+        if(n < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_dp(LOG_ERROR, &twi->log, twi->name, errno, "TPH: Error: tunnel read failed");
+            return;
+        }
+
+        for(k=0; k<n; k++)
+            capsulator_decap(twi, k);
+        capsulator_tunnel_flush(twi);
+
+        /* a short batch means the socket has been drained */
+        if((unsigned)n < twi->c->batch)
+            return;
+    }
+}
+
+/** Tunnels up to EPOLL_BURST batches (or ring blocks) of frames from bpci. */
+static void capsulator_epoll_border_port(border_port_control_info* bpci) {
+    unsigned i;
+
+    if(bpci->bp->ring) {
+        for(i=0; i<EPOLL_BURST && rx_ring_ready(bpci->bp->ring); i++)
+            capsulator_border_port_ring_block(bpci);
+        return;
+    }
+
+    for(i=0; i<EPOLL_BURST * bpci->eg->batch; i++)
+        if(capsulator_border_port_read(bpci) < 0)
+            break;
+}
+
+/**
+ * Waits up to ns nanoseconds (forever if ns < 0) for events on epfd.  Kernels
+ * without epoll_pwait2() get the timeout rounded up to whole milliseconds.
+ */
+static int capsulator_epoll_wait(int epfd, struct epoll_event* evs, long ns) {
+    static int no_pwait2 = 0;
+    struct timespec ts;
+    int n;
+
+    if(!no_pwait2) {
+        ts.tv_sec = ns / 1000000000L;
+        ts.tv_nsec = ns % 1000000000L;
+        n = epoll_pwait2(epfd, evs, EPOLL_MAX_EVENTS, (ns < 0) ? NULL : &ts, NULL);
+        if(n >= 0 || errno != ENOSYS)
+            return n;
+        no_pwait2 = 1;
+    }
+
+    return epoll_wait(epfd, evs, EPOLL_MAX_EVENTS,
+                      (ns < 0) ? -1 : (int)((ns + 999999) / 1000000));
+}
+
+/**
+ * Takes the border port queues the control thread handed to twi, storing their
+ * number in len.  The caller frees the array.
+ */
+static border_port_control_info** capsulator_loop_mail(tunnel_worker_info* twi,
+                                                       unsigned* len) {
+    border_port_control_info** mail;
+    uint64_t n;
+
+    /* clear the wakeup before looking, so no later posting is missed */
+    if(read(twi->event_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        verbose_println("%s: read from event fd failed (%s)", twi->name, strerror(errno));
+    pthread_mutex_lock(&twi->lock);
+    mail = twi->mail;
+    *len = twi->mail_len;
+    twi->mail = NULL;
+    twi->mail_len = 0;
+    pthread_mutex_unlock(&twi->lock);
+    return mail;
+}
+
+/** Adds bpci to the border port queues twi serves. */
+static void capsulator_loop_serve(tunnel_worker_info* twi, border_port_control_info* bpci) {
+    twi->bpcis = realloc(twi->bpcis, (twi->bpcis_len + 1) * sizeof(*twi->bpcis));
+    twi->dirty = realloc(twi->dirty, (twi->bpcis_len + 1) * sizeof(*twi->dirty));
+    if(!twi->bpcis || !twi->dirty)
+        pdie("realloc (border port queues)");
+    twi->bpcis[twi->bpcis_len++] = bpci;
+    twi->spinners += bpci->bp->spin;
+}
+
+/**
+ * Flushes the egress of bpci and lets go of it, telling the control thread.
+ * Nothing may refer to bpci afterwards.
+ */
+static void capsulator_loop_let_go(tunnel_worker_info* twi, border_port_control_info* bpci) {
+    unsigned j;
+
+    egress_flush(bpci->eg);
+    for(j=0; j<twi->bpcis_len; j++)
+        if(twi->bpcis[j] == bpci) {
+            twi->bpcis[j] = twi->bpcis[--twi->bpcis_len];
+            twi->spinners -= bpci->bp->spin;
+            break;
+        }
+    for(j=0; j<twi->dirty_len; j++)
+        if(twi->dirty[j] == bpci) {
+            twi->dirty[j] = twi->dirty[--twi->dirty_len];
+            break;
+        }
+    __atomic_store_n(&bpci->stopped, 1, __ATOMIC_RELEASE);
+}
+
+/** Lists bpci among the queues of twi with frames waiting, if it has any. */
+static void capsulator_loop_dirty(tunnel_worker_info* twi, border_port_control_info* bpci) {
+    if(bpci->eg->queued && !bpci->dirty) {
+        bpci->dirty = 1;
+        twi->dirty[twi->dirty_len++] = bpci;
+    }
+}
+
+/**
+ * Flushes the border port queues of twi whose batch is due.
+ *
+ * @return how long (ns) until the next batch is due, or -1 if none waits
+ */
+static long capsulator_loop_flush_due(tunnel_worker_info* twi) {
+    border_port_control_info* bpci;
+    unsigned i;
+    long ns, min_ns;
+
+    min_ns = -1;
+    for(i=0; i<twi->dirty_len; ) {
+        bpci = twi->dirty[i];
+        if((ns = egress_wait_ns(bpci->eg)) == 0)
+            egress_flush(bpci->eg);
+        if(ns <= 0) {
+            bpci->dirty = 0;
+            twi->dirty[i] = twi->dirty[--twi->dirty_len];
+            continue;
+        }
+        if(min_ns < 0 || ns < min_ns)
+            min_ns = ns;
+        i++;
+    }
+    return min_ns;
+}
+
+/**
+ * Takes the border port queues the control thread handed to twi: new ones are
+ * served from now on, and those with stop set are flushed and let go of.
+ */
+static void capsulator_epoll_mail(tunnel_worker_info* twi, int epfd) {
+    border_port_control_info **mail, *bpci;
+    struct epoll_event ev;
+    unsigned i, mail_len;
+
+    mail = capsulator_loop_mail(twi, &mail_len);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    for(i=0; i<mail_len; i++) {
+        bpci = mail[i];
+        if(!__atomic_load_n(&bpci->stop, __ATOMIC_ACQUIRE)) {
+            capsulator_loop_serve(twi, bpci);
+            ev.data.ptr = bpci;
+            if(epoll_ctl(epfd, EPOLL_CTL_ADD, bpci->fd, &ev) < 0)
+                pdie("epoll_ctl (border port)");
+            __atomic_store_n(&bpci->serving, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        /* no event refers to the queue any more once it is out of the set
+           (mail is only read after the events of a wait are handled) */
+        if(epoll_ctl(epfd, EPOLL_CTL_DEL, bpci->fd, NULL) < 0)
+            verbose_println("%s: epoll_ctl (removing border port) failed (%s)",
+                            twi->name, strerror(errno));
+        capsulator_loop_let_go(twi, bpci);
+    }
+    free(mail);
+}
+
+/**
+ * Loop of the epoll engine: a single thread serves its tunnel port socket and
+ * its share of the border port queues, draining each fd in bursts as it
+ * becomes readable and flushing partial egress batches when they are due.
+ * The control thread hands it queues through twi->mail.
+ */
+static void capsulator_epoll_loop(tunnel_worker_info* twi) {
+    struct epoll_event evs[EPOLL_MAX_EVENTS], ev;
+    border_port_control_info* bpci;
+    long min_ns;
+    int epfd, k, n, mail;
+
+    if((epfd = epoll_create1(0)) < 0)
+        pdie("epoll_create1");
+
+    /* the tunnel port socket is drained until it would block */
+    if(fcntl(twi->fd, F_SETFL, fcntl(twi->fd, F_GETFL) | O_NONBLOCK) < 0)
+        pdie("fcntl (O_NONBLOCK on tunnel port)");
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, twi->fd, &ev) < 0)
+        pdie("epoll_ctl (tunnel port)");
+
+    ev.data.ptr = &twi->event_fd;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, twi->event_fd, &ev) < 0)
+        pdie("epoll_ctl (event fd)");
+
+    while(1) {
+        /* flush the border ports whose batch is due and sleep no longer than
+           until the next one is */
+        min_ns = capsulator_loop_flush_due(twi);
+
+        /* a spinning thread only looks */
+        if(twi->spin || twi->spinners)
+            min_ns = 0;
+
+        STAT_ADD(twi->stats, syscalls, 1);
+        rcu_offline(&twi->rcu);
+        n = capsulator_epoll_wait(epfd, evs, min_ns);
+        rcu_online(&twi->rcu);
+        if(n < 0) {
+            if(errno != EINTR)
+                verbose_println("%s: epoll wait failed (%s)", twi->name, strerror(errno));
+            continue;
+        }
+
+        mail = 0;
+        for(k=0; k<n; k++) {
+            if(!(bpci = evs[k].data.ptr)) {
+                capsulator_epoll_tunnel_port(twi);
+                continue;
+            }
+            if(evs[k].data.ptr == &twi->event_fd) {
+                mail = 1;
+                continue;
+            }
+
+            capsulator_epoll_border_port(bpci);
+            capsulator_loop_dirty(twi, bpci);
+        }
+        if(mail)
+            capsulator_epoll_mail(twi, epfd);
+    }
+}
+
+/** what a port has posted to the receive ring of the io_uring engine: nothing
+    (until the loop posts again), a multishot receive (or read), or a poll
+    after which the port is read as the epoll loop does */
+#define URING_POSTED_NONE 0
+#define URING_POSTED_RECV 1
+#define URING_POSTED_POLL 2
+
+/** user data of the completions of cancellations and of the timeout which
+    bounds a wait (the others carry the port they are for) */
+#define URING_DATA_CANCEL  0
+#define URING_DATA_TIMEOUT 1
+
+/** buffer groups tunnel packets and border port frames are received into */
+#define URING_GROUP_TUNNEL 0
+#define URING_GROUP_BORDER 1
+
+/** submission and completion queue entries of the receive ring: completions
+    of both buffer rings may wait at once */
+#define URING_RX_ENTRIES    256
+#define URING_RX_CQ_ENTRIES (4 * URING_MAX_BUFS)
+
+/** egress_sink of the io_uring engine: sends the batch through the send ring
+    of the tunnel port thread arg */
+static int capsulator_uring_sink(void* arg, int fd, struct mmsghdr* msgs, unsigned len) {
+    return uring_sendmmsg(&((tunnel_worker_info*)arg)->tx, fd, msgs, len);
+}
+
+/** returns a submission queue entry of twi's receive ring */
+static struct io_uring_sqe* capsulator_uring_sqe(tunnel_worker_info* twi) {
+    struct io_uring_sqe* sqe;
+
+    if(!(sqe = uring_sqe(&twi->rx)))
+        pdie("io_uring_enter (receive ring)");
+    return sqe;
+}
+
+/**
+ * Sets up the rings and buffers of twi, and has its ingress write through the
+ * send ring.  Without buffer rings the loop polls and reads.
+ *
+ * @return 0, or -1 if the kernel has no usable io_uring (errno is set)
+ */
+static int capsulator_uring_open(tunnel_worker_info* twi) {
+    capsulator* c;
+    unsigned size;
+
+    c = twi->c;
+    if(uring_init(&twi->rx, URING_RX_ENTRIES, URING_RX_CQ_ENTRIES) < 0)
+        return -1;
+    if(uring_init(&twi->tx, c->batch, c->batch) < 0) {
+        uring_destroy(&twi->rx);
+        return -1;
+    }
+
+    /* UDP packets are received with their source address and the size of
+       the packets GRO coalesced in front of them */
+    memset(&twi->rx_msg, 0, sizeof(twi->rx_msg));
+    twi->rx_msg.msg_namelen = sizeof(struct sockaddr_in);
+    twi->rx_msg.msg_controllen = INGRESS_CTRL_LEN;
+    size = (c->udp_port && c->udp_offload) ? INGRESS_GRO_BUF_SIZE : c->buf_size;
+    if(c->udp_port)
+        size += sizeof(struct io_uring_recvmsg_out) + twi->rx_msg.msg_namelen
+                + twi->rx_msg.msg_controllen;
+
+    if((twi->tunnel_bufs = uring_bufs_create(&twi->rx, URING_GROUP_TUNNEL, size))
+       && !(twi->border_bufs = uring_bufs_create(&twi->rx, URING_GROUP_BORDER, c->buf_size))) {
+        uring_bufs_destroy(&twi->rx, twi->tunnel_bufs);
+        twi->tunnel_bufs = NULL;
+    }
+    if(!(twi->multishot = twi->tunnel_bufs != NULL))
+        verbose_println("%s: Warning: io_uring cannot provide receive buffers (%s), polling instead",
+                        twi->name, strerror(errno));
+    twi->read_multishot = twi->multishot && uring_supports(&twi->rx, URING_OP_READ_MULTISHOT);
+
+    twi->in->sink = capsulator_uring_sink;
+    twi->in->sink_arg = twi;
+    return 0;
+}
+
+/** posts the receive (or poll) of twi's tunnel port */
+static void capsulator_uring_post_tunnel(tunnel_worker_info* twi) {
+    struct io_uring_sqe* sqe;
+
+    sqe = capsulator_uring_sqe(twi);
+    if(twi->multishot) {
+        uring_prep_recv(sqe, twi->fd, twi->c->udp_port ? &twi->rx_msg : NULL,
+                        URING_GROUP_TUNNEL, 1, (uintptr_t)twi);
+        twi->posted = URING_POSTED_RECV;
+    }
+    else {
+        uring_prep_poll(sqe, twi->fd, POLLIN, (uintptr_t)twi);
+        twi->posted = URING_POSTED_POLL;
+    }
+}
+
+/** posts the receive, read (from a tap device) or poll of bpci */
+static void capsulator_uring_post_border(tunnel_worker_info* twi,
+                                         border_port_control_info* bpci) {
+    struct io_uring_sqe* sqe;
+
+    sqe = capsulator_uring_sqe(twi);
+    if(bpci->bp->vbp ? twi->read_multishot : twi->multishot) {
+        if(bpci->bp->vbp)
+            uring_prep_read_multishot(sqe, bpci->fd, URING_GROUP_BORDER, (uintptr_t)bpci);
+        else
+            uring_prep_recv(sqe, bpci->fd, NULL, URING_GROUP_BORDER, 1, (uintptr_t)bpci);
+        bpci->posted = URING_POSTED_RECV;
+    }
+    else {
+        uring_prep_poll(sqe, bpci->fd, POLLIN, (uintptr_t)bpci);
+        bpci->posted = URING_POSTED_POLL;
+    }
+}
+
+/**
+ * Returns non-zero if the multishot receive of the port named intf ended with
+ * res because the kernel cannot do it, and warns that the thread polls from
+ * now on.
+ */
+static int capsulator_uring_refused(tunnel_worker_info* twi, const char* intf, int res) {
+    if(res != -EINVAL && res != -EOPNOTSUPP)
+        return 0;
+    verbose_println("%s: Warning: multishot receives unavailable on %s, polling instead",
+                    twi->name, intf);
+    return 1;
+}
+
+/**
+ * Handles a completion of the tunnel port of twi with result res and flags:
+ * the packet in a provided buffer is decapsulated and the buffer id appended
+ * to held (to be put back once the frames are written), or after a poll the
+ * socket is drained.
+ */
+static void capsulator_uring_tunnel(tunnel_worker_info* twi, int res, unsigned flags,
+                                    unsigned* held, unsigned* held_len) {
+    struct msghdr m;
+    unsigned id, len;
+    char* pkt;
+    int posted;
+
+    posted = twi->posted;
+    if(!(flags & IORING_CQE_F_MORE)) {
+        twi->posted = URING_POSTED_NONE;
+        twi->unposted = 1;
+    }
+
+    if(flags & IORING_CQE_F_BUFFER) {
+        id = flags >> IORING_CQE_BUFFER_SHIFT;
+        held[(*held_len)++] = id;
+        pkt = uring_bufs_data(twi->tunnel_bufs, id);
+        if(!twi->c->udp_port)
+            capsulator_decap_segments(twi, 0, pkt, res, 0);
+        else {
+            /* the source is passed on as that of packet 0 of the ingress */
+            pkt = uring_recvmsg_parse(&twi->rx_msg, pkt, res, &m, &len);
+            memcpy(&twi->in->addrs[0], m.msg_name, m.msg_namelen);
+            capsulator_decap_segments(twi, 0, pkt, len, ingress_gro_size(&m));
+        }
+    }
+    else if(posted == URING_POSTED_POLL && res >= 0)
+        capsulator_epoll_tunnel_port(twi);
+    else if(res < 0 && res != -ENOBUFS) {
+        if(posted == URING_POSTED_RECV && capsulator_uring_refused(twi, twi->name, res))
+            twi->multishot = twi->read_multishot = 0;
+        else
+            log_dp(LOG_ERROR, &twi->log, twi->name, -res, "TPH: Error: tunnel read failed");
+    }
+}
+
+/** puts back the provided buffers held by bpci once its egress has sent their
+    frames */
+static void capsulator_uring_put_held(tunnel_worker_info* twi,
+                                      border_port_control_info* bpci) {
+    if(bpci->eg->queued)
+        return;
+    while(bpci->held_len)
+        uring_bufs_put(twi->border_bufs, bpci->held[--bpci->held_len]);
+}
+
+/** flushes the egress of bpci, puts back the buffers it held and lets go of it */
+static void capsulator_uring_let_go(tunnel_worker_info* twi, border_port_control_info* bpci) {
+    egress_flush(bpci->eg);
+    if(twi->border_bufs)
+        capsulator_uring_put_held(twi, bpci);
+    capsulator_loop_let_go(twi, bpci);
+}
+
+/**
+ * Handles a completion of bpci with result res and flags: the frame in a
+ * provided buffer is tunneled from there (behind the header's own iovec) and
+ * the buffer held until the egress has sent it; or after a poll the port is
+ * drained.  A queue being let go of is once its last completion came.
+ */
+static void capsulator_uring_border(tunnel_worker_info* twi, border_port_control_info* bpci,
+                                    int res, unsigned flags) {
+    unsigned id;
+    int posted;
+
+    posted = bpci->posted;
+    if(!(flags & IORING_CQE_F_MORE))
+        bpci->posted = URING_POSTED_NONE;
+
+    /* a shaped queue copies the frame into its ring, so the buffer is free
+       again at once */
+    if(flags & IORING_CQE_F_BUFFER) {
+        id = flags >> IORING_CQE_BUFFER_SHIFT;
+        bpci->held[bpci->held_len++] = id;
+        if(!bpci->cancelled)
+            capsulator_encap(bpci, uring_bufs_data(twi->border_bufs, id), res);
+        capsulator_uring_put_held(twi, bpci);
+    }
+    else if(posted == URING_POSTED_POLL && res >= 0 && !bpci->cancelled)
+        capsulator_epoll_border_port(bpci);
+    else if(res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        if(posted == URING_POSTED_RECV && capsulator_uring_refused(twi, bpci->bp->intf, res)) {
+            if(bpci->bp->vbp)
+                twi->read_multishot = 0;
+            else
+                twi->multishot = twi->read_multishot = 0;
+        }
+        else
+            log_dp(LOG_ERROR, &bpci->log, bpci->bp->intf, -res,
+                   "BPH: Error: read from border port failed");
+    }
+
+    if(bpci->posted == URING_POSTED_NONE && bpci->cancelled) {
+        capsulator_uring_let_go(twi, bpci);
+        return;
+    }
+    if(bpci->posted == URING_POSTED_NONE)
+        twi->unposted = 1;
+    capsulator_loop_dirty(twi, bpci);
+}
+
+/**
+ * Takes the border port queues the control thread handed to twi: new ones get
+ * their receive posted, and those with stop set have it cancelled (they are
+ * let go of once it completes).
+ */
+static void capsulator_uring_mail(tunnel_worker_info* twi) {
+    border_port_control_info **mail, *bpci;
+    unsigned i, mail_len;
+
+    mail = capsulator_loop_mail(twi, &mail_len);
+    for(i=0; i<mail_len; i++) {
+        bpci = mail[i];
+        if(!__atomic_load_n(&bpci->stop, __ATOMIC_ACQUIRE)) {
+            capsulator_loop_serve(twi, bpci);
+            if(twi->border_bufs && !bpci->held
+               && !(bpci->held = malloc(twi->border_bufs->count * sizeof(*bpci->held))))
+                pdie("malloc (io_uring held buffers)");
+
+            /* a shaped queue leaves the sending to the shaper thread */
+            if(!bpci->eg->ring) {
+                bpci->eg->sink = capsulator_uring_sink;
+                bpci->eg->sink_arg = twi;
+            }
+            capsulator_uring_post_border(twi, bpci);
+            __atomic_store_n(&bpci->serving, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        if(bpci->posted == URING_POSTED_NONE)
+            capsulator_uring_let_go(twi, bpci);
+        else {
+            uring_prep_cancel(capsulator_uring_sqe(twi), (uintptr_t)bpci, URING_DATA_CANCEL);
+            bpci->cancelled = 1;
+        }
+    }
+    free(mail);
+}
+
+/** posts again the receives of twi which ended (out of buffers, or polls) */
+static void capsulator_uring_repost(tunnel_worker_info* twi) {
+    unsigned i;
+
+    twi->unposted = 0;
+    if(twi->posted == URING_POSTED_NONE)
+        capsulator_uring_post_tunnel(twi);
+    for(i=0; i<twi->bpcis_len; i++)
+        if(twi->bpcis[i]->posted == URING_POSTED_NONE && !twi->bpcis[i]->cancelled)
+            capsulator_uring_post_border(twi, twi->bpcis[i]);
+}
+
+/**
+ * Loop of the io_uring engine: like the epoll loop, a single thread serves its
+ * tunnel port socket and its share of the border port queues, but the kernel
+ * receives packets into provided buffers for receives posted once, and every
+ * batch is sent with one system call whatever the kind of port.  A wait thus
+ * costs one system call for all the packets which arrived meanwhile.  Falls
+ * back to the epoll loop without a usable io_uring.
+ */
+static void capsulator_uring_loop(tunnel_worker_info* twi) {
+    struct __kernel_timespec ts;
+    struct io_uring_cqe* cqe;
+    uint64_t data;
+    unsigned *held, held_len, flags, i;
+    long min_ns;
+    int timeout, mail, res;
+
+    if(capsulator_uring_open(twi) < 0) {
+        verbose_println("%s: Warning: io_uring unavailable (%s), using the epoll loop instead",
+                        twi->name, strerror(errno));
+        capsulator_epoll_loop(twi);
+        return;
+    }
+    if(!(held = malloc((twi->tunnel_bufs ? twi->tunnel_bufs->count : 1) * sizeof(*held))))
+        pdie("malloc (io_uring held buffers)");
+
+    capsulator_uring_post_tunnel(twi);
+    uring_prep_poll(capsulator_uring_sqe(twi), twi->event_fd, POLLIN, (uintptr_t)&twi->event_fd);
+
+    timeout = 0;
+    while(1) {
+        /* flush the border ports whose batch is due and sleep no longer than
+           until the next one is (one timeout at a time suffices, since every
+           batch may wait as long) */
+        min_ns = capsulator_loop_flush_due(twi);
+        if(twi->border_bufs) {
+            for(i=0; i<twi->bpcis_len; i++)
+                capsulator_uring_put_held(twi, twi->bpcis[i]);
+            uring_bufs_commit(twi->border_bufs);
+        }
+        if(twi->spin || twi->spinners)
+            min_ns = 0;
+        if(min_ns > 0 && !timeout) {
+            ts.tv_sec = min_ns / 1000000000L;
+            ts.tv_nsec = min_ns % 1000000000L;
+            uring_prep_timeout(capsulator_uring_sqe(twi), &ts, URING_DATA_TIMEOUT);
+            timeout = 1;
+        }
+
+        STAT_ADD(twi->stats, syscalls, 1);
+        rcu_offline(&twi->rcu);
+        if(uring_enter(&twi->rx, min_ns == 0 ? 0 : 1) < 0 && errno != EINTR
+           && errno != EAGAIN && errno != EBUSY)
+            verbose_println("%s: io_uring wait failed (%s)", twi->name, strerror(errno));
+        rcu_online(&twi->rcu);
+
+        mail = 0;
+        held_len = 0;
+        while((cqe = uring_cqe(&twi->rx))) {
+            data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            uring_cqe_seen(&twi->rx);
+
+            if(data == URING_DATA_TIMEOUT)
+                timeout = 0;
+            else if(data == (uintptr_t)&twi->event_fd)
+                mail = 1;
+            else if(data == (uintptr_t)twi)
+                capsulator_uring_tunnel(twi, res, flags, held, &held_len);
+            else if(data != URING_DATA_CANCEL)
+                capsulator_uring_border(twi, (border_port_control_info*)(uintptr_t)data,
+                                        res, flags);
+        }
+
+        /* the decapsulated frames live in the tunnel buffers, so they must
+           be written before the buffers are handed back */
+        capsulator_tunnel_flush(twi);
+        if(twi->tunnel_bufs) {
+            while(held_len)
+                uring_bufs_put(twi->tunnel_bufs, held[--held_len]);
+            uring_bufs_commit(twi->tunnel_bufs);
+            uring_bufs_commit(twi->border_bufs);
+        }
+
+        if(mail) {
+            capsulator_uring_mail(twi);
+            uring_prep_poll(capsulator_uring_sqe(twi), twi->event_fd, POLLIN,
+                            (uintptr_t)&twi->event_fd);
+        }
+        if(twi->unposted)
+            capsulator_uring_repost(twi);
+    }
+}
+
+/** Forwarding state of a capsulator_replay_create() */
+struct capsulator_replay {
+    capsulator* c;
+
+    /** queue 0 of every border port */
+    border_port_control_info** bpcis;
+
+    /** the tunnel port "thread", whose ingress receives nothing */
+    tunnel_worker_info twi;
+};
+
+capsulator_replay* capsulator_replay_create(capsulator* c, egress_sink tunnel_sink,
+                                            egress_sink border_sink, void* arg) {
+    capsulator_replay* r;
+    border_port* bp;
+    unsigned i;
+
+    if(!(r = calloc(1, sizeof(*r))) || !(r->bpcis = calloc(c->bp_len, sizeof(*r->bpcis))))
+        pdie("malloc (replay)");
+    r->c = c;
+
+    /* every port has a single queue, whose "fd" tells border_sink which
+       port a batch is for */
+    c->bp_cap = c->bp_len;
+    for(i=0; i<c->bp_len; i++) {
+        bp = &c->bp[i];
+        bp->queues = 1;
+        if(!(bp->queue_fds = calloc(1, sizeof(int))))
+            pdie("malloc (replay border port)");
+        bp->fd = bp->queue_fds[0] = i;
+        bp->stats = stats_alloc(1);
+        bp->ring = NULL;
+        bp->dest_ip = broadcast ? 0 : c->tp.tunnel_dest_ips[i];
+        bp->active = 1;
+    }
+    capsulator_learn_setup(c);
+    c->tags = tag_table_create(c->bp, c->bp_len);
+
+    for(i=0; i<c->bp_len; i++)
+        r->bpcis[i] = capsulator_border_port_info(c, i, 0, tunnel_sink, arg);
+
+    r->twi.c = c;
+    r->twi.fd = -1;
+    r->twi.cpu = -1;
+    snprintf(r->twi.name, sizeof(r->twi.name), "%s", c->tp.intf);
+    r->twi.stats = stats_alloc(1);
+    r->twi.in = ingress_create(c->bp, c->bp_len, c->batch,
+                               buf_pool_create(c->batch, c->buf_size), 0, r->twi.stats);
+    r->twi.in->sink = border_sink;
+    r->twi.in->sink_arg = arg;
+    if(c->frag)
+        r->twi.frags = frag_table_create(FRAG_DEFAULT_ENTRIES, c->buf_size, r->twi.stats);
+    return r;
+}
+
+void capsulator_replay_encap(capsulator_replay* r, unsigned i, char* data, unsigned len) {
+    capsulator_encap(r->bpcis[i], data, len);
+}
+
+void capsulator_replay_decap(capsulator_replay* r, char* pkt, unsigned len, uint32_t src) {
+    r->twi.in->addrs[0].sin_addr.s_addr = src;
+    capsulator_decap_packet(&r->twi, 0, pkt, len);
+}
+
+void capsulator_replay_flush(capsulator_replay* r) {
+    unsigned i;
+
+    for(i=0; i<r->c->bp_len; i++)
+        egress_flush(r->bpcis[i]->eg);
+    capsulator_tunnel_flush(&r->twi);
 }
@@ -12,9 +12,30 @@
 
 #include <net/if.h> /* IFNAMSIZ */
 
+#include "filter.h"
+#include "mac_table.h"
+#include "rcu.h"
+#include "rx_ring.h"
+#include "shaper.h"
+#include "stats.h"
+
 /** IP protocol ID of the capsulator */
 #define IPPROTO_CAPSULATOR 0xF5
 
+/** data path engines: a thread per border port queue next to the tunnel port
+    threads, every tunnel port thread running an epoll loop (or an io_uring
+    loop) which also serves a share of the border port queues, or a thread
+    moving frames through AF_XDP sockets (leaving only fragments to the tunnel
+    port threads) */
+#define CAPSULATOR_ENGINE_THREADS 0
+#define CAPSULATOR_ENGINE_EPOLL   1
+#define CAPSULATOR_ENGINE_XDP     2
+#define CAPSULATOR_ENGINE_URING   3
+
+/** number of border port slots with a configuration file: ports added while
+    running take a free one */
+#define CAPSULATOR_MAX_BORDER_PORTS 1024
+
 /**
  * Stores information about which port will be used for tunneling and who
  * packets will be tunneled to.
@@ -29,11 +50,37 @@ typedef struct tunnel_port {
     /** number of tunnel destination IPs */
     unsigned tunnel_dest_ips_len;
 
-    /** raw IP socket file descriptor attached to this port */
+    /** NBO IPv4 addresses of backups of the endpoints: backup_ips[i] takes
+        the frames to backup_of[i] while that does not answer its probes
+        (the backups of an endpoint listed in order of preference) */
+    uint32_t* backup_of;
+    uint32_t* backup_ips;
+    unsigned backups_len;
+
+    /** raw IP (or, in UDP mode, UDP) socket file descriptor attached to this
+        port */
     int fd;
 
     /** IP to use as the IP source address on outgoing packets */
     int ip;
+
+    /** MTU of the interface (at startup) */
+    unsigned mtu;
+
+    /** counters of each tunnel port thread */
+    port_stats* worker_stats;
+
+    /** socket each tunnel port thread receives from */
+    int* worker_fds;
+
+    /** counters of the AF_XDP engine's thread, or NULL without it */
+    port_stats* xdp_stats;
+
+    /** eBPF filter of the sockets above, its drop counters and the set of
+        tags it lets through (-1 if there is none) */
+    int filter;
+    int filter_counters;
+    int filter_tags;
 } tunnel_port;
 
 /**
@@ -54,6 +101,44 @@ typedef struct border_port {
 
     /** if virtual border port, set to 1, otherwise set to 0 */
     int vbp;
+
+    /** receive ring mapped onto fd, or NULL if frames are read() one by one */
+    rx_ring* ring;
+
+    /** file descriptors of the queues of a multi-queue tap device (queue 0 is
+        fd); physical ports and single-queue taps have just one */
+    int* queue_fds;
+    unsigned queues;
+
+    /** counters of the threads serving this port, one per queue */
+    port_stats* stats;
+
+    /** with MAC learning: the index of a border port with this port's tag
+        (the first at startup), which names the tag in the MAC table */
+    unsigned domain;
+
+    /** non-zero while the slot holds a port; set last when a port is added
+        and cleared first when it is removed */
+    int active;
+
+    /** if not broadcast, the NBO IPv4 address of the tunnel endpoint this
+        port's frames are sent to */
+    uint32_t dest_ip;
+
+    /** the controls of the threads (or epoll entries) serving each queue */
+    struct border_port_control_info** controls;
+
+    /** packets the kernel dropped before the port's packet socket could
+        queue them (accumulated by the stats thread) */
+    uint64_t kernel_drops;
+
+    /** non-zero if the threads serving this port poll without sleeping */
+    int spin;
+
+    /** eBPF filter of the port's packet socket and its drop counters (-1 if
+        there is none) */
+    int filter;
+    int filter_counters;
 } border_port;
 
 /**
@@ -65,8 +150,146 @@ typedef struct capsulator {
     /** array of border_port objects */
     border_port* bp;
 
-    /* length of the bp array */
+    /* length of the bp array: the slots which hold, or once held, a port */
     unsigned bp_len;
+
+    /** number of slots allocated in bp */
+    unsigned bp_cap;
+
+    /** which border ports terminate each tag, read by the tunnel port
+        threads and replaced when border ports are added or removed */
+    struct tag_table* tags;
+
+    /** file listing further border ports and tunnel endpoints, reread on
+        SIGHUP, or NULL; the first static_bp_len ports and
+        static_dests_len endpoints come from the command line and stay */
+    const char* config_path;
+    unsigned static_bp_len;
+    unsigned static_dests_len;
+    unsigned static_backups_len;
+
+    /** the threads which read tags, macs and the border ports without
+        locks */
+    rcu_domain rcu;
+
+    /** if non-zero, physical border ports receive through a TPACKET_V3 ring
+        instead of one read() per frame */
+    int rx_ring;
+
+    /** maximum number of frames sent to a tunnel endpoint or received from
+        the tunnel port per syscall */
+    unsigned batch;
+
+    /** maximum time (us) a frame may wait for its batch to fill */
+    unsigned flush_us;
+
+    /** size of the packet buffers (set from the ports' MTUs at startup) */
+    unsigned buf_size;
+
+    /** number of threads receiving from the tunnel port; with more than one,
+        tunnel packets are spread over them by a hash of their inner flow */
+    unsigned tunnel_workers;
+
+    /** the state of each of those threads */
+    struct tunnel_worker_info* workers;
+
+    /** CAPSULATOR_ENGINE_* running the data path */
+    int engine;
+
+    /** CPUs the tunnel port threads are pinned to, round-robin (if empty and
+        there are several threads, thread i is pinned to CPU i) */
+    int* tunnel_cpus;
+    unsigned tunnel_cpus_len;
+
+    /** CPUs the border port threads are pinned to, round-robin over the
+        queues of the ports (if empty, the scheduler places them) */
+    int* border_cpus;
+    unsigned border_cpus_len;
+
+    /** if non-zero, the SO_BUSY_POLL time (us) of the border and tunnel
+        port sockets: a receive polls the device queue this long before it
+        sleeps */
+    unsigned busy_poll_us;
+
+    /** comma-separated names of the ports (border or tunnel) whose threads
+        poll for packets without ever sleeping, "all", or NULL */
+    const char* spin;
+
+    /** file the counters are periodically written to, or NULL */
+    const char* stats_path;
+
+    /** interval (ms) between rewrites of stats_path */
+    unsigned stats_interval_ms;
+
+    /** number of queues (each with its own fd and thread) virtual border
+        ports are opened with */
+    unsigned tap_queues;
+
+    /** size of the virtio-net header carried in front of every frame, from
+        border port to border port through the tunnel, or 0 if none is */
+    unsigned vnet_hdr_len;
+
+    /** NBO UDP port tunnel packets are encapsulated in and received on, or 0
+        to send them as raw IP protocol IPPROTO_CAPSULATOR */
+    uint16_t udp_port;
+
+    /** number of UDP source ports frames to each destination are spread
+        over by the hash of their flow */
+    unsigned udp_sources;
+
+    /** if non-zero, eBPF socket filters drop in the kernel what the
+        forwarding threads would throw away; the border port filters also
+        drop frames sent out of the port and those allow does not allow */
+    int socket_filters;
+    filter_allow allow;
+
+    /** in UDP mode: if non-zero, consecutive frames to an endpoint are sent
+        as one UDP GSO message and the tunnel port's sockets receive
+        coalesced (UDP_GRO) packets, where the kernel supports it */
+    int udp_offload;
+
+    /** if non-zero, frames too big for the path MTU to an endpoint are sent
+        in fragments of the capsulator's own (tagged CAPSULATOR_TAG_FRAG)
+        rather than IP fragments, and the tunnel port threads reassemble
+        them */
+    int frag;
+
+    /** in raw IP mode: if non-zero, the border port threads write the outer
+        IPv4 header of every tunnel packet themselves (IP_HDRINCL), each from
+        a template of its endpoint, rather than the kernel */
+    int hdrincl;
+
+    /** if non-zero, the interval (ms) between the probes which measure
+        the round trip time and loss to every endpoint and backup, and fail
+        endpoints over to their backups; and the state of the thread which
+        sends them, or NULL */
+    unsigned keepalive_ms;
+    struct keepalive* keepalive;
+
+    /** if non-zero, border port queues hand their frames to a shaper thread,
+        which shares the tunnel uplink between the tags by deficit round
+        robin in rounds of shape_quantum bytes per tag and holds the tags in
+        shape_rates to their rate; up to shape_queue frames of each queue
+        wait for it */
+    int shape;
+    shaper_rate* shape_rates;
+    unsigned shape_rates_len;
+    unsigned shape_quantum;
+    unsigned shape_queue;
+
+    /** the shaper thread's state, if shaping */
+    shaper* shaper;
+
+    /** if non-zero, every tag is bridged: frames to a unicast MAC address
+        learned on the border side are not tunneled, and in broadcast mode
+        those to one learned behind a tunnel endpoint are sent only to it,
+        until it has not been seen for learn_age seconds */
+    int learn;
+    unsigned learn_age;
+
+    /** where the MAC addresses of every tag were learned, or NULL unless
+        learning; replaced when the tunnel endpoints change */
+    mac_table* macs;
 } capsulator;
 
 /**
@@ -77,4 +300,35 @@ typedef struct capsulator {
  */
 void capsulator_run(capsulator* c);
 
+/**
+ * Forwarding state which reads from and writes to no sockets, for benchmarks:
+ * queue 0 of every border port and one tunnel port thread, driven by hand.
+ */
+typedef struct capsulator_replay capsulator_replay;
+
+/**
+ * Sets up c (its border ports, tags and options, but none of its interfaces)
+ * for the capsulator_replay_*() functions.  Whatever would be sent to the
+ * tunnel endpoints is handed to tunnel_sink, and whatever would be written to
+ * a border port to border_sink, with the port's slot index as fd; both get
+ * arg.  c->buf_size must be set.  Dies on failure.
+ */
+capsulator_replay* capsulator_replay_create(capsulator* c, egress_sink tunnel_sink,
+                                            egress_sink border_sink, void* arg);
+
+/**
+ * Tunnels the frame of len bytes at data as if border port i had received it.
+ * A short frame from a tap is padded, so data must have room for that.
+ */
+void capsulator_replay_encap(capsulator_replay* r, unsigned i, char* data, unsigned len);
+
+/**
+ * Decapsulates the tunnel packet of len bytes at pkt (with its IP header
+ * unless in UDP mode) as if it had come from the NBO IPv4 address src.
+ */
+void capsulator_replay_decap(capsulator_replay* r, char* pkt, unsigned len, uint32_t src);
+
+/** Sends everything queued by either. */
+void capsulator_replay_flush(capsulator_replay* r);
+
 #endif /* _CAPSULATOR_H_ */
@@ -0,0 +1,142 @@
+/* Filename: config.c */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "config.h"
+
+/** longest line the file may have */
+#define CONFIG_MAX_LINE 4096
+
+/** appends the NBO IPv4 address in str to the array *ips of *len */
+static int config_add_ip(uint32_t** ips, unsigned* len, const char* str,
+                         char* err, size_t err_len) {
+    struct in_addr in_ip;
+    uint32_t* grown;
+
+    if(inet_aton(str, &in_ip) == 0) {
+        snprintf(err, err_len, "%s is not a valid IP address", str);
+        return -1;
+    }
+    if(!(grown = realloc(*ips, (*len + 1) * sizeof(*grown))))
+        pdie("realloc (config IPs)");
+    *ips = grown;
+    (*ips)[(*len)++] = in_ip.s_addr;
+    return 0;
+}
+
+/** adds the comma-separated IPs in list to cf, each followed by any backups
+    of it ('+'-separated) */
+static int config_add_dests(config* cf, char* list, char* err, size_t err_len) {
+    uint32_t* ips;
+    char *item, *ip, *save, *save_item;
+
+    for(item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if(!(ip = strtok_r(item, "+", &save_item))) {
+            snprintf(err, err_len, "%s is not a valid IP address", item);
+            return -1;
+        }
+        if(config_add_ip(&cf->dest_ips, &cf->dest_ips_len, ip, err, err_len) != 0)
+            return -1;
+        while((ip = strtok_r(NULL, "+", &save_item))) {
+            if(config_add_ip(&cf->backup_ips, &cf->backups_len, ip, err, err_len) != 0)
+                return -1;
+            if(!(ips = realloc(cf->backup_of, cf->backups_len * sizeof(*ips))))
+                pdie("realloc (config backups)");
+            cf->backup_of = ips;
+            cf->backup_of[cf->backups_len - 1] = cf->dest_ips[cf->dest_ips_len - 1];
+        }
+    }
+    return 0;
+}
+
+/** adds the border port INTF#TAG in arg to cf */
+static int config_add_port(config* cf, char* arg, int vbp, char* err, size_t err_len) {
+    config_port* ports;
+    char *sep, *end;
+    unsigned long tag;
+
+    if(!(sep = strchr(arg, '#')) || sep == arg) {
+        snprintf(err, err_len, "%s is not an interface and tag (INTF#TAG)", arg);
+        return -1;
+    }
+    *sep = '\0';
+    errno = 0;
+    tag = strtoul(sep + 1, &end, 10);
+    if(errno || *end || end == sep + 1 || tag > UINT32_MAX) {
+        snprintf(err, err_len, "%s is not a valid tag for %s", sep + 1, arg);
+        return -1;
+    }
+    if(strlen(arg) >= IF_NAMESIZE) {
+        snprintf(err, err_len, "interface name %s is too long", arg);
+        return -1;
+    }
+
+    if(!(ports = realloc(cf->ports, (cf->ports_len + 1) * sizeof(*ports))))
+        pdie("realloc (config border ports)");
+    cf->ports = ports;
+    memset(&cf->ports[cf->ports_len], 0, sizeof(*cf->ports));
+    strncpy(cf->ports[cf->ports_len].intf, arg, IF_NAMESIZE - 1);
+    cf->ports[cf->ports_len].tag = (uint32_t)tag;
+    cf->ports[cf->ports_len].vbp = vbp;
+    cf->ports_len += 1;
+    return 0;
+}
+
+int config_read(config* cf, const char* path, char* err, size_t err_len) {
+    char line[CONFIG_MAX_LINE], *opt, *arg, *save;
+    unsigned lineno;
+    FILE* fp;
+    int ret;
+
+    memset(cf, 0, sizeof(*cf));
+    if(!(fp = fopen(path, "r"))) {
+        snprintf(err, err_len, "unable to open %s (%s)", path, strerror(errno));
+        return -1;
+    }
+
+    ret = 0;
+    lineno = 0;
+    while(ret == 0 && fgets(line, sizeof(line), fp)) {
+        lineno += 1;
+        for(opt = strtok_r(line, " \t\r\n", &save); opt && opt[0] != '#';
+            opt = strtok_r(NULL, " \t\r\n", &save)) {
+            arg = strtok_r(NULL, " \t\r\n", &save);
+            if(!arg || arg[0] == '#') {
+                snprintf(err, err_len, "%s line %u: %s requires a value", path, lineno, opt);
+                ret = -1;
+                break;
+            }
+
+            if(str_matches(opt, 3, "-f", "-forward_to", "--forward_to"))
+                ret = config_add_dests(cf, arg, err, err_len);
+            else if(str_matches(opt, 3, "-b", "-border_intf", "--border_intf"))
+                ret = config_add_port(cf, arg, 0, err, err_len);
+            else if(str_matches(opt, 3, "-vb", "-virtual_border_intf", "--virtual_border_intf"))
+                ret = config_add_port(cf, arg, 1, err, err_len);
+            else {
+                snprintf(err, err_len, "%s line %u: %s is not a -f, -b or -vb option", path, lineno, opt);
+                ret = -1;
+            }
+            if(ret != 0)
+                break;
+        }
+    }
+    fclose(fp);
+
+    if(ret != 0)
+        config_free(cf);
+    return ret;
+}
+
+void config_free(config* cf) {
+    free(cf->ports);
+    free(cf->dest_ips);
+    free(cf->backup_of);
+    free(cf->backup_ips);
+    memset(cf, 0, sizeof(*cf));
+}
@@ -0,0 +1,54 @@
+/**
+ * Filename: config.h
+ * Purpose:  read the border ports and tunnel endpoints which may change while
+ *           the capsulator runs from a file
+ */
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <net/if.h> /* IFNAMSIZ */
+#include <stddef.h> /* size_t */
+
+/** A border port listed in the file. */
+typedef struct config_port {
+    char intf[IF_NAMESIZE];
+    uint32_t tag;
+
+    /** 1 for a virtual border port (-vb), 0 for a physical one (-b) */
+    int vbp;
+} config_port;
+
+/** The contents of the file. */
+typedef struct config {
+    config_port* ports;
+    unsigned ports_len;
+
+    /** NBO IPv4 addresses of the tunnel endpoints, in the order listed */
+    uint32_t* dest_ips;
+    unsigned dest_ips_len;
+
+    /** NBO IPv4 addresses of backups (-f A+B lists B as a backup of A) and
+        of the endpoints they are backups of, in the order listed */
+    uint32_t* backup_of;
+    uint32_t* backup_ips;
+    unsigned backups_len;
+} config;
+
+/**
+ * Reads path into cf.  The file holds the -f, -b and -vb options of the command
+ * line with their values (an -f item may name backups, as in A+B+C), separated
+ * by whitespace; '#' starts a comment unless it follows an interface name.
+ *
+ * @return 0 on success, or -1 with a description of the problem in err
+ */
+int config_read(config* cf, const char* path, char* err, size_t err_len);
+
+/** Frees what config_read() allocated. */
+void config_free(config* cf);
+
+#endif /* _CONFIG_H_ */
@@ -0,0 +1,38 @@
+/* Filename: csum.c */
+
+#include <string.h>
+
+#include "csum.h"
+
+uint32_t csum_partial(const void* data, unsigned len, uint32_t sum) {
+    const uint8_t* p;
+    uint64_t sum64;
+    uint32_t w32;
+    uint16_t w16;
+
+    /* a 32-bit word at a time into 64 bits, which cannot overflow */
+    p = data;
+    sum64 = sum;
+    for(; len >= 4; p += 4, len -= 4) {
+        memcpy(&w32, p, 4);
+        sum64 += w32;
+    }
+    if(len >= 2) {
+        memcpy(&w16, p, 2);
+        sum64 += w16;
+        p += 2;
+        len -= 2;
+    }
+
+    /* an odd byte is the first of a word padded with zero */
+    if(len) {
+        w16 = 0;
+        memcpy(&w16, p, 1);
+        sum64 += w16;
+    }
+
+    /* ones' complement addition carries around */
+    sum64 = (sum64 & 0xFFFFFFFF) + (sum64 >> 32);
+    sum64 = (sum64 & 0xFFFFFFFF) + (sum64 >> 32);
+    return (uint32_t)sum64;
+}
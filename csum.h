@@ -0,0 +1,41 @@
+/**
+ * Filename: csum.h
+ * Purpose:  the Internet (ones' complement) checksum and its incremental
+ *           update (RFC 1624)
+ */
+
+#ifndef _CSUM_H_
+#define _CSUM_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+/**
+ * Returns sum plus the ones' complement sum of the len bytes at data (any
+ * alignment), as 16-bit words in memory order, not yet folded to 16 bits.
+ */
+uint32_t csum_partial(const void* data, unsigned len, uint32_t sum);
+
+/** returns the checksum of a partial sum: folded to 16 bits and complemented */
+static inline uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/** returns the checksum of the len bytes at data */
+static inline uint16_t csum(const void* data, unsigned len) {
+    return csum_fold(csum_partial(data, len, 0));
+}
+
+/**
+ * Returns checksum check updated for a 16-bit word of the data it covers
+ * changing from old to new (RFC 1624, eqn. 3).  Both words are in the byte
+ * order they have in the data.
+ */
+static inline uint16_t csum_replace16(uint16_t check, uint16_t old, uint16_t new) {
+    return csum_fold((uint32_t)(uint16_t)~check + (uint16_t)~old + new);
+}
+
+#endif /* _CSUM_H_ */
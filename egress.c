@@ -0,0 +1,715 @@
+/* Filename: egress.c */
+
+#define _GNU_SOURCE /* sendmmsg */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "capsulator.h"
+#include "common.h"
+#include "csum.h"
+#include "egress.h"
+#include "filter.h"
+#include "frag.h"
+#include "log.h"
+#include "shaper.h"
+
+/* UDP GSO options newer than some C libraries' <netinet/udp.h> */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+/** size of the control buffer of a message */
+#define EGRESS_CTRL_LEN CMSG_SPACE(sizeof(uint16_t))
+
+/** TTL of the IP headers an egress writes itself (the kernel's default) */
+#define EGRESS_IP_TTL 64
+
+/** room for the header of a fragment */
+#define EGRESS_FRAG_HDR_LEN (EGRESS_MAX_HDR_LEN + sizeof(frag_info))
+
+/** numbers the fragmented frames of all egresses */
+static uint32_t egress_frag_ids = 0;
+
+/**
+ * returns a UDP socket bound to src_ip (and a port of the kernel's choosing)
+ * and, if dst is not NULL, connected to dst
+ */
+static int egress_open_udp_socket(uint32_t src_ip, struct sockaddr_in* dst) {
+    struct sockaddr_in addr;
+    int fd;
+
+    if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        pdie("tunnel port UDP socket");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = src_ip;
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        pdie("bind (tunnel port interface)");
+
+    if(dst && connect(fd, (struct sockaddr*)dst, sizeof(*dst)) != 0)
+        pdie("connect (tunnel destination)");
+
+    return fd;
+}
+
+/** returns a raw IP socket bound to src_ip and, if dst is not NULL, connected
+    to dst */
+static int egress_open_socket(uint32_t src_ip, struct sockaddr_in* dst) {
+    struct sockaddr_in addr;
+    int fd, val;
+
+    if((fd = socket(AF_INET, SOCK_RAW, IPPROTO_CAPSULATOR)) < 0)
+        pdie("tunnel port socket");
+
+    /* let the kernel build the IP header (so it handles fragmentation!) */
+    val = 0;
+    if(setsockopt(fd, IPPROTO_IP, IP_HDRINCL, &val, sizeof(val)) < 0)
+        pdie("ioctl (IP_HDRINCL)");
+
+    /* every raw socket for our protocol gets a copy of each incoming tunnel
+       packet, but only the tunnel port's socket reads them */
+    filter_drop_all(fd);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = src_ip;
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        pdie("bind (tunnel port interface)");
+
+    if(dst && connect(fd, (struct sockaddr*)dst, sizeof(*dst)) != 0)
+        pdie("connect (tunnel destination)");
+
+    return fd;
+}
+
+/** allocates an egress with batch slots from pool and no sockets */
+static egress* egress_alloc(unsigned batch, buf_pool* pool, port_stats* stats) {
+    egress* e;
+    unsigned i;
+
+    if(!(e = calloc(1, sizeof(*e))))
+        pdie("malloc (egress)");
+    e->batch = batch;
+    e->slot_size = pool->size;
+    e->pool = pool;
+    e->stats = stats;
+    if(!(e->slots = malloc(batch * sizeof(*e->slots))))
+        pdie("malloc (egress slots)");
+    for(i=0; i<batch; i++)
+        if(!(e->slots[i] = (char*)buf_pool_get(pool)))
+            die("buffer pool too small for a batch of %u frames", batch);
+    return e;
+}
+
+/** (re)allocates the batch of socket s of e, for e->room messages per endpoint */
+static void egress_alloc_batch(egress* e, egress_sock* s) {
+    unsigned j, msgs;
+
+    free(s->msgs);
+    free(s->iovs);
+    free(s->segs);
+    free(s->ctrls);
+    free(s->frag_hdrs);
+    free(s->ip_hdrs);
+    free(s->trains);
+
+    msgs = e->room * e->dests_len;
+    s->msgs = calloc(msgs, sizeof(*s->msgs));
+    s->iovs = calloc(e->msg_iovs * msgs, sizeof(*s->iovs));
+    s->segs = calloc(msgs, sizeof(*s->segs));
+    s->ctrls = calloc(msgs, EGRESS_CTRL_LEN);
+    s->frag_hdrs = e->pmtus ? calloc(e->msg_iovs * msgs, EGRESS_FRAG_HDR_LEN) : NULL;
+    s->ip_hdrs = e->ip_tmpls ? calloc(msgs, sizeof(*s->ip_hdrs)) : NULL;
+    s->trains = calloc(e->dests_len, sizeof(*s->trains));
+    if(!s->msgs || !s->iovs || !s->segs || !s->ctrls || !s->trains
+       || (e->pmtus && !s->frag_hdrs) || (e->ip_tmpls && !s->ip_hdrs))
+        pdie("malloc (egress batch)");
+    for(j=0; j<msgs; j++)
+        s->msgs[j].msg_hdr.msg_namelen = s->addr ? 0 : sizeof(struct sockaddr_in);
+    for(j=0; j<e->dests_len; j++)
+        s->trains[j].msg = -1;
+}
+
+/** egress_create() or, if sink is not NULL, egress_create_sink() */
+static egress* egress_build(uint32_t src_ip, uint32_t* dest_ips, unsigned dest_ips_len,
+                            const void* hdr, unsigned hdr_len,
+                            uint16_t udp_port, unsigned sources, unsigned gso_max,
+                            unsigned batch, unsigned flush_us, buf_pool* pool,
+                            port_stats* stats, egress_sink sink, void* arg) {
+    struct sockaddr_in* dst;
+    egress_sock* s;
+    egress* e;
+    unsigned i;
+    int zero;
+
+    if(hdr_len > EGRESS_MAX_HDR_LEN || hdr_len > BUF_POOL_HEADROOM)
+        die("tunneling header of %uB is too long", hdr_len);
+    if(batch == 0)
+        batch = 1;
+    if(udp_port == 0 || sources == 0)
+        sources = 1;
+    if(udp_port == 0)
+        gso_max = 0;
+
+    e = egress_alloc(batch, pool, stats);
+    memcpy(e->hdr, hdr, hdr_len);
+    e->hdr_len = hdr_len;
+    e->gso_max = gso_max;
+    e->flush_ns = (long)flush_us * 1000;
+    e->room = batch;
+    e->msg_iovs = 2;
+    e->sink = sink;
+    e->sink_arg = arg;
+
+    e->dests_len = dest_ips_len;
+    e->sources = sources;
+    e->dests = calloc(dest_ips_len, sizeof(*e->dests));
+    e->socks = calloc(sources, sizeof(*e->socks));
+    if(!e->dests || !e->socks)
+        pdie("malloc (egress destinations)");
+    for(i=0; i<dest_ips_len; i++) {
+        e->dests[i].sin_family = AF_INET;
+        e->dests[i].sin_addr.s_addr = dest_ips[i];
+        e->dests[i].sin_port = udp_port;
+    }
+
+    /* a lone endpoint gets connected sockets (which need no route lookup per
+       frame); several share unconnected ones, a batch holding every frame
+       once per endpoint */
+    dst = (dest_ips_len == 1) ? &e->dests[0] : NULL;
+    for(i=0; i<sources; i++) {
+        s = &e->socks[i];
+        s->addr = dst;
+        if(sink)
+            s->fd = -1;
+        else if(udp_port)
+            s->fd = egress_open_udp_socket(src_ip, dst);
+        else
+            s->fd = egress_open_socket(src_ip, dst);
+
+        /* a kernel without UDP GSO refuses the option */
+        zero = 0;
+        if(e->gso_max && !sink && setsockopt(s->fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) < 0) {
+            verbose_println("Warning: the kernel does not support UDP GSO (%s)", strerror(errno));
+            e->gso_max = 0;
+        }
+
+        egress_alloc_batch(e, s);
+    }
+
+    return e;
+}
+
+egress* egress_create(uint32_t src_ip, uint32_t* dest_ips, unsigned dest_ips_len,
+                      const void* hdr, unsigned hdr_len,
+                      uint16_t udp_port, unsigned sources, unsigned gso_max,
+                      unsigned batch, unsigned flush_us, buf_pool* pool,
+                      port_stats* stats) {
+    return egress_build(src_ip, dest_ips, dest_ips_len, hdr, hdr_len, udp_port,
+                        sources, gso_max, batch, flush_us, pool, stats, NULL, NULL);
+}
+
+egress* egress_create_sink(uint32_t* dest_ips, unsigned dest_ips_len,
+                           const void* hdr, unsigned hdr_len,
+                           uint16_t udp_port, unsigned sources, unsigned gso_max,
+                           unsigned batch, unsigned flush_us, buf_pool* pool,
+                           port_stats* stats, egress_sink sink, void* arg) {
+    return egress_build(0, dest_ips, dest_ips_len, hdr, hdr_len, udp_port,
+                        sources, gso_max, batch, flush_us, pool, stats, sink, arg);
+}
+
+/** returns the path MTU to dst the kernel knows, or 0 if it has no route */
+static unsigned egress_path_mtu(const struct sockaddr_in* dst) {
+    struct sockaddr_in addr;
+    socklen_t len;
+    int fd, mtu;
+
+    /* only a connected socket tells, and connecting a datagram socket sends
+       nothing */
+    if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return 0;
+    addr = *dst;
+    if(!addr.sin_port)
+        addr.sin_port = htons(9); /* discard */
+    len = sizeof(mtu);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+       || getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0)
+        mtu = 0;
+    close(fd);
+    return (mtu > 0) ? (unsigned)mtu : 0;
+}
+
+/** returns the bytes of IP (and UDP) header in front of the tunneling header
+    of packets to endpoint i */
+static unsigned egress_overhead(egress* e, unsigned i) {
+    return sizeof(struct iphdr) + (e->dests[i].sin_port ? sizeof(struct udphdr) : 0);
+}
+
+/** looks the path MTUs to the endpoints of e up again (a sink has no path) */
+static void egress_check_pmtus(egress* e) {
+    unsigned i, mtu;
+
+    clock_gettime(CLOCK_MONOTONIC, &e->pmtu_checked);
+    for(i=0; !e->sink && i<e->dests_len; i++)
+        if((mtu = egress_path_mtu(&e->dests[i])) > egress_overhead(e, i))
+            e->pmtus[i] = mtu - egress_overhead(e, i);
+}
+
+void egress_fragment(egress* e, const void* frag_hdr, unsigned mtu) {
+    unsigned i;
+    int val;
+
+    if(!(e->pmtus = malloc(e->dests_len * sizeof(*e->pmtus))))
+        pdie("malloc (egress path MTUs)");
+    memcpy(e->frag_hdr, frag_hdr, e->hdr_len);
+    for(i=0; i<e->dests_len; i++)
+        e->pmtus[i] = mtu - egress_overhead(e, i);
+    egress_check_pmtus(e);
+
+    /* a batch has room for the fragments of a frame, and the kernel must
+       refuse (rather than fragment) a packet which exceeds the path MTU */
+    e->room = e->batch + FRAG_MAX_COUNT;
+    val = IP_PMTUDISC_DO;
+    for(i=0; i<e->sources; i++) {
+        if(e->socks[i].fd >= 0 &&
+           setsockopt(e->socks[i].fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val)) < 0)
+            pdie("setsockopt (IP_MTU_DISCOVER)");
+        egress_alloc_batch(e, &e->socks[i]);
+    }
+}
+
+void egress_raw_headers(egress* e, uint32_t src_ip) {
+    struct iphdr* ip;
+    unsigned i;
+    int one;
+
+    if(!(e->ip_tmpls = calloc(e->dests_len, sizeof(*e->ip_tmpls))))
+        pdie("malloc (egress IP headers)");
+    for(i=0; i<e->dests_len; i++) {
+        ip = &e->ip_tmpls[i];
+        ip->version = 4;
+        ip->ihl = sizeof(*ip) / 4;
+        ip->frag_off = htons(IP_DF);
+        ip->ttl = EGRESS_IP_TTL;
+        ip->protocol = IPPROTO_CAPSULATOR;
+        ip->saddr = src_ip;
+        ip->daddr = e->dests[i].sin_addr.s_addr;
+        ip->check = csum(ip, sizeof(*ip));
+    }
+
+    /* every message starts with its own copy */
+    e->msg_iovs = 3;
+    one = 1;
+    for(i=0; i<e->sources; i++) {
+        if(e->socks[i].fd >= 0 &&
+           setsockopt(e->socks[i].fd, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one)) < 0)
+            pdie("setsockopt (IP_HDRINCL)");
+        egress_alloc_batch(e, &e->socks[i]);
+    }
+}
+
+void egress_follow(egress* e, uint32_t* const* follows) {
+    if(!(e->follows = malloc(e->dests_len * sizeof(*e->follows))))
+        pdie("malloc (egress endpoints)");
+    memcpy(e->follows, follows, e->dests_len * sizeof(*e->follows));
+}
+
+egress* egress_create_shaped(struct shaper_ring* ring, unsigned sources,
+                             unsigned batch, buf_pool* pool, port_stats* stats) {
+    egress* e;
+
+    e = egress_alloc(batch ? batch : 1, pool, stats);
+    e->sources = sources;
+    e->ring = ring;
+    return e;
+}
+
+char* egress_slot(egress* e) {
+    char* slot;
+
+    /* with the ring full, the frame is read into a slot only to be dropped */
+    if(e->ring && (slot = shaper_ring_slot(e->ring)))
+        return slot;
+    return e->slots[e->queued];
+}
+
+void egress_queue(egress* e, char* data, unsigned len, uint32_t hash) {
+    egress_queue_dest(e, EGRESS_ALL_DESTS, data, len, hash);
+}
+
+/**
+ * Starts message m, the next of socket s, with the IP header of a packet of seg
+ * bytes (behind it) to endpoint i: a copy of the endpoint's template with the
+ * packet's length and number, and the checksum updated for those alone.
+ */
+static void egress_ip_hdr(egress* e, egress_sock* s, unsigned i, struct msghdr* m,
+                          unsigned seg) {
+    struct iphdr* ip;
+
+    ip = &s->ip_hdrs[s->pending];
+    *ip = e->ip_tmpls[i];
+    ip->tot_len = htons(sizeof(*ip) + seg);
+    ip->id = htons(e->ip_id++);
+    ip->check = csum_replace16(csum_replace16(ip->check, 0, ip->tot_len), 0, ip->id);
+
+    m->msg_iov[0].iov_base = ip;
+    m->msg_iov[0].iov_len = sizeof(*ip);
+    m->msg_iovlen = 1;
+    s->trains[i].iov_next += 1;
+}
+
+/**
+ * Returns the message of socket s the next frame (of seg bytes with its header)
+ * to endpoint i goes into: the endpoint's train, if the frame may join it as a
+ * UDP GSO segment, else a new one.
+ */
+static struct msghdr* egress_msg(egress* e, egress_sock* s, unsigned i, unsigned seg) {
+    struct cmsghdr* cm;
+    struct msghdr* m;
+    egress_train* t;
+    uint16_t gso_size;
+
+    /* segments after the first may be no longer, and one shorter ends the
+       train (the kernel cuts all but the last to the first's size) */
+    t = &s->trains[i];
+    if(t->msg >= 0 && seg <= t->seg && s->segs[t->msg] < EGRESS_GSO_MAX_SEGS
+       && t->bytes + seg <= EGRESS_GSO_MAX_BYTES) {
+        m = &s->msgs[t->msg].msg_hdr;
+        if(s->segs[t->msg]++ == 1) {
+            m->msg_control = s->ctrls + (size_t)t->msg * EGRESS_CTRL_LEN;
+            m->msg_controllen = EGRESS_CTRL_LEN;
+            cm = CMSG_FIRSTHDR(m);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(gso_size));
+            gso_size = t->seg;
+            memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+        }
+        t->bytes += seg;
+        if(seg < t->seg)
+            t->msg = -1;
+        return m;
+    }
+
+    m = &s->msgs[s->pending].msg_hdr;
+    if(!s->addr)
+        m->msg_name = &e->dests[i];
+    m->msg_iov = &s->iovs[e->msg_iovs * e->room * i + t->iov_next];
+    m->msg_iovlen = 0;
+    m->msg_control = NULL;
+    m->msg_controllen = 0;
+    s->segs[s->pending] = 1;
+    if(e->ip_tmpls)
+        egress_ip_hdr(e, s, i, m, seg);
+
+    t->msg = (seg <= e->gso_max) ? (int)s->pending : -1;
+    t->seg = seg;
+    t->bytes = seg;
+    s->pending += 1;
+    return m;
+}
+
+/**
+ * Returns the number of packets a frame of len bytes to endpoint i takes: 1,
+ * its number of fragments if it exceeds the path MTU, or 0 if it needs too
+ * many.
+ */
+static unsigned egress_packets(egress* e, unsigned i, unsigned len) {
+    if(!e->pmtus || e->hdr_len + len <= e->pmtus[i])
+        return 1;
+    if(e->pmtus[i] <= e->hdr_len + sizeof(frag_info))
+        return 0;
+    return frag_count(len, e->pmtus[i] - e->hdr_len - sizeof(frag_info));
+}
+
+/** returns non-zero if socket s has room for need more messages to each of
+    endpoints first to last (exclusive) */
+static int egress_fits(egress* e, egress_sock* s, unsigned first, unsigned last,
+                       unsigned need) {
+    unsigned i;
+
+    if(s->pending + need * (last - first) > e->room * e->dests_len)
+        return 0;
+    for(i=first; i<last; i++)
+        if(s->trains[i].iov_next + e->msg_iovs * need > e->msg_iovs * e->room)
+            return 0;
+    return 1;
+}
+
+/**
+ * Queues the frame of len bytes at data for endpoint i on socket s, split into
+ * about count fragments of equal size which are numbered id.
+ */
+static void egress_queue_frags(egress* e, egress_sock* s, unsigned i,
+                               char* data, unsigned len, unsigned count, uint32_t id) {
+    struct msghdr* m;
+    struct iovec* iov;
+    frag_info fi;
+    unsigned k, seg, off, n;
+    char* fh;
+
+    seg = (len + count - 1) / count;
+    fi.id = id;
+    fi.count = (len + seg - 1) / seg;
+    for(k=0, off=0; off<len; k++, off+=n) {
+        n = (len - off < seg) ? len - off : seg;
+        m = egress_msg(e, s, i, e->hdr_len + sizeof(fi) + n);
+        iov = m->msg_iov + m->msg_iovlen;
+
+        fi.offset = htons(off);
+        fi.index = k;
+        fh = s->frag_hdrs + (size_t)(iov - s->iovs) * EGRESS_FRAG_HDR_LEN;
+        memcpy(fh, e->frag_hdr, e->hdr_len);
+        memcpy(fh + e->hdr_len, &fi, sizeof(fi));
+        iov[0].iov_base = fh;
+        iov[0].iov_len = e->hdr_len + sizeof(fi);
+        iov[1].iov_base = data + off;
+        iov[1].iov_len = n;
+        m->msg_iovlen += 2;
+        s->trains[i].iov_next += 2;
+    }
+    STAT_ADD(e->stats, tx_fragments, fi.count);
+}
+
+void egress_queue_dest(egress* e, int dest, char* data, unsigned len, uint32_t hash) {
+    struct msghdr* m;
+    struct iovec* iov;
+    egress_sock* s;
+    unsigned i, first, last, need, n;
+    uint32_t id;
+    char* slot;
+    int in_slot;
+
+    if(e->ring) {
+        if(shaper_ring_push(e->ring, dest, data, len, hash) < 0)
+            STAT_ADD(e->stats, drop_shaper, 1);
+        return;
+    }
+
+    first = (dest == EGRESS_ALL_DESTS) ? 0 : (unsigned)dest;
+    last = (dest == EGRESS_ALL_DESTS) ? e->dests_len : first + 1;
+    s = &e->socks[hash % e->sources];
+    in_slot = (data == e->slots[e->queued]);
+
+    /* the fragments of a frame each take a message, so the batch goes first
+       if they may not fit; a frame in its slot moves to the first one, which
+       is the next frame's slot no more */
+    need = 1;
+    for(i=first; e->pmtus && i<last; i++)
+        if((n = egress_packets(e, i, len)) > need)
+            need = n;
+    if(e->pmtus && e->queued && !egress_fits(e, s, first, last, need)) {
+        if(in_slot) {
+            slot = e->slots[0];
+            e->slots[0] = e->slots[e->queued];
+            e->slots[e->queued] = slot;
+        }
+        egress_flush(e);
+    }
+    id = (need > 1) ? htonl(__atomic_fetch_add(&egress_frag_ids, 1, __ATOMIC_RELAXED)) : 0;
+
+    if(e->queued == 0)
+        clock_gettime(CLOCK_MONOTONIC, &e->first);
+
+    /* a frame in its slot gets the header in its headroom; others (in a
+       receive ring, say) are sent behind the header's own iovec */
+    if(in_slot)
+        memcpy(data - e->hdr_len, e->hdr, e->hdr_len);
+
+    /* every endpoint has its own share of the iovecs, so the frames of a
+       train are contiguous */
+    for(i=first; i<last; i++) {
+        if(need > 1 && (n = egress_packets(e, i, len)) != 1) {
+            if(n)
+                egress_queue_frags(e, s, i, data, len, n, id);
+            else
+                STAT_ADD(e->stats, drop_frag, 1);
+            continue;
+        }
+
+        m = egress_msg(e, s, i, e->hdr_len + len);
+        iov = m->msg_iov + m->msg_iovlen;
+        if(in_slot) {
+            iov[0].iov_base = data - e->hdr_len;
+            iov[0].iov_len = e->hdr_len + len;
+            m->msg_iovlen += 1;
+            s->trains[i].iov_next += 1;
+        }
+        else {
+            iov[0].iov_base = e->hdr;
+            iov[0].iov_len = e->hdr_len;
+            iov[1].iov_base = data;
+            iov[1].iov_len = len;
+            m->msg_iovlen += 2;
+            s->trains[i].iov_next += 2;
+        }
+    }
+    e->queued += 1;
+
+    if(e->queued >= e->batch || egress_wait_ns(e) == 0)
+        egress_flush(e);
+}
+
+/** sends the pending batch of socket s */
+static void egress_flush_sock(egress* e, egress_sock* s) {
+    struct sockaddr_in* dst;
+    unsigned i, sent;
+    int n;
+
+    sent = 0;
+    while(sent < s->pending) {
+        if(e->sink)
+            n = e->sink(e->sink_arg, s->fd, s->msgs + sent, s->pending - sent);
+        else
+            n = sendmmsg(s->fd, s->msgs + sent, s->pending - sent, 0);
+        STAT_ADD(e->stats, syscalls, 1);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+
+            /* skip the message the kernel refused and carry on with the rest;
+               a device which cannot checksum a GSO message refuses it with EIO,
+               so frames are sent one by one from then on */
+            dst = s->addr ? s->addr : s->msgs[sent].msg_hdr.msg_name;
+            log_dp(LOG_ERROR, &e->log, inet_ntoa(dst->sin_addr), errno,
+                   "Error: forwarding data to this tunnel endpoint failed");
+            if(errno == EIO && s->segs[sent] > 1)
+                e->gso_max = 0;
+
+            /* a path MTU dropped: fragment to fit it from now on */
+            if(errno == EMSGSIZE && e->pmtus)
+                egress_check_pmtus(e);
+            STAT_ADD(e->stats, drop_write, s->segs[sent]);
+            sent += 1;
+            continue;
+        }
+
+        for(i=sent; i<sent+n; i++) {
+            if(s->segs[i] > 1)
+                STAT_ADD(e->stats, tx_coalesced, 1);
+            STAT_ADD(e->stats, tx_packets, s->segs[i]);
+            STAT_ADD(e->stats, tx_bytes, s->msgs[i].msg_len);
+        }
+        sent += n;
+    }
+    s->pending = 0;
+    for(i=0; i<e->dests_len; i++) {
+        s->trains[i].msg = -1;
+        s->trains[i].iov_next = 0;
+    }
+}
+
+/** changes the destination of IP header h to the NBO address ip, updating
+    its checksum for the two 16-bit words which change */
+static void egress_set_daddr(struct iphdr* h, uint32_t ip) {
+    uint16_t old[2], new[2];
+
+    memcpy(old, &h->daddr, sizeof(old));
+    memcpy(new, &ip, sizeof(new));
+    h->daddr = ip;
+    h->check = csum_replace16(csum_replace16(h->check, old[0], new[0]), old[1], new[1]);
+}
+
+/** points endpoint i of e at the NBO address ip: its sockets, IP headers
+    (those of queued packets too) and path MTU */
+static void egress_move(egress* e, unsigned i, uint32_t ip) {
+    egress_sock* s;
+    unsigned j, k, mtu;
+    socklen_t len;
+    int err;
+
+    e->dests[i].sin_addr.s_addr = ip;
+    for(j=0; j<e->sources; j++) {
+        s = &e->socks[j];
+
+        /* an error the old address left behind (its ICMP unreachable, say)
+           would fail the first send to the new one */
+        if(s->addr == &e->dests[i] && s->fd >= 0) {
+            if(connect(s->fd, (struct sockaddr*)&e->dests[i], sizeof(e->dests[i])) != 0)
+                log_dp(LOG_ERROR, &e->log, inet_ntoa(e->dests[i].sin_addr), errno,
+                       "Error: connect (tunnel destination) failed");
+            len = sizeof(err);
+            getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        }
+        for(k=0; e->ip_tmpls && k<s->pending; k++)
+            if((s->addr ? s->addr : s->msgs[k].msg_hdr.msg_name) == &e->dests[i])
+                egress_set_daddr(&s->ip_hdrs[k], ip);
+    }
+
+    if(e->ip_tmpls)
+        egress_set_daddr(&e->ip_tmpls[i], ip);
+    if(e->pmtus && !e->sink && (mtu = egress_path_mtu(&e->dests[i])) > egress_overhead(e, i))
+        e->pmtus[i] = mtu - egress_overhead(e, i);
+}
+
+void egress_flush(egress* e) {
+    uint32_t ip;
+    unsigned i;
+
+    if(e->queued == 0)
+        return;
+
+    /* an endpoint which moved takes this batch at its new address */
+    for(i=0; e->follows && i<e->dests_len; i++)
+        if(e->follows[i] &&
+           (ip = __atomic_load_n(e->follows[i], __ATOMIC_ACQUIRE)) != e->dests[i].sin_addr.s_addr)
+            egress_move(e, i, ip);
+
+    for(i=0; i<e->sources; i++)
+        if(e->socks[i].pending)
+            egress_flush_sock(e, &e->socks[i]);
+    e->queued = 0;
+
+    /* a path MTU may also have risen again */
+    if(e->pmtus && e->first.tv_sec - e->pmtu_checked.tv_sec >= EGRESS_PMTU_CHECK_S)
+        egress_check_pmtus(e);
+}
+
+long egress_wait_ns(egress* e) {
+    struct timespec now;
+    long waited;
+
+    if(e->queued == 0)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    waited = (now.tv_sec - e->first.tv_sec) * 1000000000L
+           + (now.tv_nsec - e->first.tv_nsec);
+    return (waited >= e->flush_ns) ? 0 : e->flush_ns - waited;
+}
+
+void egress_destroy(egress* e) {
+    egress_sock* s;
+    unsigned i;
+
+    for(i=0; e->socks && i<e->sources; i++) {
+        s = &e->socks[i];
+        if(s->fd >= 0)
+            close(s->fd);
+        free(s->msgs);
+        free(s->iovs);
+        free(s->segs);
+        free(s->ctrls);
+        free(s->frag_hdrs);
+        free(s->ip_hdrs);
+        free(s->trains);
+    }
+    free(e->socks);
+    free(e->dests);
+    free(e->pmtus);
+    free(e->ip_tmpls);
+    free(e->follows);
+    free(e->slots);
+    free(e);
+}
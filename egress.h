@@ -0,0 +1,298 @@
+/**
+ * Filename: egress.h
+ * Purpose:  batch encapsulated frames and send them to the tunnel endpoints
+ *           with one sendmmsg() per destination
+ */
+
+#ifndef _EGRESS_H_
+#define _EGRESS_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <netinet/in.h> /* struct sockaddr_in */
+#include <sys/socket.h> /* struct mmsghdr */
+#include <sys/uio.h>    /* struct iovec */
+#include <time.h>       /* struct timespec */
+
+#include "buf_pool.h"
+#include "log.h"
+#include "stats.h"
+
+/** default number of frames collected before a batch is flushed */
+#define EGRESS_DEFAULT_BATCH 32
+
+/** default time (us) a queued frame may wait for its batch to fill */
+#define EGRESS_DEFAULT_FLUSH_US 100
+
+/** default number of UDP source ports per destination in UDP mode */
+#define EGRESS_DEFAULT_UDP_SOURCES 16
+
+/** maximum size of the tunneling header prepended to every frame */
+#define EGRESS_MAX_HDR_LEN 16
+
+/** most segments and bytes of UDP payload the kernel takes in one UDP GSO
+    (UDP_SEGMENT) send */
+#define EGRESS_GSO_MAX_SEGS  64
+#define EGRESS_GSO_MAX_BYTES (0xFFFF - 20 - 8)
+
+/** interval (s) between lookups of the path MTUs of a fragmenting egress */
+#define EGRESS_PMTU_CHECK_S 10
+
+/**
+ * The message of a socket's batch the frames to one endpoint are appended to
+ * as UDP GSO segments while they are no longer than its first.
+ */
+typedef struct egress_train {
+    /** index of the message, or -1 if the next frame starts a new one */
+    int msg;
+
+    /** size of its segments and of all of them together */
+    unsigned seg;
+    unsigned bytes;
+
+    /** next unused iovec of the endpoint's share of the socket's iovecs */
+    unsigned iov_next;
+} egress_train;
+
+/**
+ * A socket frames leave through, with its pending batch.  Towards a single
+ * tunnel endpoint the socket is connected to it.  Towards several, one
+ * unconnected socket serves them all and every message names its endpoint, so
+ * a frame is replicated to all of them by one sendmmsg() which shares its
+ * iovecs (rather than one syscall per endpoint).
+ */
+typedef struct egress_sock {
+    /** raw IP or UDP socket */
+    int fd;
+
+    /** the endpoint the socket is connected to, or NULL if unconnected */
+    struct sockaddr_in* addr;
+
+    /** one message per queued frame and endpoint, or with UDP GSO per train
+        of frames to an endpoint; each frame takes the header and frame
+        iovecs (or one iovec, if its header is in its headroom) from the
+        endpoint's share of iovs, behind the iovec of its IP header if the
+        egress writes those */
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+
+    /** per message: the frames (segments) it carries and its control
+        buffer, which holds the segment size of a UDP GSO message */
+    unsigned* segs;
+    char* ctrls;
+
+    /** per iovec, if fragmenting: the header of the fragment behind it */
+    char* frag_hdrs;
+
+    /** per message, if the egress writes IP headers: the message's */
+    struct iphdr* ip_hdrs;
+
+    /** per endpoint: the train frames to it are appended to */
+    egress_train* trains;
+
+    /** number of messages waiting in msgs */
+    unsigned pending;
+} egress_sock;
+
+struct shaper_ring;
+
+/**
+ * Stands in for sendmmsg(fd, msgs, len, 0) where a benchmark takes the batches
+ * of an egress (or ingress) rather than the kernel.  It must set msg_len of
+ * the messages it takes and return their number.
+ */
+typedef int (*egress_sink)(void* arg, int fd, struct mmsghdr* msgs, unsigned len);
+
+/** egress_queue_dest() destination meaning every endpoint */
+#define EGRESS_ALL_DESTS (-1)
+
+/**
+ * Egress state of one border port thread.  Not thread-safe: each border port
+ * thread owns its own instance.  A shaped instance has no sockets: it hands
+ * frames to the shaper thread, which sends them through an egress of its own.
+ */
+typedef struct egress {
+    /** the tunnel endpoints frames are sent to */
+    struct sockaddr_in* dests;
+    unsigned dests_len;
+
+    /** the sockets frames leave through: with one endpoint, one per source;
+        with several, socket s serves source s of all of them */
+    egress_sock* socks;
+    unsigned sources;
+
+    /** tunneling header sent in front of every frame */
+    char hdr[EGRESS_MAX_HDR_LEN];
+    unsigned hdr_len;
+
+    /** largest frame and header sent as a UDP GSO segment, or 0 to send
+        every frame in a message of its own */
+    unsigned gso_max;
+
+    /** maximum number of frames per batch and maximum wait (ns) for one */
+    unsigned batch;
+    long flush_ns;
+
+    /** messages per endpoint a batch may take (batch, and room for
+        FRAG_MAX_COUNT fragments more if fragmenting), and iovecs per message
+        (2, and one more for the IP header if the egress writes those) */
+    unsigned room;
+    unsigned msg_iovs;
+
+    /** if not NULL, the IP_HDRINCL sockets send the outer IPv4 header of
+        each packet from per message copies of the template of its endpoint,
+        whose checksum is that of a tot_len and id of 0; only those two and
+        the checksum change per packet, numbered by ip_id */
+    struct iphdr* ip_tmpls;
+    uint16_t ip_id;
+
+    /** if not NULL, per endpoint: the NBO address it has moved to, which
+        another thread updates (NULL for one which stays put) */
+    uint32_t** follows;
+
+    /** if not NULL, per endpoint: the most bytes of tunneling header and
+        frame one packet to it may carry (from its path MTU), beyond which
+        frames are split into fragments with frag_hdr in front; and when the
+        path MTUs were last looked up */
+    unsigned* pmtus;
+    char frag_hdr[EGRESS_MAX_HDR_LEN];
+    struct timespec pmtu_checked;
+
+    /** batch slots callers may read frames into (batch buffers of slot_size
+        bytes from the owning thread's pool); the tunneling header is written
+        into their headroom, so a frame read into one is sent as a single
+        iovec */
+    char** slots;
+    unsigned slot_size;
+    buf_pool* pool;
+
+    /** frames queued since the last flush and when the first of them was */
+    unsigned queued;
+    struct timespec first;
+
+    /** counters of the owning border port thread, and how much it logs
+        about this egress */
+    port_stats* stats;
+    log_limit log;
+
+    /** if not NULL, the ring frames are queued to instead (they are never
+        held here, so there is nothing to flush) */
+    struct shaper_ring* ring;
+
+    /** if not NULL, batches are handed to sink (with sink_arg) instead of
+        sockets, which there are none of */
+    egress_sink sink;
+    void* sink_arg;
+} egress;
+
+/**
+ * Creates the egress state for a border port: sockets bound to src_ip and
+ * connected to the destination or, if there are several, shared by all of them.
+ * Dies on failure.
+ *
+ * @param hdr        tunneling header to prepend to every frame
+ * @param udp_port   NBO UDP port to encapsulate in, or 0 for raw IP protocol
+ *                   IPPROTO_CAPSULATOR
+ * @param sources    in UDP mode, the number of sockets (each with its own
+ *                   source port) frames to a destination are spread over by
+ *                   their flow hash, so that the receiver's NIC (RSS) and the
+ *                   routers between (ECMP) can spread them too
+ * @param gso_max    in UDP mode, the largest UDP payload (tunneling header and
+ *                   frame) which fits the tunnel port's MTU; consecutive frames
+ *                   to an endpoint are then handed to the kernel as one UDP GSO
+ *                   message, if it supports that.  0 disables GSO.
+ * @param batch      maximum number of frames per sendmmsg()
+ * @param flush_us   maximum time a frame may wait for its batch to fill
+ * @param pool       pool the buffers returned by egress_slot() are taken from
+ * @param stats      counters the sends are accounted to
+ */
+egress* egress_create(uint32_t src_ip, uint32_t* dest_ips, unsigned dest_ips_len,
+                      const void* hdr, unsigned hdr_len,
+                      uint16_t udp_port, unsigned sources, unsigned gso_max,
+                      unsigned batch, unsigned flush_us, buf_pool* pool,
+                      port_stats* stats);
+
+/**
+ * Like egress_create(), but opens no sockets: every batch is handed to sink,
+ * with arg and an fd of -1, instead.  Dies on failure.
+ */
+egress* egress_create_sink(uint32_t* dest_ips, unsigned dest_ips_len,
+                           const void* hdr, unsigned hdr_len,
+                           uint16_t udp_port, unsigned sources, unsigned gso_max,
+                           unsigned batch, unsigned flush_us, buf_pool* pool,
+                           port_stats* stats, egress_sink sink, void* arg);
+
+/**
+ * Has e split frames too big for the path MTU to an endpoint into fragments
+ * (see frag.h) behind frag_hdr, a tunneling header as long as its own, rather
+ * than leave them to IP fragmentation.  The path MTUs are looked up from the
+ * kernel now, when a send exceeds one, and every EGRESS_PMTU_CHECK_S seconds;
+ * mtu stands in for those it does not know.  Dies on failure.
+ */
+void egress_fragment(egress* e, const void* frag_hdr, unsigned mtu);
+
+/**
+ * Has e (in raw IP mode) write the outer IPv4 header of every packet itself,
+ * from src_ip (0 for the address of the outgoing interface), rather than leave
+ * it to the kernel (IP_HDRINCL).  The kernel does not fragment such packets, so
+ * frames too big for the path MTU are dropped unless e fragments them too.
+ * Dies on failure.
+ */
+void egress_raw_headers(egress* e, uint32_t src_ip);
+
+/**
+ * Has e send the frames for each endpoint i to the NBO address *follows[i]
+ * (which another thread may change at any time, after a failover, say) rather
+ * than the one it was created with, unless follows[i] is NULL.  A change takes
+ * effect with the next flush.  Dies on failure.
+ */
+void egress_follow(egress* e, uint32_t* const* follows);
+
+/**
+ * Creates the egress state for a border port whose frames a shaper sends from
+ * ring: each queued frame is copied into the ring (unless it was read into its
+ * slot) or, if the ring is full, dropped.  sources and batch should be those
+ * of the egress the shaper sends through.  Dies on failure.
+ */
+egress* egress_create_shaped(struct shaper_ring* ring, unsigned sources,
+                             unsigned batch, buf_pool* pool, port_stats* stats);
+
+/**
+ * Returns a buffer the next frame may be read into.  It remains valid until
+ * the batch it is queued in has been flushed.
+ */
+char* egress_slot(egress* e);
+
+/**
+ * Queues a frame for every destination, on the source socket picked by hash
+ * (its flow hash; ignored unless there are several sources).  The frame must
+ * remain valid until the next flush.  Flushes when the batch is full or its
+ * deadline has passed.
+ */
+void egress_queue(egress* e, char* data, unsigned len, uint32_t hash);
+
+/**
+ * Like egress_queue(), but queues the frame only for endpoint dest (an index
+ * into the dest_ips given to egress_create()), or for every endpoint if dest
+ * is EGRESS_ALL_DESTS.
+ */
+void egress_queue_dest(egress* e, int dest, char* data, unsigned len, uint32_t hash);
+
+/** Sends all queued frames. */
+void egress_flush(egress* e);
+
+/**
+ * Closes the sockets of e and frees it; its slots go with their pool, which
+ * the caller destroys.  Queued frames are dropped (flush first).
+ */
+void egress_destroy(egress* e);
+
+/**
+ * Returns how long (in ns) the caller may wait for more frames before it must
+ * call egress_flush(), or -1 if nothing is queued.
+ */
+long egress_wait_ns(egress* e);
+
+#endif /* _EGRESS_H_ */
@@ -0,0 +1,338 @@
+/* Filename: filter.c */
+
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "bpf.h"
+#include "capsulator.h"
+#include "common.h"
+#include "filter.h"
+
+/** most instructions an eBPF socket filter here has */
+#define FILTER_MAX_INSNS 256
+
+/* struct __sk_buff offsets */
+#define SKB_LEN           0
+#define SKB_PKT_TYPE      4
+#define SKB_VLAN_PRESENT 20
+#define SKB_VLAN_TCI     24
+
+/* places an eBPF socket filter jumps to; the first three end the program:
+   keep the packet, count the drop reason in r7 and drop it, or drop it
+   uncounted */
+#define L_ACCEPT    0
+#define L_DROP      1
+#define L_IGNORE    2
+#define L_IN_BAND   3
+#define L_TAGGED    4
+#define L_CHECK     5
+#define L_VLAN_OK   6
+#define FILTER_LABELS 7
+
+/* offsets into a tunnel packet as seen from its outer IP header (which has no
+   options; the tunnel port drops those) */
+#define OFF_TAG        20
+#define OFF_ETH        (OFF_TAG + 4)
+#define OFF_ETH_TYPE   (OFF_ETH + 12)
+#define OFF_IP         (OFF_ETH + 14)
+#define OFF_IP_FRAG    (OFF_IP + 6)
+#define OFF_IP_PROTO   (OFF_IP + 9)
+#define OFF_IP_SRC     (OFF_IP + 12)
+#define OFF_IP_DST     (OFF_IP + 16)
+
+/** XORs the 32-bit word loaded by (load, off) into scratch memory slot 0
+    (5 instructions) */
+#define HASH_WORD(load, off) \
+    BPF_STMT(load, off), \
+    BPF_STMT(BPF_MISC | BPF_TAX, 0), \
+    BPF_STMT(BPF_LD | BPF_MEM, 0), \
+    BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0), \
+    BPF_STMT(BPF_ST, 0)
+
+/** attaches the classic BPF program code (of len instructions) to fd */
+static int filter_attach(int fd, int level, int optname,
+                         struct sock_filter* code, unsigned len) {
+    struct sock_fprog prog;
+
+    prog.len = len;
+    prog.filter = code;
+    return setsockopt(fd, level, optname, &prog, sizeof(prog));
+}
+
+void filter_drop_all(int fd) {
+    struct sock_filter code[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+
+    if(filter_attach(fd, SOL_SOCKET, SO_ATTACH_FILTER, code, 1) < 0)
+        verbose_println("Warning: unable to discard input on socket %d", fd);
+}
+
+void filter_tunnel_input(int fd, uint32_t ip) {
+    struct sock_filter code[] = {
+        /* 0 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+        /* 1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_HOST, 0, 5),
+        /* 2 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+        /* 3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_CAPSULATOR, 0, 3),
+        /* 4 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 16),
+        /* 5 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(ip), 0, 1),
+        /* 6 */ BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+        /* 7 */ BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+
+    if(filter_attach(fd, SOL_SOCKET, SO_ATTACH_FILTER, code, sizeof(code) / sizeof(code[0])) < 0)
+        pdie("setsockopt (SO_ATTACH_FILTER on tunnel port)");
+}
+
+void filter_fanout_flow_hash(int fd, unsigned n) {
+    struct sock_filter code[] = {
+        /*  0 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, OFF_TAG),
+        /*  1 */ BPF_STMT(BPF_ST, 0),
+        /*  2 */ HASH_WORD(BPF_LD | BPF_W | BPF_ABS, OFF_ETH),
+        /*  7 */ HASH_WORD(BPF_LD | BPF_W | BPF_ABS, OFF_ETH + 4),
+        /* 12 */ HASH_WORD(BPF_LD | BPF_W | BPF_ABS, OFF_ETH + 8),
+        /* 17 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, OFF_ETH_TYPE),
+        /* 18 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0800, 0, 21),
+        /* 19 */ HASH_WORD(BPF_LD | BPF_W | BPF_ABS, OFF_IP_SRC),
+        /* 24 */ HASH_WORD(BPF_LD | BPF_W | BPF_ABS, OFF_IP_DST),
+        /* 29 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, OFF_IP_PROTO),
+        /* 30 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 1, 0),
+        /* 31 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 8),
+        /* 32 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, OFF_IP_FRAG),
+        /* 33 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1FFF, 6, 0),
+        /* 34 */ BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, OFF_IP),
+        /* 35 */ HASH_WORD(BPF_LD | BPF_W | BPF_IND, OFF_IP),
+        /* 40 */ BPF_STMT(BPF_LD | BPF_MEM, 0),
+        /* 41 */ BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        /* 42 */ BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        /* 43 */ BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        /* 44 */ BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n),
+        /* 45 */ BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+
+    if(filter_attach(fd, SOL_PACKET, PACKET_FANOUT_DATA, code, sizeof(code) / sizeof(code[0])) < 0)
+        pdie("setsockopt (PACKET_FANOUT_DATA on tunnel port)");
+}
+
+/** an eBPF socket filter being assembled */
+typedef struct filter_prog {
+    struct bpf_insn insns[FILTER_MAX_INSNS];
+    unsigned len;
+
+    /** where each label was placed */
+    unsigned labels[FILTER_LABELS];
+
+    /** jumps and the label each goes to */
+    unsigned jumps[FILTER_MAX_INSNS];
+    unsigned jump_labels[FILTER_MAX_INSNS];
+    unsigned jumps_len;
+} filter_prog;
+
+static void emit(filter_prog* p, struct bpf_insn insn) {
+    p->insns[p->len++] = insn;
+}
+
+/** emits a jump to label */
+static void emit_jump(filter_prog* p, struct bpf_insn insn, unsigned label) {
+    p->jumps[p->jumps_len] = p->len;
+    p->jump_labels[p->jumps_len++] = label;
+    emit(p, insn);
+}
+
+/** places label at the next instruction */
+static void place(filter_prog* p, unsigned label) {
+    p->labels[label] = p->len;
+}
+
+/** emits the exits, patches the jumps and loads the program */
+static int filter_prog_load(filter_prog* p, int counters) {
+    struct bpf_insn ld_map[] = { LD_MAP_FD(BPF_REG_1, counters) };
+    unsigned i;
+
+    place(p, L_ACCEPT);
+    emit(p, MOV64_IMM(BPF_REG_0, -1));
+    emit(p, EXIT());
+
+    /* counters[r7] += 1 (no other CPU writes this copy) */
+    place(p, L_DROP);
+    emit(p, STX(BPF_W, BPF_REG_10, BPF_REG_7, -4));
+    emit(p, MOV64_REG(BPF_REG_2, BPF_REG_10));
+    emit(p, ADD64_IMM(BPF_REG_2, -4));
+    emit(p, ld_map[0]);
+    emit(p, ld_map[1]);
+    emit(p, CALL(BPF_FUNC_map_lookup_elem));
+    emit_jump(p, JEQ_IMM(BPF_REG_0, 0), L_IGNORE);
+    emit(p, LDX(BPF_DW, BPF_REG_1, BPF_REG_0, 0));
+    emit(p, ADD64_IMM(BPF_REG_1, 1));
+    emit(p, STX(BPF_DW, BPF_REG_0, BPF_REG_1, 0));
+
+    place(p, L_IGNORE);
+    emit(p, MOV64_IMM(BPF_REG_0, 0));
+    emit(p, EXIT());
+
+    for(i=0; i<p->jumps_len; i++)
+        p->insns[p->jumps[i]].off = p->labels[p->jump_labels[i]] - p->jumps[i] - 1;
+    return bpf_prog_load(BPF_PROG_TYPE_SOCKET_FILTER, 0, p->insns, p->len);
+}
+
+int filter_counters_create(void) {
+    return bpf_map_create(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t), sizeof(uint64_t),
+                          FILTER_DROP_REASONS);
+}
+
+void filter_counters_read(int counters, uint64_t* drops) {
+    uint64_t* values;
+    unsigned i, n;
+    uint32_t r;
+
+    n = bpf_possible_cpus();
+    if(!(values = malloc(n * sizeof(*values))))
+        pdie("malloc (filter counters)");
+    for(r=0; r<FILTER_DROP_REASONS; r++) {
+        drops[r] = 0;
+        if(bpf_map_lookup(counters, &r, values) == 0)
+            for(i=0; i<n; i++)
+                drops[r] += values[i];
+    }
+    free(values);
+}
+
+int filter_tags_create(unsigned max) {
+    return bpf_map_create(BPF_MAP_TYPE_HASH, sizeof(uint32_t), sizeof(uint8_t),
+                          max ? max : 1);
+}
+
+void filter_tags_set(int tags, const uint32_t* list, unsigned len) {
+    uint32_t key, next, *stale;
+    unsigned i, stale_len;
+    uint8_t one;
+    int more;
+
+    one = 1;
+    for(i=0; i<len; i++)
+        if(bpf_map_update(tags, &list[i], &one) < 0)
+            verbose_println("Warning: unable to let tag %u through the tunnel port filter",
+                            list[i]);
+
+    /* collect the tags no longer listed first: deleting while walking the
+       keys would restart the walk */
+    stale = NULL;
+    stale_len = 0;
+    for(more = bpf_map_next_key(tags, NULL, &next) == 0; more;
+        more = bpf_map_next_key(tags, &key, &next) == 0) {
+        key = next;
+        for(i=0; i<len && list[i] != key; i++);
+        if(i < len)
+            continue;
+        if(!(stale = realloc(stale, (stale_len + 1) * sizeof(*stale))))
+            pdie("realloc (tunnel port filter tags)");
+        stale[stale_len++] = key;
+    }
+    for(i=0; i<stale_len; i++)
+        bpf_map_delete(tags, &stale[i]);
+    free(stale);
+}
+
+int filter_border_prog(int counters, const filter_allow* allow, unsigned min_len) {
+    filter_prog p;
+    unsigned i;
+
+    memset(&p, 0, sizeof(p));
+    emit(&p, MOV64_REG(BPF_REG_6, BPF_REG_1));
+
+    /* a packet socket sees what the port sends too */
+    emit(&p, MOV64_IMM(BPF_REG_7, FILTER_DROP_OUTGOING));
+    emit(&p, LDX(BPF_W, BPF_REG_0, BPF_REG_6, SKB_PKT_TYPE));
+    emit_jump(&p, JEQ32_IMM(BPF_REG_0, PACKET_OUTGOING), L_DROP);
+
+    emit(&p, MOV64_IMM(BPF_REG_7, FILTER_DROP_SHORT));
+    emit(&p, LDX(BPF_W, BPF_REG_0, BPF_REG_6, SKB_LEN));
+    emit_jump(&p, JLT32_IMM(BPF_REG_0, min_len), L_DROP);
+
+    if(!allow->vlans_len && !allow->ethertypes_len)
+        return filter_prog_load(&p, counters);
+
+    /* r8 = the VLAN ID (0 if untagged) and r9 = the EtherType behind it; the
+       NIC may have taken the tag out of the frame already */
+    emit(&p, MOV64_IMM(BPF_REG_8, 0));
+    emit(&p, LD_ABS(BPF_H, 12));
+    emit(&p, MOV64_REG(BPF_REG_9, BPF_REG_0));
+    emit(&p, LDX(BPF_W, BPF_REG_0, BPF_REG_6, SKB_VLAN_PRESENT));
+    emit_jump(&p, JEQ32_IMM(BPF_REG_0, 0), L_IN_BAND);
+    emit(&p, LDX(BPF_W, BPF_REG_8, BPF_REG_6, SKB_VLAN_TCI));
+    emit(&p, AND64_IMM(BPF_REG_8, 0xFFF));
+    emit_jump(&p, JA(), L_CHECK);
+    place(&p, L_IN_BAND);
+    emit_jump(&p, JEQ32_IMM(BPF_REG_9, ETH_P_8021Q), L_TAGGED);
+    emit_jump(&p, JNE32_IMM(BPF_REG_9, ETH_P_8021AD), L_CHECK);
+    place(&p, L_TAGGED);
+    emit(&p, LD_ABS(BPF_H, 14));
+    emit(&p, MOV64_REG(BPF_REG_8, BPF_REG_0));
+    emit(&p, AND64_IMM(BPF_REG_8, 0xFFF));
+    emit(&p, LD_ABS(BPF_H, 16));
+    emit(&p, MOV64_REG(BPF_REG_9, BPF_REG_0));
+    place(&p, L_CHECK);
+
+    if(allow->vlans_len) {
+        emit(&p, MOV64_IMM(BPF_REG_7, FILTER_DROP_VLAN));
+        for(i=0; i<allow->vlans_len; i++)
+            emit_jump(&p, JEQ32_IMM(BPF_REG_8, allow->vlans[i]), L_VLAN_OK);
+        emit_jump(&p, JA(), L_DROP);
+    }
+    place(&p, L_VLAN_OK);
+
+    if(allow->ethertypes_len) {
+        emit(&p, MOV64_IMM(BPF_REG_7, FILTER_DROP_ETHERTYPE));
+        for(i=0; i<allow->ethertypes_len; i++)
+            emit_jump(&p, JEQ32_IMM(BPF_REG_9, allow->ethertypes[i]), L_ACCEPT);
+        emit_jump(&p, JA(), L_DROP);
+    }
+    return filter_prog_load(&p, counters);
+}
+
+int filter_tunnel_prog(int counters, int tags, uint32_t ip, int udp, unsigned min_len) {
+    struct bpf_insn ld_map[] = { LD_MAP_FD(BPF_REG_1, tags) };
+    filter_prog p;
+
+    memset(&p, 0, sizeof(p));
+    emit(&p, MOV64_REG(BPF_REG_6, BPF_REG_1));
+
+    /* a packet socket sees all IP traffic of the port, the capsulator's own
+       tunnel packets included */
+    if(!udp) {
+        emit(&p, LDX(BPF_W, BPF_REG_0, BPF_REG_6, SKB_PKT_TYPE));
+        emit_jump(&p, JNE32_IMM(BPF_REG_0, PACKET_HOST), L_IGNORE);
+        emit(&p, LD_ABS(BPF_B, 9));
+        emit_jump(&p, JNE32_IMM(BPF_REG_0, IPPROTO_CAPSULATOR), L_IGNORE);
+        emit(&p, LD_ABS(BPF_W, 16));
+        emit_jump(&p, JNE32_IMM(BPF_REG_0, (int32_t)ntohl(ip)), L_IGNORE);
+
+        emit(&p, MOV64_IMM(BPF_REG_7, FILTER_DROP_IP_OPTIONS));
+        emit(&p, LD_ABS(BPF_B, 0));
+        emit(&p, AND64_IMM(BPF_REG_0, 0x0F));
+        emit_jump(&p, JNE32_IMM(BPF_REG_0, 5), L_DROP);
+    }
+
+    emit(&p, MOV64_IMM(BPF_REG_7, FILTER_DROP_SHORT));
+    emit(&p, LDX(BPF_W, BPF_REG_0, BPF_REG_6, SKB_LEN));
+    emit_jump(&p, JLT32_IMM(BPF_REG_0, min_len), L_DROP);
+
+    /* look the tag up in the set */
+    emit(&p, MOV64_IMM(BPF_REG_7, FILTER_DROP_UNKNOWN_TAG));
+    emit(&p, LD_ABS(BPF_W, udp ? 8 : 20));
+    emit(&p, STX(BPF_W, BPF_REG_10, BPF_REG_0, -4));
+    emit(&p, MOV64_REG(BPF_REG_2, BPF_REG_10));
+    emit(&p, ADD64_IMM(BPF_REG_2, -4));
+    emit(&p, ld_map[0]);
+    emit(&p, ld_map[1]);
+    emit(&p, CALL(BPF_FUNC_map_lookup_elem));
+    emit_jump(&p, JEQ_IMM(BPF_REG_0, 0), L_DROP);
+    return filter_prog_load(&p, counters);
+}
+
+int filter_attach_prog(int fd, int prog) {
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_BPF, &prog, sizeof(prog));
+}
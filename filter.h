@@ -0,0 +1,103 @@
+/**
+ * Filename: filter.h
+ * Purpose:  classic and eBPF programs attached to the capsulator's sockets,
+ *           which drop what the forwarding threads would throw away before it
+ *           is copied to user space
+ */
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+/** reasons the eBPF socket filters drop packets for, which index their
+    counters: too short to carry an Ethernet frame, sent out of the border
+    port (by the host or the capsulator), EtherType or VLAN not allowed, IP
+    header with options, and tag no border port terminates */
+#define FILTER_DROP_SHORT       0
+#define FILTER_DROP_OUTGOING    1
+#define FILTER_DROP_ETHERTYPE   2
+#define FILTER_DROP_VLAN        3
+#define FILTER_DROP_IP_OPTIONS  4
+#define FILTER_DROP_UNKNOWN_TAG 5
+#define FILTER_DROP_REASONS     6
+
+/** most entries an EtherType or VLAN allow-list may have */
+#define FILTER_MAX_ALLOW 32
+
+/** The frames the border port filters let through; an empty list allows all. */
+typedef struct filter_allow {
+    /** EtherTypes of the payload (behind any VLAN tag) */
+    uint16_t ethertypes[FILTER_MAX_ALLOW];
+    unsigned ethertypes_len;
+
+    /** VLAN IDs, 0 standing for untagged frames */
+    uint16_t vlans[FILTER_MAX_ALLOW];
+    unsigned vlans_len;
+} filter_allow;
+
+/** Makes the kernel discard everything which would be queued to fd. */
+void filter_drop_all(int fd);
+
+/**
+ * Makes a SOCK_DGRAM packet socket only accept tunnel packets (IP protocol
+ * IPPROTO_CAPSULATOR) addressed to the NBO IPv4 address ip.  Dies on failure.
+ */
+void filter_tunnel_input(int fd, uint32_t ip);
+
+/**
+ * Installs the program which spreads the tunnel packets of a PACKET_FANOUT_CBPF
+ * group over its n members by a hash of the tag and the inner Ethernet/IPv4
+ * flow.  fd must already be a member of the group.  Dies on failure.
+ */
+void filter_fanout_flow_hash(int fd, unsigned n);
+
+/**
+ * Creates the per-CPU drop counters of an eBPF socket filter, one for each
+ * FILTER_DROP_* reason.
+ *
+ * @return the counters' map fd, or -1 if the kernel refused (errno is set)
+ */
+int filter_counters_create(void);
+
+/** Stores the counters, summed over all CPUs, in drops[FILTER_DROP_REASONS]. */
+void filter_counters_read(int counters, uint64_t* drops);
+
+/**
+ * Creates the set of (host order) tags the tunnel port filter lets through,
+ * which holds up to max of them.
+ *
+ * @return the set's map fd, or -1 if the kernel refused (errno is set)
+ */
+int filter_tags_create(unsigned max);
+
+/** Makes the set tags hold exactly the len tags in list. */
+void filter_tags_set(int tags, const uint32_t* list, unsigned len);
+
+/**
+ * Loads the filter of a border port's packet socket.  It drops frames sent out
+ * of the port, frames shorter than min_len and those allow does not allow,
+ * counting them in counters.
+ *
+ * @return the program fd, or -1 if the kernel refused (errno is set)
+ */
+int filter_border_prog(int counters, const filter_allow* allow, unsigned min_len);
+
+/**
+ * Loads the filter of the tunnel port's sockets: a raw IP or SOCK_DGRAM packet
+ * socket (reading from the IP header) unless udp is set, else UDP sockets
+ * (reading from the UDP header).  Packets which are not tunnel packets to the
+ * NBO IPv4 address ip are dropped uncounted.  Tunnel packets are dropped and
+ * counted in counters if their IP header has options, if they are shorter than
+ * min_len, or if their tag is not in the set tags.
+ *
+ * @return the program fd, or -1 if the kernel refused (errno is set)
+ */
+int filter_tunnel_prog(int counters, int tags, uint32_t ip, int udp, unsigned min_len);
+
+/** Attaches the eBPF program prog to socket fd (replacing any filter). */
+int filter_attach_prog(int fd, int prog);
+
+#endif /* _FILTER_H_ */
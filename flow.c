@@ -0,0 +1,73 @@
+/* Filename: flow.c */
+
+#include <netinet/in.h> /* IPPROTO_* */
+#include <string.h>
+
+#include "flow.h"
+
+#define ETH_HDR_LEN 14
+#define VLAN_HDR_LEN 4
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86DD
+#define ETHERTYPE_VLAN 0x8100
+
+/** folds the len bytes at p into the hash h */
+static uint32_t flow_mix(uint32_t h, const uint8_t* p, unsigned len) {
+    uint32_t w;
+
+    for(; len >= 4; p += 4, len -= 4) {
+        memcpy(&w, p, 4);
+        h = (h ^ w) * 0x9E3779B1u;
+    }
+    for(; len > 0; p++, len--)
+        h = (h ^ *p) * 0x9E3779B1u;
+    return h;
+}
+
+uint32_t flow_hash(const uint8_t* frame, unsigned len) {
+    const uint8_t* l3;
+    unsigned off, ihl, proto;
+    uint16_t type;
+    uint32_t h;
+
+    if(len < ETH_HDR_LEN)
+        return 0;
+
+    /* destination and source MAC addresses */
+    h = flow_mix(0, frame, 12);
+
+    off = 12;
+    type = (frame[off] << 8) | frame[off + 1];
+    if(type == ETHERTYPE_VLAN && len >= ETH_HDR_LEN + VLAN_HDR_LEN) {
+        off += VLAN_HDR_LEN;
+        type = (frame[off] << 8) | frame[off + 1];
+    }
+    off += 2;
+    l3 = frame + off;
+    len -= off;
+
+    if(type == ETHERTYPE_IPV4 && len >= 20) {
+        ihl = (l3[0] & 0x0F) * 4;
+        proto = l3[9];
+        h = flow_mix(h, l3 + 12, 8);
+
+        /* fragments leave the ports out: only the first one carries them */
+        if((l3[6] & 0x3F) == 0 && l3[7] == 0
+           && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) && len >= ihl + 4)
+            h = flow_mix(h, l3 + ihl, 4);
+    }
+    else if(type == ETHERTYPE_IPV6 && len >= 40) {
+        proto = l3[6];
+        h = flow_mix(h, l3 + 8, 32);
+        if((proto == IPPROTO_TCP || proto == IPPROTO_UDP) && len >= 44)
+            h = flow_mix(h, l3 + 40, 4);
+    }
+
+    /* spread every input bit over the low bits callers reduce the hash to
+       (murmur3's finalizer) */
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    return h ^ (h >> 16);
+}
@@ -0,0 +1,20 @@
+/**
+ * Filename: flow.h
+ * Purpose:  hash the flow an Ethernet frame belongs to
+ */
+
+#ifndef _FLOW_H_
+#define _FLOW_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+/**
+ * Returns a hash of the flow of the Ethernet frame of len bytes: its MAC
+ * addresses and, for IPv4 and IPv6, its IP addresses and TCP/UDP ports.  All
+ * frames of a flow (including every fragment of an IP packet) hash alike.
+ */
+uint32_t flow_hash(const uint8_t* frame, unsigned len);
+
+#endif /* _FLOW_H_ */
@@ -0,0 +1,219 @@
+/* Filename: frag.c */
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "frag.h"
+
+/** returns the current tick of the wheel */
+static uint32_t frag_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec * (1000 / FRAG_TICK_MS) + ts.tv_nsec / (FRAG_TICK_MS * 1000000L));
+}
+
+/** returns the hash bucket of the frame id with tag from src */
+static frag_entry** frag_bucket(frag_table* t, uint32_t src, uint32_t tag, uint32_t id) {
+    uint32_t h;
+
+    h = (src * 0x9E3779B1u) ^ (tag * 0x85EBCA6Bu) ^ (id * 0xC2B2AE35u);
+    return &t->buckets[(h ^ (h >> 16)) & t->mask];
+}
+
+/** links e into the wheel slot of the tick it expires at */
+static void frag_wheel_add(frag_table* t, frag_entry* e) {
+    frag_entry** slot;
+
+    slot = &t->wheel[e->expires % FRAG_WHEEL_SLOTS];
+    e->wprev = NULL;
+    e->wnext = *slot;
+    if(*slot)
+        (*slot)->wprev = e;
+    *slot = e;
+}
+
+/** takes e out of its hash bucket and wheel slot */
+static void frag_unlink(frag_table* t, frag_entry* e) {
+    frag_entry** p;
+
+    for(p = frag_bucket(t, e->src, e->tag, e->id); *p != e; p = &(*p)->next);
+    *p = e->next;
+
+    if(e->wprev)
+        e->wprev->wnext = e->wnext;
+    else
+        t->wheel[e->expires % FRAG_WHEEL_SLOTS] = e->wnext;
+    if(e->wnext)
+        e->wnext->wprev = e->wprev;
+}
+
+/** gives up on the partial frame of e */
+static void frag_drop(frag_table* t, frag_entry* e) {
+    frag_unlink(t, e);
+    e->next = t->free;
+    t->free = e;
+    STAT_ADD(t->stats, drop_frag, 1);
+}
+
+/** drops the partial frames whose time is up by tick now */
+static void frag_expire(frag_table* t, uint32_t now) {
+    unsigned n;
+
+    /* every entry of a slot passed expires then (none waits a whole turn of
+       the wheel), so after a long quiet spell one turn clears them all */
+    for(n=0; t->tick != now && n < FRAG_WHEEL_SLOTS; n++) {
+        t->tick += 1;
+        while(t->wheel[t->tick % FRAG_WHEEL_SLOTS])
+            frag_drop(t, t->wheel[t->tick % FRAG_WHEEL_SLOTS]);
+    }
+    t->tick = now;
+}
+
+/** returns a free entry, evicting the partial frame closest to expiry if
+    there is none, or NULL if every entry holds a completed frame */
+static frag_entry* frag_alloc(frag_table* t) {
+    frag_entry* e;
+    unsigned n;
+
+    for(n=1; !t->free && n<=FRAG_WHEEL_SLOTS; n++)
+        if((e = t->wheel[(t->tick + n) % FRAG_WHEEL_SLOTS]))
+            frag_drop(t, e);
+    if((e = t->free))
+        t->free = e->next;
+    return e;
+}
+
+frag_table* frag_table_create(unsigned entries, unsigned buf_size, port_stats* stats) {
+    frag_table* t;
+    unsigned i, n;
+
+    if(entries == 0)
+        entries = 1;
+    for(n = 2; n < 2 * entries; n *= 2);
+
+    if(!(t = calloc(1, sizeof(*t))))
+        pdie("malloc (reassembly table)");
+    t->entries = calloc(entries, sizeof(*t->entries));
+    t->bufs = malloc((size_t)entries * buf_size);
+    t->buckets = calloc(n, sizeof(*t->buckets));
+    if(!t->entries || !t->bufs || !t->buckets)
+        pdie("malloc (reassembly table)");
+    t->buf_size = buf_size;
+    t->mask = n - 1;
+    t->stats = stats;
+    t->tick = frag_now();
+
+    for(i=0; i<entries; i++) {
+        t->entries[i].buf = t->bufs + (size_t)i * buf_size;
+        t->entries[i].next = t->free;
+        t->free = &t->entries[i];
+    }
+    return t;
+}
+
+void frag_table_destroy(frag_table* t) {
+    free(t->entries);
+    free(t->bufs);
+    free(t->buckets);
+    free(t);
+}
+
+/**
+ * Returns the length of all but the last fragment of a frame which the fragment
+ * of len bytes described by fi implies, or 0 if it is not where that puts it.
+ * The last fragment, if not the only one, only implies it by its offset.
+ */
+static unsigned frag_seg(const frag_info* fi, unsigned offset, unsigned len) {
+    unsigned seg;
+
+    if(len == 0)
+        return 0;
+    if(fi->index < fi->count - 1)
+        seg = len;
+    else if(fi->index == 0)
+        return (offset == 0) ? len : 0;
+    else if(offset % fi->index == 0)
+        seg = offset / fi->index;
+    else
+        return 0;
+    return (offset == fi->index * seg && len <= seg) ? seg : 0;
+}
+
+char* frag_add(frag_table* t, uint32_t src, uint32_t tag, const frag_info* fi,
+               const char* data, unsigned len, unsigned* frame_len) {
+    frag_entry *e, **b;
+    unsigned offset, seg;
+
+    STAT_ADD(t->stats, rx_fragments, 1);
+    offset = ntohs(fi->offset);
+    if(fi->count == 0 || fi->count > FRAG_MAX_COUNT || fi->index >= fi->count
+       || offset + len > t->buf_size || !(seg = frag_seg(fi, offset, len))) {
+        STAT_ADD(t->stats, drop_frag, 1);
+        return NULL;
+    }
+
+    frag_expire(t, frag_now());
+
+    b = frag_bucket(t, src, tag, fi->id);
+    for(e = *b; e; e = e->next)
+        if(e->src == src && e->tag == tag && e->id == fi->id)
+            break;
+    if(!e) {
+        if(!(e = frag_alloc(t))) {
+            STAT_ADD(t->stats, drop_frag, 1);
+            return NULL;
+        }
+        e->src = src;
+        e->tag = tag;
+        e->id = fi->id;
+        e->count = fi->count;
+        e->have = 0;
+        e->seg = 0;
+        e->len = 0;
+        e->expires = t->tick + FRAG_TIMEOUT_MS / FRAG_TICK_MS;
+        e->next = *b;
+        *b = e;
+        frag_wheel_add(t, e);
+    }
+    /* the fragments must tile the frame, or it would carry bytes left in
+       the buffer by an earlier one (perhaps of another tag) */
+    if(e->count != fi->count || (fi->count > 1 && e->seg && e->seg != seg)) {
+        frag_drop(t, e);
+        return NULL;
+    }
+    if(fi->count > 1)
+        e->seg = seg;
+
+    /* a duplicate changes nothing */
+    if(e->have & (1ULL << fi->index))
+        return NULL;
+    e->have |= 1ULL << fi->index;
+    memcpy(e->buf + offset, data, len);
+    if(fi->index == fi->count - 1)
+        e->len = offset + len;
+
+    if(e->have != ((e->count == 64) ? ~0ULL : (1ULL << e->count) - 1))
+        return NULL;
+
+    /* complete: the frame stays put until the caller is done with it */
+    frag_unlink(t, e);
+    e->next = t->done;
+    t->done = e;
+    STAT_ADD(t->stats, reassembled, 1);
+    *frame_len = e->len;
+    return e->buf;
+}
+
+void frag_release(frag_table* t) {
+    frag_entry* e;
+
+    while((e = t->done)) {
+        t->done = e->next;
+        e->next = t->free;
+        t->free = e;
+    }
+}
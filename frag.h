@@ -0,0 +1,156 @@
+/**
+ * Filename: frag.h
+ * Purpose:  the capsulator's own fragments of frames too big for the path MTU
+ *           to a tunnel endpoint, and their reassembly in a bounded table
+ *           whose partial frames expire through a timer wheel
+ */
+
+#ifndef _FRAG_H_
+#define _FRAG_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include "stats.h"
+
+/** set in the (host order) tag of a tunnel packet which carries a fragment:
+    its tunneling header is followed by a frag_info */
+#define CAPSULATOR_TAG_FRAG 0x80000000u
+
+/** most fragments a frame may be split into */
+#define FRAG_MAX_COUNT 64
+
+/** default number of partial frames a tunnel port thread reassembles at
+    once; a fragment of another evicts the oldest */
+#define FRAG_DEFAULT_ENTRIES 64
+
+/** time (ms) a partial frame waits for its missing fragments, and the
+    granularity and number of slots of the wheel which expires it (the
+    slots must span more than the timeout) */
+#define FRAG_TIMEOUT_MS   200
+#define FRAG_TICK_MS      4
+#define FRAG_WHEEL_SLOTS  64
+
+/**
+ * Follows the tunneling header of a fragment.  A frame of len bytes split into
+ * count fragments has fragments of (len + count - 1) / count bytes but the
+ * last, so none is much shorter than the others.
+ */
+typedef struct frag_info {
+    /** NBO number of the frame, unique among those of its sender */
+    uint32_t id;
+
+    /** NBO offset of the fragment's bytes in the frame */
+    uint16_t offset;
+
+    /** which fragment this is, and how many the frame was split into */
+    uint8_t index;
+    uint8_t count;
+} frag_info;
+
+/**
+ * Returns the number of fragments of at most room bytes a frame of len bytes
+ * is split into, or 0 if that takes more than FRAG_MAX_COUNT.
+ */
+static inline unsigned frag_count(unsigned len, unsigned room) {
+    unsigned count;
+
+    if(room == 0)
+        return 0;
+    count = (len + room - 1) / room;
+    return (count <= FRAG_MAX_COUNT) ? count : 0;
+}
+
+/**
+ * A frame being reassembled.  Free entries, and completed ones until
+ * frag_release(), are in neither a hash bucket nor the wheel.
+ */
+typedef struct frag_entry {
+    /** NBO source address, tag (without CAPSULATOR_TAG_FRAG) and frame id */
+    uint32_t src;
+    uint32_t tag;
+    uint32_t id;
+
+    /** fragments of the frame, those received so far (a bit per index),
+        the length of all but the last (0 until one came), and the frame's
+        length once its last fragment came (else 0) */
+    unsigned count;
+    uint64_t have;
+    unsigned seg;
+    unsigned len;
+
+    /** tick of the wheel at which the entry expires */
+    uint32_t expires;
+
+    /** next entry of the hash bucket (or of the free or completed list),
+        and neighbours in the wheel slot */
+    struct frag_entry* next;
+    struct frag_entry* wnext;
+    struct frag_entry* wprev;
+
+    /** the frame, buf_size bytes */
+    char* buf;
+} frag_entry;
+
+/**
+ * Reassembly state of one tunnel port thread.  Not thread-safe.
+ */
+typedef struct frag_table {
+    /** the entries and their frame buffers */
+    frag_entry* entries;
+    char* bufs;
+    unsigned buf_size;
+
+    /** hash buckets of the entries in use (a power-of-two number) */
+    frag_entry** buckets;
+    unsigned mask;
+
+    /** unused entries, and completed ones whose frames may still be
+        referenced (until frag_release()) */
+    frag_entry* free;
+    frag_entry* done;
+
+    /** entries in use by the tick they expire at, and the last tick the
+        wheel was advanced to */
+    frag_entry* wheel[FRAG_WHEEL_SLOTS];
+    uint32_t tick;
+
+    /** counters of the owning thread */
+    port_stats* stats;
+} frag_table;
+
+/**
+ * Creates a table reassembling up to entries frames of at most buf_size bytes
+ * at once, accounting to stats.  Dies on failure.
+ */
+frag_table* frag_table_create(unsigned entries, unsigned buf_size, port_stats* stats);
+
+/** Frees t. */
+void frag_table_destroy(frag_table* t);
+
+/**
+ * Adds the fragment of len bytes at data, described by fi, of a frame with
+ * (NBO) tag from NBO address src.  Fragment index must start index * seg bytes
+ * into the frame, seg being the length of all but the last (which may be
+ * shorter); a fragment which disagrees with those before it drops the frame.
+ *
+ * @return the frame (its length stored in frame_len) if this fragment completed
+ *         it, or NULL; the frame stays valid until frag_release()
+ */
+char* frag_add(frag_table* t, uint32_t src, uint32_t tag, const frag_info* fi,
+               const char* data, unsigned len, unsigned* frame_len);
+
+/** Frees the entries of the frames frag_add() returned. */
+void frag_release(frag_table* t);
+
+/**
+ * Returns non-zero if no entry is free but some hold frames frag_add() returned,
+ * so frag_release() should come before the next frag_add() (which would
+ * otherwise evict a partial frame).
+ */
+static inline int frag_full(frag_table* t) {
+    return !t->free && t->done;
+}
+
+#endif /* _FRAG_H_ */
@@ -0,0 +1,197 @@
+/* Filename: ingress.c */
+
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
+
+#include <errno.h>
+#include <netinet/udp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ingress.h"
+#include "log.h"
+
+/* UDP GRO options newer than some C libraries' <netinet/udp.h> */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+ingress* ingress_create(border_port* bp, unsigned bp_len,
+                        unsigned batch, buf_pool* pool,
+                        unsigned queue, port_stats* stats) {
+    ingress_port* p;
+    ingress* in;
+    unsigned i;
+
+    if(batch == 0)
+        batch = 1;
+
+    if(!(in = calloc(1, sizeof(*in))))
+        pdie("malloc (ingress)");
+    in->batch = batch;
+    in->queue = queue;
+    in->stats = stats;
+    in->msgs = calloc(batch, sizeof(*in->msgs));
+    in->iovs = calloc(batch, sizeof(*in->iovs));
+    in->addrs = calloc(batch, sizeof(*in->addrs));
+    in->ctrls = calloc(batch, INGRESS_CTRL_LEN);
+    if(!in->msgs || !in->iovs || !in->addrs || !in->ctrls)
+        pdie("malloc (ingress buffers)");
+
+    /* each message always receives into the same buffer */
+    for(i=0; i<batch; i++) {
+        if(!(in->iovs[i].iov_base = buf_pool_get(pool)))
+            die("buffer pool too small for a batch of %u packets", batch);
+        in->iovs[i].iov_len = pool->size;
+        in->msgs[i].msg_hdr.msg_iov = &in->iovs[i];
+        in->msgs[i].msg_hdr.msg_iovlen = 1;
+        in->msgs[i].msg_hdr.msg_name = &in->addrs[i];
+        in->msgs[i].msg_hdr.msg_control = in->ctrls + (size_t)i * INGRESS_CTRL_LEN;
+    }
+
+    in->ports_len = bp_len;
+    in->ports = calloc(bp_len, sizeof(*in->ports));
+    in->dirty = calloc(bp_len, sizeof(*in->dirty));
+    if(!in->ports || !in->dirty)
+        pdie("malloc (ingress ports)");
+
+    for(i=0; i<bp_len; i++) {
+        p = &in->ports[i];
+        p->bp = &bp[i];
+        p->msgs = calloc(batch, sizeof(*p->msgs));
+        p->iovs = calloc(batch, sizeof(*p->iovs));
+        if(!p->msgs || !p->iovs)
+            pdie("malloc (ingress port batch)");
+        if(bp[i].active)
+            ingress_open_port(in, i);
+    }
+
+    return in;
+}
+
+void ingress_open_port(ingress* in, unsigned i) {
+    ingress_port* p;
+
+    p = &in->ports[i];
+    p->fd = p->bp->queue_fds[in->queue % p->bp->queues];
+}
+
+int ingress_recv(ingress* in, int fd, int wait) {
+    unsigned i;
+
+    /* the address and control lengths are value-result */
+    for(i=0; i<in->batch; i++) {
+        in->msgs[i].msg_hdr.msg_namelen = sizeof(in->addrs[i]);
+        in->msgs[i].msg_hdr.msg_controllen = INGRESS_CTRL_LEN;
+    }
+
+    STAT_ADD(in->stats, syscalls, 1);
+    return recvmmsg(fd, in->msgs, in->batch, wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+}
+
+char* ingress_packet(ingress* in, unsigned k, unsigned* len) {
+    *len = in->msgs[k].msg_len;
+    return in->iovs[k].iov_base;
+}
+
+unsigned ingress_segment_size(ingress* in, unsigned k) {
+    return ingress_gro_size(&in->msgs[k].msg_hdr);
+}
+
+unsigned ingress_gro_size(struct msghdr* m) {
+    struct cmsghdr* cm;
+    int size;
+
+    for(cm = CMSG_FIRSTHDR(m); cm; cm = CMSG_NXTHDR(m, cm))
+        if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            memcpy(&size, CMSG_DATA(cm), sizeof(size));
+            return (size > 0) ? (unsigned)size : 0;
+        }
+    return 0;
+}
+
+uint32_t ingress_source(ingress* in, unsigned k) {
+    return in->addrs[k].sin_addr.s_addr;
+}
+
+/** writes all frames queued for port p */
+static void ingress_flush_port(ingress* in, ingress_port* p) {
+    unsigned i, sent;
+    int n;
+
+    sent = 0;
+    while(sent < p->pending) {
+        if(in->sink)
+            n = in->sink(in->sink_arg, p->fd, p->msgs + sent, p->pending - sent);
+        else if(p->bp->vbp) {
+            /* tap devices only take one frame per write() */
+            n = write(p->fd, p->iovs[sent].iov_base, p->iovs[sent].iov_len);
+            if(n >= 0) {
+                p->msgs[sent].msg_len = n;
+                n = 1;
+            }
+        }
+        else
+            n = sendmmsg(p->fd, p->msgs + sent, p->pending - sent, 0);
+        STAT_ADD(in->stats, syscalls, 1);
+
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+
+            /* skip the frame the kernel refused and carry on with the rest */
+            log_dp(LOG_ERROR, &in->log, p->bp->intf, errno,
+                   "Error: forwarding data to this border port failed");
+            STAT_ADD(in->stats, drop_write, 1);
+            sent += 1;
+            continue;
+        }
+
+        for(i=sent; i<sent+n; i++) {
+            if(p->msgs[i].msg_len != p->iovs[i].iov_len) {
+                log_dp(LOG_ERROR, &in->log, p->bp->intf, 0,
+                       "Error: forwarding data to this border port failed (sent %luB, had %luB to send)",
+                       (long)p->msgs[i].msg_len, (long)p->iovs[i].iov_len);
+                STAT_ADD(in->stats, drop_write, 1);
+                continue;
+            }
+            STAT_ADD(in->stats, tx_packets, 1);
+            STAT_ADD(in->stats, tx_bytes, p->msgs[i].msg_len);
+        }
+        sent += n;
+    }
+    p->pending = 0;
+}
+
+void ingress_queue(ingress* in, unsigned i, char* data, unsigned len) {
+    ingress_port* p;
+
+    p = &in->ports[i];
+    if(p->pending == in->batch)
+        ingress_flush_port(in, p);
+    if(!p->dirty) {
+        p->dirty = 1;
+        in->dirty[in->dirty_len++] = i;
+    }
+
+    p->iovs[p->pending].iov_base = data;
+    p->iovs[p->pending].iov_len = len;
+    p->msgs[p->pending].msg_hdr.msg_iov = &p->iovs[p->pending];
+    p->msgs[p->pending].msg_hdr.msg_iovlen = 1;
+    p->pending += 1;
+}
+
+void ingress_flush(ingress* in) {
+    unsigned i;
+
+    for(i=0; i<in->dirty_len; i++) {
+        ingress_flush_port(in, &in->ports[in->dirty[i]]);
+        in->ports[in->dirty[i]].dirty = 0;
+    }
+    in->dirty_len = 0;
+}
@@ -0,0 +1,144 @@
+/**
+ * Filename: ingress.h
+ * Purpose:  receive tunneled packets in batches with recvmmsg() and forward
+ *           the decapsulated frames to the border ports in batches
+ */
+
+#ifndef _INGRESS_H_
+#define _INGRESS_H_
+
+#include <netinet/in.h> /* struct sockaddr_in */
+#include <sys/socket.h> /* struct mmsghdr */
+#include <sys/uio.h>    /* struct iovec */
+
+#include "buf_pool.h"
+#include "capsulator.h"
+#include "egress.h"
+#include "stats.h"
+
+/** size of the receive buffers of a UDP socket with UDP_GRO on, which may
+    receive up to 64KB of coalesced packets at once */
+#define INGRESS_GRO_BUF_SIZE 0xFFFF
+
+/** size of the control buffer of a received message */
+#define INGRESS_CTRL_LEN CMSG_SPACE(sizeof(int))
+
+/**
+ * Frames waiting to be written to one border port.
+ */
+typedef struct ingress_port {
+    /** the border port the frames are written to and the file descriptor
+        (one of its queues) they are written through */
+    border_port* bp;
+    int fd;
+
+    /** one message per queued frame */
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+
+    /** number of frames waiting in msgs */
+    unsigned pending;
+
+    /** non-zero while the port is listed in its ingress' dirty array */
+    int dirty;
+} ingress_port;
+
+/**
+ * Receive buffers of the tunnel port thread and the per border port output
+ * batches they are sorted into.  Not thread-safe.
+ */
+typedef struct ingress {
+    /** maximum number of packets received per recvmmsg() */
+    unsigned batch;
+
+    /** one receive buffer per message, from the owning thread's pool, and
+        the address each packet came from (filled in for UDP sockets) */
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+    struct sockaddr_in* addrs;
+
+    /** one control buffer per message, which tells the size of the packets
+        a UDP socket with UDP_GRO on coalesced into it */
+    char* ctrls;
+
+    /** one output batch per border port */
+    ingress_port* ports;
+    unsigned ports_len;
+
+    /** indices of the ports with pending frames, in the order first queued */
+    unsigned* dirty;
+    unsigned dirty_len;
+
+    /** the queue of each border port frames are written to (modulo its
+        number of queues) */
+    unsigned queue;
+
+    /** counters of the owning tunnel port thread, and how much it logs
+        about the border ports */
+    port_stats* stats;
+    log_limit log;
+
+    /** if not NULL, batches are handed to sink (with sink_arg) instead of
+        the border ports */
+    egress_sink sink;
+    void* sink_arg;
+} ingress;
+
+/**
+ * Creates the ingress state for the bp_len border port slots in bp, accounting
+ * to stats.  Frames are written to queue (queue modulo the number of queues)
+ * of each port, so tunnel port threads can spread their writes over the queues
+ * of multi-queue taps.  Dies on failure.
+ */
+ingress* ingress_create(border_port* bp, unsigned bp_len,
+                        unsigned batch, buf_pool* pool,
+                        unsigned queue, port_stats* stats);
+
+/**
+ * Picks up the file descriptors of the port in slot i, which was not active
+ * when in was created or has been replaced since.  No frames may be queued
+ * for the slot until this returns.
+ */
+void ingress_open_port(ingress* in, unsigned i);
+
+/**
+ * Blocks (if wait is non-zero) until at least one packet arrives on fd, then
+ * receives as many as are ready (up to the batch size) without blocking again.
+ *
+ * @return the number of packets received, or -1 on error (errno is set, to
+ *         EAGAIN if there was nothing to receive without waiting)
+ */
+int ingress_recv(ingress* in, int fd, int wait);
+
+/**
+ * Returns received packet k and stores its length in len.  With UDP_GRO on,
+ * it may hold several packets (see ingress_segment_size()).
+ */
+char* ingress_packet(ingress* in, unsigned k, unsigned* len);
+
+/**
+ * Returns the size of each of the packets (the last may be shorter) which were
+ * coalesced into received packet k, or 0 if it holds a single one.
+ */
+unsigned ingress_segment_size(ingress* in, unsigned k);
+
+/** Returns the segment size in the control data of m, as for
+    ingress_segment_size(). */
+unsigned ingress_gro_size(struct msghdr* m);
+
+/**
+ * Returns the NBO IPv4 address received packet k came from, if the socket
+ * reports one (UDP sockets do; raw sockets leave it in the IP header).
+ */
+uint32_t ingress_source(ingress* in, unsigned k);
+
+/**
+ * Queues a frame to be written to border port i.  The frame must remain
+ * valid until the next flush.
+ */
+void ingress_queue(ingress* in, unsigned i, char* data, unsigned len);
+
+/** Writes all queued frames to their border ports. */
+void ingress_flush(ingress* in);
+
+#endif /* _INGRESS_H_ */
@@ -0,0 +1,379 @@
+/* Filename: keepalive.c */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "capsulator.h"
+#include "common.h"
+#include "filter.h"
+#include "keepalive.h"
+
+/** room for a probe with its tunneling header and padding */
+#define KEEPALIVE_BUF_LEN 256
+
+/** weight (1/n) of a new round trip time in the smoothed one (as TCP's) */
+#define KEEPALIVE_SRTT_WEIGHT 8
+
+/** returns the monotonic clock in ns */
+static uint64_t keepalive_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+keepalive* keepalive_create(uint32_t src_ip, uint16_t udp_port, unsigned min_len,
+                            unsigned interval_ms) {
+    struct sockaddr_in addr;
+    keepalive* ka;
+
+    if(sizeof(uint32_t) + min_len > KEEPALIVE_BUF_LEN)
+        die("keepalive probes of %uB are too long", min_len);
+    if(!(ka = calloc(1, sizeof(*ka))) ||
+       !(ka->endpoints = calloc(KEEPALIVE_MAX_ENDPOINTS, sizeof(*ka->endpoints))) ||
+       !(ka->paths = calloc(KEEPALIVE_MAX_ENDPOINTS, sizeof(*ka->paths))))
+        pdie("malloc (keepalive)");
+    pthread_mutex_init(&ka->lock, NULL);
+    ka->udp_port = udp_port;
+    ka->probe_len = sizeof(uint32_t)
+                  + ((min_len > sizeof(keepalive_probe)) ? min_len : sizeof(keepalive_probe));
+    ka->interval_ms = interval_ms ? interval_ms : KEEPALIVE_DEFAULT_INTERVAL_MS;
+
+    /* a raw socket for our protocol gets a copy of each incoming tunnel
+       packet, which the tunnel port's sockets read */
+    if(udp_port)
+        ka->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    else
+        ka->fd = socket(AF_INET, SOCK_RAW, IPPROTO_CAPSULATOR);
+    if(ka->fd < 0)
+        pdie("keepalive socket");
+    if(!udp_port)
+        filter_drop_all(ka->fd);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = src_ip;
+    if(bind(ka->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        pdie("bind (keepalive socket)");
+    return ka;
+}
+
+/** sends probe p to the NBO address ip without blocking; a probe which cannot
+    be sent is as good as lost */
+static void keepalive_send(keepalive* ka, uint32_t ip, const keepalive_probe* p) {
+    char buf[KEEPALIVE_BUF_LEN];
+    struct sockaddr_in addr;
+    uint32_t tag;
+
+    memset(buf, 0, ka->probe_len);
+    tag = htonl(CAPSULATOR_TAG_PROBE);
+    memcpy(buf, &tag, sizeof(tag));
+    memcpy(buf + sizeof(tag), p, sizeof(*p));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ip;
+    addr.sin_port = ka->udp_port;
+    sendto(ka->fd, buf, ka->probe_len, MSG_DONTWAIT, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+/** formats the NBO address ip into buf (INET_ADDRSTRLEN bytes) and returns it */
+static const char* keepalive_ntop(uint32_t ip, char* buf) {
+    struct in_addr addr;
+
+    addr.s_addr = ip;
+    return inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+}
+
+/** returns the endpoint with the NBO address ip, or NULL */
+static keepalive_endpoint* keepalive_endpoint_of(keepalive* ka, uint32_t ip) {
+    unsigned i, n;
+
+    n = __atomic_load_n(&ka->endpoints_len, __ATOMIC_ACQUIRE);
+    for(i=0; i<n; i++)
+        if(ka->endpoints[i].ip == ip)
+            return &ka->endpoints[i];
+    return NULL;
+}
+
+/** returns the path of the endpoint with the NBO address primary, or NULL */
+static keepalive_path* keepalive_path_of(keepalive* ka, uint32_t primary) {
+    unsigned i, n;
+
+    n = __atomic_load_n(&ka->paths_len, __ATOMIC_ACQUIRE);
+    for(i=0; i<n; i++)
+        if(ka->paths[i].primary == primary)
+            return &ka->paths[i];
+    return NULL;
+}
+
+/** returns the index of the endpoint with the NBO address ip, adding it (up,
+    until its probes say otherwise) if there is none; with the lock held */
+static unsigned keepalive_add_endpoint(keepalive* ka, uint32_t ip) {
+    keepalive_endpoint* e;
+    unsigned i;
+
+    if((e = keepalive_endpoint_of(ka, ip)))
+        return e - ka->endpoints;
+    i = ka->endpoints_len;
+    e = &ka->endpoints[i];
+    memset(e, 0, sizeof(*e));
+    e->ip = ip;
+    e->up = 1;
+    __atomic_store_n(&ka->endpoints_len, i + 1, __ATOMIC_RELEASE);
+    return i;
+}
+
+/** returns the path of the endpoint with the NBO address primary, adding it if
+    there is none; with the lock held */
+static keepalive_path* keepalive_add_path(keepalive* ka, uint32_t primary) {
+    keepalive_path* p;
+    unsigned i;
+
+    if((p = keepalive_path_of(ka, primary)))
+        return p;
+    i = ka->paths_len;
+    p = &ka->paths[i];
+    memset(p, 0, sizeof(*p));
+    p->primary = primary;
+    p->active = primary;
+    __atomic_store_n(&ka->paths_len, i + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+/** points the frames to p at its first member which is up (or its primary, if
+    none is); with the lock held */
+static void keepalive_elect(keepalive* ka, keepalive_path* p) {
+    char primary[INET_ADDRSTRLEN], from[INET_ADDRSTRLEN], to[INET_ADDRSTRLEN];
+    uint32_t active;
+    unsigned j;
+
+    active = p->primary;
+    for(j=0; j<p->members_len; j++)
+        if(ka->endpoints[p->members[j]].up) {
+            active = ka->endpoints[p->members[j]].ip;
+            break;
+        }
+    if(active == p->active)
+        return;
+
+    verbose_println("tunnel endpoint %s: frames now go to %s rather than %s",
+                    keepalive_ntop(p->primary, primary), keepalive_ntop(active, to),
+                    keepalive_ntop(p->active, from));
+    __atomic_store_n(&p->active, active, __ATOMIC_RELEASE);
+    __atomic_store_n(&p->failovers, p->failovers + 1, __ATOMIC_RELAXED);
+}
+
+/** returns address i of dests followed by backup_ips */
+static uint32_t keepalive_ip_at(const uint32_t* dests, unsigned dests_len,
+                                const uint32_t* backup_ips, unsigned i) {
+    return (i < dests_len) ? dests[i] : backup_ips[i - dests_len];
+}
+
+int keepalive_set_paths(keepalive* ka, const uint32_t* dests, unsigned dests_len,
+                        const uint32_t* backup_of, const uint32_t* backup_ips,
+                        unsigned backups_len, char* err, size_t err_len) {
+    char backup[INET_ADDRSTRLEN], of[INET_ADDRSTRLEN];
+    keepalive_path* p;
+    unsigned i, j, k, n, idx, new_endpoints, new_paths;
+    uint32_t ip;
+
+    /* check everything first, so a failure changes nothing */
+    for(i=0; i<backups_len; i++) {
+        for(j=0; j<dests_len && dests[j] != backup_of[i]; j++);
+        if(j == dests_len) {
+            snprintf(err, err_len, "%s is a backup of %s, which is not a tunnel endpoint",
+                     keepalive_ntop(backup_ips[i], backup), keepalive_ntop(backup_of[i], of));
+            return -1;
+        }
+        for(n=0, k=0; k<backups_len; k++)
+            n += (backup_of[k] == backup_of[i]);
+        if(n > KEEPALIVE_MAX_BACKUPS) {
+            snprintf(err, err_len, "a tunnel endpoint may have at most %u backups",
+                     KEEPALIVE_MAX_BACKUPS);
+            return -1;
+        }
+    }
+
+    /* only addresses without a slot yet (counted once) take one, so the same
+       addresses may be set again however many there are */
+    pthread_mutex_lock(&ka->lock);
+    new_endpoints = 0;
+    for(i=0; i<dests_len + backups_len; i++) {
+        ip = keepalive_ip_at(dests, dests_len, backup_ips, i);
+        for(j=0; j<i && keepalive_ip_at(dests, dests_len, backup_ips, j) != ip; j++);
+        if(j == i && !keepalive_endpoint_of(ka, ip))
+            new_endpoints += 1;
+    }
+    new_paths = 0;
+    for(i=0; i<dests_len; i++) {
+        for(j=0; j<i && dests[j] != dests[i]; j++);
+        if(j == i && !keepalive_path_of(ka, dests[i]))
+            new_paths += 1;
+    }
+    if(ka->endpoints_len + new_endpoints > KEEPALIVE_MAX_ENDPOINTS ||
+       ka->paths_len + new_paths > KEEPALIVE_MAX_ENDPOINTS) {
+        pthread_mutex_unlock(&ka->lock);
+        snprintf(err, err_len, "at most %u tunnel endpoints and backups may be probed",
+                 KEEPALIVE_MAX_ENDPOINTS);
+        return -1;
+    }
+
+    for(i=0; i<ka->endpoints_len; i++)
+        ka->endpoints[i].wanted = 0;
+    for(i=0; i<ka->paths_len; i++) {
+        ka->paths[i].wanted = 0;
+        ka->paths[i].members_len = 0;
+    }
+
+    /* every endpoint prefers itself, then its backups in the order listed */
+    for(i=0; i<dests_len; i++) {
+        p = keepalive_add_path(ka, dests[i]);
+        if(p->wanted)
+            continue;
+        p->wanted = 1;
+        idx = keepalive_add_endpoint(ka, dests[i]);
+        ka->endpoints[idx].wanted = 1;
+        p->members[p->members_len++] = idx;
+    }
+    for(i=0; i<backups_len; i++) {
+        p = keepalive_path_of(ka, backup_of[i]);
+        idx = keepalive_add_endpoint(ka, backup_ips[i]);
+        ka->endpoints[idx].wanted = 1;
+        for(j=0; j<p->members_len && p->members[j] != idx; j++);
+        if(j == p->members_len)
+            p->members[p->members_len++] = idx;
+    }
+
+    /* a backup in use may no longer be one */
+    for(i=0; i<ka->paths_len; i++)
+        if(ka->paths[i].wanted)
+            keepalive_elect(ka, &ka->paths[i]);
+    pthread_mutex_unlock(&ka->lock);
+    return 0;
+}
+
+uint32_t* keepalive_active(keepalive* ka, uint32_t primary) {
+    keepalive_path* p;
+
+    return (p = keepalive_path_of(ka, primary)) ? &p->active : NULL;
+}
+
+/**
+ * Settles the last probe of e, which has had its interval to be answered: takes
+ * its round trip time, or counts it lost and, after KEEPALIVE_MISSES in a row,
+ * takes e down.
+ */
+static void keepalive_settle(keepalive_endpoint* e) {
+    char ip[INET_ADDRSTRLEN];
+    int64_t rtt, srtt;
+    int answered;
+
+    if(e->seq == 0)
+        return;
+
+    answered = (__atomic_load_n(&e->reply_seq, __ATOMIC_ACQUIRE) == e->seq);
+    e->history = (e->history << 1) | (uint64_t)answered;
+    if(e->history_len < KEEPALIVE_HISTORY)
+        e->history_len += 1;
+
+    if(answered) {
+        rtt = __atomic_load_n(&e->rtt_ns, __ATOMIC_RELAXED);
+        srtt = e->srtt_ns ? (int64_t)e->srtt_ns + (rtt - (int64_t)e->srtt_ns) / KEEPALIVE_SRTT_WEIGHT
+                          : rtt;
+        __atomic_store_n(&e->srtt_ns, (uint64_t)srtt, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->answered, e->answered + 1, __ATOMIC_RELAXED);
+        e->misses = 0;
+        if(!e->up)
+            verbose_println("tunnel endpoint %s answers again", keepalive_ntop(e->ip, ip));
+        __atomic_store_n(&e->up, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_store_n(&e->lost, e->lost + 1, __ATOMIC_RELAXED);
+    if(++e->misses == KEEPALIVE_MISSES && e->up) {
+        verbose_println("tunnel endpoint %s is down (%u probes unanswered)",
+                        keepalive_ntop(e->ip, ip), e->misses);
+        __atomic_store_n(&e->up, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/** Entry point of the thread which probes the endpoints and fails them over. */
+static void* keepalive_main(void* vka) {
+    keepalive_endpoint* e;
+    keepalive_probe p;
+    struct timespec next;
+    keepalive* ka;
+    unsigned i;
+
+    pthread_detach(pthread_self());
+    ka = (keepalive*)vka;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    memset(&p, 0, sizeof(p));
+    p.type = KEEPALIVE_REQUEST;
+
+    while(1) {
+        pthread_mutex_lock(&ka->lock);
+
+        /* the probes sent an interval ago have had their time */
+        for(i=0; i<ka->endpoints_len; i++)
+            if(ka->endpoints[i].wanted)
+                keepalive_settle(&ka->endpoints[i]);
+        for(i=0; i<ka->paths_len; i++)
+            if(ka->paths[i].wanted)
+                keepalive_elect(ka, &ka->paths[i]);
+
+        for(i=0; i<ka->endpoints_len; i++) {
+            e = &ka->endpoints[i];
+            if(!e->wanted)
+                continue;
+            e->seq += 1;
+            p.seq = htonl(e->seq);
+            p.sent_ns = keepalive_now_ns();
+            keepalive_send(ka, e->ip, &p);
+        }
+        pthread_mutex_unlock(&ka->lock);
+
+        /* on a steady beat, unless it fell far behind */
+        next.tv_nsec += (long)(ka->interval_ms % 1000) * 1000000L;
+        next.tv_sec += ka->interval_ms / 1000 + next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        if(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0 ||
+           keepalive_now_ns() > (uint64_t)next.tv_sec * 1000000000ULL + next.tv_nsec
+                                + (uint64_t)ka->interval_ms * 1000000ULL)
+            clock_gettime(CLOCK_MONOTONIC, &next);
+    }
+
+    return NULL;
+}
+
+void keepalive_start(keepalive* ka) {
+    pthread_t tid;
+
+    if(pthread_create(&tid, NULL, keepalive_main, ka) != 0)
+        pdie("pthread_create (keepalive)");
+}
+
+void keepalive_input(keepalive* ka, uint32_t src, const char* data, unsigned len) {
+    keepalive_endpoint* e;
+    keepalive_probe p;
+
+    if(len < sizeof(p))
+        return;
+    memcpy(&p, data, sizeof(p));
+
+    if(p.type == KEEPALIVE_REQUEST) {
+        p.type = KEEPALIVE_REPLY;
+        keepalive_send(ka, src, &p);
+        return;
+    }
+    if(p.type != KEEPALIVE_REPLY || !(e = keepalive_endpoint_of(ka, src)))
+        return;
+
+    __atomic_store_n(&e->rtt_ns, keepalive_now_ns() - p.sent_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->reply_seq, ntohl(p.seq), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,174 @@
+/**
+ * Filename: keepalive.h
+ * Purpose:  probe the tunnel endpoints in band, measure their round trip
+ *           times and loss, and fail each endpoint over to the first of its
+ *           backups which answers while it does not
+ */
+
+#ifndef _KEEPALIVE_H_
+#define _KEEPALIVE_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <pthread.h>
+#include <stddef.h> /* size_t */
+
+/** (host order) tag of the tunnel packets which carry a keepalive_probe
+    rather than a frame; no border port may have it or, with -frag, have it
+    as its fragment tag */
+#define CAPSULATOR_TAG_PROBE 0xFFFFFFFFu
+
+/** default interval (ms) between probes of an endpoint */
+#define KEEPALIVE_DEFAULT_INTERVAL_MS 100
+
+/** consecutive probes an endpoint leaves unanswered before it is down; one
+    answer brings it up again */
+#define KEEPALIVE_MISSES 3
+
+/** most endpoints (primaries and backups) probed, and most backups of one */
+#define KEEPALIVE_MAX_ENDPOINTS 1024
+#define KEEPALIVE_MAX_BACKUPS   7
+
+/** probes the loss ratio of an endpoint is taken over */
+#define KEEPALIVE_HISTORY 64
+
+/** types of probe */
+#define KEEPALIVE_REQUEST 1
+#define KEEPALIVE_REPLY   2
+
+/**
+ * Follows the tunneling header of a probe (padded to the shortest tunnel
+ * packet the tunnel port filter lets through).  A reply echoes its request
+ * with the type changed.
+ */
+typedef struct keepalive_probe {
+    uint8_t type;
+    uint8_t pad[3];
+
+    /** NBO number of the probe among those to its endpoint */
+    uint32_t seq;
+
+    /** when the request was sent (ns, the sender's monotonic clock) */
+    uint64_t sent_ns;
+} keepalive_probe;
+
+/**
+ * An address which is probed: a tunnel endpoint or a backup of one.  Slots are
+ * only ever added, so other threads may keep pointers to them.
+ */
+typedef struct keepalive_endpoint {
+    /** NBO IPv4 address */
+    uint32_t ip;
+
+    /** non-zero while some endpoint has it as itself or a backup */
+    int wanted;
+
+    /** written by the tunnel port threads: the number and round trip time
+        (ns) of the last reply */
+    uint32_t reply_seq;
+    uint64_t rtt_ns;
+
+    /** the keepalive thread's: number of the last probe, consecutive probes
+        unanswered, whether it is up, smoothed round trip time (ns), and which
+        of the last history_len probes were answered (bit 0 the latest) */
+    uint32_t seq;
+    unsigned misses;
+    int up;
+    uint64_t srtt_ns;
+    uint64_t history;
+    unsigned history_len;
+
+    /** probes answered and left unanswered (read by the stats thread) */
+    uint64_t answered;
+    uint64_t lost;
+} keepalive_endpoint;
+
+/**
+ * A tunnel endpoint (as listed with -f) and its backups.  Slots are only ever
+ * added, so egresses may keep pointers to active.
+ */
+typedef struct keepalive_path {
+    /** NBO IPv4 address frames to the endpoint go to unless it is down */
+    uint32_t primary;
+
+    /** non-zero while the endpoint is listed */
+    int wanted;
+
+    /** indices into keepalive.endpoints in order of preference: the primary,
+        then its backups (changed under the lock) */
+    unsigned members[1 + KEEPALIVE_MAX_BACKUPS];
+    unsigned members_len;
+
+    /** NBO address frames to the endpoint go to now: the first member which
+        is up (the primary if none is), and how often that changed */
+    uint32_t active;
+    uint64_t failovers;
+} keepalive_path;
+
+/**
+ * Keepalive state shared by the keepalive thread, which probes and fails over,
+ * the tunnel port threads, which answer probes and take the replies, and the
+ * control thread, which changes the endpoints.
+ */
+typedef struct keepalive {
+    /** the probed addresses and the endpoints; the lengths only grow, and
+        are published once the slots below them are filled in */
+    keepalive_endpoint* endpoints;
+    unsigned endpoints_len;
+    keepalive_path* paths;
+    unsigned paths_len;
+
+    /** held by the keepalive thread while it probes and by whoever changes
+        the endpoints (never by a forwarding thread) */
+    pthread_mutex_t lock;
+
+    /** socket probes and replies are sent from, the NBO UDP port they go to
+        (0 in raw IP mode), their length with the tunneling header, and the
+        interval (ms) between probes */
+    int fd;
+    uint16_t udp_port;
+    unsigned probe_len;
+    unsigned interval_ms;
+} keepalive;
+
+/**
+ * Creates the keepalive state, with a socket bound to src_ip which sends probes
+ * of at least min_len bytes (behind the tunneling header) as raw IP protocol
+ * IPPROTO_CAPSULATOR or, if udp_port is not 0, to that UDP port.  Dies on
+ * failure.
+ */
+keepalive* keepalive_create(uint32_t src_ip, uint16_t udp_port, unsigned min_len,
+                            unsigned interval_ms);
+
+/**
+ * Makes dests (NBO, dests_len of them) the endpoints which are probed and
+ * failed over, backup_ips[i] being a backup of backup_of[i] (listed in order
+ * of preference, backups_len of them).  Endpoints no longer listed are no
+ * longer probed.
+ *
+ * @return 0 on success, or -1 (changing nothing) with a description of the
+ *         problem in err
+ */
+int keepalive_set_paths(keepalive* ka, const uint32_t* dests, unsigned dests_len,
+                        const uint32_t* backup_of, const uint32_t* backup_ips,
+                        unsigned backups_len, char* err, size_t err_len);
+
+/**
+ * Returns the address frames to the endpoint primary (NBO) go to now, which
+ * the keepalive thread changes on failover, or NULL if it is not one.
+ */
+uint32_t* keepalive_active(keepalive* ka, uint32_t primary);
+
+/** Starts the keepalive thread.  Dies on failure. */
+void keepalive_start(keepalive* ka);
+
+/**
+ * Takes the probe of len bytes at data (behind its tunneling header) which
+ * came from the NBO address src: answers a request and records the round
+ * trip time of a reply.  Never blocks.
+ */
+void keepalive_input(keepalive* ka, uint32_t src, const char* data, unsigned len);
+
+#endif /* _KEEPALIVE_H_ */
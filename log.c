@@ -0,0 +1,215 @@
+/* Filename: log.c */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/** how often (ms) the drain thread empties the rings */
+#define LOG_DRAIN_MS 10
+
+int log_level = LOG_PACKET;
+unsigned log_sample = 1;
+unsigned log_rate = LOG_DEFAULT_RATE;
+
+/** a message as its thread queued it, to be formatted by the drain thread */
+typedef struct log_entry {
+    struct timespec ts;
+    const char* format;
+    long args[LOG_MAX_ARGS];
+    int err;
+    unsigned suppressed;
+    char who[LOG_WHO_LEN];
+} log_entry;
+
+/**
+ * The records of one thread: it fills entries at head, the drain thread
+ * prints them from tail.
+ */
+typedef struct log_ring {
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+
+    /** records the thread found no room for (written by it only) and how
+        many of those the drain thread has reported */
+    uint64_t dropped;
+    uint64_t reported;
+
+    /** set once the thread has exited, so another may take the ring over */
+    int orphaned;
+
+    struct log_ring* next;
+    log_entry entries[LOG_RING_SIZE];
+} log_ring;
+
+/** every thread's ring; the list only grows (rings are reused) */
+static log_ring* log_rings = NULL;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** the calling thread's ring, and the key which orphans it when the thread
+    exits */
+static __thread log_ring* log_mine = NULL;
+static pthread_key_t log_key;
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+
+/** marks the ring of an exiting thread free for another */
+static void log_orphan(void* ring) {
+    __atomic_store_n(&((log_ring*)ring)->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void log_make_key(void) {
+    pthread_key_create(&log_key, log_orphan);
+}
+
+/** returns the calling thread's ring: an orphaned one or a new one */
+static log_ring* log_ring_of_thread(void) {
+    log_ring* r;
+
+    if(log_mine)
+        return log_mine;
+
+    pthread_once(&log_key_once, log_make_key);
+    pthread_mutex_lock(&log_lock);
+    for(r=log_rings; r; r=r->next)
+        if(__atomic_load_n(&r->orphaned, __ATOMIC_ACQUIRE))
+            break;
+    if(r)
+        r->orphaned = 0;
+    else if(posix_memalign((void**)&r, 64, sizeof(*r)) == 0) {
+        memset(r, 0, sizeof(*r));
+        r->next = log_rings;
+        __atomic_store_n(&log_rings, r, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    if(r)
+        pthread_setspecific(log_key, r);
+    return log_mine = r;
+}
+
+int log_admit(log_limit* limit) {
+    struct timespec now;
+
+    if(!limit)
+        return 1;
+
+    limit->seen += 1;
+    if(log_sample > 1 && limit->seen % log_sample) {
+        limit->suppressed += 1;
+        return 0;
+    }
+
+    /* the coarse clock is cheap and precise enough for a per-second cap */
+    if(log_rate) {
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        if(now.tv_sec != limit->sec) {
+            limit->sec = now.tv_sec;
+            limit->in_sec = 0;
+        }
+        if(limit->in_sec >= log_rate) {
+            limit->suppressed += 1;
+            return 0;
+        }
+        limit->in_sec += 1;
+    }
+    return 1;
+}
+
+void log_record(log_limit* limit, const char* who, int err,
+                const char* format, ...) {
+    log_entry* e;
+    log_ring* r;
+    const char* p;
+    va_list args;
+    unsigned n;
+
+    if(!(r = log_ring_of_thread()))
+        return;
+    if(r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    e = &r->entries[r->head % LOG_RING_SIZE];
+    clock_gettime(CLOCK_REALTIME, &e->ts);
+    e->format = format;
+    e->err = err;
+    e->suppressed = 0;
+    if(limit) {
+        e->suppressed = limit->suppressed;
+        limit->suppressed = 0;
+    }
+    strncpy(e->who, who ? who : "", LOG_WHO_LEN - 1);
+    e->who[LOG_WHO_LEN - 1] = '\0';
+
+    /* every conversion takes a long */
+    va_start(args, format);
+    for(n=0, p=format; (p = strchr(p, '%')) && n < LOG_MAX_ARGS; p++) {
+        if(p[1] == '%') {
+            p++;
+            continue;
+        }
+        e->args[n++] = va_arg(args, long);
+    }
+    va_end(args);
+
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/** prints entry e */
+static void log_print(const log_entry* e) {
+    char msg[256];
+    struct tm tm;
+
+    snprintf(msg, sizeof(msg), e->format, e->args[0], e->args[1], e->args[2], e->args[3]);
+    localtime_r(&e->ts.tv_sec, &tm);
+    fprintf(stderr, "%02d:%02d:%02d.%06ld %s%s%s%s%s%s",
+            tm.tm_hour, tm.tm_min, tm.tm_sec, e->ts.tv_nsec / 1000,
+            e->who, e->who[0] ? " " : "",
+            msg, e->err ? " (" : "", e->err ? strerror(e->err) : "", e->err ? ")" : "");
+    if(e->suppressed)
+        fprintf(stderr, " (%u more suppressed)", e->suppressed);
+    fputc('\n', stderr);
+}
+
+/** the drain thread: prints what every ring holds, every LOG_DRAIN_MS */
+static void* log_drain_main(void* arg) {
+    uint32_t head;
+    uint64_t dropped;
+    log_ring* r;
+
+    (void)arg;
+    while(1) {
+        for(r=__atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r=r->next) {
+            head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            while(r->tail != head) {
+                log_print(&r->entries[r->tail % LOG_RING_SIZE]);
+                __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+            }
+
+            dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+            if(dropped != r->reported) {
+                fprintf(stderr, "Warning: %llu log messages lost (log ring full)\n",
+                        (unsigned long long)(dropped - r->reported));
+                r->reported = dropped;
+            }
+        }
+        fflush(stderr);
+        usleep(LOG_DRAIN_MS * 1000);
+    }
+    return NULL;
+}
+
+void log_start(void) {
+    pthread_t tid;
+
+    if(pthread_create(&tid, NULL, log_drain_main, NULL) != 0)
+        pdie("pthread_create (log)");
+    pthread_detach(tid);
+}
@@ -0,0 +1,94 @@
+/**
+ * Filename: log.h
+ * Purpose:  logging from the forwarding threads without stalling them: each
+ *           thread appends binary records to a ring of its own, which a drain
+ *           thread formats and prints to stderr
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include "common.h" /* verbose */
+
+/** levels of data path messages, most severe first: a frame or packet
+    dropped for good, one dropped for a reason worth noting, and what
+    happens to every packet or batch */
+#define LOG_ERROR  0
+#define LOG_WARN   1
+#define LOG_PACKET 2
+
+/** data path messages above this level are compiled out: release builds
+    keep only errors and warnings */
+#ifndef LOG_COMPILED_LEVEL
+#ifdef _DEBUG_
+#define LOG_COMPILED_LEVEL LOG_PACKET
+#else
+#define LOG_COMPILED_LEVEL LOG_WARN
+#endif
+#endif
+
+/** default most messages per second a thread logs for a port */
+#define LOG_DEFAULT_RATE 1000
+
+/** records each thread's ring holds; more are dropped (and counted) */
+#define LOG_RING_SIZE 1024
+
+/** most arguments a message takes, and the length of its origin */
+#define LOG_MAX_ARGS 4
+#define LOG_WHO_LEN  32
+
+/** with -v, messages up to this level are logged (default LOG_PACKET) */
+extern int log_level;
+
+/** one in log_sample messages of a thread for a port is logged, at most
+    log_rate (0 for unlimited) per second */
+extern unsigned log_sample;
+extern unsigned log_rate;
+
+/**
+ * How many messages one thread has logged for one port, which the sampling
+ * and rate limit apply to.  Only that thread touches it.
+ */
+typedef struct log_limit {
+    uint64_t seen;
+
+    /** the second messages are counted in and how many were logged in it */
+    long sec;
+    unsigned in_sec;
+
+    /** messages left out since the last one logged */
+    unsigned suppressed;
+} log_limit;
+
+/**
+ * Logs a message of level from a forwarding thread, subject to limit (may be
+ * NULL), if -v is on and the level is both compiled in and enabled.  Until
+ * then none of the arguments is evaluated.
+ *
+ * @param who  the origin (an interface or thread name), which is copied and
+ *             printed in front of the message
+ * @param err  an errno value whose description is appended, or 0
+ * @param ...  a format whose conversions all take a long (%ld, %lu or %lx),
+ *             and the longs
+ */
+#define log_dp(level, limit, who, err, ...) do { \
+        if((level) <= LOG_COMPILED_LEVEL && verbose && (level) <= log_level && \
+           log_admit(limit)) \
+            log_record(limit, who, err, __VA_ARGS__); \
+    } while(0)
+
+/** Returns non-zero if the next message counted by limit is to be logged. */
+int log_admit(log_limit* limit);
+
+/** Queues a message for the drain thread (see log_dp()). */
+void log_record(log_limit* limit, const char* who, int err,
+                const char* format, ...);
+
+/** Starts the thread which prints the queued messages. */
+void log_start(void);
+
+#endif /* _LOG_H_ */
@@ -0,0 +1,166 @@
+/* Filename: mac_table.c */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "mac_table.h"
+
+/** number of entries (a power of two) */
+#define MAC_TABLE_SIZE 65536
+
+/** entries probed for an address before the oldest of them is replaced */
+#define MAC_TABLE_PROBES 8
+
+/** location stored for MAC_TABLE_LOCAL */
+#define MAC_TABLE_LOCATION_LOCAL 0xFFFF
+
+/** returns the 48-bit MAC address at mac as an integer */
+static uint64_t mac_table_key(const uint8_t* mac) {
+    return ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32)
+         | ((uint64_t)mac[2] << 24) | ((uint64_t)mac[3] << 16)
+         | ((uint64_t)mac[4] << 8) | mac[5];
+}
+
+/** the low bits pick the first entry probed, the top 16 are the check */
+static uint64_t mac_table_hash(uint64_t key) {
+    key ^= key >> 31;
+    key *= 0xBF58476D1CE4E5B9ULL;
+    key ^= key >> 29;
+    return key;
+}
+
+/** returns the current time in seconds, cheaply */
+static uint32_t mac_table_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+mac_table* mac_table_create(const uint32_t* dest_ips, unsigned dest_ips_len,
+                            unsigned age) {
+    mac_table* t;
+    unsigned i, j, n;
+
+    if(dest_ips_len > MAC_TABLE_MAX_ENDPOINTS)
+        die("MAC learning supports at most %u tunnel endpoints", MAC_TABLE_MAX_ENDPOINTS);
+
+    if(!(t = calloc(1, sizeof(*t))))
+        pdie("malloc (MAC table)");
+    t->mask = MAC_TABLE_SIZE - 1;
+    t->age = age;
+    t->entries = calloc(MAC_TABLE_SIZE, sizeof(*t->entries));
+
+    for(n = 8; n < 2 * dest_ips_len; n *= 2);
+    t->ips_mask = n - 1;
+    t->ips = calloc(n, sizeof(*t->ips));
+    t->ip_index = calloc(n, sizeof(*t->ip_index));
+    if(!t->entries || !t->ips || !t->ip_index)
+        pdie("malloc (MAC table)");
+
+    /* the first occurrence of an IP listed twice keeps its index */
+    for(i=0; i<dest_ips_len; i++) {
+        if(mac_table_endpoint(t, dest_ips[i]) >= 0)
+            continue;
+        for(j = (dest_ips[i] * 0x9E3779B1u) & t->ips_mask; t->ips[j]; j = (j + 1) & t->ips_mask);
+        t->ips[j] = dest_ips[i];
+        t->ip_index[j] = i;
+    }
+
+    return t;
+}
+
+void mac_table_destroy(mac_table* t) {
+    free(t->entries);
+    free(t->ips);
+    free(t->ip_index);
+    free(t);
+}
+
+int mac_table_endpoint(mac_table* t, uint32_t ip) {
+    unsigned i;
+
+    for(i = (ip * 0x9E3779B1u) & t->ips_mask; t->ips[i]; i = (i + 1) & t->ips_mask)
+        if(t->ips[i] == ip)
+            return t->ip_index[i];
+    return MAC_TABLE_UNKNOWN;
+}
+
+void mac_table_learn(mac_table* t, unsigned domain, const uint8_t* mac,
+                     int location) {
+    mac_table_entry* e;
+    uint64_t key, k, hash, value;
+    unsigned i, p, victim;
+    uint32_t oldest, seen;
+
+    if((mac[0] & 1) || location == MAC_TABLE_UNKNOWN)
+        return;
+
+    /* the all-zero address would look like an empty entry */
+    if((key = mac_table_key(mac)) == 0)
+        return;
+    key = (key << 16) | (domain & 0xFFFF);
+    hash = mac_table_hash(key);
+    value = ((uint64_t)mac_table_now() << 32) | ((hash >> 48) << 16)
+          | (location == MAC_TABLE_LOCAL ? MAC_TABLE_LOCATION_LOCAL : (unsigned)location);
+
+    /* refresh the address where it is (writing only what changed, so the
+       cache lines other threads read stay shared), else claim the first
+       empty entry of its probe window or take over the oldest one */
+    victim = 0;
+    oldest = UINT32_MAX;
+    for(p=0; p<MAC_TABLE_PROBES; p++) {
+        i = (unsigned)(hash + p) & t->mask;
+        e = &t->entries[i];
+        k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+        if(k == 0 && __atomic_compare_exchange_n(&e->key, &k, key, 0,
+                                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            k = key;
+        if(k == key) {
+            if(__atomic_load_n(&e->value, __ATOMIC_RELAXED) != value)
+                __atomic_store_n(&e->value, value, __ATOMIC_RELEASE);
+            return;
+        }
+        seen = (uint32_t)(__atomic_load_n(&e->value, __ATOMIC_RELAXED) >> 32);
+        if(seen < oldest) {
+            oldest = seen;
+            victim = i;
+        }
+    }
+
+    /* readers catching the new key with the old value see its check fail */
+    e = &t->entries[victim];
+    __atomic_store_n(&e->key, key, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->value, value, __ATOMIC_RELEASE);
+}
+
+int mac_table_lookup(mac_table* t, unsigned domain, const uint8_t* mac) {
+    mac_table_entry* e;
+    uint64_t key, k, hash, value;
+    unsigned p;
+
+    if(mac[0] & 1)
+        return MAC_TABLE_UNKNOWN;
+
+    /* entries are never emptied, so an empty one ends the search */
+    key = (mac_table_key(mac) << 16) | (domain & 0xFFFF);
+    hash = mac_table_hash(key);
+    for(p=0; p<MAC_TABLE_PROBES; p++) {
+        e = &t->entries[(unsigned)(hash + p) & t->mask];
+        k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+        if(k == 0)
+            return MAC_TABLE_UNKNOWN;
+        if(k != key)
+            continue;
+
+        value = __atomic_load_n(&e->value, __ATOMIC_ACQUIRE);
+        if(((value >> 16) & 0xFFFF) != (hash >> 48)
+           || mac_table_now() - (uint32_t)(value >> 32) > t->age)
+            return MAC_TABLE_UNKNOWN;
+        if((value & 0xFFFF) == MAC_TABLE_LOCATION_LOCAL)
+            return MAC_TABLE_LOCAL;
+        return (int)(value & 0xFFFF);
+    }
+    return MAC_TABLE_UNKNOWN;
+}
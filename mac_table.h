@@ -0,0 +1,92 @@
+/**
+ * Filename: mac_table.h
+ * Purpose:  learn where each MAC address of every tag lives (behind a tunnel
+ *           endpoint or on the local border side), so frames are not flooded
+ *           across the tunnel when they need not be
+ */
+
+#ifndef _MAC_TABLE_H_
+#define _MAC_TABLE_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+/** default time (s) a learned MAC address is trusted without being seen */
+#define MAC_TABLE_DEFAULT_AGE 300
+
+/** mac_table_lookup() result for a MAC address not (or no longer) known */
+#define MAC_TABLE_UNKNOWN (-1)
+
+/** where a MAC address learned from a border port lives */
+#define MAC_TABLE_LOCAL (-2)
+
+/** maximum number of tunnel endpoints and of domains (tags) */
+#define MAC_TABLE_MAX_ENDPOINTS 0xFFFE
+#define MAC_TABLE_MAX_DOMAINS   0x10000
+
+/** one forwarding database entry */
+typedef struct mac_table_entry {
+    /** MAC address << 16 | domain, or 0 if the entry is empty */
+    uint64_t key;
+
+    /** when the entry was last learned (seconds of CLOCK_MONOTONIC_COARSE)
+        << 32 | check << 16 | location; check is taken from the hash of the key
+        the value was written for, so a reader catching an entry while it is
+        handed to another key sees the mismatch */
+    uint64_t value;
+} mac_table_entry;
+
+/**
+ * A fixed-size forwarding database keyed by (domain, MAC address), shared by
+ * all threads without locks.  A domain is the tag frames are bridged on: the
+ * same address may live in different places in different domains.  Tunnel
+ * port threads learn the source addresses of decapsulated frames, border port
+ * threads learn those of the frames they receive and look up destinations.
+ */
+typedef struct mac_table {
+    mac_table_entry* entries;
+    unsigned mask;
+
+    /** seconds an entry stays valid without being learned again */
+    unsigned age;
+
+    /** endpoint index of each tunnel endpoint IP (open addressing, IP 0
+        marks an empty slot) */
+    uint32_t* ips;
+    uint16_t* ip_index;
+    unsigned ips_mask;
+} mac_table;
+
+/**
+ * Creates a table for the tunnel endpoints dest_ips (an endpoint's index is its
+ * position in dest_ips).  Dies on failure.
+ */
+mac_table* mac_table_create(const uint32_t* dest_ips, unsigned dest_ips_len,
+                            unsigned age);
+
+/** Frees a table no thread reads any more. */
+void mac_table_destroy(mac_table* t);
+
+/**
+ * Returns the index of the tunnel endpoint with the NBO IPv4 address ip, or
+ * MAC_TABLE_UNKNOWN if it is not one.
+ */
+int mac_table_endpoint(mac_table* t, uint32_t ip);
+
+/**
+ * Learns that the MAC address mac of domain lives at location (an endpoint
+ * index or MAC_TABLE_LOCAL).  Ignores multicast addresses and
+ * MAC_TABLE_UNKNOWN locations.
+ */
+void mac_table_learn(mac_table* t, unsigned domain, const uint8_t* mac,
+                     int location);
+
+/**
+ * Returns where the unicast MAC address mac of domain was learned (an
+ * endpoint index or MAC_TABLE_LOCAL), or MAC_TABLE_UNKNOWN if a frame to it
+ * has to be flooded.
+ */
+int mac_table_lookup(mac_table* t, unsigned domain, const uint8_t* mac);
+
+#endif /* _MAC_TABLE_H_ */
@@ -3,13 +3,23 @@
  * Purpose:  parses command-line arguments for Capsulator
  */
 
+#define _GNU_SOURCE /* CPU_SETSIZE */
+
 #include <arpa/inet.h>
+#include <linux/virtio_net.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "capsulator.h"
 #include "common.h"
+#include "config.h"
+#include "egress.h"
+#include "frag.h"
+#include "keepalive.h"
+#include "log.h"
+#include "shaper.h"
 
 #define STR_VERSION "0.01b"
 
@@ -19,6 +29,8 @@ Capsulator v%s\n\
   -?, -help:         displays this help\n\
   -t, -tunnel_intf:  names the interface which is the tunnel endpoint\n\
   -f, -forward_to:   comma-seperated list of IPs the tunnel should forward frames to\n\
+       (an IP may be followed by backups which take its frames while it\n\
+       does not answer, ex: 10.0.0.2+10.0.1.2; implies -keepalive)\n\
   -b, -border_intf:  specifies a border interface and its tag (may be specified \n\
        multiple times; format is INTF#TAG ... ex: eth0#1248)\n\
   -vb, -virtual_border_intf:  specifies a tap device name as border\n\ 
@@ -27,27 +39,292 @@ Capsulator v%s\n\
   -a, -all:	broadcast packets to every ip addresses provided with -f\n\
        NOTE: if -a not used, packets received on n-th -b/-vb ports will\n\
        be capsulated and sent to n-th ip address listed on -f \n\
-  -v, --verbose:     enables verbose logging to stderr\n"
+  -learn:            bridge every tag: learn where each MAC address lives\n\
+       (on the border side, or with -a behind which tunnel endpoint) from\n\
+       the frames it sends, and tunnel unicast frames only where needed\n\
+  -learn_age:        seconds a learned MAC address is trusted without being\n\
+       seen again (default: %u)\n\
+  -nr, -no_rx_ring:  read() frames from physical border ports one at a time\n\
+       instead of walking a memory-mapped TPACKET_V3 receive ring\n\
+  -batch:            maximum number of frames sent to a tunnel endpoint with\n\
+       one sendmmsg() or received from the tunnel with one recvmmsg()\n\
+       (default: %u)\n\
+  -flush_us:         maximum time in microseconds a frame waits for its batch\n\
+       to fill before it is sent anyway (default: %u)\n\
+  -tw, -tunnel_workers:  number of threads receiving from the tunnel port\n\
+       (default: 1); with more than one, tunnel packets are spread over\n\
+       them by a hash of their inner flow\n\
+  -tc, -tunnel_cpus: comma-separated list of CPUs (or ranges like 2-5) the\n\
+       tunnel port threads are pinned to, round-robin (default: thread i\n\
+       on CPU i when -tw > 1)\n\
+  -bc, -border_cpus: list of CPUs, as for -tc, the border port threads are\n\
+       pinned to, round-robin over the queues of the ports in order\n\
+       (default: none); a port's receive ring is allocated on the NUMA\n\
+       node of its thread's CPU\n\
+  -busy_poll:        microseconds a receive from a border or tunnel port\n\
+       socket busy-polls the device queue before sleeping (SO_BUSY_POLL;\n\
+       default: 0, off)\n\
+  -spin:             comma-separated list of ports (border or tunnel) whose\n\
+       threads poll for packets without ever sleeping, or \"all\"; for\n\
+       latency-critical ports, at the cost of a busy CPU each\n\
+  -engine:           threads (default): one thread per border port queue\n\
+       epoll: only the -tw tunnel port threads, each running an epoll loop\n\
+       which also serves a share of the border ports\n\
+       uring: like epoll, but with io_uring receives posted once and every\n\
+       batch sent with one system call (falls back to epoll on kernels\n\
+       without io_uring)\n\
+       xdp: one thread moving frames through AF_XDP sockets (physical\n\
+       border ports only, no -vnet)\n\
+  -tq, -tap_queues:  number of queues virtual border ports are opened with,\n\
+       each read by its own thread (default: 1)\n\
+  -vnet:             carry the virtio-net header of every frame through the\n\
+       tunnel so checksum-offloaded and GSO frames cross it unsegmented\n\
+       (both tunnel endpoints must use it)\n\
+  -udp:              encapsulate in UDP to and from this port instead of raw\n\
+       IP protocol 0xF5 (both tunnel endpoints must use it)\n\
+  -udp_sources:      number of UDP source ports frames to each destination\n\
+       are spread over by the hash of their flow, so NICs (RSS) and\n\
+       routers (ECMP) can spread them too (default: %u)\n\
+  -frag:             split frames too big for the path MTU to an endpoint into\n\
+       fragments of the capsulator's own, reassembled by the receiving\n\
+       capsulator, rather than IP fragments (both tunnel endpoints must use\n\
+       it; tags must be below 2147483648)\n\
+  -hdrincl:          in raw IP mode, write the outer IP header of every tunnel\n\
+       packet from a template of its endpoint rather than have the kernel\n\
+       build it (frames too big for the MTU are dropped unless -frag)\n\
+  -keepalive:        milliseconds between the probes sent to every tunnel\n\
+       endpoint and backup, which measure round trip times and loss and\n\
+       fail endpoints over to their backups after %u unanswered in a row\n\
+       (both tunnel endpoints must use it; default: off, or %u with\n\
+       backups; not with -engine xdp)\n\
+  -no_gso:           in UDP mode, send every frame in a UDP packet of its own\n\
+       and receive them one by one, rather than letting the kernel split\n\
+       and coalesce them (UDP GSO and GRO)\n\
+  -no_filter:        check every packet in user space only, rather than\n\
+       attaching eBPF socket filters which drop short frames, tunnel\n\
+       packets with IP options or unknown tags, and frames sent out of a\n\
+       border port (by the host or the capsulator) in the kernel\n\
+  -ethertypes:       comma-separated EtherTypes (e.g. 0x0800,0x86DD,0x0806)\n\
+       the border port filters let through, behind any VLAN tag\n\
+       (default: all)\n\
+  -vlans:            comma-separated VLAN IDs the border port filters let\n\
+       through, 0 for untagged frames (default: all)\n\
+  -rate:             TAG:RATE[:BURST] holds the frames of tag TAG to RATE\n\
+       bits per second (with an optional k, M or G), letting BURST bytes\n\
+       through at once after a pause (default: %ums worth); may be given\n\
+       for several tags, and implies -fq\n\
+  -fq, -fair_queue:  have a shaper thread send the frames of all tags,\n\
+       taking turns so that each gets an equal share of the uplink when\n\
+       it is busy (deficit round robin; not with -engine xdp)\n\
+  -quantum:          bytes each tag may send per turn of the shaper\n\
+       (default: %u)\n\
+  -shape_queue:      frames of each border port queue which may wait for\n\
+       the shaper before further ones are dropped (default: %u)\n\
+  -config:           file with further -f, -b and -vb options (one or more\n\
+       per line, '#' starts a comment); on SIGHUP it is read again and\n\
+       border ports and tunnel endpoints are added, removed or changed to\n\
+       match it without a restart (not with -engine xdp)\n\
+  -stats:            file the counters are periodically written to in\n\
+       Prometheus text format (default: none)\n\
+  -stats_interval:   milliseconds between rewrites of the -stats file\n\
+       (default: %u)\n\
+  -v, --verbose:     enables verbose logging to stderr\n\
+  -log_level:        with -v, the forwarding threads log errors, warnings\n\
+       (dropped frames and packets) or every packet: error, warn or\n\
+       packet (default: packet; a release build only has error and warn)\n\
+  -log_sample:       with -v, the forwarding threads log one in N of their\n\
+       messages about each port (default: 1, all)\n\
+  -log_rate:         with -v, most messages per second a forwarding thread\n\
+       logs about each port, 0 for no limit (default: %u); the others are\n\
+       counted and the count is added to the next message logged\n\
+\n\
+Send SIGUSR1 to print all counters to stderr in Prometheus text format.\n"
+
+/**
+ * Appends the CPUs in list (comma-separated numbers or ranges like 2-5) to the
+ * cpus_len CPUs in cpus.  Dies if the list is not valid.
+ */
+static void parse_cpus(const char* list, int** cpus, unsigned* cpus_len) {
+    const char* start;
+    char* end;
+    long first, last;
+
+    start = list;
+    do {
+        first = last = strtol(start, &end, 10);
+        if(end != start && *end == '-') {
+            start = end + 1;
+            last = strtol(start, &end, 10);
+        }
+        if(end == start || first < 0 || last < first || last >= CPU_SETSIZE)
+            die("%s is not a valid list of CPUs", list);
+
+        for(; first <= last; first++) {
+            if(!(*cpus = realloc(*cpus, (*cpus_len + 1) * sizeof(int))))
+                pdie("realloc (CPU list)");
+            (*cpus)[(*cpus_len)++] = first;
+        }
+        start = end + 1;
+    } while(*end == ',');
+
+    if(*end != '\0')
+        die("%s is not a valid list of CPUs", list);
+}
+
+/**
+ * Stores the comma-separated numbers (decimal, or hexadecimal with 0x) in list,
+ * none greater than max, in values[FILTER_MAX_ALLOW].  Dies if the list is not
+ * valid.
+ */
+static void parse_allow_list(const char* list, unsigned long max,
+                             uint16_t* values, unsigned* values_len) {
+    const char* start;
+    unsigned long v;
+    char* end;
+
+    start = list;
+    do {
+        v = strtoul(start, &end, 0);
+        if(end == start || v > max || *values_len == FILTER_MAX_ALLOW)
+            die("%s is not a valid list (of at most %u values up to %lu)",
+                list, FILTER_MAX_ALLOW, max);
+        values[(*values_len)++] = (uint16_t)v;
+        start = end + 1;
+    } while(*end == ',');
+
+    if(*end != '\0')
+        die("%s is not a valid list (of at most %u values up to %lu)",
+            list, FILTER_MAX_ALLOW, max);
+}
+
+/**
+ * Appends the '+'-separated IPs in list to the backups of the tunnel endpoint
+ * of (NBO) in tp.  Dies if one is not valid.
+ */
+static void parse_backups(tunnel_port* tp, uint32_t of, char* list) {
+    struct in_addr in_ip;
+    char* ip;
+
+    for(ip = strtok(list, "+"); ip; ip = strtok(NULL, "+")) {
+        if(inet_aton(ip, &in_ip) == 0)
+            die("%s is not a valid IP address\n", ip);
+        tp->backup_of = realloc(tp->backup_of, (tp->backups_len + 1) * sizeof(uint32_t));
+        tp->backup_ips = realloc(tp->backup_ips, (tp->backups_len + 1) * sizeof(uint32_t));
+        if(!tp->backup_of || !tp->backup_ips)
+            pdie("realloc (backups)");
+        tp->backup_of[tp->backups_len] = of;
+        tp->backup_ips[tp->backups_len++] = in_ip.s_addr;
+    }
+}
+
+/**
+ * Parses a number with an optional k, M or G suffix (powers of 1000) at start,
+ * pointing end past it.
+ */
+static uint64_t parse_scaled(const char* start, char** end) {
+    double v;
+
+    v = strtod(start, end);
+    if(*end == start || v < 0)
+        return 0;
+    switch(**end) {
+    case 'k': v *= 1e3; (*end)++; break;
+    case 'M': v *= 1e6; (*end)++; break;
+    case 'G': v *= 1e9; (*end)++; break;
+    }
+    return (uint64_t)v;
+}
+
+/**
+ * Appends the rate in arg (TAG:RATE[:BURST], RATE in bits per second and BURST
+ * in bytes) to the rates_len rates in rates.  Dies if it is not valid.
+ */
+static void parse_rate(const char* arg, shaper_rate** rates, unsigned* rates_len) {
+    shaper_rate r;
+    char* end;
+
+    r.tag = strtoul(arg, &end, 10);
+    if(end == arg || *end != ':')
+        die("%s is not a valid rate (TAG:RATE[:BURST])", arg);
+    r.rate = parse_scaled(end + 1, &end) / 8;
+    r.burst = 0;
+    if(*end == ':')
+        r.burst = parse_scaled(end + 1, &end);
+    if(*end != '\0' || r.rate == 0)
+        die("%s is not a valid rate (TAG:RATE[:BURST])", arg);
+
+    if(!(*rates = realloc(*rates, (*rates_len + 1) * sizeof(r))))
+        pdie("realloc (rates)");
+    (*rates)[(*rates_len)++] = r;
+}
 
 int main( int argc, char** argv ) {
     struct in_addr in_ip;
-    char *pch_end, *pch_start, done;
+    char *pch_end, *pch_start, *pch_plus, done;
     capsulator c;
     border_port* bp;
     int got_tp_ifrname;
+    unsigned long val;
+    config cf;
+    char err[256];
 
     got_tp_ifrname = 0;
     c.tp.tunnel_dest_ips = NULL;
     c.tp.tunnel_dest_ips_len = 0;
+    c.tp.backup_of = NULL;
+    c.tp.backup_ips = NULL;
+    c.tp.backups_len = 0;
+    c.tp.xdp_stats = NULL;
     c.bp = NULL;
     c.bp_len = 0;
+    c.rx_ring = 1;
+    c.batch = EGRESS_DEFAULT_BATCH;
+    c.flush_us = EGRESS_DEFAULT_FLUSH_US;
+    c.tunnel_workers = 1;
+    c.tunnel_cpus = NULL;
+    c.tunnel_cpus_len = 0;
+    c.border_cpus = NULL;
+    c.border_cpus_len = 0;
+    c.busy_poll_us = 0;
+    c.spin = NULL;
+    c.engine = CAPSULATOR_ENGINE_THREADS;
+    c.stats_path = NULL;
+    c.stats_interval_ms = STATS_DEFAULT_INTERVAL_MS;
+    c.tap_queues = 1;
+    c.vnet_hdr_len = 0;
+    c.udp_port = 0;
+    c.udp_sources = EGRESS_DEFAULT_UDP_SOURCES;
+    c.udp_offload = 1;
+    c.frag = 0;
+    c.hdrincl = 0;
+    c.keepalive_ms = 0;
+    c.keepalive = NULL;
+    c.socket_filters = 1;
+    memset(&c.allow, 0, sizeof(c.allow));
+    c.shape = 0;
+    c.shape_rates = NULL;
+    c.shape_rates_len = 0;
+    c.shape_quantum = SHAPER_DEFAULT_QUANTUM;
+    c.shape_queue = SHAPER_DEFAULT_RING;
+    c.shaper = NULL;
+    c.learn = 0;
+    c.learn_age = MAC_TABLE_DEFAULT_AGE;
+    c.macs = NULL;
+    c.config_path = NULL;
     
     broadcast = 0;
     /* parse command-line arguments */
     unsigned i;
     for( i=1; i<argc || argc<=1; i++ ) {
         if( argc<=1 || str_matches(argv[i], 5, "-?", "-help", "--help", "help", "?") ) {
-            printf( STR_USAGE, STR_VERSION, (argc>0) ? argv[0] : "capsulator" );
+            printf( STR_USAGE, STR_VERSION, (argc>0) ? argv[0] : "capsulator",
+                    MAC_TABLE_DEFAULT_AGE,
+                    EGRESS_DEFAULT_BATCH, EGRESS_DEFAULT_FLUSH_US,
+                    EGRESS_DEFAULT_UDP_SOURCES,
+                    KEEPALIVE_MISSES, KEEPALIVE_DEFAULT_INTERVAL_MS,
+                    SHAPER_DEFAULT_BURST_MS,
+                    SHAPER_DEFAULT_QUANTUM, SHAPER_DEFAULT_RING,
+                    STATS_DEFAULT_INTERVAL_MS, LOG_DEFAULT_RATE );
             return 0;
         }
         else if( str_matches(argv[i], 3, "-t", "-tunnel_intf", "--tunnel_intf") ) {
@@ -74,6 +351,11 @@ int main( int argc, char** argv ) {
                 else
                     done = 1;
 
+                /* backups of the endpoint follow it, '+'-separated */
+                pch_plus = strchr(pch_start, '+');
+                if(pch_plus)
+                    *pch_plus = '\0';
+
                 /* parse the string */
                 if(inet_aton(pch_start, &in_ip) == 0)
                     die("%s is not a valid IP address\n", pch_start);
@@ -84,6 +366,8 @@ int main( int argc, char** argv ) {
                     c.tp.tunnel_dest_ips[c.tp.tunnel_dest_ips_len - 1] = in_ip.s_addr;
                 else
                     pdie("realloc (tunnel_dest_ips)");
+                if(pch_plus)
+                    parse_backups(&c.tp, in_ip.s_addr, pch_plus + 1);
 
                 /* go to the start of the next IP, if any */
                 if(!done)
@@ -159,15 +443,280 @@ int main( int argc, char** argv ) {
             verbose = 1;
 
         }
+        else if( str_matches(argv[i], 2, "-log_level", "--log_level") ) {
+            i += 1;
+            if( i == argc )
+                die("-log_level requires a level to be specified");
+
+            if( strcmp(argv[i], "error") == 0 )
+                log_level = LOG_ERROR;
+            else if( strcmp(argv[i], "warn") == 0 )
+                log_level = LOG_WARN;
+            else if( strcmp(argv[i], "packet") == 0 )
+                log_level = LOG_PACKET;
+            else
+                die("-log_level must be error, warn or packet");
+        }
+        else if( str_matches(argv[i], 2, "-log_sample", "--log_sample") ) {
+            i += 1;
+            if( i == argc )
+                die("-log_sample requires a number of messages to be specified");
+
+            log_sample = strtoul(argv[i], NULL, 10);
+            if( log_sample == 0 )
+                die("-log_sample must be at least 1");
+        }
+        else if( str_matches(argv[i], 2, "-log_rate", "--log_rate") ) {
+            i += 1;
+            if( i == argc )
+                die("-log_rate requires a number of messages per second to be specified");
+
+            log_rate = strtoul(argv[i], NULL, 10);
+        }
         else if( str_matches(argv[i], 3, "-a", "-all", "--all") ) {
             broadcast = 1;
         }
+        else if( str_matches(argv[i], 2, "-learn", "--learn") ) {
+            c.learn = 1;
+        }
+        else if( str_matches(argv[i], 2, "-learn_age", "--learn_age") ) {
+            i += 1;
+            if( i == argc )
+                die("-learn_age requires a time in seconds to be specified");
+            c.learn_age = strtoul(argv[i], NULL, 10);
+        }
+        else if( str_matches(argv[i], 3, "-nr", "-no_rx_ring", "--no_rx_ring") ) {
+            c.rx_ring = 0;
+        }
+        else if( str_matches(argv[i], 2, "-batch", "--batch") ) {
+            i += 1;
+            if( i == argc )
+                die("-batch requires a number of frames to be specified");
+
+            c.batch = strtoul(argv[i], NULL, 10);
+            if( c.batch == 0 )
+                die("-batch must be at least 1");
+        }
+        else if( str_matches(argv[i], 3, "-flush_us", "-flush", "--flush_us") ) {
+            i += 1;
+            if( i == argc )
+                die("-flush_us requires a time in microseconds to be specified");
+
+            c.flush_us = strtoul(argv[i], NULL, 10);
+        }
+        else if( str_matches(argv[i], 3, "-tw", "-tunnel_workers", "--tunnel_workers") ) {
+            i += 1;
+            if( i == argc )
+                die("-tw requires a number of threads to be specified");
+
+            c.tunnel_workers = strtoul(argv[i], NULL, 10);
+            if( c.tunnel_workers == 0 )
+                die("-tw must be at least 1");
+        }
+        else if( str_matches(argv[i], 3, "-tc", "-tunnel_cpus", "--tunnel_cpus") ) {
+            i += 1;
+            if( i == argc )
+                die("-tc requires a list of CPUs to be specified");
+
+            parse_cpus(argv[i], &c.tunnel_cpus, &c.tunnel_cpus_len);
+        }
+        else if( str_matches(argv[i], 3, "-bc", "-border_cpus", "--border_cpus") ) {
+            i += 1;
+            if( i == argc )
+                die("-bc requires a list of CPUs to be specified");
+
+            parse_cpus(argv[i], &c.border_cpus, &c.border_cpus_len);
+        }
+        else if( str_matches(argv[i], 2, "-busy_poll", "--busy_poll") ) {
+            i += 1;
+            if( i == argc )
+                die("-busy_poll requires a time in microseconds to be specified");
+
+            c.busy_poll_us = strtoul(argv[i], NULL, 10);
+        }
+        else if( str_matches(argv[i], 2, "-spin", "--spin") ) {
+            i += 1;
+            if( i == argc )
+                die("-spin requires a list of ports (or all) to be specified");
+
+            c.spin = argv[i];
+        }
+        else if( str_matches(argv[i], 2, "-engine", "--engine") ) {
+            i += 1;
+            if( i == argc )
+                die("-engine requires an engine (threads, epoll, uring or xdp) to be specified");
+
+            if( str_matches(argv[i], 1, "threads") )
+                c.engine = CAPSULATOR_ENGINE_THREADS;
+            else if( str_matches(argv[i], 1, "epoll") )
+                c.engine = CAPSULATOR_ENGINE_EPOLL;
+            else if( str_matches(argv[i], 1, "uring") )
+                c.engine = CAPSULATOR_ENGINE_URING;
+            else if( str_matches(argv[i], 1, "xdp") )
+                c.engine = CAPSULATOR_ENGINE_XDP;
+            else
+                die("%s is not an engine (threads, epoll, uring or xdp)", argv[i]);
+        }
+        else if( str_matches(argv[i], 2, "-config", "--config") ) {
+            i += 1;
+            if( i == argc )
+                die("-config requires a file name to be specified");
+
+            c.config_path = argv[i];
+        }
+        else if( str_matches(argv[i], 2, "-stats", "--stats") ) {
+            i += 1;
+            if( i == argc )
+                die("-stats requires a file name to be specified");
+
+            c.stats_path = argv[i];
+        }
+        else if( str_matches(argv[i], 2, "-stats_interval", "--stats_interval") ) {
+            i += 1;
+            if( i == argc )
+                die("-stats_interval requires a time in milliseconds to be specified");
+
+            c.stats_interval_ms = strtoul(argv[i], NULL, 10);
+            if( c.stats_interval_ms == 0 )
+                die("-stats_interval must be at least 1");
+        }
+        else if( str_matches(argv[i], 3, "-tq", "-tap_queues", "--tap_queues") ) {
+            i += 1;
+            if( i == argc )
+                die("-tq requires a number of queues to be specified");
+
+            c.tap_queues = strtoul(argv[i], NULL, 10);
+            if( c.tap_queues == 0 )
+                die("-tq must be at least 1");
+        }
+        else if( str_matches(argv[i], 2, "-udp", "--udp") ) {
+            i += 1;
+            if( i == argc )
+                die("-udp requires a port to be specified");
+
+            val = strtoul(argv[i], NULL, 10);
+            if( val == 0 || val > 65535 )
+                die("%s is not a valid UDP port", argv[i]);
+            c.udp_port = htons(val);
+        }
+        else if( str_matches(argv[i], 2, "-no_gso", "--no_gso") ) {
+            c.udp_offload = 0;
+        }
+        else if( str_matches(argv[i], 2, "-no_filter", "--no_filter") ) {
+            c.socket_filters = 0;
+        }
+        else if( str_matches(argv[i], 2, "-ethertypes", "--ethertypes") ) {
+            i += 1;
+            if( i == argc )
+                die("-ethertypes requires a list of EtherTypes to be specified");
+
+            parse_allow_list(argv[i], 0xFFFF, c.allow.ethertypes, &c.allow.ethertypes_len);
+        }
+        else if( str_matches(argv[i], 2, "-vlans", "--vlans") ) {
+            i += 1;
+            if( i == argc )
+                die("-vlans requires a list of VLAN IDs to be specified");
+
+            parse_allow_list(argv[i], 4094, c.allow.vlans, &c.allow.vlans_len);
+        }
+        else if( str_matches(argv[i], 2, "-rate", "--rate") ) {
+            i += 1;
+            if( i == argc )
+                die("-rate requires a tag and rate to be specified");
+
+            parse_rate(argv[i], &c.shape_rates, &c.shape_rates_len);
+            c.shape = 1;
+        }
+        else if( str_matches(argv[i], 3, "-fq", "-fair_queue", "--fair_queue") ) {
+            c.shape = 1;
+        }
+        else if( str_matches(argv[i], 2, "-quantum", "--quantum") ) {
+            i += 1;
+            if( i == argc )
+                die("-quantum requires a number of bytes to be specified");
+
+            c.shape_quantum = strtoul(argv[i], NULL, 10);
+            if( c.shape_quantum == 0 )
+                die("-quantum must be at least 1");
+        }
+        else if( str_matches(argv[i], 2, "-shape_queue", "--shape_queue") ) {
+            i += 1;
+            if( i == argc )
+                die("-shape_queue requires a number of frames to be specified");
+
+            c.shape_queue = strtoul(argv[i], NULL, 10);
+            if( c.shape_queue == 0 )
+                die("-shape_queue must be at least 1");
+        }
+        else if( str_matches(argv[i], 2, "-udp_sources", "--udp_sources") ) {
+            i += 1;
+            if( i == argc )
+                die("-udp_sources requires a number of ports to be specified");
+
+            c.udp_sources = strtoul(argv[i], NULL, 10);
+            if( c.udp_sources == 0 )
+                die("-udp_sources must be at least 1");
+        }
+        else if( str_matches(argv[i], 2, "-vnet", "--vnet") ) {
+            c.vnet_hdr_len = sizeof(struct virtio_net_hdr);
+        }
+        else if( str_matches(argv[i], 2, "-frag", "--frag") ) {
+            c.frag = 1;
+        }
+        else if( str_matches(argv[i], 2, "-hdrincl", "--hdrincl") ) {
+            c.hdrincl = 1;
+        }
+        else if( str_matches(argv[i], 2, "-keepalive", "--keepalive") ) {
+            i += 1;
+            if( i == argc )
+                die("-keepalive requires a number of milliseconds to be specified");
+
+            c.keepalive_ms = strtoul(argv[i], NULL, 10);
+            if( c.keepalive_ms == 0 )
+                die("-keepalive must be at least 1");
+        }
+    }
+
+    /* the ports and endpoints of the file follow those of the command line,
+       which a reload leaves alone */
+    c.static_bp_len = c.bp_len;
+    c.static_dests_len = c.tp.tunnel_dest_ips_len;
+    c.static_backups_len = c.tp.backups_len;
+    if( c.config_path ) {
+        if( c.engine == CAPSULATOR_ENGINE_XDP )
+            die("-config cannot be used with -engine xdp");
+        if( config_read(&cf, c.config_path, err, sizeof(err)) != 0 )
+            die("%s", err);
+
+        c.bp = realloc(c.bp, (c.bp_len + cf.ports_len) * sizeof(border_port));
+        c.tp.tunnel_dest_ips = realloc(c.tp.tunnel_dest_ips,
+                                       (c.tp.tunnel_dest_ips_len + cf.dest_ips_len + 1) * sizeof(uint32_t));
+        if( !c.bp || !c.tp.tunnel_dest_ips )
+            pdie("realloc (configuration file)");
+        for( i=0; i<cf.ports_len; i++ ) {
+            bp = &c.bp[c.bp_len++];
+            memset(bp, 0, sizeof(*bp));
+            memcpy(bp->intf, cf.ports[i].intf, IF_NAMESIZE);
+            bp->tag = cf.ports[i].tag;
+            bp->vbp = cf.ports[i].vbp;
+        }
+        memcpy(&c.tp.tunnel_dest_ips[c.tp.tunnel_dest_ips_len], cf.dest_ips,
+               cf.dest_ips_len * sizeof(uint32_t));
+        c.tp.tunnel_dest_ips_len += cf.dest_ips_len;
+        c.tp.backup_of = realloc(c.tp.backup_of, (c.tp.backups_len + cf.backups_len + 1) * sizeof(uint32_t));
+        c.tp.backup_ips = realloc(c.tp.backup_ips, (c.tp.backups_len + cf.backups_len + 1) * sizeof(uint32_t));
+        if( !c.tp.backup_of || !c.tp.backup_ips )
+            pdie("realloc (configuration file)");
+        memcpy(&c.tp.backup_of[c.tp.backups_len], cf.backup_of, cf.backups_len * sizeof(uint32_t));
+        memcpy(&c.tp.backup_ips[c.tp.backups_len], cf.backup_ips, cf.backups_len * sizeof(uint32_t));
+        c.tp.backups_len += cf.backups_len;
+        config_free(&cf);
     }
 
     if( c.tp.tunnel_dest_ips_len == 0 )
         die("you must specify at least one IP to forward tunneled packets to with -f");
 
-    if( c.bp_len == 0)
+    if( c.bp_len == 0 && !c.config_path )
         die("you must specify at least one border port to tunnel packets to and from with -b");
 
     if( !got_tp_ifrname )
@@ -176,6 +725,51 @@ int main( int argc, char** argv ) {
     if ( broadcast == 0 && c.bp_len != c.tp.tunnel_dest_ips_len)
 	die("in non-braodcast mode, number of ip addresses specified with -f must be equal to number of -b and -vb ports");
 
+    if( !c.socket_filters && (c.allow.ethertypes_len || c.allow.vlans_len) )
+        die("-ethertypes and -vlans need the socket filters (not -no_filter)");
+
+    if( c.engine == CAPSULATOR_ENGINE_EPOLL && c.border_cpus_len )
+        die("-bc cannot be used with -engine epoll (its border ports are served by the -tc threads)");
+
+    if( c.engine == CAPSULATOR_ENGINE_URING && c.border_cpus_len )
+        die("-bc cannot be used with -engine uring (its border ports are served by the -tc threads)");
+
+    if( c.engine == CAPSULATOR_ENGINE_XDP ) {
+        for(i=0; i<c.bp_len; i++)
+            if( c.bp[i].vbp )
+                die("-engine xdp cannot serve virtual border port %s (-vb)", c.bp[i].intf);
+        if( c.vnet_hdr_len )
+            die("-engine xdp cannot carry virtio-net headers (-vnet)");
+        if( c.border_cpus_len || c.busy_poll_us || c.spin )
+            die("-bc, -busy_poll and -spin cannot be used with -engine xdp");
+        if( c.allow.ethertypes_len || c.allow.vlans_len )
+            die("-ethertypes and -vlans cannot be used with -engine xdp");
+        if( c.shape )
+            die("-rate and -fq cannot be used with -engine xdp");
+        if( c.frag )
+            die("-frag cannot be used with -engine xdp");
+        if( c.hdrincl )
+            die("-hdrincl cannot be used with -engine xdp (which writes the IP headers itself)");
+        if( c.keepalive_ms || c.tp.backups_len )
+            die("-keepalive and backups cannot be used with -engine xdp");
+    }
+
+    /* backups are only ever taken over by probing */
+    if( c.tp.backups_len && !c.keepalive_ms )
+        c.keepalive_ms = KEEPALIVE_DEFAULT_INTERVAL_MS;
+
+    if( c.hdrincl && c.udp_port )
+        die("-hdrincl cannot be used with -udp");
+
+    for(i=0; c.frag && i<c.bp_len; i++)
+        if( c.bp[i].tag & CAPSULATOR_TAG_FRAG )
+            die("tag %u of %s is too large for -frag (at most %u)",
+                c.bp[i].tag, c.bp[i].intf, CAPSULATOR_TAG_FRAG - 1);
+
+    for(i=0; c.keepalive_ms && i<c.bp_len; i++)
+        if( (c.frag ? c.bp[i].tag | CAPSULATOR_TAG_FRAG : c.bp[i].tag) == CAPSULATOR_TAG_PROBE )
+            die("tag %u of %s is reserved for -keepalive probes", c.bp[i].tag, c.bp[i].intf);
+
     capsulator_run(&c);
     return 0;
 }
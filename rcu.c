@@ -0,0 +1,52 @@
+/* Filename: rcu.c */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "rcu.h"
+
+/** how long (us) rcu_synchronize() sleeps between looks at the readers */
+#define RCU_POLL_US 100
+
+void rcu_init(rcu_domain* d) {
+    d->readers = NULL;
+    d->readers_len = 0;
+    pthread_mutex_init(&d->lock, NULL);
+}
+
+void rcu_register(rcu_domain* d, rcu_reader* r) {
+    rcu_reader** readers;
+
+    r->seq = 0;
+    pthread_mutex_lock(&d->lock);
+    if(!(readers = realloc(d->readers, (d->readers_len + 1) * sizeof(*readers))))
+        pdie("realloc (RCU readers)");
+    d->readers = readers;
+    d->readers[d->readers_len++] = r;
+    pthread_mutex_unlock(&d->lock);
+}
+
+void rcu_synchronize(rcu_domain* d) {
+    struct timespec ts;
+    uint64_t* seen;
+    unsigned i;
+
+    /* order the caller's unpublishing before the looks at the readers */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&d->lock);
+    if(!(seen = malloc((d->readers_len ? d->readers_len : 1) * sizeof(*seen))))
+        pdie("malloc (RCU grace period)");
+    for(i=0; i<d->readers_len; i++)
+        seen[i] = __atomic_load_n(&d->readers[i]->seq, __ATOMIC_ACQUIRE);
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = RCU_POLL_US * 1000L;
+    for(i=0; i<d->readers_len; i++)
+        while((seen[i] & 1) && __atomic_load_n(&d->readers[i]->seq, __ATOMIC_ACQUIRE) == seen[i])
+            nanosleep(&ts, NULL);
+    pthread_mutex_unlock(&d->lock);
+
+    free(seen);
+}
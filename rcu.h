@@ -0,0 +1,62 @@
+/**
+ * Filename: rcu.h
+ * Purpose:  let a control thread replace the tables the forwarding threads
+ *           read without locks: readers announce the stretches in which they
+ *           hold no references (blocked in a system call, say), and the
+ *           writer waits for every reader to pass through one before
+ *           freeing an old table
+ */
+
+#ifndef _RCU_H_
+#define _RCU_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <pthread.h>
+
+/**
+ * The state of one reading thread: odd while it may hold references to shared
+ * tables, even while it holds none (blocked in a system call, say).  Only the
+ * reader writes it.
+ */
+typedef struct rcu_reader {
+    uint64_t seq;
+} __attribute__((aligned(64))) rcu_reader;
+
+/** The readers a writer has to wait for. */
+typedef struct rcu_domain {
+    rcu_reader** readers;
+    unsigned readers_len;
+    pthread_mutex_t lock;
+} rcu_domain;
+
+/** Initializes an empty domain. */
+void rcu_init(rcu_domain* d);
+
+/** Adds reader r (which starts offline) to the domain.  Dies on failure. */
+void rcu_register(rcu_domain* d, rcu_reader* r);
+
+/**
+ * Marks r online: from here until rcu_offline() it may load and use shared
+ * table pointers.
+ */
+static inline void rcu_online(rcu_reader* r) {
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/** Marks r offline: it holds no references until it goes online again. */
+static inline void rcu_offline(rcu_reader* r) {
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Waits until every reader which was online when called has been offline
+ * since, so nothing unpublished before the call is referenced any more and it
+ * may be freed.
+ */
+void rcu_synchronize(rcu_domain* d);
+
+#endif /* _RCU_H_ */
@@ -0,0 +1,129 @@
+/* Filename: rx_ring.c */
+
+#include <linux/if_packet.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "rx_ring.h"
+
+/** returns the descriptor of block i */
+static struct tpacket_block_desc* rx_ring_block(rx_ring* r, unsigned i) {
+    return (struct tpacket_block_desc*)(r->map + (size_t)i * RX_RING_BLOCK_SIZE);
+}
+
+/**
+ * Takes the ring (if any) off fd and puts it back to TPACKET_V1, so the kernel
+ * queues frames for read() again rather than into a ring nobody maps.
+ */
+static void rx_ring_undo(int fd) {
+    struct tpacket_req3 req;
+    int ver;
+
+    memset(&req, 0, sizeof(req));
+    setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+    ver = TPACKET_V1;
+    setsockopt(fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver));
+}
+
+rx_ring* rx_ring_create(int fd) {
+    struct tpacket_req3 req;
+    rx_ring* r;
+    int ver;
+
+    ver = TPACKET_V3;
+    if(setsockopt(fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0)
+        return NULL;
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = RX_RING_BLOCK_SIZE;
+    req.tp_block_nr = RX_RING_BLOCK_NR;
+    req.tp_frame_size = RX_RING_FRAME_SIZE;
+    req.tp_frame_nr = (RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE) * RX_RING_BLOCK_NR;
+    req.tp_retire_blk_tov = RX_RING_BLOCK_TIMEOUT_MS;
+    if(setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        rx_ring_undo(fd);
+        return NULL;
+    }
+
+    if(!(r = malloc(sizeof(*r)))) {
+        rx_ring_undo(fd);
+        return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->map_len = (size_t)RX_RING_BLOCK_SIZE * RX_RING_BLOCK_NR;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, 0);
+    if(r->map == MAP_FAILED) {
+        free(r);
+        rx_ring_undo(fd);
+        return NULL;
+    }
+
+    return r;
+}
+
+int rx_ring_ready(rx_ring* r) {
+    struct tpacket_block_desc* pbd;
+
+    if(r->pkts_left)
+        return 1;
+
+    pbd = rx_ring_block(r, r->cur);
+    if(!(__atomic_load_n(&pbd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+        return 0;
+
+    r->held = 1;
+    r->pkts_left = pbd->hdr.bh1.num_pkts;
+    r->pkt = (uint8_t*)pbd + pbd->hdr.bh1.offset_to_first_pkt;
+    return 1;
+}
+
+int rx_ring_wait(rx_ring* r, int timeout_ms) {
+    struct pollfd pfd;
+    int ret;
+
+    while(!rx_ring_ready(r)) {
+        pfd.fd = r->fd;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+        r->polls += 1;
+        if((ret = poll(&pfd, 1, timeout_ms)) <= 0)
+            return ret;
+    }
+
+    return 1;
+}
+
+uint8_t* rx_ring_next_frame(rx_ring* r, unsigned* len) {
+    struct tpacket3_hdr* ppd;
+
+    if(!r->pkts_left)
+        return NULL;
+
+    ppd = (struct tpacket3_hdr*)r->pkt;
+    r->pkt += ppd->tp_next_offset;
+    r->pkts_left -= 1;
+
+    *len = ppd->tp_snaplen;
+    return (uint8_t*)ppd + ppd->tp_mac;
+}
+
+void rx_ring_release(rx_ring* r) {
+    if(!r->held)
+        return;
+
+    __atomic_store_n(&rx_ring_block(r, r->cur)->hdr.bh1.block_status,
+                     TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    r->cur = (r->cur + 1) % RX_RING_BLOCK_NR;
+    r->held = 0;
+    r->pkts_left = 0;
+}
+
+void rx_ring_destroy(rx_ring* r) {
+    munmap(r->map, r->map_len);
+    free(r);
+}
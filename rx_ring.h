@@ -0,0 +1,93 @@
+/**
+ * Filename: rx_ring.h
+ * Purpose:  TPACKET_V3 memory-mapped receive ring for raw packet sockets
+ */
+
+#ifndef _RX_RING_H_
+#define _RX_RING_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <stddef.h> /* size_t */
+
+/** size of each block in the ring (must be a power-of-two number of pages) */
+#define RX_RING_BLOCK_SIZE (1 << 18)
+
+/** number of blocks in the ring */
+#define RX_RING_BLOCK_NR 64
+
+/** nominal frame size used to size the ring (V3 frames are variable length) */
+#define RX_RING_FRAME_SIZE 2048
+
+/** how long (ms) the kernel may hold a partially filled block before handing
+    it to user space; bounds the latency added by the ring at low rates */
+#define RX_RING_BLOCK_TIMEOUT_MS 1
+
+/**
+ * A TPACKET_V3 block ring mapped onto a packet socket.  Frames are walked in
+ * place; a block is handed back to the kernel once all its frames were read.
+ */
+typedef struct rx_ring {
+    /** packet socket the ring is attached to */
+    int fd;
+
+    /** the mapped ring and its length */
+    uint8_t* map;
+    size_t map_len;
+
+    /** index of the block currently being walked */
+    unsigned cur;
+
+    /** non-zero if the current block is owned by user space */
+    int held;
+
+    /** next frame to return from the current block and frames left in it */
+    uint8_t* pkt;
+    unsigned pkts_left;
+
+    /** number of times rx_ring_wait() had to poll() */
+    uint64_t polls;
+} rx_ring;
+
+/**
+ * Switches fd to TPACKET_V3 and maps a receive ring onto it.
+ *
+ * @return the new ring, or NULL if the kernel refused (fd is left usable with
+ *         plain read() in that case)
+ */
+rx_ring* rx_ring_create(int fd);
+
+/**
+ * Checks, without a system call, whether there is at least one frame to read
+ * from the ring.
+ *
+ * @return 1 if frames are ready, 0 otherwise
+ */
+int rx_ring_ready(rx_ring* r);
+
+/**
+ * Waits until there is at least one frame to read from the ring.
+ *
+ * @param timeout_ms  maximum time to wait, or -1 to wait forever
+ *
+ * @return 1 if frames are ready, 0 on timeout, -1 on error (errno is set)
+ */
+int rx_ring_wait(rx_ring* r, int timeout_ms);
+
+/**
+ * Returns the next frame in the current block and stores its length in len.
+ * Frames stay valid until the block is handed back with rx_ring_release().
+ *
+ * @return the frame, or NULL once the current block has been exhausted
+ */
+uint8_t* rx_ring_next_frame(rx_ring* r, unsigned* len);
+
+/** Hands the exhausted current block back to the kernel. */
+void rx_ring_release(rx_ring* r);
+
+/** Unmaps the ring (the socket is left open). */
+void rx_ring_destroy(rx_ring* r);
+
+#endif /* _RX_RING_H_ */
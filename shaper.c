@@ -0,0 +1,373 @@
+/* Filename: shaper.c */
+
+#define _GNU_SOURCE /* ppoll */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "shaper.h"
+
+/** most time (ns) a token bucket is refilled for at once, so the product with
+    its rate cannot overflow (the bucket's depth caps it anyway) */
+#define SHAPER_MAX_REFILL_NS 100000000L
+
+/** time (us) a detach waits between checks on the shaper thread */
+#define SHAPER_DETACH_POLL_US 100
+
+shaper_ring* shaper_ring_create(unsigned entries, unsigned slot_size,
+                                uint32_t tag, egress* out) {
+    shaper_ring* r = NULL;
+    unsigned i, n;
+
+    for(n=1; n<entries; n*=2)
+        ;
+
+    if(posix_memalign((void**)&r, 64, sizeof(*r)) != 0)
+        pdie("posix_memalign (shaper ring)");
+    memset(r, 0, sizeof(*r));
+    r->mask = n - 1;
+    r->slot_size = slot_size;
+    r->tag = tag;
+    r->out = out;
+    r->entries = calloc(n, sizeof(*r->entries));
+    r->bufs = malloc(n * sizeof(*r->bufs));
+    if(!r->entries || !r->bufs)
+        pdie("malloc (shaper ring)");
+    r->pool = buf_pool_create(n, slot_size);
+    for(i=0; i<n; i++)
+        r->bufs[i] = (char*)buf_pool_get(r->pool);
+    return r;
+}
+
+void shaper_ring_destroy(shaper_ring* r) {
+    free(r->entries);
+    buf_pool_destroy(r->pool);
+    free(r->bufs);
+    free(r);
+}
+
+/** returns the buffer of entry i of r */
+static char* shaper_ring_buf(shaper_ring* r, uint32_t i) {
+    return r->bufs[i & r->mask];
+}
+
+/** wakes the shaper thread of s if it sleeps */
+static void shaper_wake(shaper* s) {
+    uint64_t one;
+
+    if(!__atomic_exchange_n(&s->asleep, 0, __ATOMIC_SEQ_CST))
+        return;
+    one = 1;
+    if(write(s->wake_fd, &one, sizeof(one)) < 0)
+        verbose_println("shaper: unable to wake up the thread (%s)", strerror(errno));
+}
+
+char* shaper_ring_slot(shaper_ring* r) {
+    if(r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask)
+        return NULL;
+    return shaper_ring_buf(r, r->head);
+}
+
+int shaper_ring_push(shaper_ring* r, int dest, const char* data, unsigned len,
+                     uint32_t hash) {
+    shaper_entry* e;
+    char* slot;
+
+    if(!(slot = shaper_ring_slot(r)) || len > r->slot_size)
+        return -1;
+
+    /* a frame read into the slot may start behind a header in front of it */
+    if(data != slot)
+        memmove(slot, data, len);
+    e = &r->entries[r->head & r->mask];
+    e->len = len;
+    e->dest = dest;
+    e->hash = hash;
+    /* the store and the load are ordered against the thread's going to
+       sleep, so it either sees the frame or is woken for it */
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+    if(r->owner && __atomic_load_n(&r->owner->asleep, __ATOMIC_SEQ_CST))
+        shaper_wake(r->owner);
+    return 0;
+}
+
+/** returns the class of tag, creating it (at rate 0 unless s has one for the
+    tag) if there is none */
+static shaper_class* shaper_class_of(shaper* s, uint32_t tag) {
+    shaper_class* k;
+    unsigned i;
+
+    for(i=0; i<s->classes_len; i++)
+        if(s->classes[i].tag == tag)
+            return &s->classes[i];
+
+    if(!(s->classes = realloc(s->classes, (s->classes_len + 1) * sizeof(*s->classes))))
+        pdie("realloc (shaper classes)");
+    k = &s->classes[s->classes_len++];
+    memset(k, 0, sizeof(*k));
+    k->tag = tag;
+    for(i=0; i<s->rates_len; i++) {
+        if(s->rates[i].tag != tag)
+            continue;
+
+        /* a bucket shallower than a round could never fill for one */
+        k->rate = s->rates[i].rate;
+        k->burst = s->rates[i].burst;
+        if(!k->burst)
+            k->burst = k->rate * SHAPER_DEFAULT_BURST_MS / 1000;
+        if(k->burst < s->quantum)
+            k->burst = s->quantum;
+        k->burst *= 1000000000ULL;
+        k->tokens = k->burst;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &k->filled);
+    return k;
+}
+
+/**
+ * Gives the rings the shaper has taken frames from but not yet sent back to
+ * their producers, once the frames have left.
+ */
+static void shaper_flush(shaper* s) {
+    shaper_class* k;
+    shaper_ring* r;
+    unsigned i, j;
+
+    for(i=0; i<s->classes_len; i++) {
+        k = &s->classes[i];
+        for(j=0; j<k->rings_len; j++) {
+            r = k->rings[j];
+            if(r->taken == r->tail)
+                continue;
+            egress_flush(r->out);
+            __atomic_store_n(&r->tail, r->taken, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/** carries out the attach and detach requests waiting in the mail */
+static void shaper_read_mail(shaper* s) {
+    shaper_class* k;
+    shaper_ring* r;
+    unsigned i, j;
+
+    pthread_mutex_lock(&s->lock);
+    for(i=0; i<s->mail_len; i++) {
+        r = s->mail[i].ring;
+        k = shaper_class_of(s, r->tag);
+        if(s->mail[i].attach) {
+            if(!(k->rings = realloc(k->rings, (k->rings_len + 1) * sizeof(*k->rings))))
+                pdie("realloc (shaper rings)");
+            r->taken = r->tail;
+            k->rings[k->rings_len++] = r;
+            continue;
+        }
+
+        for(j=0; j<k->rings_len && k->rings[j] != r; j++)
+            ;
+        if(j < k->rings_len)
+            k->rings[j] = k->rings[--k->rings_len];
+        __atomic_store_n(&r->released, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&s->mail_len, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/** adds the tokens k earned since it was last filled at time now */
+static void shaper_refill(shaper_class* k, const struct timespec* now) {
+    long ns;
+
+    ns = (now->tv_sec - k->filled.tv_sec) * 1000000000L
+       + (now->tv_nsec - k->filled.tv_nsec);
+    k->filled = *now;
+    if(ns > SHAPER_MAX_REFILL_NS)
+        ns = SHAPER_MAX_REFILL_NS;
+    if(ns > 0)
+        k->tokens += (uint64_t)ns * k->rate;
+    if(k->tokens > k->burst)
+        k->tokens = k->burst;
+}
+
+/**
+ * Serves class k for one round: its rings take turns sending one frame each
+ * until its deficit or tokens run out or they are empty.
+ *
+ * @return the number of frames sent, or -1 if none was while frames wait
+ */
+static int shaper_serve(shaper* s, shaper_class* k) {
+    shaper_entry* e;
+    shaper_ring* r;
+    uint64_t cost;
+    unsigned empty;
+    int sent;
+
+    /* a class kept waiting by its bucket saves up no more than one extra
+       round, so it cannot burst past its share once it may send again */
+    if(k->deficit < (long)s->quantum)
+        k->deficit += s->quantum;
+
+    sent = 0;
+    empty = 0;
+    k->wait_ns = 0;
+    while(empty < k->rings_len) {
+        r = k->rings[k->next++ % k->rings_len];
+        if(r->taken == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+            empty += 1;
+            continue;
+        }
+
+        e = &r->entries[r->taken & r->mask];
+        cost = (uint64_t)e->len * 1000000000ULL;
+        if((long)e->len > k->deficit || (k->rate && cost > k->tokens)) {
+            if(!sent && k->rate && cost > k->tokens)
+                k->wait_ns = (long)((cost - k->tokens + k->rate - 1) / k->rate);
+            return sent ? sent : -1;
+        }
+        egress_queue_dest(r->out, e->dest, shaper_ring_buf(r, r->taken), e->len, e->hash);
+        r->taken += 1;
+        k->deficit -= e->len;
+        if(k->rate)
+            k->tokens -= cost;
+        sent += 1;
+        empty = 0;
+    }
+
+    /* an idle class does not bank its share */
+    k->deficit = 0;
+    return sent;
+}
+
+/**
+ * Returns whether s has mail, or frames waiting in a class its bucket does not
+ * hold back (those held back are for the timeout of shaper_sleep())
+ */
+static int shaper_pending(shaper* s) {
+    shaper_class* k;
+    shaper_ring* r;
+    unsigned i, j;
+
+    if(__atomic_load_n(&s->mail_len, __ATOMIC_SEQ_CST))
+        return 1;
+    for(i=0; i<s->classes_len; i++) {
+        k = &s->classes[i];
+        for(j=0; !k->wait_ns && j<k->rings_len; j++) {
+            r = k->rings[j];
+            if(r->taken != __atomic_load_n(&r->head, __ATOMIC_SEQ_CST))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Blocks the shaper thread until a frame or mail comes for it, or for up to ns
+ * nanoseconds (forever if ns < 0), when a bucket will let a frame go.
+ */
+static void shaper_sleep(shaper* s, long ns) {
+    struct pollfd pfd;
+    struct timespec ts;
+    uint64_t n;
+
+    /* announce the sleep before the last look, so a producer either sees it
+       and wakes the thread or pushed in time to be seen */
+    __atomic_store_n(&s->asleep, 1, __ATOMIC_SEQ_CST);
+    if(!shaper_pending(s)) {
+        ts.tv_sec = ns / 1000000000L;
+        ts.tv_nsec = ns % 1000000000L;
+        pfd.fd = s->wake_fd;
+        pfd.events = POLLIN;
+        if(ppoll(&pfd, 1, (ns < 0) ? NULL : &ts, NULL) < 0 && errno != EINTR)
+            verbose_println("shaper: ppoll failed (%s)", strerror(errno));
+    }
+    __atomic_store_n(&s->asleep, 0, __ATOMIC_SEQ_CST);
+    if(read(s->wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        verbose_println("shaper: read from event fd failed (%s)", strerror(errno));
+}
+
+/** the shaper thread: deficit round robin over the tags, forever */
+static void* shaper_thread_main(void* arg) {
+    shaper* s;
+    struct timespec now;
+    unsigned i;
+    long wait_ns;
+    int n, sent;
+
+    s = arg;
+    while(1) {
+        if(__atomic_load_n(&s->mail_len, __ATOMIC_ACQUIRE)) {
+            shaper_flush(s);
+            shaper_read_mail(s);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        sent = 0;
+        wait_ns = -1;
+        for(i=0; i<s->classes_len; i++) {
+            if(!s->classes[i].rings_len)
+                continue;
+            if(s->classes[i].rate)
+                shaper_refill(&s->classes[i], &now);
+            if((n = shaper_serve(s, &s->classes[i])) > 0)
+                sent += n;
+            if(s->classes[i].wait_ns && (wait_ns < 0 || s->classes[i].wait_ns < wait_ns))
+                wait_ns = s->classes[i].wait_ns;
+        }
+        shaper_flush(s);
+
+        /* nothing to send, or nothing the buckets allow until the soonest
+           refill */
+        if(!sent)
+            shaper_sleep(s, wait_ns);
+    }
+    return NULL;
+}
+
+shaper* shaper_create(const shaper_rate* rates, unsigned rates_len,
+                      unsigned quantum, unsigned max_frame) {
+    shaper* s;
+
+    if(!(s = calloc(1, sizeof(*s))))
+        pdie("malloc (shaper)");
+    if(rates_len && !(s->rates = malloc(rates_len * sizeof(*s->rates))))
+        pdie("malloc (shaper rates)");
+    if(rates_len)
+        memcpy(s->rates, rates, rates_len * sizeof(*s->rates));
+    s->rates_len = rates_len;
+    s->quantum = (quantum < max_frame) ? max_frame : quantum;
+    pthread_mutex_init(&s->lock, NULL);
+    if((s->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+        pdie("eventfd (shaper)");
+
+    if(pthread_create(&s->tid, NULL, shaper_thread_main, s) != 0)
+        pdie("pthread_create (shaper)");
+    pthread_detach(s->tid);
+    return s;
+}
+
+/** hands a request for r to the shaper thread */
+static void shaper_post(shaper* s, shaper_ring* r, int attach) {
+    pthread_mutex_lock(&s->lock);
+    if(!(s->mail = realloc(s->mail, (s->mail_len + 1) * sizeof(*s->mail))))
+        pdie("realloc (shaper mail)");
+    s->mail[s->mail_len].ring = r;
+    s->mail[s->mail_len].attach = attach;
+    __atomic_store_n(&s->mail_len, s->mail_len + 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&s->lock);
+    shaper_wake(s);
+}
+
+void shaper_attach(shaper* s, shaper_ring* r) {
+    r->owner = s;
+    shaper_post(s, r, 1);
+}
+
+void shaper_detach(shaper* s, shaper_ring* r) {
+    shaper_post(s, r, 0);
+    while(!__atomic_load_n(&r->released, __ATOMIC_ACQUIRE))
+        usleep(SHAPER_DETACH_POLL_US);
+}
@@ -0,0 +1,182 @@
+/**
+ * Filename: shaper.h
+ * Purpose:  share the tunnel uplink between tags: border port queues hand their
+ *           frames to a shaper thread through lock-free rings, and it sends
+ *           them by deficit round robin across the tags, each held to the rate
+ *           of its token bucket
+ */
+
+#ifndef _SHAPER_H_
+#define _SHAPER_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <pthread.h>
+#include <time.h> /* struct timespec */
+
+#include "egress.h"
+
+/** default number of bytes each tag may send per round */
+#define SHAPER_DEFAULT_QUANTUM 16384
+
+/** default number of frames a border port queue may have waiting */
+#define SHAPER_DEFAULT_RING 256
+
+/** default depth of a token bucket, in ms of its rate */
+#define SHAPER_DEFAULT_BURST_MS 10
+
+/** The rate a tag is held to. */
+typedef struct shaper_rate {
+    uint32_t tag;
+
+    /** bytes per second, and how many may be sent at once after a pause (0
+        for the default) */
+    uint64_t rate;
+    uint64_t burst;
+} shaper_rate;
+
+/** A frame waiting in a ring, as egress_queue_dest() takes it. */
+typedef struct shaper_entry {
+    unsigned len;
+    int dest;
+    uint32_t hash;
+} shaper_entry;
+
+/**
+ * Frames of one border port queue on their way to the shaper thread: a single-
+ * producer, single-consumer ring.  The border port thread fills entries at
+ * head, the shaper thread sends them from tail through out.
+ */
+typedef struct shaper_ring {
+    /** next entry to fill; written by the border port thread only */
+    uint32_t head __attribute__((aligned(64)));
+
+    /** oldest entry still in use; written by the shaper thread only, once
+        the frames before it have left through out */
+    uint32_t tail __attribute__((aligned(64)));
+
+    /** next entry to send (the shaper thread's own) */
+    uint32_t taken;
+
+    shaper_entry* entries;
+    buf_pool* pool;
+    char** bufs;
+    unsigned mask;
+    unsigned slot_size;
+
+    uint32_t tag;
+
+    /** the egress the shaper thread sends the frames through */
+    egress* out;
+
+    /** the shaper the ring is attached to, which a push wakes if it sleeps */
+    struct shaper* owner;
+
+    /** set by the shaper thread once it has let go of the ring */
+    int released;
+} shaper_ring;
+
+/** The frames of one tag: a token bucket and a deficit round robin share. */
+typedef struct shaper_class {
+    uint32_t tag;
+
+    /** bytes per second (0 if unlimited), and the bucket's depth and
+        content, both in nanosecond-bytes (bytes * 1e9) */
+    uint64_t rate;
+    uint64_t burst;
+    uint64_t tokens;
+    struct timespec filled;
+
+    /** time (ns) until the bucket lets the next frame go, if it is what keeps
+        the class waiting (0 if not) */
+    long wait_ns;
+
+    /** bytes the tag may still send this round */
+    long deficit;
+
+    /** the rings of the border port queues with this tag, served round
+        robin from next */
+    shaper_ring** rings;
+    unsigned rings_len;
+    unsigned next;
+} shaper_class;
+
+/** An attach or detach request for the shaper thread. */
+typedef struct shaper_mail {
+    shaper_ring* ring;
+    int attach;
+} shaper_mail;
+
+/**
+ * The shaper and its thread.  The classes belong to the thread; other threads
+ * hand it rings through the mail.
+ */
+typedef struct shaper {
+    shaper_class* classes;
+    unsigned classes_len;
+
+    shaper_rate* rates;
+    unsigned rates_len;
+    unsigned quantum;
+
+    pthread_mutex_t lock;
+    shaper_mail* mail;
+    unsigned mail_len;
+
+    /** an eventfd the thread blocks on when it has nothing it may send, and
+        whether it does (so only the first frame or mail for it writes one) */
+    int wake_fd;
+    int asleep;
+
+    pthread_t tid;
+} shaper;
+
+/**
+ * Creates a shaper and starts its thread.  Tags without a rate are unlimited
+ * but still get no more than their share when the uplink is busy.  Dies on
+ * failure.
+ *
+ * @param quantum  bytes each tag may send per round; raised to max_frame if
+ *                 smaller, so every frame can be sent
+ */
+shaper* shaper_create(const shaper_rate* rates, unsigned rates_len,
+                      unsigned quantum, unsigned max_frame);
+
+/**
+ * Creates a ring of (at least) entries frames of up to slot_size bytes for a
+ * border port queue with tag tag, whose frames leave through out.  Dies on
+ * failure.
+ */
+shaper_ring* shaper_ring_create(unsigned entries, unsigned slot_size,
+                                uint32_t tag, egress* out);
+
+/** Frees r (not its egress), which the shaper must have let go of. */
+void shaper_ring_destroy(shaper_ring* r);
+
+/**
+ * Returns the buffer of the next free entry of r, which a frame may be read
+ * into to be pushed without a copy, or NULL if r is full.
+ */
+char* shaper_ring_slot(shaper_ring* r);
+
+/**
+ * Hands a frame to the shaper thread, copying it unless it was read into
+ * shaper_ring_slot().
+ *
+ * @return 0, or -1 if r is full (the frame is dropped)
+ */
+int shaper_ring_push(shaper_ring* r, int dest, const char* data, unsigned len,
+                     uint32_t hash);
+
+/** Has the shaper thread serve r from its next round. */
+void shaper_attach(shaper* s, shaper_ring* r);
+
+/**
+ * Has the shaper thread let go of r, after sending the frames it took from
+ * it; the rest are dropped.  Returns once it has.
+ */
+void shaper_detach(shaper* s, shaper_ring* r);
+
+#endif /* _SHAPER_H_ */
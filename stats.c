@@ -0,0 +1,382 @@
+/* Filename: stats.c */
+
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "capsulator.h"
+#include "common.h"
+#include "keepalive.h"
+#include "stats.h"
+
+/** how often (ms) the stats thread checks for a dump request */
+#define STATS_POLL_MS 100
+
+/** a counter exported as (part of) a Prometheus metric */
+typedef struct stats_metric {
+    const char* name;
+    const char* help;
+
+    /** extra label (e.g. reason="short_frame"), or NULL */
+    const char* label;
+
+    /** offset of the counter in port_stats */
+    size_t offset;
+} stats_metric;
+
+static const stats_metric stats_metrics[] = {
+    { "capsulator_rx_packets_total", "Packets received by the thread.", NULL,
+      offsetof(port_stats, rx_packets) },
+    { "capsulator_rx_bytes_total", "Bytes received by the thread.", NULL,
+      offsetof(port_stats, rx_bytes) },
+    { "capsulator_tx_packets_total", "Packets sent by the thread.", NULL,
+      offsetof(port_stats, tx_packets) },
+    { "capsulator_tx_bytes_total", "Bytes sent by the thread.", NULL,
+      offsetof(port_stats, tx_bytes) },
+    { "capsulator_drops_total", "Packets dropped in user space, by reason.",
+      "reason=\"short_frame\"", offsetof(port_stats, drop_short) },
+    { "capsulator_drops_total", NULL,
+      "reason=\"ip_options\"", offsetof(port_stats, drop_ip_options) },
+    { "capsulator_drops_total", NULL,
+      "reason=\"unknown_tag\"", offsetof(port_stats, drop_unknown_tag) },
+    { "capsulator_drops_total", NULL,
+      "reason=\"write\"", offsetof(port_stats, drop_write) },
+    { "capsulator_drops_total", NULL,
+      "reason=\"local_destination\"", offsetof(port_stats, drop_local) },
+    { "capsulator_drops_total", NULL,
+      "reason=\"shaper_queue\"", offsetof(port_stats, drop_shaper) },
+    { "capsulator_drops_total", NULL,
+      "reason=\"fragmentation\"", offsetof(port_stats, drop_frag) },
+    { "capsulator_tag_lookups_total", "Tag dispatch table lookups, by result.",
+      "result=\"hit\"", offsetof(port_stats, tag_hits) },
+    { "capsulator_tag_lookups_total", NULL,
+      "result=\"miss\"", offsetof(port_stats, drop_unknown_tag) },
+    { "capsulator_learned_frames_total",
+      "Frames sent only to the endpoint their destination MAC address was learned behind.",
+      NULL, offsetof(port_stats, learned_frames) },
+    { "capsulator_coalesced_packets_total",
+      "Super-packets carrying several tunnel packets (UDP GRO and GSO), by direction.",
+      "direction=\"rx\"", offsetof(port_stats, rx_coalesced) },
+    { "capsulator_coalesced_packets_total", NULL,
+      "direction=\"tx\"", offsetof(port_stats, tx_coalesced) },
+    { "capsulator_fragments_total",
+      "Tunnel packets carrying capsulator fragments, by direction.",
+      "direction=\"rx\"", offsetof(port_stats, rx_fragments) },
+    { "capsulator_fragments_total", NULL,
+      "direction=\"tx\"", offsetof(port_stats, tx_fragments) },
+    { "capsulator_reassembled_frames_total",
+      "Frames reassembled from capsulator fragments.", NULL,
+      offsetof(port_stats, reassembled) },
+    { "capsulator_syscalls_total", "System calls issued on the data path.", NULL,
+      offsetof(port_stats, syscalls) },
+};
+
+/** label values of the FILTER_DROP_* reasons, matching those of the user
+    space drops where they are the same */
+static const char* const stats_filter_reasons[FILTER_DROP_REASONS] = {
+    "short_frame", "outgoing", "ethertype", "vlan", "ip_options", "unknown_tag"
+};
+
+/** bumped by stats_request_dump() */
+static volatile sig_atomic_t stats_dump_requests = 0;
+
+/** packets the kernel dropped before the tunnel port threads' packet sockets
+    could queue them (PACKET_STATISTICS resets on every read, so they are
+    accumulated here and, for the border ports, in border_port) */
+static uint64_t* stats_kernel_drops_tp;
+
+port_stats* stats_alloc(unsigned n) {
+    port_stats* s = NULL;
+
+    if(posix_memalign((void**)&s, STATS_CACHE_LINE, (n ? n : 1) * sizeof(*s)) != 0)
+        pdie("posix_memalign (stats)");
+    memset(s, 0, (n ? n : 1) * sizeof(*s));
+    return s;
+}
+
+/** reads (and thereby resets) the kernel drop count of a packet socket */
+static uint64_t stats_read_kernel_drops(int fd) {
+    struct tpacket_stats_v3 st;
+    socklen_t len;
+
+    len = sizeof(st);
+    memset(&st, 0, sizeof(st));
+    if(getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+        return 0;
+    return st.tp_drops;
+}
+
+/** returns the number of border port slots (ports may be added meanwhile) */
+static unsigned stats_port_slots(capsulator* c) {
+    return __atomic_load_n(&c->bp_len, __ATOMIC_ACQUIRE);
+}
+
+/** returns whether border port slot i holds a port whose state may be read */
+static int stats_port_active(capsulator* c, unsigned i) {
+    return __atomic_load_n(&c->bp[i].active, __ATOMIC_ACQUIRE);
+}
+
+/** adds the kernel drops since the last call to the accumulated counts */
+static void stats_poll_kernel_drops(capsulator* c) {
+    unsigned i;
+
+    for(i=0; i<stats_port_slots(c); i++)
+        if(stats_port_active(c, i) && !c->bp[i].vbp)
+            c->bp[i].kernel_drops += stats_read_kernel_drops(c->bp[i].fd);
+
+    /* a single tunnel port thread reads a raw IP socket, and UDP sockets
+       have no such statistics */
+    if(c->tunnel_workers > 1 && !c->udp_port)
+        for(i=0; i<c->tunnel_workers; i++)
+            stats_kernel_drops_tp[i] += stats_read_kernel_drops(c->tp.worker_fds[i]);
+}
+
+/** reads one counter written by another thread */
+static uint64_t stats_get(const port_stats* s, size_t offset) {
+    return __atomic_load_n((const uint64_t*)((const char*)s + offset), __ATOMIC_RELAXED);
+}
+
+/** reads one counter of queue q of border port i, including what the shaper
+    sent for it (which it counts in a port_stats of its own) */
+static uint64_t stats_get_border(capsulator* c, unsigned i, unsigned q, size_t offset) {
+    border_port* bp;
+
+    bp = &c->bp[i];
+    return stats_get(&bp->stats[q], offset)
+         + (c->shaper ? stats_get(&bp->stats[bp->queues + q], offset) : 0);
+}
+
+/** writes what the keepalive probes found out about the endpoints to fp */
+static void stats_write_keepalive(keepalive* ka, FILE* fp) {
+    char ip[INET_ADDRSTRLEN], active[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    keepalive_endpoint* e;
+    keepalive_path* p;
+    uint64_t history;
+    unsigned i, n, len;
+
+    n = __atomic_load_n(&ka->endpoints_len, __ATOMIC_ACQUIRE);
+    fprintf(fp, "# HELP capsulator_endpoint_up Whether a tunnel endpoint (or backup) answers its keepalive probes.\n");
+    fprintf(fp, "# TYPE capsulator_endpoint_up gauge\n");
+    for(i=0; i<n; i++)
+        if((e = &ka->endpoints[i])->wanted) {
+            addr.s_addr = e->ip;
+            fprintf(fp, "capsulator_endpoint_up{endpoint=\"%s\"} %d\n",
+                    inet_ntop(AF_INET, &addr, ip, sizeof(ip)), __atomic_load_n(&e->up, __ATOMIC_RELAXED));
+        }
+
+    fprintf(fp, "# HELP capsulator_endpoint_rtt_seconds Smoothed round trip time of the keepalive probes to a tunnel endpoint.\n");
+    fprintf(fp, "# TYPE capsulator_endpoint_rtt_seconds gauge\n");
+    for(i=0; i<n; i++)
+        if((e = &ka->endpoints[i])->wanted) {
+            addr.s_addr = e->ip;
+            fprintf(fp, "capsulator_endpoint_rtt_seconds{endpoint=\"%s\"} %.9f\n",
+                    inet_ntop(AF_INET, &addr, ip, sizeof(ip)),
+                    __atomic_load_n(&e->srtt_ns, __ATOMIC_RELAXED) / 1e9);
+        }
+
+    fprintf(fp, "# HELP capsulator_endpoint_loss_ratio Share of the last %u keepalive probes to a tunnel endpoint left unanswered.\n",
+            KEEPALIVE_HISTORY);
+    fprintf(fp, "# TYPE capsulator_endpoint_loss_ratio gauge\n");
+    for(i=0; i<n; i++)
+        if((e = &ka->endpoints[i])->wanted) {
+            addr.s_addr = e->ip;
+            history = __atomic_load_n(&e->history, __ATOMIC_RELAXED);
+            len = __atomic_load_n(&e->history_len, __ATOMIC_RELAXED);
+            if(len < KEEPALIVE_HISTORY)
+                history &= (1ULL << len) - 1;
+            fprintf(fp, "capsulator_endpoint_loss_ratio{endpoint=\"%s\"} %g\n",
+                    inet_ntop(AF_INET, &addr, ip, sizeof(ip)),
+                    len ? (double)(len - __builtin_popcountll(history)) / len : 0.0);
+        }
+
+    fprintf(fp, "# HELP capsulator_endpoint_probes_total Keepalive probes sent to a tunnel endpoint, by result.\n");
+    fprintf(fp, "# TYPE capsulator_endpoint_probes_total counter\n");
+    for(i=0; i<n; i++)
+        if((e = &ka->endpoints[i])->wanted) {
+            addr.s_addr = e->ip;
+            inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+            fprintf(fp, "capsulator_endpoint_probes_total{endpoint=\"%s\",result=\"answered\"} %llu\n",
+                    ip, (unsigned long long)__atomic_load_n(&e->answered, __ATOMIC_RELAXED));
+            fprintf(fp, "capsulator_endpoint_probes_total{endpoint=\"%s\",result=\"lost\"} %llu\n",
+                    ip, (unsigned long long)__atomic_load_n(&e->lost, __ATOMIC_RELAXED));
+        }
+
+    n = __atomic_load_n(&ka->paths_len, __ATOMIC_ACQUIRE);
+    fprintf(fp, "# HELP capsulator_endpoint_active The address the frames to a tunnel endpoint go to: its own or a backup's.\n");
+    fprintf(fp, "# TYPE capsulator_endpoint_active gauge\n");
+    for(i=0; i<n; i++)
+        if((p = &ka->paths[i])->wanted) {
+            addr.s_addr = p->primary;
+            inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+            addr.s_addr = __atomic_load_n(&p->active, __ATOMIC_ACQUIRE);
+            fprintf(fp, "capsulator_endpoint_active{endpoint=\"%s\",address=\"%s\"} 1\n",
+                    ip, inet_ntop(AF_INET, &addr, active, sizeof(active)));
+        }
+
+    fprintf(fp, "# HELP capsulator_endpoint_failovers_total Times the frames to a tunnel endpoint changed address.\n");
+    fprintf(fp, "# TYPE capsulator_endpoint_failovers_total counter\n");
+    for(i=0; i<n; i++)
+        if((p = &ka->paths[i])->wanted) {
+            addr.s_addr = p->primary;
+            fprintf(fp, "capsulator_endpoint_failovers_total{endpoint=\"%s\"} %llu\n",
+                    inet_ntop(AF_INET, &addr, ip, sizeof(ip)),
+                    (unsigned long long)__atomic_load_n(&p->failovers, __ATOMIC_RELAXED));
+        }
+}
+
+void stats_write_prometheus(capsulator* c, FILE* fp) {
+    uint64_t drops[FILTER_DROP_REASONS];
+    const stats_metric* m;
+    unsigned i, j, q;
+
+    for(j=0; j<sizeof(stats_metrics) / sizeof(stats_metrics[0]); j++) {
+        m = &stats_metrics[j];
+        if(m->help) {
+            fprintf(fp, "# HELP %s %s\n", m->name, m->help);
+            fprintf(fp, "# TYPE %s counter\n", m->name);
+        }
+
+        for(i=0; i<stats_port_slots(c); i++)
+            for(q=0; stats_port_active(c, i) && q<c->bp[i].queues; q++)
+                fprintf(fp, "%s{role=\"border\",port=\"%s\",tag=\"%u\",queue=\"%u\"%s%s} %llu\n",
+                        m->name, c->bp[i].intf, c->bp[i].tag, q,
+                        m->label ? "," : "", m->label ? m->label : "",
+                        (unsigned long long)stats_get_border(c, i, q, m->offset));
+
+        for(i=0; i<c->tunnel_workers; i++)
+            fprintf(fp, "%s{role=\"tunnel\",port=\"%s\",worker=\"%u\"%s%s} %llu\n",
+                    m->name, c->tp.intf, i,
+                    m->label ? "," : "", m->label ? m->label : "",
+                    (unsigned long long)stats_get(&c->tp.worker_stats[i], m->offset));
+
+        if(c->tp.xdp_stats)
+            fprintf(fp, "%s{role=\"tunnel\",port=\"%s\",worker=\"xdp\"%s%s} %llu\n",
+                    m->name, c->tp.intf,
+                    m->label ? "," : "", m->label ? m->label : "",
+                    (unsigned long long)stats_get(c->tp.xdp_stats, m->offset));
+    }
+
+    fprintf(fp, "# HELP capsulator_kernel_drops_total Packets the kernel dropped before they reached a packet socket.\n");
+    fprintf(fp, "# TYPE capsulator_kernel_drops_total counter\n");
+    for(i=0; i<stats_port_slots(c); i++)
+        if(stats_port_active(c, i) && !c->bp[i].vbp)
+            fprintf(fp, "capsulator_kernel_drops_total{role=\"border\",port=\"%s\",tag=\"%u\",queue=\"0\"} %llu\n",
+                    c->bp[i].intf, c->bp[i].tag,
+                    (unsigned long long)c->bp[i].kernel_drops);
+    if(c->tunnel_workers > 1 && !c->udp_port)
+        for(i=0; i<c->tunnel_workers; i++)
+            fprintf(fp, "capsulator_kernel_drops_total{role=\"tunnel\",port=\"%s\",worker=\"%u\"} %llu\n",
+                    c->tp.intf, i, (unsigned long long)stats_kernel_drops_tp[i]);
+
+    fprintf(fp, "# HELP capsulator_filter_drops_total Packets the socket filters dropped in the kernel, by reason.\n");
+    fprintf(fp, "# TYPE capsulator_filter_drops_total counter\n");
+    for(i=0; i<stats_port_slots(c); i++) {
+        if(!stats_port_active(c, i) || c->bp[i].filter < 0)
+            continue;
+        filter_counters_read(c->bp[i].filter_counters, drops);
+        for(j=0; j<FILTER_DROP_REASONS; j++)
+            if(j != FILTER_DROP_IP_OPTIONS && j != FILTER_DROP_UNKNOWN_TAG)
+                fprintf(fp, "capsulator_filter_drops_total{role=\"border\",port=\"%s\",tag=\"%u\",reason=\"%s\"} %llu\n",
+                        c->bp[i].intf, c->bp[i].tag, stats_filter_reasons[j],
+                        (unsigned long long)drops[j]);
+    }
+    if(c->tp.filter >= 0) {
+        filter_counters_read(c->tp.filter_counters, drops);
+        for(j=0; j<FILTER_DROP_REASONS; j++)
+            if(j == FILTER_DROP_SHORT || j == FILTER_DROP_IP_OPTIONS || j == FILTER_DROP_UNKNOWN_TAG)
+                fprintf(fp, "capsulator_filter_drops_total{role=\"tunnel\",port=\"%s\",reason=\"%s\"} %llu\n",
+                        c->tp.intf, stats_filter_reasons[j], (unsigned long long)drops[j]);
+    }
+
+    if(c->keepalive)
+        stats_write_keepalive(c->keepalive, fp);
+}
+
+/** rewrites path through a temporary file so readers never see it half done */
+static void stats_write_file(capsulator* c, const char* path) {
+    char tmp[4096];
+    FILE* fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if(!(fp = fopen(tmp, "w"))) {
+        verbose_println("Warning: unable to write stats file %s", tmp);
+        return;
+    }
+    stats_write_prometheus(c, fp);
+    if(fclose(fp) != 0 || rename(tmp, path) != 0)
+        verbose_println("Warning: unable to replace stats file %s", path);
+}
+
+/** arguments of the stats thread */
+typedef struct stats_thread_info {
+    capsulator* c;
+    const char* path;
+    unsigned interval_ms;
+} stats_thread_info;
+
+static void* stats_thread_main(void* vsti) {
+    stats_thread_info* sti;
+    struct timespec ts;
+    sig_atomic_t dumped;
+    unsigned waited;
+    rcu_reader rcu;
+
+    pthread_detach(pthread_self());
+    sti = (stats_thread_info*)vsti;
+    dumped = stats_dump_requests;
+
+    /* border ports removed while running are freed once no dump reads them */
+    rcu_register(&sti->c->rcu, &rcu);
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = STATS_POLL_MS * 1000000L;
+    waited = 0;
+    while(1) {
+        nanosleep(&ts, NULL);
+        waited += STATS_POLL_MS;
+
+        if(dumped != stats_dump_requests) {
+            dumped = stats_dump_requests;
+            rcu_online(&rcu);
+            stats_poll_kernel_drops(sti->c);
+            stats_write_prometheus(sti->c, stderr);
+            rcu_offline(&rcu);
+        }
+
+        if(sti->path && waited >= sti->interval_ms) {
+            waited = 0;
+            rcu_online(&rcu);
+            stats_poll_kernel_drops(sti->c);
+            stats_write_file(sti->c, sti->path);
+            rcu_offline(&rcu);
+        }
+    }
+
+    return NULL;
+}
+
+void stats_start(capsulator* c, const char* path, unsigned interval_ms) {
+    stats_thread_info* sti;
+    pthread_t tid;
+
+    stats_kernel_drops_tp = calloc(c->tunnel_workers, sizeof(uint64_t));
+    if(!(sti = malloc(sizeof(*sti))) || !stats_kernel_drops_tp)
+        pdie("malloc (stats)");
+    sti->c = c;
+    sti->path = path;
+    sti->interval_ms = interval_ms ? interval_ms : STATS_POLL_MS;
+
+    if(pthread_create(&tid, NULL, stats_thread_main, sti) != 0)
+        pdie("pthread_create");
+}
+
+void stats_request_dump(void) {
+    stats_dump_requests += 1;
+}
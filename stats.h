@@ -0,0 +1,106 @@
+/**
+ * Filename: stats.h
+ * Purpose:  per-thread data path counters and their Prometheus text export
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <stdio.h> /* FILE */
+
+/** size of a cache line; each thread's counters start on their own */
+#define STATS_CACHE_LINE 64
+
+/** default interval (ms) between rewrites of the stats file */
+#define STATS_DEFAULT_INTERVAL_MS 1000
+
+/**
+ * Counters of one forwarding thread.  Only the owning thread writes them, with
+ * plain stores (STAT_ADD); the stats thread reads them without locking.
+ */
+typedef struct port_stats {
+    /** packets and bytes read from this thread's port */
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+
+    /** packets and bytes written out by this thread */
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+
+    /** dropped: frame or packet too short to carry an Ethernet frame */
+    uint64_t drop_short;
+
+    /** dropped: tunnel packet whose IP header has options */
+    uint64_t drop_ip_options;
+
+    /** dropped: tunnel packet whose tag no border port terminates */
+    uint64_t drop_unknown_tag;
+
+    /** dropped: the kernel refused or short-counted a write */
+    uint64_t drop_write;
+
+    /** dropped: frame for the shaper, whose queue for this thread was
+        full */
+    uint64_t drop_shaper;
+
+    /** dropped: frame to a MAC address learned on the border side, which
+        needs no tunneling */
+    uint64_t drop_local;
+
+    /** tunnel packets whose tag was found in the dispatch table */
+    uint64_t tag_hits;
+
+    /** frames sent only to the tunnel endpoint their destination MAC address
+        was learned behind, rather than flooded to all of them */
+    uint64_t learned_frames;
+
+    /** super-packets carrying several tunnel packets: received coalesced
+        (UDP GRO) and sent for the kernel to segment (UDP GSO) */
+    uint64_t rx_coalesced;
+    uint64_t tx_coalesced;
+
+    /** tunnel packets carrying capsulator fragments: sent, received, and
+        the frames reassembled from them */
+    uint64_t tx_fragments;
+    uint64_t rx_fragments;
+    uint64_t reassembled;
+
+    /** dropped: frame needing more than FRAG_MAX_COUNT fragments, or partial
+        frame which expired, was evicted or had inconsistent fragments */
+    uint64_t drop_frag;
+
+    /** system calls issued on the data path */
+    uint64_t syscalls;
+} __attribute__((aligned(STATS_CACHE_LINE))) port_stats;
+
+/**
+ * Adds n to counter field of the port_stats s.  Not an atomic read-modify-
+ * write (only the owning thread writes), but a single store the stats thread
+ * can never see torn.
+ */
+#define STAT_ADD(s, field, n) \
+    __atomic_store_n(&(s)->field, (s)->field + (n), __ATOMIC_RELAXED)
+
+/** Allocates n zeroed, cache-line aligned port_stats.  Dies on failure. */
+port_stats* stats_alloc(unsigned n);
+
+struct capsulator;
+
+/** Writes all counters of c in Prometheus text exposition format to fp. */
+void stats_write_prometheus(struct capsulator* c, FILE* fp);
+
+/**
+ * Starts the stats thread.  Every interval_ms it rewrites path (if not NULL)
+ * atomically with the current counters, and whenever stats_request_dump() has
+ * been called it prints them to stderr.
+ */
+void stats_start(struct capsulator* c, const char* path, unsigned interval_ms);
+
+/** Asks the stats thread to print the counters to stderr; signal-safe. */
+void stats_request_dump(void);
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,66 @@
+/* Filename: tag_table.c */
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "tag_table.h"
+
+/** returns the slot for NBO tag, which is empty if the tag is not present */
+static tag_entry* tag_table_find_slot(tag_table* t, uint32_t tag) {
+    unsigned i;
+
+    for(i = tag_table_hash(t, tag); ; i = (i + 1) & t->mask)
+        if(t->slots[i].count == 0 || t->slots[i].tag == tag)
+            return &t->slots[i];
+}
+
+tag_table* tag_table_create(border_port* bp, unsigned bp_len) {
+    tag_table* t;
+    tag_entry* e;
+    unsigned* fill;
+    unsigned i, nslots, offset;
+
+    /* keep the table at most half full so probe sequences stay short */
+    for(nslots = 8; nslots < 2 * bp_len; nslots *= 2);
+
+    if(!(t = calloc(1, sizeof(*t))))
+        pdie("malloc (tag table)");
+    t->mask = nslots - 1;
+    t->slots = calloc(nslots, sizeof(*t->slots));
+    t->ports = calloc(bp_len ? bp_len : 1, sizeof(*t->ports));
+    fill = calloc(nslots, sizeof(*fill));
+    if(!t->slots || !t->ports || !fill)
+        pdie("malloc (tag table)");
+
+    /* count the border ports of each tag */
+    for(i=0; i<bp_len; i++) {
+        if(!bp[i].active)
+            continue;
+        e = tag_table_find_slot(t, htonl(bp[i].tag));
+        e->tag = htonl(bp[i].tag);
+        e->count += 1;
+    }
+
+    /* lay the port indices of each tag out next to each other */
+    offset = 0;
+    for(i=0; i<nslots; i++) {
+        t->slots[i].first = offset;
+        offset += t->slots[i].count;
+    }
+    for(i=0; i<bp_len; i++) {
+        if(!bp[i].active)
+            continue;
+        e = tag_table_find_slot(t, htonl(bp[i].tag));
+        t->ports[e->first + fill[e - t->slots]++] = i;
+    }
+
+    free(fill);
+    return t;
+}
+
+void tag_table_destroy(tag_table* t) {
+    free(t->slots);
+    free(t->ports);
+    free(t);
+}
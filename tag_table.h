@@ -0,0 +1,81 @@
+/**
+ * Filename: tag_table.h
+ * Purpose:  map tunnel tags to the border ports which terminate them in O(1)
+ */
+
+#ifndef _TAG_TABLE_H_
+#define _TAG_TABLE_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include "capsulator.h"
+
+/**
+ * A slot in the open-addressing hash.  The key is kept in network byte order
+ * so lookups can use the tag straight from the packet.
+ */
+typedef struct tag_entry {
+    /** NBO tag of this slot */
+    uint32_t tag;
+
+    /** number of border ports for the tag (0 if the slot is empty) */
+    unsigned count;
+
+    /** offset of the tag's first border port index in tag_table.ports */
+    unsigned first;
+} tag_entry;
+
+/**
+ * Dispatch index from tag to border ports, only read once built, so all tunnel
+ * port threads may share it.  A reload builds a new one rather than changing
+ * it.
+ */
+typedef struct tag_table {
+    /** hash slots (a power-of-two number of them, at most half full) */
+    tag_entry* slots;
+    unsigned mask;
+
+    /** border port indices, grouped by tag */
+    unsigned* ports;
+} tag_table;
+
+/**
+ * Builds the dispatch index for the active ones of the bp_len border ports in
+ * bp.  Dies on failure.
+ */
+tag_table* tag_table_create(border_port* bp, unsigned bp_len);
+
+/** Frees a table no thread reads any more. */
+void tag_table_destroy(tag_table* t);
+
+/** returns the slot a NBO tag hashes to */
+static inline unsigned tag_table_hash(const tag_table* t, uint32_t tag) {
+    return ((tag * 0x9E3779B1u) >> 12) & t->mask;
+}
+
+/**
+ * Looks up the border ports for a NBO tag.
+ *
+ * @param ports  set to the indices (into capsulator.bp) of the ports
+ *
+ * @return the number of border ports for the tag (0 if it is unknown)
+ */
+static inline unsigned tag_table_lookup(const tag_table* t, uint32_t tag,
+                                        const unsigned** ports) {
+    const tag_entry* e;
+    unsigned i;
+
+    for(i = tag_table_hash(t, tag); ; i = (i + 1) & t->mask) {
+        e = &t->slots[i];
+        if(e->count == 0)
+            return 0;
+        if(e->tag == tag) {
+            *ports = &t->ports[e->first];
+            return e->count;
+        }
+    }
+}
+
+#endif /* _TAG_TABLE_H_ */
@@ -0,0 +1,331 @@
+/* Filename: uring.c */
+
+#define _GNU_SOURCE /* struct mmsghdr */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "uring.h"
+
+/** number of opcodes asked about when probing */
+#define URING_PROBE_OPS 256
+
+static int uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(uring* r, unsigned op, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, r->fd, op, arg, nr_args);
+}
+
+int uring_init(uring* r, unsigned sq_entries, unsigned cq_entries) {
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(r, 0, sizeof(*r));
+    r->sq_map = r->cq_map = r->sqes = MAP_FAILED;
+
+    /* completions are only run when the owner asks for them, which saves
+       interrupting it for every packet; older kernels lack the flags */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = cq_entries;
+    if((r->fd = uring_setup(sq_entries, &p)) < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+        r->fd = uring_setup(sq_entries, &p);
+    }
+    if(r->fd < 0)
+        return -1;
+    r->features = p.features;
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(r->features & IORING_FEAT_SINGLE_MMAP) {
+        if(r->cq_map_len > r->sq_map_len)
+            r->sq_map_len = r->cq_map_len;
+        r->cq_map_len = 0;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_map == MAP_FAILED)
+        goto fail;
+    if(r->cq_map_len) {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_map == MAP_FAILED)
+            goto fail;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED)
+        goto fail;
+
+    sq = r->sq_map;
+    cq = r->cq_map_len ? r->cq_map : r->sq_map;
+    r->sq_head = (uint32_t*)(sq + p.sq_off.head);
+    r->sq_tail = (uint32_t*)(sq + p.sq_off.tail);
+    r->sq_array = (uint32_t*)(sq + p.sq_off.array);
+    r->sq_mask = *(uint32_t*)(sq + p.sq_off.ring_mask);
+    r->sq_entries = *(uint32_t*)(sq + p.sq_off.ring_entries);
+    r->sq_local = *r->sq_tail;
+    r->cq_head = (uint32_t*)(cq + p.cq_off.head);
+    r->cq_tail = (uint32_t*)(cq + p.cq_off.tail);
+    r->cq_mask = *(uint32_t*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    uring_destroy(r);
+    return -1;
+}
+
+void uring_destroy(uring* r) {
+    if(r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    if(r->cq_map != MAP_FAILED)
+        munmap(r->cq_map, r->cq_map_len);
+    if(r->sq_map != MAP_FAILED)
+        munmap(r->sq_map, r->sq_map_len);
+    if(r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+}
+
+int uring_supports(uring* r, unsigned op) {
+    struct io_uring_probe* p;
+    int ok;
+
+    p = calloc(1, sizeof(*p) + URING_PROBE_OPS * sizeof(struct io_uring_probe_op));
+    if(!p)
+        pdie("malloc (io_uring probe)");
+    ok = uring_register(r, IORING_REGISTER_PROBE, p, URING_PROBE_OPS) == 0
+         && op <= p->last_op && (p->ops[op].flags & IO_URING_OP_SUPPORTED);
+    free(p);
+    return ok;
+}
+
+struct io_uring_sqe* uring_sqe(uring* r) {
+    struct io_uring_sqe* sqe;
+    uint32_t i;
+
+    if(r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        uring_enter(r, 0);
+        if(r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+            return NULL;
+    }
+
+    i = r->sq_local & r->sq_mask;
+    r->sq_array[i] = i;
+    sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_local += 1;
+    return sqe;
+}
+
+int uring_enter(uring* r, unsigned wait_nr) {
+    unsigned n;
+
+    /* entries the kernel has not consumed yet (an interrupted call may
+       leave some) are submitted again */
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    n = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    return (int)syscall(__NR_io_uring_enter, r->fd, n, wait_nr,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+void uring_prep_recv(struct io_uring_sqe* sqe, int fd, struct msghdr* msg,
+                     uint16_t group, int multishot, uint64_t user_data) {
+    sqe->opcode = msg ? IORING_OP_RECVMSG : IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = msg ? 1 : 0;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = user_data;
+}
+
+char* uring_recvmsg_parse(struct msghdr* msg, char* buf, unsigned res,
+                          struct msghdr* out, unsigned* len) {
+    struct io_uring_recvmsg_out* o;
+    char* payload;
+
+    /* the kernel reserves the room msg asked for whatever it filled in */
+    o = (struct io_uring_recvmsg_out*)buf;
+    memset(out, 0, sizeof(*out));
+    out->msg_name = buf + sizeof(*o);
+    out->msg_namelen = (o->namelen < msg->msg_namelen) ? o->namelen : msg->msg_namelen;
+    out->msg_control = (char*)out->msg_name + msg->msg_namelen;
+    out->msg_controllen = o->controllen;
+    out->msg_flags = o->flags;
+    payload = (char*)out->msg_control + msg->msg_controllen;
+    *len = res - (unsigned)(payload - buf);
+    return payload;
+}
+
+void uring_prep_read_multishot(struct io_uring_sqe* sqe, int fd, uint16_t group,
+                               uint64_t user_data) {
+    sqe->opcode = URING_OP_READ_MULTISHOT;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_poll(struct io_uring_sqe* sqe, int fd, unsigned events,
+                     uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t target, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_timeout(struct io_uring_sqe* sqe, struct __kernel_timespec* ts,
+                        uint64_t user_data) {
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)ts;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+}
+
+int uring_sendmmsg(uring* r, int fd, struct mmsghdr* msgs, unsigned len) {
+    struct io_uring_sqe *sqe, *last;
+    struct io_uring_cqe* cqe;
+    struct msghdr* m;
+    unsigned i, n, done, sent;
+    int err;
+
+    /* the messages are linked, so one which fails cancels the rest and
+       what was sent is a prefix, as with sendmmsg() */
+    n = (len < r->sq_entries) ? len : r->sq_entries;
+    last = NULL;
+    for(i=0; i<n; i++) {
+        if(!(sqe = uring_sqe(r)))
+            break;
+        last = sqe;
+        m = &msgs[i].msg_hdr;
+        sqe->fd = fd;
+        if(!m->msg_name && !m->msg_controllen) {
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->addr = (uintptr_t)m->msg_iov;
+            sqe->len = m->msg_iovlen;
+        }
+        else {
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->addr = (uintptr_t)m;
+            sqe->len = 1;
+        }
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = i;
+    }
+    if(last)
+        last->flags = 0;
+    n = i;
+
+    sent = n;
+    err = 0;
+    for(done=0; done<n; ) {
+        if(!(cqe = uring_cqe(r))) {
+            if(uring_enter(r, n - done) < 0 && errno != EINTR && errno != EAGAIN
+               && errno != EBUSY)
+                return -1;
+            continue;
+        }
+
+        i = (unsigned)cqe->user_data;
+        if(cqe->res >= 0)
+            msgs[i].msg_len = cqe->res;
+        else if(i < sent) {
+            sent = i;
+            err = -cqe->res;
+        }
+        uring_cqe_seen(r);
+        done += 1;
+    }
+
+    if(sent == 0 && n) {
+        errno = err;
+        return -1;
+    }
+    return sent;
+}
+
+uring_bufs* uring_bufs_create(uring* r, uint16_t group, unsigned size) {
+    struct io_uring_buf_reg reg;
+    uring_bufs* b;
+    unsigned count, i;
+
+    for(count=16; count * 2 <= URING_MAX_BUFS && count * 2 * size <= URING_BUFS_BYTES; count*=2)
+        ;
+
+    if(!(b = calloc(1, sizeof(*b))))
+        pdie("malloc (provided buffers)");
+    b->count = count;
+    b->size = size;
+    b->mask = count - 1;
+    b->group = group;
+    if(posix_memalign((void**)&b->ring, sysconf(_SC_PAGESIZE),
+                      count * sizeof(struct io_uring_buf)) != 0
+       || !(b->bufs = malloc(count * sizeof(*b->bufs))))
+        pdie("malloc (provided buffers)");
+    memset(b->ring, 0, count * sizeof(struct io_uring_buf));
+    b->pool = buf_pool_create(count, size);
+    for(i=0; i<count; i++)
+        b->bufs[i] = (char*)buf_pool_get(b->pool);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)b->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if(uring_register(r, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        buf_pool_destroy(b->pool);
+        free(b->bufs);
+        free(b->ring);
+        free(b);
+        return NULL;
+    }
+
+    for(i=0; i<count; i++)
+        uring_bufs_put(b, i);
+    uring_bufs_commit(b);
+    return b;
+}
+
+void uring_bufs_destroy(uring* r, uring_bufs* b) {
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = b->group;
+    uring_register(r, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    buf_pool_destroy(b->pool);
+    free(b->bufs);
+    free(b->ring);
+    free(b);
+}
+
+void uring_bufs_put(uring_bufs* b, unsigned id) {
+    struct io_uring_buf* buf;
+
+    buf = &b->ring->bufs[b->tail & b->mask];
+    buf->addr = (uintptr_t)uring_bufs_data(b, id);
+    buf->len = b->size;
+    buf->bid = id;
+    b->tail += 1;
+}
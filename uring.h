@@ -0,0 +1,198 @@
+/**
+ * Filename: uring.h
+ * Purpose:  io_uring instances driven through their mapped rings with raw
+ *           system calls: receives posted once and completed for every
+ *           packet into provided buffer rings, and batches of messages sent
+ *           with one system call
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <stddef.h>        /* size_t */
+#include <sys/socket.h>    /* struct msghdr, struct mmsghdr */
+#include <linux/io_uring.h>
+
+#include "buf_pool.h"
+
+/** multishot read (Linux 6.7), which older headers do not name */
+#define URING_OP_READ_MULTISHOT 49
+
+/** most bytes of provided buffers per buffer ring, and most buffers */
+#define URING_BUFS_BYTES (8 * 1024 * 1024)
+#define URING_MAX_BUFS   1024
+
+/**
+ * An io_uring instance.  Not thread-safe: one thread submits to it and reaps
+ * its completions.
+ */
+typedef struct uring {
+    int fd;
+
+    /** submission queue: the kernel consumes from head, entries up to the
+        local tail have been prepared (and those up to *sq_tail published) */
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t sq_local;
+    struct io_uring_sqe* sqes;
+
+    /** completion queue: the kernel fills up to tail, the owner reaps from
+        head */
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe* cqes;
+
+    /** IORING_FEAT_* of the kernel */
+    uint32_t features;
+
+    /** the mappings of the rings and of the submission queue entries */
+    void* sq_map;
+    size_t sq_map_len;
+    void* cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+} uring;
+
+/**
+ * A provided buffer ring: buffers of size bytes (from pool) which the kernel
+ * picks for the receives of group group as packets arrive.  A buffer it filled
+ * belongs to the owner until put back and committed.
+ */
+typedef struct uring_bufs {
+    struct io_uring_buf_ring* ring;
+    buf_pool* pool;
+    char** bufs;
+    unsigned count;
+    unsigned size;
+    uint16_t mask;
+    uint16_t group;
+
+    /** buffers put back up to here, of which the kernel sees those up to
+        the last commit */
+    uint16_t tail;
+} uring_bufs;
+
+/**
+ * Sets up r with sq_entries submission and cq_entries completion queue
+ * entries.
+ *
+ * @return 0, or -1 if the kernel has no (usable) io_uring (errno is set)
+ */
+int uring_init(uring* r, unsigned sq_entries, unsigned cq_entries);
+
+/** Closes r (its requests are cancelled). */
+void uring_destroy(uring* r);
+
+/** Returns non-zero if the kernel of r supports opcode op. */
+int uring_supports(uring* r, unsigned op);
+
+/**
+ * Returns a zeroed submission queue entry to prepare, submitting those
+ * prepared so far first if the queue is full, or NULL if it stays full.
+ */
+struct io_uring_sqe* uring_sqe(uring* r);
+
+/**
+ * Submits the prepared entries and waits until at least wait_nr completions
+ * are waiting (0 to only submit and look).
+ *
+ * @return the number of entries submitted, or -1 (errno is set)
+ */
+int uring_enter(uring* r, unsigned wait_nr);
+
+/** Returns the oldest completion not reaped yet, or NULL if there is none. */
+static inline struct io_uring_cqe* uring_cqe(uring* r) {
+    uint32_t head;
+
+    head = *r->cq_head;
+    if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+/** Hands the completion uring_cqe() returned back to the kernel. */
+static inline void uring_cqe_seen(uring* r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Prepares sqe to receive from socket fd (with msg, if not NULL, as for
+ * recvmsg()) into a buffer of group: once, or with multishot for every
+ * packet until cancelled or out of buffers.  With msg each buffer starts with
+ * a struct io_uring_recvmsg_out followed by the address, control data and
+ * packet.
+ */
+void uring_prep_recv(struct io_uring_sqe* sqe, int fd, struct msghdr* msg,
+                     uint16_t group, int multishot, uint64_t user_data);
+
+/**
+ * Returns the packet in buffer buf (res bytes) of a receive prepared with msg
+ * and stores its length in len.  Points out's address and control data at
+ * those in buf.
+ */
+char* uring_recvmsg_parse(struct msghdr* msg, char* buf, unsigned res,
+                          struct msghdr* out, unsigned* len);
+
+/** Prepares sqe to read from fd into a buffer of group for every packet
+    (URING_OP_READ_MULTISHOT). */
+void uring_prep_read_multishot(struct io_uring_sqe* sqe, int fd, uint16_t group,
+                               uint64_t user_data);
+
+/** Prepares sqe to complete once fd has any of the poll() events. */
+void uring_prep_poll(struct io_uring_sqe* sqe, int fd, unsigned events,
+                     uint64_t user_data);
+
+/** Prepares sqe to cancel the requests with user data target. */
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t target, uint64_t user_data);
+
+/** Prepares sqe to complete (with -ETIME) once ts has passed; ts need only
+    last until it is submitted. */
+void uring_prep_timeout(struct io_uring_sqe* sqe, struct __kernel_timespec* ts,
+                        uint64_t user_data);
+
+/**
+ * Sends the len messages of msgs through fd as sendmmsg() would, but with one
+ * system call whatever the kind of fd: messages without address or control
+ * data are written (which tap devices take too), the others sent.  Messages
+ * after one which fails are not sent.
+ *
+ * @return the number of messages sent (their msg_len set), or -1 if the first
+ *         failed (errno is set)
+ */
+int uring_sendmmsg(uring* r, int fd, struct mmsghdr* msgs, unsigned len);
+
+/**
+ * Registers a ring of buffers of size bytes for group group of r: as many as
+ * fit in URING_BUFS_BYTES (at least 16, at most URING_MAX_BUFS), all handed
+ * to the kernel.
+ *
+ * @return the ring, or NULL if the kernel cannot provide buffers this way
+ *         (errno is set)
+ */
+uring_bufs* uring_bufs_create(uring* r, uint16_t group, unsigned size);
+
+/** Unregisters and frees b. */
+void uring_bufs_destroy(uring* r, uring_bufs* b);
+
+/** Returns buffer id of b. */
+static inline char* uring_bufs_data(uring_bufs* b, unsigned id) {
+    return b->bufs[id];
+}
+
+/** Puts buffer id back into b; the kernel sees it from the next commit. */
+void uring_bufs_put(uring_bufs* b, unsigned id);
+
+/** Hands the buffers put back so far to the kernel. */
+static inline void uring_bufs_commit(uring_bufs* b) {
+    __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+#endif /* _URING_H_ */
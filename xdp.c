@@ -0,0 +1,151 @@
+/* Filename: xdp.c */
+
+#include <errno.h>
+#include <linux/if_link.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bpf.h"
+#include "capsulator.h"
+#include "common.h"
+#include "xdp.h"
+
+/** most instructions a program here has */
+#define XDP_MAX_INSNS 32
+
+/* struct xdp_md offsets */
+#define MD_DATA      0
+#define MD_DATA_END  4
+#define MD_RX_QUEUE 16
+
+/** a program being assembled */
+typedef struct xdp_prog {
+    struct bpf_insn insns[XDP_MAX_INSNS];
+    unsigned len;
+
+    /** jumps to the XDP_PASS exit */
+    unsigned pass[XDP_MAX_INSNS];
+    unsigned pass_len;
+} xdp_prog;
+
+static void emit(xdp_prog* p, struct bpf_insn insn) {
+    p->insns[p->len++] = insn;
+}
+
+/** emits a conditional jump to the XDP_PASS exit */
+static void emit_pass_if(xdp_prog* p, struct bpf_insn insn) {
+    p->pass[p->pass_len++] = p->len;
+    emit(p, insn);
+}
+
+/** emits return bpf_redirect_map(map, ctx (r6)->rx_queue_index, XDP_PASS) */
+static void emit_redirect(xdp_prog* p, int map) {
+    struct bpf_insn ld_map[] = { LD_MAP_FD(BPF_REG_1, map) };
+
+    emit(p, LDX(BPF_W, BPF_REG_2, BPF_REG_6, MD_RX_QUEUE));
+    emit(p, ld_map[0]);
+    emit(p, ld_map[1]);
+    emit(p, MOV64_IMM(BPF_REG_3, XDP_PASS));
+    emit(p, CALL(BPF_FUNC_redirect_map));
+    emit(p, EXIT());
+}
+
+/** emits the XDP_PASS exit (if anything jumps to it) and loads the program */
+static int xdp_prog_load(xdp_prog* p) {
+    unsigned i;
+    int fd;
+
+    if(p->pass_len) {
+        for(i=0; i<p->pass_len; i++)
+            p->insns[p->pass[i]].off = p->len - p->pass[i] - 1;
+        emit(p, MOV64_IMM(BPF_REG_0, XDP_PASS));
+        emit(p, EXIT());
+    }
+
+    if((fd = bpf_prog_load(BPF_PROG_TYPE_XDP, BPF_XDP, p->insns, p->len)) < 0)
+        pdie("bpf (load XDP program)");
+    return fd;
+}
+
+int xdp_xskmap_create(unsigned entries) {
+    int fd;
+
+    if((fd = bpf_map_create(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t), sizeof(uint32_t), entries)) < 0)
+        pdie("bpf (create XSKMAP)");
+    return fd;
+}
+
+void xdp_xskmap_set(int map, unsigned key, int fd) {
+    uint32_t k, v;
+
+    k = key;
+    v = fd;
+    if(bpf_map_update(map, &k, &v) < 0)
+        pdie("bpf (update XSKMAP)");
+}
+
+int xdp_prog_redirect_all(int map) {
+    xdp_prog p;
+
+    memset(&p, 0, sizeof(p));
+    emit(&p, MOV64_REG(BPF_REG_6, BPF_REG_1));
+    emit_redirect(&p, map);
+    return xdp_prog_load(&p);
+}
+
+int xdp_prog_redirect_tunnel(int map, uint32_t ip, uint16_t udp_port) {
+    xdp_prog p;
+
+    /* loads are little-endian, so NBO values compare as stored: EtherType
+       IPv4 reads as 0x0008, and MF plus the fragment offset as 0xFF3F */
+    memset(&p, 0, sizeof(p));
+    emit(&p, MOV64_REG(BPF_REG_6, BPF_REG_1));
+    emit(&p, LDX(BPF_W, BPF_REG_2, BPF_REG_6, MD_DATA));
+    emit(&p, LDX(BPF_W, BPF_REG_3, BPF_REG_6, MD_DATA_END));
+    emit(&p, MOV64_REG(BPF_REG_4, BPF_REG_2));
+    emit(&p, ADD64_IMM(BPF_REG_4, 14 + 20 + (udp_port ? 8 : 0)));
+    emit_pass_if(&p, JGT_REG(BPF_REG_4, BPF_REG_3));
+    emit(&p, LDX(BPF_H, BPF_REG_5, BPF_REG_2, 12));
+    emit_pass_if(&p, JNE32_IMM(BPF_REG_5, 0x0008));
+    emit(&p, LDX(BPF_B, BPF_REG_5, BPF_REG_2, 14));
+    emit_pass_if(&p, JNE32_IMM(BPF_REG_5, 0x45));
+    emit(&p, LDX(BPF_H, BPF_REG_5, BPF_REG_2, 14 + 6));
+    emit_pass_if(&p, JSET32_IMM(BPF_REG_5, 0xFF3F));
+    emit(&p, LDX(BPF_B, BPF_REG_5, BPF_REG_2, 14 + 9));
+    emit_pass_if(&p, JNE32_IMM(BPF_REG_5, udp_port ? IPPROTO_UDP : IPPROTO_CAPSULATOR));
+    emit(&p, LDX(BPF_W, BPF_REG_5, BPF_REG_2, 14 + 16));
+    emit_pass_if(&p, JNE32_IMM(BPF_REG_5, (int32_t)ip));
+    if(udp_port) {
+        emit(&p, LDX(BPF_H, BPF_REG_5, BPF_REG_2, 14 + 20 + 2));
+        emit_pass_if(&p, JNE32_IMM(BPF_REG_5, udp_port));
+    }
+    emit_redirect(&p, map);
+    return xdp_prog_load(&p);
+}
+
+/** links prog to ifindex with XDP_FLAGS_* flags */
+static int xdp_link(int prog, unsigned ifindex, unsigned flags) {
+    union bpf_attr a;
+
+    memset(&a, 0, sizeof(a));
+    a.link_create.prog_fd = prog;
+    a.link_create.target_ifindex = ifindex;
+    a.link_create.attach_type = BPF_XDP;
+    a.link_create.flags = flags;
+    return syscall(__NR_bpf, BPF_LINK_CREATE, &a, sizeof(a));
+}
+
+int xdp_attach(int prog, unsigned ifindex, const char** mode) {
+    int fd;
+
+    *mode = "native";
+    if((fd = xdp_link(prog, ifindex, XDP_FLAGS_DRV_MODE)) >= 0)
+        return fd;
+
+    *mode = "generic";
+    if((fd = xdp_link(prog, ifindex, XDP_FLAGS_SKB_MODE)) < 0)
+        pdie("bpf (attach XDP program)");
+    return fd;
+}
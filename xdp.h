@@ -0,0 +1,43 @@
+/**
+ * Filename: xdp.h
+ * Purpose:  eBPF XDP programs steering packets into AF_XDP sockets
+ */
+
+#ifndef _XDP_H_
+#define _XDP_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+/** Creates an XSKMAP of entries entries.  Dies on failure. */
+int xdp_xskmap_create(unsigned entries);
+
+/** Makes entry key of XSKMAP map the AF_XDP socket fd.  Dies on failure. */
+void xdp_xskmap_set(int map, unsigned key, int fd);
+
+/**
+ * Loads the program which redirects every frame to the socket at the index of
+ * its receive queue in map.  Dies on failure.
+ */
+int xdp_prog_redirect_all(int map);
+
+/**
+ * Loads the program which redirects tunnel packets addressed to the NBO IPv4
+ * address ip to the socket at the index of their receive queue in map.  Tunnel
+ * packets are IPv4 packets without options or fragmentation carrying IP
+ * protocol IPPROTO_CAPSULATOR or, if udp_port (NBO) is non-zero, UDP to that
+ * port.  Everything else goes on to the kernel.  Dies on failure.
+ */
+int xdp_prog_redirect_tunnel(int map, uint32_t ip, uint16_t udp_port);
+
+/**
+ * Attaches prog to interface ifindex, natively if its driver supports XDP and
+ * in generic (SKB) mode otherwise.  The program stays attached as long as the
+ * returned link is open.  Dies on failure.
+ *
+ * @param mode  set to "native" or "generic"
+ */
+int xdp_attach(int prog, unsigned ifindex, const char** mode);
+
+#endif /* _XDP_H_ */
@@ -0,0 +1,491 @@
+/* Filename: xdp_engine.c */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/route.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "common.h"
+#include "csum.h"
+#include "flow.h"
+#include "xdp.h"
+#include "xdp_engine.h"
+
+/** most packets taken from one socket before the others get their turn */
+#define XDP_BURST 64
+
+/** most times a tx ring is kicked per loop before the engine moves on */
+#define XDP_MAX_KICKS 8
+
+/** how long (ms) the engine sleeps when nothing arrives */
+#define XDP_POLL_MS 1000
+
+#define MIN_ETH_LEN 60
+#define MIN_IP_HEADER_LEN 20
+
+/** UDP source ports (from this one up) frames are spread over by flow */
+#define XDP_UDP_SOURCE_BASE 49152
+
+/** returns the number of receive queues of intf (1 if the driver won't say) */
+static unsigned xdp_rx_queues(int fd, const char* intf) {
+    struct ethtool_channels ch;
+    struct ifreq ifr;
+    unsigned n;
+
+    memset(&ifr, 0, sizeof(ifr));
+    memset(&ch, 0, sizeof(ch));
+    ch.cmd = ETHTOOL_GCHANNELS;
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", intf);
+    ifr.ifr_data = (void*)&ch;
+    if(ioctl(fd, SIOCETHTOOL, &ifr) < 0)
+        return 1;
+
+    n = ch.combined_count > ch.rx_count ? ch.combined_count : ch.rx_count;
+    return n ? n : 1;
+}
+
+/** returns the NBO IPv4 address of the next hop from intf towards ip */
+static uint32_t xdp_next_hop(const char* intf, uint32_t ip) {
+    char line[256], name[IF_NAMESIZE + 1];
+    unsigned dst, gw, flags, mask;
+    uint32_t hop;
+    int best;
+    FILE* fp;
+
+    if(!(fp = fopen("/proc/net/route", "r")))
+        return ip;
+
+    /* the addresses are printed as the hex of their NBO value in memory */
+    hop = ip;
+    best = -1;
+    while(fgets(line, sizeof(line), fp)) {
+        if(sscanf(line, "%16s %x %x %x %*d %*d %*d %x",
+                  name, &dst, &gw, &flags, &mask) != 5)
+            continue;
+        if(strcmp(name, intf) || !(flags & RTF_UP) || (ip & mask) != dst
+           || __builtin_popcount(mask) <= best)
+            continue;
+        best = __builtin_popcount(mask);
+        hop = (flags & RTF_GATEWAY) ? gw : ip;
+    }
+    fclose(fp);
+    return hop;
+}
+
+/**
+ * Looks up the MAC address of the next hop towards every tunnel endpoint in
+ * the kernel's neighbour table.  Frames to an endpoint whose next hop is not in
+ * it take the kernel path, which makes the kernel resolve it.
+ */
+static void xdp_engine_resolve(xdp_engine* xe) {
+    struct sockaddr_in* sin;
+    struct arpreq req;
+    xdp_dest* d;
+    unsigned i;
+
+    for(i=0; i<xe->dests_len; i++) {
+        d = &xe->dests[i];
+        memset(&req, 0, sizeof(req));
+        sin = (struct sockaddr_in*)&req.arp_pa;
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = xdp_next_hop(xe->c->tp.intf, d->ip);
+        snprintf(req.arp_dev, sizeof(req.arp_dev), "%s", xe->c->tp.intf);
+
+        if(ioctl(xe->c->tp.fd, SIOCGARP, &req) == 0 && (req.arp_flags & ATF_COM)) {
+            if(!d->resolved)
+                verbose_println("XDP: next hop towards %s resolved",
+                                inet_ntoa(*(struct in_addr*)&d->ip));
+            memcpy(d->mac, req.arp_ha.sa_data, ETH_ALEN);
+            d->resolved = 1;
+        }
+        else
+            d->resolved = 0;
+    }
+}
+
+/**
+ * Opens a socket on each of the n receive queues of intf and attaches the
+ * program steering frames (all of them, or just the tunnel packets) into them.
+ */
+static xsk** xdp_engine_open(xdp_engine* xe, const char* intf, unsigned n, int tunnel) {
+    const char* mode;
+    unsigned ifindex, q;
+    int map, prog;
+    xsk** xsks;
+
+    if(!(ifindex = if_nametoindex(intf)))
+        die("%s: no such interface", intf);
+    if(!(xsks = calloc(n, sizeof(*xsks))))
+        pdie("malloc (AF_XDP sockets)");
+
+    map = xdp_xskmap_create(n);
+    for(q=0; q<n; q++) {
+        if(!(xsks[q] = xsk_open(xe->umem, ifindex, q)))
+            die("%s: unable to open an AF_XDP socket on queue %u (%s)",
+                intf, q, strerror(errno));
+        xdp_xskmap_set(map, q, xsks[q]->fd);
+    }
+
+    if(tunnel)
+        prog = xdp_prog_redirect_tunnel(map, xe->c->tp.ip, xe->c->udp_port);
+    else
+        prog = xdp_prog_redirect_all(map);
+
+    /* the link is never closed: the program stays attached until we exit */
+    xdp_attach(prog, ifindex, &mode);
+    verbose_println("%s: XDP program attached (%s mode), %u AF_XDP socket(s) (%s)",
+                    intf, mode, n, xsks[0]->zerocopy ? "zero-copy" : "copy");
+
+    return xsks;
+}
+
+xdp_engine* xdp_engine_create(capsulator* c, tag_table* tags, egress** eg) {
+    xdp_engine* xe;
+    struct ifreq ifr;
+    unsigned i, j, n, *queues;
+
+    if(!(xe = calloc(1, sizeof(*xe))))
+        pdie("malloc (XDP engine)");
+    xe->c = c;
+    xe->tags = tags;
+    xe->hdr_len = ETH_HLEN + MIN_IP_HEADER_LEN + (c->udp_port ? sizeof(struct udphdr) : 0)
+                + sizeof(uint32_t);
+    xe->stats = c->tp.xdp_stats = stats_alloc(1);
+
+    /* the tunnel port's MAC address and MTU */
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", c->tp.intf);
+    if(ioctl(c->tp.fd, SIOCGIFHWADDR, &ifr) < 0)
+        pdie("ioctl (SIOCGIFHWADDR on tunnel port)");
+    memcpy(xe->src_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    if(ioctl(c->tp.fd, SIOCGIFMTU, &ifr) < 0)
+        pdie("ioctl (SIOCGIFMTU on tunnel port)");
+    xe->mtu = ifr.ifr_mtu;
+
+    xe->dests_len = c->tp.tunnel_dest_ips_len;
+    xe->ports = calloc(c->bp_len, sizeof(*xe->ports));
+    xe->dests = calloc(xe->dests_len, sizeof(*xe->dests));
+    queues = calloc(c->bp_len + 1, sizeof(*queues));
+    if(!xe->ports || !xe->dests || !queues)
+        pdie("malloc (XDP engine)");
+    for(i=0; i<xe->dests_len; i++)
+        xe->dests[i].ip = c->tp.tunnel_dest_ips[i];
+
+    /* every socket lends a fill ring's worth of frames to the kernel and may
+       have a tx ring's worth in flight */
+    n = queues[c->bp_len] = xdp_rx_queues(c->tp.fd, c->tp.intf);
+    for(i=0; i<c->bp_len; i++)
+        n += queues[i] = xdp_rx_queues(c->tp.fd, c->bp[i].intf);
+    xe->umem = xsk_umem_create(2 * XSK_RING_SIZE * n);
+
+    xe->tunnel_len = queues[c->bp_len];
+    xe->tunnel = xdp_engine_open(xe, c->tp.intf, xe->tunnel_len, 1);
+    for(i=0; i<c->bp_len; i++) {
+        xe->ports[i].bp = &c->bp[i];
+        xe->ports[i].eg = eg[i];
+        xe->ports[i].xsks_len = queues[i];
+        xe->ports[i].xsks = xdp_engine_open(xe, c->bp[i].intf, queues[i], 0);
+
+        /* as with the kernel path: to every endpoint, or to the port's own */
+        xe->ports[i].dests_len = broadcast ? xe->dests_len : 1;
+        if(!(xe->ports[i].dests = calloc(xe->ports[i].dests_len, sizeof(unsigned))))
+            pdie("malloc (XDP engine)");
+        for(j=0; j<xe->ports[i].dests_len; j++)
+            xe->ports[i].dests[j] = broadcast ? j : i;
+    }
+
+    /* poll the tunnel port's sockets first */
+    xe->pfds = calloc(n, sizeof(*xe->pfds));
+    xe->pxsks = calloc(n, sizeof(*xe->pxsks));
+    xe->pports = calloc(n, sizeof(*xe->pports));
+    if(!xe->pfds || !xe->pxsks || !xe->pports)
+        pdie("malloc (XDP engine)");
+    for(j=0; j<xe->tunnel_len; j++)
+        xe->pxsks[xe->pfds_len++] = xe->tunnel[j];
+    for(i=0; i<c->bp_len; i++)
+        for(j=0; j<xe->ports[i].xsks_len; j++) {
+            xe->pports[xe->pfds_len] = &xe->ports[i];
+            xe->pxsks[xe->pfds_len++] = xe->ports[i].xsks[j];
+        }
+    for(i=0; i<xe->pfds_len; i++) {
+        xe->pfds[i].fd = xe->pxsks[i]->fd;
+        xe->pfds[i].events = POLLIN;
+    }
+    free(queues);
+
+    xdp_engine_resolve(xe);
+    xe->resolved_at = time(NULL);
+    return xe;
+}
+
+/**
+ * Encapsulates the len-byte frame at UMEM address addr in place (its headroom
+ * takes the headers) and queues it on the tunnel port.
+ */
+static void xdp_engine_tunnel_tx(xdp_engine* xe, xdp_port* p, xdp_dest* d,
+                                 uint64_t addr, unsigned len, uint32_t hash) {
+    struct ether_header* eth;
+    struct udphdr* udp;
+    struct iphdr* ip;
+    uint32_t tag;
+    uint8_t* pkt;
+
+    addr -= xe->hdr_len;
+    pkt = xsk_umem_data(xe->umem, addr);
+
+    eth = (struct ether_header*)pkt;
+    memcpy(eth->ether_dhost, d->mac, ETH_ALEN);
+    memcpy(eth->ether_shost, xe->src_mac, ETH_ALEN);
+    eth->ether_type = htons(ETHERTYPE_IP);
+
+    ip = (struct iphdr*)(eth + 1);
+    ip->version = 4;
+    ip->ihl = MIN_IP_HEADER_LEN / 4;
+    ip->tos = 0;
+    ip->tot_len = htons(xe->hdr_len - ETH_HLEN + len);
+    ip->id = htons(xe->ip_id++);
+    ip->frag_off = 0;
+    ip->ttl = 64;
+    ip->protocol = xe->c->udp_port ? IPPROTO_UDP : IPPROTO_CAPSULATOR;
+    ip->check = 0;
+    ip->saddr = xe->c->tp.ip;
+    ip->daddr = d->ip;
+    ip->check = csum(ip, sizeof(*ip));
+
+    if(xe->c->udp_port) {
+        /* no checksum, which IPv4 allows; the source port varies by flow
+           as the kernel path's source sockets do */
+        udp = (struct udphdr*)(ip + 1);
+        udp->source = htons(XDP_UDP_SOURCE_BASE + hash % xe->c->udp_sources);
+        udp->dest = xe->c->udp_port;
+        udp->len = htons(sizeof(*udp) + sizeof(tag) + len);
+        udp->check = 0;
+    }
+
+    tag = htonl(p->bp->tag);
+    memcpy(pkt + xe->hdr_len - sizeof(tag), &tag, sizeof(tag));
+
+    if(!xsk_tx_queue(xe->tunnel[0], addr, xe->hdr_len + len)) {
+        xsk_umem_free(xe->umem, addr);
+        STAT_ADD(p->bp->stats, drop_write, 1);
+        return;
+    }
+    STAT_ADD(p->bp->stats, tx_packets, 1);
+    STAT_ADD(p->bp->stats, tx_bytes, sizeof(tag) + len);
+}
+
+/**
+ * Tunnels the frame received from border port p to each of its endpoints:
+ * copies to all but the last, which gets the received frame itself.
+ */
+static void xdp_engine_encap(xdp_engine* xe, xdp_port* p, const struct xdp_desc* rx) {
+    uint8_t* frame;
+    uint64_t addr;
+    uint32_t hash;
+    const unsigned* dests;
+    unsigned j, dests_len, learned;
+    int direct, dest, where;
+
+    frame = xsk_umem_data(xe->umem, rx->addr);
+    STAT_ADD(p->bp->stats, rx_packets, 1);
+    STAT_ADD(p->bp->stats, rx_bytes, rx->len);
+
+    if(rx->len < MIN_ETH_LEN) {
+        STAT_ADD(p->bp->stats, drop_short, 1);
+        xsk_umem_free(xe->umem, rx->addr);
+        return;
+    }
+    hash = (xe->c->udp_sources > 1) ? flow_hash(frame, rx->len) : 0;
+
+    /* bridge the tag, as on the kernel path */
+    dests = p->dests;
+    dests_len = p->dests_len;
+    dest = EGRESS_ALL_DESTS;
+    if(xe->c->macs) {
+        mac_table_learn(xe->c->macs, p->bp->domain, frame + ETH_ALEN, MAC_TABLE_LOCAL);
+        where = mac_table_lookup(xe->c->macs, p->bp->domain, frame);
+        if(where == MAC_TABLE_LOCAL) {
+            STAT_ADD(p->bp->stats, drop_local, 1);
+            xsk_umem_free(xe->umem, rx->addr);
+            return;
+        }
+        if(where != MAC_TABLE_UNKNOWN && broadcast) {
+            STAT_ADD(p->bp->stats, learned_frames, 1);
+            dest = where;
+            learned = (unsigned)where;
+            dests = &learned;
+            dests_len = 1;
+        }
+    }
+
+    /* frames needing fragmentation or an unresolved next hop take the
+       kernel path */
+    direct = (rx->addr & (XSK_FRAME_SIZE - 1)) >= xe->hdr_len
+          && xe->hdr_len - ETH_HLEN + rx->len <= xe->mtu;
+    for(j=0; direct && j<dests_len; j++)
+        direct = xe->dests[dests[j]].resolved;
+    if(!direct) {
+        egress_queue_dest(p->eg, dest, (char*)frame, rx->len, hash);
+        egress_flush(p->eg);
+        xsk_umem_free(xe->umem, rx->addr);
+        return;
+    }
+
+    for(j=0; j<dests_len; j++) {
+        if(j + 1 == dests_len)
+            addr = rx->addr;
+        else if((addr = xsk_umem_alloc(xe->umem)) == (uint64_t)-1) {
+            STAT_ADD(p->bp->stats, drop_write, 1);
+            continue;
+        }
+        else {
+            addr += XSK_HEADROOM;
+            memcpy(xsk_umem_data(xe->umem, addr), frame, rx->len);
+        }
+        xdp_engine_tunnel_tx(xe, p, &xe->dests[dests[j]], addr, rx->len, hash);
+    }
+}
+
+/**
+ * Decapsulates a tunnel packet and sends its frame out every border port which
+ * terminates its tag: copies to all but the last, which gets the frame in
+ * place.
+ */
+static void xdp_engine_decap(xdp_engine* xe, const struct xdp_desc* rx) {
+    const unsigned* ports;
+    struct iphdr* ip;
+    uint8_t* pkt;
+    uint64_t addr;
+    unsigned i, nports, len;
+    uint32_t tag;
+
+    pkt = xsk_umem_data(xe->umem, rx->addr);
+    ip = (struct iphdr*)(pkt + ETH_HLEN);
+    STAT_ADD(xe->stats, rx_packets, 1);
+    STAT_ADD(xe->stats, rx_bytes, rx->len);
+
+    /* the IP length excludes any Ethernet padding (the program has checked
+       the headers up to the UDP one) */
+    len = ETH_HLEN + ntohs(ip->tot_len);
+    if(len > rx->len || len < xe->hdr_len + MIN_ETH_LEN) {
+        STAT_ADD(xe->stats, drop_short, 1);
+        xsk_umem_free(xe->umem, rx->addr);
+        return;
+    }
+    len -= xe->hdr_len;
+    memcpy(&tag, pkt + xe->hdr_len - sizeof(tag), sizeof(tag));
+
+    if(!(nports = tag_table_lookup(xe->tags, tag, &ports))) {
+        STAT_ADD(xe->stats, drop_unknown_tag, 1);
+        xsk_umem_free(xe->umem, rx->addr);
+        return;
+    }
+    STAT_ADD(xe->stats, tag_hits, 1);
+
+    /* the frame's sender is behind the endpoint it came from */
+    if(xe->c->macs)
+        mac_table_learn(xe->c->macs, xe->c->bp[ports[0]].domain,
+                        pkt + xe->hdr_len + ETH_ALEN,
+                        mac_table_endpoint(xe->c->macs, ip->saddr));
+
+    for(i=0; i<nports; i++) {
+        if(i + 1 == nports)
+            addr = rx->addr + xe->hdr_len;
+        else if((addr = xsk_umem_alloc(xe->umem)) == (uint64_t)-1) {
+            STAT_ADD(xe->stats, drop_write, 1);
+            continue;
+        }
+        else {
+            addr += XSK_HEADROOM;
+            memcpy(xsk_umem_data(xe->umem, addr), pkt + xe->hdr_len, len);
+        }
+
+        if(!xsk_tx_queue(xe->ports[ports[i]].xsks[0], addr, len)) {
+            xsk_umem_free(xe->umem, addr);
+            STAT_ADD(xe->stats, drop_write, 1);
+            continue;
+        }
+        STAT_ADD(xe->stats, tx_packets, 1);
+        STAT_ADD(xe->stats, tx_bytes, len);
+    }
+}
+
+/**
+ * Publishes what was queued on the tx rings and kicks the kernel into sending
+ * it.
+ *
+ * @return non-zero if some is still waiting to be sent
+ */
+static int xdp_engine_kick(xdp_engine* xe) {
+    unsigned i, k;
+    int pending, more;
+
+    pending = 0;
+    for(i=0; i<=xe->c->bp_len; i++) {
+        more = 1;
+        for(k=0; more && k<XDP_MAX_KICKS; k++) {
+            if(i < xe->c->bp_len)
+                more = xsk_tx_kick(xe->ports[i].xsks[0]);
+            else
+                more = xsk_tx_kick(xe->tunnel[0]);
+        }
+        pending |= more;
+    }
+    return pending;
+}
+
+void* xdp_engine_main(void* vxe) {
+    xdp_engine* xe;
+    struct xdp_desc d;
+    unsigned i, k;
+    int pending;
+    time_t now;
+
+    pthread_detach(pthread_self());
+    xe = (xdp_engine*)vxe;
+    verbose_println("XDP: thread serving %u AF_XDP sockets is now running", xe->pfds_len);
+
+    pending = 0;
+    while(1) {
+        /* take back sent frames and lend free ones to receive into */
+        for(i=0; i<xe->pfds_len; i++) {
+            xsk_complete(xe->pxsks[i]);
+            xsk_fill(xe->pxsks[i]);
+        }
+
+        if(poll(xe->pfds, xe->pfds_len, pending ? 1 : XDP_POLL_MS) < 0 && errno != EINTR)
+            pdie("poll (AF_XDP sockets)");
+        STAT_ADD(xe->stats, syscalls, 1);
+
+        now = time(NULL);
+        if(now != xe->resolved_at) {
+            xe->resolved_at = now;
+            xdp_engine_resolve(xe);
+        }
+
+        for(i=0; i<xe->pfds_len; i++) {
+            for(k=0; k<XDP_BURST && xsk_rx_next(xe->pxsks[i], &d); k++) {
+                if(xe->pports[i])
+                    xdp_engine_encap(xe, xe->pports[i], &d);
+                else
+                    xdp_engine_decap(xe, &d);
+            }
+            if(k)
+                xsk_rx_release(xe->pxsks[i]);
+        }
+
+        pending = xdp_engine_kick(xe);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,115 @@
+/**
+ * Filename: xdp_engine.h
+ * Purpose:  data path which moves frames between the border ports and the
+ *           tunnel port through AF_XDP sockets, bypassing the kernel stack
+ */
+
+#ifndef _XDP_ENGINE_H_
+#define _XDP_ENGINE_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <net/ethernet.h> /* ETH_ALEN */
+#include <poll.h>         /* struct pollfd */
+#include <time.h>         /* time_t */
+
+#include "capsulator.h"
+#include "egress.h"
+#include "tag_table.h"
+#include "xsk.h"
+
+/**
+ * A tunnel endpoint as the engine sends to it: straight to the MAC address of
+ * the next hop towards it, once that is known.
+ */
+typedef struct xdp_dest {
+    /** NBO IPv4 address of the endpoint */
+    uint32_t ip;
+
+    /** MAC address of the next hop, valid if resolved is non-zero */
+    uint8_t mac[ETH_ALEN];
+    int resolved;
+} xdp_dest;
+
+/**
+ * A border port as seen by the engine.
+ */
+typedef struct xdp_port {
+    border_port* bp;
+
+    /** one socket per receive queue; frames are sent on the first */
+    xsk** xsks;
+    unsigned xsks_len;
+
+    /** indices into xdp_engine.dests of the endpoints its frames go to */
+    unsigned* dests;
+    unsigned dests_len;
+
+    /** the kernel path, for frames which do not fit the tunnel port's MTU
+        once encapsulated or whose next hop is not resolved yet */
+    egress* eg;
+} xdp_port;
+
+/**
+ * State of the thread running the AF_XDP data path.  All the sockets share one
+ * UMEM, so a frame received on one port is sent on another without copying it
+ * (unless it goes out several times).
+ */
+typedef struct xdp_engine {
+    capsulator* c;
+    tag_table* tags;
+    xsk_umem* umem;
+
+    /** the border ports, indexed like capsulator.bp */
+    xdp_port* ports;
+
+    /** one socket per receive queue of the tunnel port; packets are sent on
+        the first */
+    xsk** tunnel;
+    unsigned tunnel_len;
+
+    /** the tunnel endpoints */
+    xdp_dest* dests;
+    unsigned dests_len;
+
+    /** MAC address and MTU of the tunnel port */
+    uint8_t src_mac[ETH_ALEN];
+    unsigned mtu;
+
+    /** size of the Ethernet, IP, UDP (in UDP mode) and tunneling headers */
+    unsigned hdr_len;
+
+    /** IP ID of the next tunnel packet */
+    uint16_t ip_id;
+
+    /** every socket to wait on (tunnel sockets first) and the border port
+        each belongs to (NULL for the tunnel port's) */
+    struct pollfd* pfds;
+    xsk** pxsks;
+    xdp_port** pports;
+    unsigned pfds_len;
+
+    /** when the next hops were last resolved */
+    time_t resolved_at;
+
+    /** counters of the tunnel side (the border side counts to the ports') */
+    port_stats* stats;
+} xdp_engine;
+
+/**
+ * Opens AF_XDP sockets on every receive queue of the tunnel port and border
+ * ports of c and attaches the programs which steer frames into them: all of a
+ * border port's, and the tunnel port's tunnel packets except fragments (which
+ * are left to the tunnel port threads).  Dies on failure.
+ *
+ * @param tags  tag dispatch index
+ * @param eg    the kernel path egress of each border port
+ */
+xdp_engine* xdp_engine_create(capsulator* c, tag_table* tags, egress** eg);
+
+/** Entry point of the thread running the engine.  Does not return. */
+void* xdp_engine_main(void* vxe);
+
+#endif /* _XDP_ENGINE_H_ */
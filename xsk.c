@@ -0,0 +1,238 @@
+/* Filename: xsk.c */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "log.h"
+#include "xsk.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+xsk_umem* xsk_umem_create(unsigned frames) {
+    xsk_umem* u;
+    unsigned i;
+
+    if(!(u = calloc(1, sizeof(*u))))
+        pdie("malloc (UMEM)");
+    u->frames = frames;
+    u->len = (size_t)frames * XSK_FRAME_SIZE;
+    u->area = mmap(NULL, u->len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(u->area == MAP_FAILED)
+        pdie("mmap (UMEM)");
+
+    if(!(u->free = malloc(frames * sizeof(*u->free))))
+        pdie("malloc (UMEM free frames)");
+    for(i=0; i<frames; i++)
+        u->free[i] = (uint64_t)(frames - 1 - i) * XSK_FRAME_SIZE;
+    u->free_len = frames;
+    u->fd = -1;
+
+    return u;
+}
+
+uint64_t xsk_umem_alloc(xsk_umem* u) {
+    if(u->free_len == 0)
+        return (uint64_t)-1;
+    return u->free[--u->free_len];
+}
+
+void xsk_umem_free(xsk_umem* u, uint64_t addr) {
+    u->free[u->free_len++] = addr & ~(uint64_t)(XSK_FRAME_SIZE - 1);
+}
+
+/** maps ring r of size descriptors of desc_size bytes at page offset pgoff */
+static int xsk_map_ring(xsk* x, xsk_ring* r, const struct xdp_ring_offset* off,
+                        uint64_t pgoff, size_t desc_size) {
+    uint8_t* map;
+
+    r->map_len = off->desc + XSK_RING_SIZE * desc_size;
+    map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, x->fd, pgoff);
+    if(map == MAP_FAILED)
+        return -1;
+
+    r->map = map;
+    r->producer = (uint32_t*)(map + off->producer);
+    r->consumer = (uint32_t*)(map + off->consumer);
+    r->descs = map + off->desc;
+    r->size = XSK_RING_SIZE;
+    r->mask = XSK_RING_SIZE - 1;
+    r->cached_prod = *r->producer;
+    r->cached_cons = *r->consumer;
+    return 0;
+}
+
+xsk* xsk_open(xsk_umem* u, unsigned ifindex, unsigned queue) {
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp addr;
+    struct xdp_options opts;
+    socklen_t len;
+    int size, err;
+    xsk* x;
+
+    if(!(x = calloc(1, sizeof(*x))))
+        pdie("malloc (AF_XDP socket)");
+    x->umem = u;
+    x->ifindex = ifindex;
+    x->queue = queue;
+    if((x->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0)
+        goto fail;
+
+    if(u->fd < 0) {
+        memset(&reg, 0, sizeof(reg));
+        reg.addr = (uintptr_t)u->area;
+        reg.len = u->len;
+        reg.chunk_size = XSK_FRAME_SIZE;
+        reg.headroom = XSK_HEADROOM;
+        if(setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+            goto fail;
+    }
+
+    /* every interface queue has its own fill and completion rings, even on
+       a shared UMEM */
+    size = XSK_RING_SIZE;
+    if(setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0
+       || setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0
+       || setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0
+       || setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0)
+        goto fail;
+
+    len = sizeof(off);
+    if(getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0)
+        goto fail;
+    if(xsk_map_ring(x, &x->rx, &off.rx, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc)) < 0
+       || xsk_map_ring(x, &x->tx, &off.tx, XDP_PGOFF_TX_RING, sizeof(struct xdp_desc)) < 0
+       || xsk_map_ring(x, &x->fill, &off.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t)) < 0
+       || xsk_map_ring(x, &x->comp, &off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t)) < 0)
+        goto fail;
+
+    /* the producer side owns the whole ring until the kernel consumes */
+    x->fill.cached_cons += XSK_RING_SIZE;
+    x->tx.cached_cons += XSK_RING_SIZE;
+
+    /* without flags the kernel uses zero-copy if the driver supports it and
+       falls back to copying (which is what generic XDP does anyway) */
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifindex;
+    addr.sxdp_queue_id = queue;
+    if(u->fd >= 0) {
+        addr.sxdp_flags = XDP_SHARED_UMEM;
+        addr.sxdp_shared_umem_fd = u->fd;
+    }
+    if(bind(x->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        goto fail;
+    if(u->fd < 0)
+        u->fd = x->fd;
+
+    len = sizeof(opts);
+    if(getsockopt(x->fd, SOL_XDP, XDP_OPTIONS, &opts, &len) == 0)
+        x->zerocopy = (opts.flags & XDP_OPTIONS_ZEROCOPY) != 0;
+
+    return x;
+
+fail:
+    err = errno;
+    if(x->fd >= 0)
+        close(x->fd);
+    free(x);
+    errno = err;
+    return NULL;
+}
+
+/** returns the number of descriptors the producer of r may still write */
+static uint32_t xsk_ring_free(xsk_ring* r) {
+    if(r->cached_cons == r->cached_prod)
+        r->cached_cons = __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE) + r->size;
+    return r->cached_cons - r->cached_prod;
+}
+
+/** returns the number of descriptors the consumer of r may read */
+static uint32_t xsk_ring_avail(xsk_ring* r) {
+    if(r->cached_prod == r->cached_cons)
+        r->cached_prod = __atomic_load_n(r->producer, __ATOMIC_ACQUIRE);
+    return r->cached_prod - r->cached_cons;
+}
+
+void xsk_fill(xsk* x) {
+    uint64_t* addrs;
+    uint32_t n;
+
+    addrs = x->fill.descs;
+    n = xsk_ring_free(&x->fill);
+    if(n == 0 || x->umem->free_len == 0)
+        return;
+
+    while(n-- > 0 && x->umem->free_len > 0) {
+        addrs[x->fill.cached_prod & x->fill.mask] = xsk_umem_alloc(x->umem);
+        x->fill.cached_prod += 1;
+    }
+    __atomic_store_n(x->fill.producer, x->fill.cached_prod, __ATOMIC_RELEASE);
+}
+
+void xsk_complete(xsk* x) {
+    uint64_t* addrs;
+    uint32_t n;
+
+    addrs = x->comp.descs;
+    if((n = xsk_ring_avail(&x->comp)) == 0)
+        return;
+
+    while(n-- > 0) {
+        xsk_umem_free(x->umem, addrs[x->comp.cached_cons & x->comp.mask]);
+        x->comp.cached_cons += 1;
+    }
+    __atomic_store_n(x->comp.consumer, x->comp.cached_cons, __ATOMIC_RELEASE);
+}
+
+int xsk_rx_next(xsk* x, struct xdp_desc* d) {
+    if(xsk_ring_avail(&x->rx) == 0)
+        return 0;
+
+    *d = ((struct xdp_desc*)x->rx.descs)[x->rx.cached_cons & x->rx.mask];
+    x->rx.cached_cons += 1;
+    return 1;
+}
+
+void xsk_rx_release(xsk* x) {
+    __atomic_store_n(x->rx.consumer, x->rx.cached_cons, __ATOMIC_RELEASE);
+}
+
+int xsk_tx_queue(xsk* x, uint64_t addr, uint32_t len) {
+    struct xdp_desc* d;
+
+    if(xsk_ring_free(&x->tx) == 0)
+        return 0;
+
+    d = &((struct xdp_desc*)x->tx.descs)[x->tx.cached_prod & x->tx.mask];
+    d->addr = addr;
+    d->len = len;
+    d->options = 0;
+    x->tx.cached_prod += 1;
+    return 1;
+}
+
+int xsk_tx_kick(xsk* x) {
+    __atomic_store_n(x->tx.producer, x->tx.cached_prod, __ATOMIC_RELEASE);
+    if(__atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE) == x->tx.cached_prod)
+        return 0;
+
+    /* the kernel sends a bounded number per call; the caller kicks again */
+    if(sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0
+       && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN)
+        log_dp(LOG_WARN, &x->log, "XDP:", errno,
+               "Warning: AF_XDP transmit on ifindex %lu failed", (long)x->ifindex);
+    return __atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE) != x->tx.cached_prod;
+}
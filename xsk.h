@@ -0,0 +1,149 @@
+/**
+ * Filename: xsk.h
+ * Purpose:  AF_XDP sockets sharing one UMEM, driven through their mapped rings
+ */
+
+#ifndef _XSK_H_
+#define _XSK_H_
+
+#ifdef _LINUX_
+#include <stdint.h> /* uint*_t */
+#endif
+
+#include <stddef.h>     /* size_t */
+#include <linux/if_xdp.h> /* struct xdp_desc */
+
+#include "log.h"
+
+/** size of each UMEM frame (a frame holds one packet and its headroom) */
+#define XSK_FRAME_SIZE 4096
+
+/** headroom the kernel leaves in front of every received packet, for the
+    headers prepended to it in place */
+#define XSK_HEADROOM 128
+
+/** number of descriptors in each ring of a socket */
+#define XSK_RING_SIZE 1024
+
+/**
+ * A single-producer single-consumer ring shared with the kernel.  The cached
+ * indices save reading the other side's index for every descriptor.
+ */
+typedef struct xsk_ring {
+    uint32_t* producer;
+    uint32_t* consumer;
+
+    /** uint64_t frame addresses (fill and completion rings) or struct
+        xdp_desc (rx and tx rings) */
+    void* descs;
+    uint32_t mask;
+    uint32_t size;
+
+    uint32_t cached_prod;
+    uint32_t cached_cons;
+
+    /** the mapping of the ring */
+    void* map;
+    size_t map_len;
+} xsk_ring;
+
+/**
+ * Packet memory registered with the kernel and shared by all the sockets
+ * opened on it.  Frames not lent to the kernel are kept on a free stack.
+ * Not thread-safe: one thread drives all its sockets.
+ */
+typedef struct xsk_umem {
+    uint8_t* area;
+    size_t len;
+    unsigned frames;
+
+    /** addresses of the frames user space owns and does not use */
+    uint64_t* free;
+    unsigned free_len;
+
+    /** socket the UMEM was registered with, or -1 before the first one */
+    int fd;
+} xsk_umem;
+
+/**
+ * An AF_XDP socket bound to one queue of one interface.
+ */
+typedef struct xsk {
+    int fd;
+    unsigned ifindex;
+    unsigned queue;
+
+    /** received packets and packets to send */
+    xsk_ring rx;
+    xsk_ring tx;
+
+    /** frames lent to the kernel to receive into, and sent frames it has
+        given back */
+    xsk_ring fill;
+    xsk_ring comp;
+
+    xsk_umem* umem;
+
+    /** non-zero if the kernel moves packets without copying them */
+    int zerocopy;
+
+    /** how much the thread using the socket logs about it */
+    log_limit log;
+} xsk;
+
+/** Allocates a UMEM of frames frames of XSK_FRAME_SIZE bytes.  Dies on failure. */
+xsk_umem* xsk_umem_create(unsigned frames);
+
+/** Returns the address of a free frame of u, or (uint64_t)-1 if none is left. */
+uint64_t xsk_umem_alloc(xsk_umem* u);
+
+/** Returns the frame containing addr to the free frames of u. */
+void xsk_umem_free(xsk_umem* u, uint64_t addr);
+
+/** Returns a pointer to the byte at UMEM address addr. */
+static inline uint8_t* xsk_umem_data(xsk_umem* u, uint64_t addr) {
+    return u->area + addr;
+}
+
+/**
+ * Opens an AF_XDP socket on queue of interface ifindex.  The first socket
+ * opened on u registers it; later ones share it.  The kernel moves packets
+ * without copying them if the driver can, and copies them otherwise.
+ *
+ * @return the socket, or NULL if the kernel refused (errno is set)
+ */
+xsk* xsk_open(xsk_umem* u, unsigned ifindex, unsigned queue);
+
+/** Lends as many free frames as fit to the kernel to receive into. */
+void xsk_fill(xsk* x);
+
+/** Takes the frames the kernel has finished sending back as free frames. */
+void xsk_complete(xsk* x);
+
+/**
+ * Takes the next received packet.
+ *
+ * @return 1 if d was set, 0 if no packet is waiting
+ */
+int xsk_rx_next(xsk* x, struct xdp_desc* d);
+
+/** Lets the kernel reuse the rx descriptors taken so far. */
+void xsk_rx_release(xsk* x);
+
+/**
+ * Queues len bytes at UMEM address addr to be sent.  The frame belongs to the
+ * kernel until xsk_complete() gives it back.
+ *
+ * @return 1 if queued, 0 if the tx ring is full
+ */
+int xsk_tx_queue(xsk* x, uint64_t addr, uint32_t len);
+
+/**
+ * Publishes the queued packets and, if the kernel has not sent all of them
+ * yet, asks it to.
+ *
+ * @return non-zero if packets are still waiting to be sent
+ */
+int xsk_tx_kick(xsk* x);
+
+#endif /* _XSK_H_ */